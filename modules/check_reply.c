@@ -7,7 +7,7 @@
  * check a banner returned by a remote service.
  *
  * Written by Larry Schwimmer
- * Copyright 1997, 1998, 2008, 2012
+ * Copyright 1997, 1998, 2008, 2012, 2026
  *     The Board of Trustees of the Leland Stanford Junior University
  *
  * See LICENSE for licensing terms.
@@ -17,29 +17,33 @@
 #include <portable/socket.h>
 #include <portable/system.h>
 
+#include <errno.h>
 #ifdef HAVE_SYS_SELECT_H
 # include <sys/select.h>
 #endif
 #include <sys/time.h>
+#include <time.h>
 
 #include <modules/modules.h>
 
 
 /*
  * Given a socket, timeout, and token, check that one can read data matching
- * token from the socket within timeout seconds.  Returns 0 on success and -1
- * on failure.
+ * token from the socket within timeout seconds.  The reply may arrive in
+ * several pieces, so keep reading until we have as many bytes as the token or
+ * the timeout expires.  Returns 0 on success and -1 on failure.
  */
 int
 lbcd_check_reply(socket_type sd, int timeout, const char *token)
 {
     struct timeval tv = { 0, 0 };
     fd_set rset;
-    int retval = 0;
+    int retval = -1;
     char *buf;
-    int len;
+    size_t len, got;
+    ssize_t status;
+    time_t deadline, now;
 
-    tv.tv_sec = timeout;
     if (token == NULL)
         return -1;
     len = strlen(token);
@@ -47,18 +51,30 @@ lbcd_check_reply(socket_type sd, int timeout, const char *token)
     if (buf == NULL)
         return -1;
 
-    FD_ZERO(&rset);
-    FD_SET(sd, &rset);
-    if (select(sd + 1, &rset, NULL, NULL, &tv) > 0) {
+    deadline = time(NULL) + timeout;
+    got = 0;
+    while (got < len) {
+        now = time(NULL);
+        if (now >= deadline)
+            break;
+        tv.tv_sec = deadline - now;
+        tv.tv_usec = 0;
+        FD_ZERO(&rset);
+        FD_SET(sd, &rset);
+        status = select(sd + 1, &rset, NULL, NULL, &tv);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0)
+            break;
+        status = socket_read(sd, buf + got, len - got);
+        if (status <= 0)
+            break;
+        got += status;
+    }
+    if (got == len) {
         buf[len] = '\0';
-        if (socket_read(sd, buf, len) > 0) {
-            if (strcmp(buf, token) != 0)
-                retval = -1;
-        } else {
-            retval = -1;
-        }
-    } else {
-        retval = -1;
+        if (strcmp(buf, token) == 0)
+            retval = 0;
     }
     free(buf);
     return retval;
@@ -0,0 +1,383 @@
+/*
+ * Listening TCP socket probe.
+ *
+ * The tcp service checks a service by connecting to it, which costs a full
+ * handshake for every query, shows up in the service's logs, and says
+ * nothing about how busy the service is.  The listen service instead asks
+ * the kernel about the sockets on the port with a NETLINK_SOCK_DIAG dump:
+ * whether something is listening on it, how many connections are waiting
+ * in its accept queue compared with its backlog, and how many connections
+ * to it are established.  Those are turned into a weight without touching
+ * the service.
+ *
+ * One dump covers every TCP port, so it is kept briefly and shared by all
+ * the listen services in a query.  The listening sockets are dumped first
+ * into a hash table by port, and then established connections are counted
+ * only for ports found there, so that a host with tens of thousands of
+ * connections costs one table lookup for each.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+#include <errno.h>
+#if defined(HAVE_LINUX_NETLINK_H) && defined(HAVE_LINUX_INET_DIAG_H) \
+    && defined(HAVE_LINUX_SOCK_DIAG_H)
+# include <linux/netlink.h>
+# include <linux/inet_diag.h>
+# include <linux/sock_diag.h>
+# define HAVE_SOCK_DIAG 1
+#endif
+
+#include <server/internal.h>
+#include <server/sample.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* The TCP states we ask for, from the kernel's numbering. */
+#define LISTEN_STATE_ESTABLISHED 1
+#define LISTEN_STATE_LISTEN      10
+
+/* How long a dump is reused, in microseconds. */
+#define LISTEN_MAX_AGE 1000000
+
+/* The size of the buffer for reading a dump. */
+#define LISTEN_BUFFER_SIZE 32768
+
+/* The initial number of slots in a table, which must be a power of two. */
+#define LISTEN_TABLE_SIZE 64
+
+/*
+ * The weight of each established connection, the weight of an accept queue
+ * as long as its backlog, and the increment.
+ */
+#define LISTEN_CONNECTION_WEIGHT 10
+#define LISTEN_QUEUE_WEIGHT      10000
+#define LISTEN_INCREMENT         10
+
+/* The last dump and when it was taken. */
+static struct listen_table table = { NULL, 0, 0 };
+static unsigned long long dumped = 0;
+static bool have_dump = false;
+
+
+/*
+ * Return the slot for a port in a table, which is either the slot holding
+ * its entry or the empty slot where it would go.  The table must have at
+ * least one empty slot.
+ */
+static size_t
+table_slot(const struct listen_table *ports, unsigned short port)
+{
+    size_t mask = ports->size - 1;
+    size_t i;
+
+    i = (((uint32_t) port * 2654435761U) >> 16) & mask;
+    while (ports->ports[i].listening && ports->ports[i].port != port)
+        i = (i + 1) & mask;
+    return i;
+}
+
+
+/*
+ * Return the entry for a port in a table, or NULL if nothing is listening on
+ * it.
+ */
+const struct listen_port *
+lbcd_listen_find(const struct listen_table *ports, unsigned short port)
+{
+    const struct listen_port *entry;
+
+    if (ports->size == 0)
+        return NULL;
+    entry = &ports->ports[table_slot(ports, port)];
+    return entry->listening ? entry : NULL;
+}
+
+
+/*
+ * Double the number of slots in a table, or allocate the first ones, and
+ * move the entries to their new slots.
+ */
+static void
+table_grow(struct listen_table *ports)
+{
+    struct listen_port *old = ports->ports;
+    size_t old_size = ports->size;
+    size_t i, slot;
+
+    ports->size = (old_size == 0) ? LISTEN_TABLE_SIZE : old_size * 2;
+    ports->ports = xcalloc(ports->size, sizeof(struct listen_port));
+    for (i = 0; i < old_size; i++)
+        if (old[i].listening) {
+            slot = table_slot(ports, old[i].port);
+            ports->ports[slot] = old[i];
+        }
+    free(old);
+}
+
+
+/*
+ * Return the entry for a listening port in a table, adding an empty one if
+ * needed.  The table is kept no more than half full.
+ */
+static struct listen_port *
+table_add(struct listen_table *ports, unsigned short port)
+{
+    struct listen_port *entry;
+
+    if ((ports->count + 1) * 2 > ports->size)
+        table_grow(ports);
+    entry = &ports->ports[table_slot(ports, port)];
+    if (!entry->listening) {
+        entry->port = port;
+        entry->listening = true;
+        ports->count++;
+    }
+    return entry;
+}
+
+
+/*
+ * Add the sockets in a buffer of netlink messages from a sock_diag dump to a
+ * table.  For a listening socket, the kernel reports the length of the
+ * accept queue as its receive queue and the backlog as its send queue.  A
+ * port may have several listening sockets, such as for IPv4 and IPv6, so
+ * their queues are added together.  Established sockets are counted under
+ * their local port, so that connections from the host to a service don't
+ * count against the port they come from, and only if something is already
+ * listening on it, so the listening sockets must be parsed first.
+ *
+ * Returns 1 if the dump is complete, 0 if more messages are needed, and -1
+ * if the kernel reported an error.
+ */
+#ifdef HAVE_SOCK_DIAG
+int
+lbcd_listen_parse(struct listen_table *ports, const void *buffer,
+                  size_t length)
+{
+    const struct nlmsghdr *header = buffer;
+    const struct nlmsgerr *error;
+    const struct inet_diag_msg *msg;
+    struct listen_port *entry;
+    unsigned short port;
+    unsigned int left = length;
+
+    for (; NLMSG_OK(header, left); header = NLMSG_NEXT(header, left)) {
+        if (header->nlmsg_type == NLMSG_DONE)
+            return 1;
+        if (header->nlmsg_type == NLMSG_ERROR) {
+            error = NLMSG_DATA(header);
+            if (header->nlmsg_len >= NLMSG_LENGTH(sizeof(*error)))
+                errno = -error->error;
+            else
+                errno = EPROTO;
+            return -1;
+        }
+        if (header->nlmsg_len < NLMSG_LENGTH(sizeof(*msg)))
+            continue;
+        msg = NLMSG_DATA(header);
+        port = ntohs(msg->id.idiag_sport);
+        if (msg->idiag_state == LISTEN_STATE_LISTEN) {
+            entry = table_add(ports, port);
+            entry->queue += msg->idiag_rqueue;
+            entry->backlog += msg->idiag_wqueue;
+        } else if (msg->idiag_state == LISTEN_STATE_ESTABLISHED) {
+            entry = (struct listen_port *) lbcd_listen_find(ports, port);
+            if (entry != NULL)
+                entry->established++;
+        }
+    }
+    return 0;
+}
+#else
+int
+lbcd_listen_parse(struct listen_table *ports UNUSED,
+                  const void *buffer UNUSED, size_t length UNUSED)
+{
+    errno = ENOSYS;
+    return -1;
+}
+#endif
+
+
+#ifdef HAVE_SOCK_DIAG
+/*
+ * Dump the TCP sockets of one address family in one state into a table using
+ * a netlink socket.  Returns true on success and false on failure, setting
+ * errno.
+ */
+static bool
+dump_family(int fd, int family, int state, struct listen_table *ports)
+{
+    struct {
+        struct nlmsghdr header;
+        struct inet_diag_req_v2 request;
+    } message;
+    struct sockaddr_nl kernel;
+    char *buffer;
+    ssize_t length;
+    int status = 0;
+
+    memset(&message, 0, sizeof(message));
+    message.header.nlmsg_len = sizeof(message);
+    message.header.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    message.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    message.header.nlmsg_seq = family;
+    message.request.sdiag_family = family;
+    message.request.sdiag_protocol = IPPROTO_TCP;
+    message.request.idiag_states = 1U << state;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    if (sendto(fd, &message, sizeof(message), 0, (struct sockaddr *) &kernel,
+               sizeof(kernel)) < 0)
+        return false;
+    buffer = xmalloc(LISTEN_BUFFER_SIZE);
+    while (status == 0) {
+        length = recv(fd, buffer, LISTEN_BUFFER_SIZE, 0);
+        if (length < 0 && errno == EINTR)
+            continue;
+        if (length <= 0) {
+            if (length == 0)
+                errno = EPROTO;
+            status = -1;
+            break;
+        }
+        status = lbcd_listen_parse(ports, buffer, length);
+    }
+    free(buffer);
+    return status > 0;
+}
+#endif
+
+
+/*
+ * Replace the saved dump with a new one unless it is recent enough.  Returns
+ * true on success and false on failure.
+ */
+static bool
+dump_update(void)
+{
+#ifdef HAVE_SOCK_DIAG
+    struct listen_table ports = { NULL, 0, 0 };
+    unsigned long long now;
+    int fd;
+    bool okay;
+
+    now = sample_now();
+    if (have_dump && now - dumped < LISTEN_MAX_AGE)
+        return true;
+    fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_SOCK_DIAG);
+    if (fd < 0) {
+        debug("cannot create sock_diag socket: %s", strerror(errno));
+        return false;
+    }
+    okay = dump_family(fd, AF_INET, LISTEN_STATE_LISTEN, &ports)
+        && dump_family(fd, AF_INET6, LISTEN_STATE_LISTEN, &ports);
+    if (okay && ports.count > 0)
+        okay = dump_family(fd, AF_INET, LISTEN_STATE_ESTABLISHED, &ports)
+            && dump_family(fd, AF_INET6, LISTEN_STATE_ESTABLISHED, &ports);
+    if (!okay)
+        debug("cannot dump TCP sockets: %s", strerror(errno));
+    close(fd);
+    if (!okay) {
+        free(ports.ports);
+        return false;
+    }
+    free(table.ports);
+    table = ports;
+    dumped = now;
+    have_dump = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+/*
+ * Parse the port argument of the service, which is either a port number or
+ * the name of a TCP service.  Returns the port or 0 if it is invalid.
+ */
+static unsigned short
+parse_port(const char *portarg)
+{
+    const struct servent *entry;
+    const char *p;
+    long port;
+
+    if (portarg == NULL || *portarg == '\0')
+        return 0;
+    for (p = portarg; *p != '\0'; p++)
+        if (!isdigit((unsigned char) *p))
+            break;
+    if (*p != '\0') {
+        entry = getservbyname(portarg, "tcp");
+        return (entry == NULL) ? 0 : ntohs(entry->s_port);
+    }
+    if (p - portarg > 5)
+        return 0;
+    port = strtol(portarg, NULL, 10);
+    return (port < 1 || port > 65535) ? 0 : (unsigned short) port;
+}
+
+
+/*
+ * The listen service, which takes the port as its argument.  The weight is
+ * the number of established connections to the port plus the length of the
+ * accept queue relative to the backlog, and is the maximum if nothing is
+ * listening on the port or the accept queue is full, since new connections
+ * would then be refused or dropped.  Returns 0 on success and -1 if the
+ * port is invalid or the kernel couldn't be asked.
+ */
+int
+lbcd_listen_weight(uint32_t *weight_val, uint32_t *incr_val,
+                   int timeout UNUSED, const char *portarg,
+                   struct lbcd_reply *lb UNUSED)
+{
+    const struct listen_port *entry;
+    unsigned short port;
+    unsigned long long weight;
+
+    *weight_val = (uint32_t) -1;
+    port = parse_port(portarg);
+    if (port == 0 || !dump_update())
+        return -1;
+    *incr_val = LISTEN_INCREMENT;
+    entry = lbcd_listen_find(&table, port);
+    if (entry == NULL || !entry->listening)
+        return 0;
+    if (entry->queue > entry->backlog)
+        return 0;
+    weight = (unsigned long long) entry->established
+             * LISTEN_CONNECTION_WEIGHT;
+    if (entry->backlog > 0)
+        weight += (unsigned long long) entry->queue * LISTEN_QUEUE_WEIGHT
+                  / entry->backlog;
+    if (weight < (uint32_t) -1)
+        *weight_val = (uint32_t) weight;
+    return 0;
+}
+
+
+/*
+ * Free the saved dump.
+ */
+void
+lbcd_listen_close(void)
+{
+    free(table.ports);
+    table.ports = NULL;
+    table.count = 0;
+    table.size = 0;
+    have_dump = false;
+}
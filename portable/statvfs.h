@@ -48,6 +48,7 @@
  */
 #ifndef HAVE_STATVFS
 # define statvfs  statfs
+# define fstatvfs fstatfs
 # define f_frsize f_bsize
 # define f_bavail f_bfree
 # define f_favail f_ffree
@@ -0,0 +1,550 @@
+/*
+ * Load reported by applications.
+ *
+ * Applications often know their own load, such as the depth of their work
+ * queue or the number of requests in progress, far better than lbcd can
+ * infer it.  If configured, lbcd listens on a Unix datagram socket for
+ * reports from them.  Each datagram is a line of the form:
+ *
+ *     <name> <weight> <increment> <ttl>
+ *
+ * and sets the weight and increment of the service app:<name> for the next
+ * <ttl> seconds.  A report with a ttl of 0 removes the service.  Once a
+ * report expires without being renewed, the application is presumed to be
+ * down and the service returns the maximum weight, as it does for a name
+ * that has never been reported.
+ *
+ * Reports are read from the main loop whenever the socket is readable, so
+ * reporting costs an application one datagram and lbcd no processes.
+ *
+ * Applications that update their load too often even for that can instead
+ * publish it in a slot of a shared-memory file, using the interface in
+ * shm.h, which lbcd reads when answering a query.  A current report in a
+ * slot takes precedence over one received on the socket.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <server/internal.h>
+#include <server/sample.h>
+#include <server/shm.h>
+#include <util/fdflag.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/*
+ * The longest application name, chosen so that app:<name> fits in the
+ * service names of the protocol.
+ */
+#define APP_NAME_MAX (sizeof(lbcd_name_type) - sizeof("app:"))
+
+/* The size of the buffer for a report, which must be shorter than this. */
+#define APP_REPORT_MAX 256
+
+/* The largest number of applications and the longest ttl, in seconds. */
+#define APP_MAX      256
+#define APP_TTL_MAX  86400
+
+/* The last report of an application. */
+struct app {
+    char name[APP_NAME_MAX + 1];
+    uint32_t weight;
+    uint32_t incr;
+    unsigned long long expires; /* Monotonic time the report expires */
+};
+
+/* The reported applications. */
+static struct app *apps = NULL;
+static size_t apps_count = 0;
+
+/* The configured socket path, the bound socket, and the path it's bound to. */
+static char *app_path = NULL;
+static int app_fd = -1;
+static char *bound_path = NULL;
+static struct stat bound_stat;
+
+/* The configured shared-memory file and its mapping. */
+static char *shm_path = NULL;
+static struct lbcd_shm_header *shm = NULL;
+
+/*
+ * The socket path and shared-memory file of a new configuration, the new
+ * mapping if the file changed, and whether there is a new configuration.
+ */
+static char *pending_path = NULL;
+static char *pending_shm_path = NULL;
+static struct lbcd_shm_header *pending_shm = NULL;
+static bool have_pending = false;
+
+
+/*
+ * Parse an unsigned number of at most max after skipping spaces, storing it
+ * in value.  Returns a pointer to the character following it, or NULL if
+ * there is no valid number.
+ */
+static const char *
+parse_number(const char *p, unsigned long max, unsigned long *value)
+{
+    char *end;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (!isdigit((unsigned char) *p))
+        return NULL;
+    errno = 0;
+    *value = strtoul(p, &end, 10);
+    if (errno != 0 || *value > max)
+        return NULL;
+    return end;
+}
+
+
+/*
+ * Return the entry for an application, or NULL if it has none.
+ */
+static struct app *
+app_find(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < apps_count; i++)
+        if (strcmp(apps[i].name, name) == 0)
+            return &apps[i];
+    return NULL;
+}
+
+
+/*
+ * Apply a report from an application, given as a buffer that need not be
+ * nul-terminated and the current monotonic time in microseconds.  Expired
+ * entries are reused once the table is full.  Returns false after reporting
+ * the problem with debug if the report is invalid or the table is full of
+ * current reports.
+ */
+bool
+lbcd_app_report(const char *report, size_t length, unsigned long long now)
+{
+    char buffer[APP_REPORT_MAX];
+    char name[APP_NAME_MAX + 1];
+    unsigned long weight, incr, ttl;
+    const char *p;
+    struct app *app;
+    size_t i, n;
+
+    if (length >= sizeof(buffer)) {
+        debug("application report too long");
+        return false;
+    }
+    memcpy(buffer, report, length);
+    buffer[length] = '\0';
+
+    /* Parse the report. */
+    p = buffer;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    for (n = 0; isalnum((unsigned char) p[n]) || p[n] == '-'
+             || p[n] == '_' || p[n] == '.'; n++)
+        ;
+    if (n == 0 || n > APP_NAME_MAX) {
+        debug("invalid application name in report");
+        return false;
+    }
+    memcpy(name, p, n);
+    name[n] = '\0';
+    p = parse_number(p + n, (uint32_t) -1, &weight);
+    if (p != NULL)
+        p = parse_number(p, (uint32_t) -1, &incr);
+    if (p != NULL)
+        p = parse_number(p, APP_TTL_MAX, &ttl);
+    if (p != NULL)
+        while (isspace((unsigned char) *p))
+            p++;
+    if (p == NULL || *p != '\0') {
+        debug("invalid report for application %s", name);
+        return false;
+    }
+
+    /* A ttl of 0 removes the application. */
+    app = app_find(name);
+    if (ttl == 0) {
+        if (app != NULL) {
+            *app = apps[apps_count - 1];
+            apps_count--;
+        }
+        return true;
+    }
+
+    /* Otherwise, update its entry, adding one if needed. */
+    if (app == NULL) {
+        if (apps_count < APP_MAX) {
+            apps = xreallocarray(apps, apps_count + 1, sizeof(struct app));
+            app = &apps[apps_count++];
+        } else
+            for (i = 0; i < apps_count; i++)
+                if (apps[i].expires <= now) {
+                    app = &apps[i];
+                    break;
+                }
+        if (app == NULL) {
+            debug("too many applications, ignoring report for %s", name);
+            return false;
+        }
+        strlcpy(app->name, name, sizeof(app->name));
+    }
+    app->weight = weight;
+    app->incr = incr;
+    app->expires = now + (unsigned long long) ttl * 1000000;
+    return true;
+}
+
+
+/*
+ * Look up the weight and increment of an application at the given monotonic
+ * time in microseconds.  Returns false if the application has not reported
+ * or its report has expired.
+ */
+bool
+lbcd_app_lookup(const char *name, unsigned long long now, uint32_t *weight,
+                uint32_t *incr)
+{
+    const struct app *app;
+    const struct lbcd_shm_slot *slot;
+    uint64_t heartbeat;
+    uint32_t slot_weight, slot_incr, ttl;
+
+    if (shm != NULL) {
+        slot = lbcd_shm_find_in(shm, LBCD_SHM_SLOTS, name);
+        if (slot != NULL
+            && lbcd_shm_read(slot, &slot_weight, &slot_incr, &heartbeat,
+                             &ttl) == 0
+            && heartbeat + (uint64_t) ttl * 1000000 > now) {
+            *weight = slot_weight;
+            *incr = slot_incr;
+            return true;
+        }
+    }
+    app = app_find(name);
+    if (app == NULL || app->expires <= now)
+        return false;
+    *weight = app->weight;
+    *incr = app->incr;
+    return true;
+}
+
+
+/*
+ * The app service, which takes the name of the application as its argument
+ * and returns its last report, or the maximum weight if it has none.
+ */
+static int
+app_weight(void *data UNUSED, uint32_t *weight_val, uint32_t *incr_val,
+           int timeout UNUSED, const char *portarg,
+           struct lbcd_reply *lb UNUSED)
+{
+    if (portarg == NULL
+        || !lbcd_app_lookup(portarg, sample_now(), weight_val, incr_val)) {
+        *weight_val = (uint32_t) -1;
+        *incr_val = 0;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Close the socket.  Its path is removed unless something else, such as a
+ * new lbcd that has taken over, has since been bound to it.
+ */
+static void
+app_socket_close(void)
+{
+    struct stat st;
+
+    if (app_fd < 0)
+        return;
+    close(app_fd);
+    app_fd = -1;
+    if (stat(bound_path, &st) == 0 && st.st_dev == bound_stat.st_dev
+        && st.st_ino == bound_stat.st_ino)
+        unlink(bound_path);
+    free(bound_path);
+    bound_path = NULL;
+}
+
+
+/*
+ * Unmap the shared-memory file.  The file is kept so that applications that
+ * have it mapped can keep publishing and a later lbcd can pick up their
+ * slots.
+ */
+static void
+shm_close(void)
+{
+    if (shm != NULL)
+        munmap(shm, lbcd_shm_size(LBCD_SHM_SLOTS));
+    shm = NULL;
+    free(shm_path);
+    shm_path = NULL;
+}
+
+
+/*
+ * Map the shared-memory file at path, creating it if needed, and return the
+ * mapping.  An existing file in the current format is used as is, keeping
+ * its slots along with its ownership and permissions.  Since lbcd normally
+ * runs as root, a symlink is never followed, and only a file that we just
+ * created or that is empty is initialized, so that a mistyped path can't
+ * destroy some other file.  Returns NULL after reporting the problem with
+ * warn on failure, including for a nonempty file in another format.
+ */
+static struct lbcd_shm_header *
+shm_open_file(const char *path)
+{
+    struct lbcd_shm_header *header;
+    struct stat st;
+    size_t size = lbcd_shm_size(LBCD_SHM_SLOTS);
+    void *region;
+    bool created = true;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == EEXIST) {
+        created = false;
+        fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        syswarn("cannot open %s", path);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        warn("%s is not a regular file", path);
+        close(fd);
+        return NULL;
+    }
+    if (!created && st.st_size != 0 && (size_t) st.st_size != size) {
+        warn("%s is not an lbcd shared-memory file, not using it", path);
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size == 0 && ftruncate(fd, size) < 0) {
+        syswarn("cannot resize %s", path);
+        close(fd);
+        if (created)
+            unlink(path);
+        return NULL;
+    }
+    region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) {
+        syswarn("cannot map %s", path);
+        return NULL;
+    }
+    header = region;
+    if (st.st_size == 0) {
+        header->version = LBCD_SHM_VERSION;
+        header->slots = LBCD_SHM_SLOTS;
+        header->slot_size = sizeof(struct lbcd_shm_slot);
+        __atomic_store_n(&header->magic, LBCD_SHM_MAGIC, __ATOMIC_RELEASE);
+    } else if (header->magic != LBCD_SHM_MAGIC
+               || header->version != LBCD_SHM_VERSION
+               || header->slots != LBCD_SHM_SLOTS
+               || header->slot_size != sizeof(struct lbcd_shm_slot)) {
+        warn("%s is not an lbcd shared-memory file, not using it", path);
+        munmap(region, size);
+        return NULL;
+    }
+    return header;
+}
+
+
+/*
+ * Check the path of the socket on which to receive reports and map the
+ * shared-memory file for reports if it changed, either of which may be NULL,
+ * and keep them to be used once lbcd_app_commit is called.  Registers the
+ * app service if either is set.  Returns false after reporting the problem
+ * with warn if the socket path is too long or the file can't be mapped.
+ */
+bool
+lbcd_app_prepare(const char *path, const char *shm_file)
+{
+    lbcd_app_abort();
+    if (path != NULL
+        && strlen(path) >= sizeof(((struct sockaddr_un *) 0)->sun_path)) {
+        warn("application socket path %s too long", path);
+        return false;
+    }
+    if (shm_file != NULL
+        && (shm_path == NULL || strcmp(shm_file, shm_path) != 0)) {
+        pending_shm = shm_open_file(shm_file);
+        if (pending_shm == NULL)
+            return false;
+    }
+    pending_path = (path == NULL) ? NULL : xstrdup(path);
+    pending_shm_path = (shm_file == NULL) ? NULL : xstrdup(shm_file);
+    have_pending = true;
+    if (path != NULL || shm_file != NULL)
+        lbcd_service_register("app", app_weight, NULL, 0, NULL);
+    return true;
+}
+
+
+/*
+ * Switch to the socket path and shared-memory file from lbcd_app_prepare.
+ * The socket itself is opened by lbcd_app_open so that lbcd -t doesn't take
+ * it over from a running lbcd, but the shared-memory file is mapped by
+ * lbcd_app_prepare so that lbcd -t can show the reports in it.  Reports
+ * already received are kept.
+ */
+void
+lbcd_app_commit(void)
+{
+    if (!have_pending)
+        return;
+    if (pending_shm_path == NULL)
+        shm_close();
+    else if (pending_shm != NULL) {
+        shm_close();
+        shm = pending_shm;
+        shm_path = pending_shm_path;
+        pending_shm = NULL;
+        pending_shm_path = NULL;
+    }
+    free(app_path);
+    app_path = pending_path;
+    pending_path = NULL;
+    lbcd_app_abort();
+}
+
+
+/*
+ * Discard the settings from lbcd_app_prepare, unmapping any new
+ * shared-memory file.
+ */
+void
+lbcd_app_abort(void)
+{
+    if (pending_shm != NULL)
+        munmap(pending_shm, lbcd_shm_size(LBCD_SHM_SLOTS));
+    pending_shm = NULL;
+    free(pending_shm_path);
+    pending_shm_path = NULL;
+    free(pending_path);
+    pending_path = NULL;
+    have_pending = false;
+}
+
+
+/*
+ * Set the socket path and shared-memory file immediately, as with
+ * lbcd_app_prepare.  Returns false after reporting the problem with warn if
+ * the socket path is too long or the file can't be mapped, in which case
+ * nothing is changed.
+ */
+bool
+lbcd_app_init(const char *path, const char *shm_file)
+{
+    if (!lbcd_app_prepare(path, shm_file))
+        return false;
+    lbcd_app_commit();
+    return true;
+}
+
+
+/*
+ * Open the socket for application reports if needed and return it, or
+ * return -1 if none is configured or it can't be opened.  A stale socket
+ * left at the path is replaced, but any other file is left alone.  Called
+ * again after each reload, which may change or remove the path.
+ */
+int
+lbcd_app_open(void)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if (app_fd >= 0 && app_path != NULL && strcmp(app_path, bound_path) == 0)
+        return app_fd;
+    app_socket_close();
+    if (app_path == NULL)
+        return -1;
+    if (lstat(app_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            warn("%s exists and is not a socket", app_path);
+            return -1;
+        }
+        unlink(app_path);
+    }
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        syswarn("cannot create application socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, app_path, sizeof(addr.sun_path));
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+        || stat(app_path, &bound_stat) < 0) {
+        syswarn("cannot bind application socket %s", app_path);
+        close(fd);
+        return -1;
+    }
+    fdflag_close_exec(fd, true);
+    fdflag_nonblocking(fd, true);
+    app_fd = fd;
+    bound_path = xstrdup(app_path);
+    return app_fd;
+}
+
+
+/*
+ * Read and apply all pending reports from the application socket.
+ */
+void
+lbcd_app_event(void)
+{
+    char buffer[APP_REPORT_MAX];
+    ssize_t length;
+
+    if (app_fd < 0)
+        return;
+    while ((length = recv(app_fd, buffer, sizeof(buffer), 0)) >= 0)
+        lbcd_app_report(buffer, length, sample_now());
+    if (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+        && errno != EINTR)
+        syswarn("cannot read application reports");
+}
+
+
+/*
+ * Close the socket, unmap the shared-memory file, and forget all reports
+ * received on the socket.
+ */
+void
+lbcd_app_close(void)
+{
+    lbcd_app_abort();
+    app_socket_close();
+    shm_close();
+    free(app_path);
+    app_path = NULL;
+    free(apps);
+    apps = NULL;
+    apps_count = 0;
+}
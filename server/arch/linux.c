@@ -2,7 +2,7 @@
  * lbcd kernel code for Linux.
  *
  * Written by Larry Schwimmer
- * Copyright 1997, 1998, 2009, 2012
+ * Copyright 1997, 1998, 2009, 2012, 2026
  *     The Board of Trustees of the Leland Stanford Junior University
  *
  * See LICENSE for licensing terms.
@@ -11,11 +11,147 @@
 #include <config.h>
 #include <portable/system.h>
 
+#ifdef HAVE_SYSINFO
+# include <sys/sysinfo.h>
+#endif
 #include <time.h>
 
 #include <server/internal.h>
+#include <server/procfile.h>
 #include <util/messages.h>
 
+/* The boot time last returned, kept stable across calls. */
+static time_t last_boottime = 0;
+
+
+/*
+ * Given a boot time computed from the current time and the uptime, return
+ * the boot time to report.  Both are in whole seconds, so the computed boot
+ * time varies by a second from call to call.  Only change the reported boot
+ * time if it moves by more than that, such as when the clock is set.
+ */
+static time_t
+stable_boottime(time_t boottime)
+{
+    if (last_boottime == 0 || boottime > last_boottime + 1
+        || boottime < last_boottime - 1)
+        last_boottime = boottime;
+    return last_boottime;
+}
+
+
+#ifdef HAVE_SYSINFO
+
+/* Allow the kernel code to provide the additional system information. */
+# define KERNEL_HAVE_GETINFO 1
+
+/* The fixed-point shift for the load averages from sysinfo. */
+# ifndef SI_LOAD_SHIFT
+#  define SI_LOAD_SHIFT 16
+# endif
+
+/*
+ * The last results from sysinfo and when we got them.  The kernel only
+ * updates the load averages every five seconds, so call sysinfo at most once
+ * a second.  This also means that the calls for one reply share one result.
+ */
+static struct sysinfo info;
+static time_t info_time = 0;
+
+
+/*
+ * Refresh the sysinfo results if they're more than a second old.  Returns 0
+ * on success and -1 on failure.
+ */
+static int
+sysinfo_update(void)
+{
+    time_t now;
+
+    now = time(NULL);
+    if (info_time == now)
+        return 0;
+    if (sysinfo(&info) < 0) {
+        syswarn("cannot get system information");
+        info_time = 0;
+        return -1;
+    }
+    info_time = now;
+    return 0;
+}
+
+
+/*
+ * Convert an amount of memory from sysinfo to MiB.
+ */
+static unsigned long
+sysinfo_mib(unsigned long amount)
+{
+    unsigned long long bytes;
+
+    bytes = (unsigned long long) amount * info.mem_unit;
+    return (unsigned long) (bytes / (1024 * 1024));
+}
+
+
+/*
+ * Get the current load average from the kernel and return the one minute,
+ * five minute, and fifteen minute averages in the given parameters.  Returns
+ * 0 on success and -1 on failure.
+ */
+int
+kernel_getload(double *l1, double *l5, double *l15)
+{
+    if (sysinfo_update() < 0)
+        return -1;
+    *l1 = (double) info.loads[0] / (1 << SI_LOAD_SHIFT);
+    *l5 = (double) info.loads[1] / (1 << SI_LOAD_SHIFT);
+    *l15 = (double) info.loads[2] / (1 << SI_LOAD_SHIFT);
+    return 0;
+}
+
+
+/*
+ * Get the system uptime and return it in the boottime parameter.  Returns 0
+ * on success and -1 on failure.
+ */
+int
+kernel_getboottime(time_t *boottime)
+{
+    if (sysinfo_update() < 0)
+        return -1;
+    *boottime = stable_boottime(info_time - info.uptime);
+    return 0;
+}
+
+
+/*
+ * Get the number of processes and the memory and swap totals.  Returns 0 on
+ * success and -1 on failure.
+ */
+int
+kernel_getinfo(struct kernel_info *result)
+{
+    if (sysinfo_update() < 0)
+        return -1;
+    result->procs = info.procs;
+    result->mem_total = sysinfo_mib(info.totalram);
+    result->mem_free = sysinfo_mib(info.freeram);
+    result->swap_total = sysinfo_mib(info.totalswap);
+    result->swap_free = sysinfo_mib(info.freeswap);
+    return 0;
+}
+
+#else /* !HAVE_SYSINFO */
+
+/*
+ * The files we read, kept open for the life of the process.  Both are only a
+ * single short line.
+ */
+static struct procfile proc_loadavg = PROCFILE_INIT("/proc/loadavg");
+static struct procfile proc_uptime = PROCFILE_INIT("/proc/uptime");
+# define PROC_LINE_MAX 128
+
 
 /*
  * Get the current load average from the kernel and return the one minute,
@@ -25,19 +161,23 @@
 int
 kernel_getload(double *l1, double *l5, double *l15)
 {
-    FILE *fp;
+    char buffer[PROC_LINE_MAX];
+    const char *p;
+    unsigned long load[3];
+    size_t i;
 
-    fp = fopen("/proc/loadavg", "r");
-    if (fp == NULL) {
-        syswarn("cannot open /proc/loadavg");
+    if (procfile_read(&proc_loadavg, buffer, sizeof(buffer)) < 0)
         return -1;
-    }
-    if (fscanf(fp, "%lf %lf %lf", l1, l5, l15) < 3) {
-        fclose(fp);
+    p = buffer;
+    for (i = 0; i < 3 && p != NULL; i++)
+        p = procfile_fixed(p, 2, &load[i]);
+    if (p == NULL) {
         warn("cannot parse /proc/loadavg");
         return -1;
     }
-    fclose(fp);
+    *l1 = load[0] / 100.0;
+    *l5 = load[1] / 100.0;
+    *l15 = load[2] / 100.0;
     return 0;
 }
 
@@ -49,26 +189,21 @@ kernel_getload(double *l1, double *l5, double *l15)
 int
 kernel_getboottime(time_t *boottime)
 {
-    FILE *fp;
-    double uptime;
-    time_t curr;
+    char buffer[PROC_LINE_MAX];
+    unsigned long uptime;
 
-    fp = fopen("/proc/uptime", "r");
-    if (fp == NULL) {
-        syswarn("cannot open /proc/uptime");
+    if (procfile_read(&proc_uptime, buffer, sizeof(buffer)) < 0)
         return -1;
-    }
-    if (fscanf(fp, "%lf", &uptime) < 1) {
-        fclose(fp);
+    if (procfile_fixed(buffer, 0, &uptime) == NULL) {
         warn("cannot parse /proc/uptime");
         return -1;
     }
-    fclose(fp);
-    curr = time(NULL);
-    *boottime = curr - uptime;
+    *boottime = stable_boottime(time(NULL) - (time_t) uptime);
     return 0;
 }
 
+#endif /* !HAVE_SYSINFO */
+
 
 /*
  * Test routine.
@@ -0,0 +1,423 @@
+/*
+ * Capacity calibration.
+ *
+ * Pools often mix hardware generations, and an idle old system gets the same
+ * weight as an idle new one even though the new one can take on much more
+ * work.  To correct for that, lbcd can run a short CPU and memory bandwidth
+ * benchmark and scale the weight and increment of the load service by the
+ * result.  The work done by the benchmark is fixed, so only how long it takes
+ * varies between systems.
+ *
+ * The score is 100 for a system as fast as the reference system and higher
+ * for faster systems.  Since the benchmark takes a noticeable fraction of a
+ * second, the score is cached in a state file and only measured again if
+ * that file is missing or invalid or if asked to with SIGUSR1.  When asked
+ * with SIGUSR1, the benchmark runs in a child process so that queries are
+ * still answered, and the new score is used once the child reports it.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+#include <util/xwrite.h>
+
+/*
+ * The version of the benchmark.  This is stored in the state file and must
+ * be incremented whenever the benchmark changes so that old scores are not
+ * used.
+ */
+#define CAPACITY_VERSION 1
+
+/* The work done by the CPU benchmark, in rounds of its inner loop. */
+#define CAPACITY_CPU_ROUNDS 10000000UL
+
+/*
+ * The memory benchmark copies between two buffers of this many words, large
+ * enough not to fit in cache, this many times.
+ */
+#define CAPACITY_MEM_WORDS (4UL * 1024 * 1024)
+#define CAPACITY_MEM_PASSES 8
+
+/* Each benchmark is run this many times and the fastest run is used. */
+#define CAPACITY_RUNS 3
+
+/*
+ * How long each benchmark takes on the reference system, a current x86-64
+ * server, in seconds.  This system scores 100.
+ */
+#define CAPACITY_CPU_REFERENCE 0.06
+#define CAPACITY_MEM_REFERENCE 0.05
+
+/* The smallest and largest scores we'll use. */
+#define CAPACITY_MIN 1
+#define CAPACITY_MAX 100000
+
+/* The configured state file, or NULL, and the current score or 0. */
+static char *state_file = NULL;
+static unsigned long capacity = 0;
+
+/* The child running the benchmark for lbcd_capacity_start and its pipe. */
+static pid_t child = -1;
+static int child_fd = -1;
+
+/*
+ * Where the benchmarks store their results so that the compiler can't
+ * optimize them away.
+ */
+static volatile unsigned long long sink;
+
+
+/*
+ * Return the current monotonic time in seconds.
+ */
+static double
+now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        sysdie("cannot get the current time");
+    return (double) ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * The CPU benchmark: a xorshift generator mixed with multiplication and a
+ * data-dependent branch, which exercises the integer units and the branch
+ * predictor.  Returns the elapsed time in seconds.
+ */
+static double
+benchmark_cpu(void)
+{
+    unsigned long long x = 88172645463325252ULL;
+    unsigned long long sum = 0;
+    unsigned long i;
+    double start;
+
+    start = now();
+    for (i = 0; i < CAPACITY_CPU_ROUNDS; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        if (x & 1)
+            sum += x * (i | 1);
+        else
+            sum ^= x >> 3;
+    }
+    sink = sum;
+    return now() - start;
+}
+
+
+/*
+ * The memory benchmark: repeatedly compute one buffer from the other, which
+ * is limited by memory bandwidth.  The buffers are allocated and touched
+ * before starting the clock.  Returns the elapsed time in seconds.
+ */
+static double
+benchmark_memory(void)
+{
+    unsigned long long *a, *b, *tmp;
+    unsigned long i, pass;
+    double start, elapsed;
+
+    a = xcalloc(CAPACITY_MEM_WORDS, sizeof(unsigned long long));
+    b = xcalloc(CAPACITY_MEM_WORDS, sizeof(unsigned long long));
+    for (i = 0; i < CAPACITY_MEM_WORDS; i++)
+        a[i] = i;
+    memset(b, 0, CAPACITY_MEM_WORDS * sizeof(unsigned long long));
+    start = now();
+    for (pass = 0; pass < CAPACITY_MEM_PASSES; pass++) {
+        for (i = 0; i < CAPACITY_MEM_WORDS; i++)
+            b[i] = a[i] * 3 + pass;
+        tmp = a;
+        a = b;
+        b = tmp;
+    }
+    elapsed = now() - start;
+    sink = a[CAPACITY_MEM_WORDS - 1];
+    free(a);
+    free(b);
+    return elapsed;
+}
+
+
+/*
+ * Run the benchmarks and return the score, the time the reference system
+ * takes for both benchmarks divided by the time we took, times 100.
+ */
+static unsigned long
+benchmark(void)
+{
+    double cpu, memory, elapsed, score;
+    int i;
+
+    cpu = benchmark_cpu();
+    memory = benchmark_memory();
+    for (i = 1; i < CAPACITY_RUNS; i++) {
+        elapsed = benchmark_cpu();
+        if (elapsed < cpu)
+            cpu = elapsed;
+        elapsed = benchmark_memory();
+        if (elapsed < memory)
+            memory = elapsed;
+    }
+    if (cpu + memory <= 0)
+        return CAPACITY_MAX;
+    score = 100 * (CAPACITY_CPU_REFERENCE + CAPACITY_MEM_REFERENCE)
+        / (cpu + memory);
+    if (score < CAPACITY_MIN)
+        return CAPACITY_MIN;
+    else if (score > CAPACITY_MAX)
+        return CAPACITY_MAX;
+    return (unsigned long) score;
+}
+
+
+/*
+ * Read the score from the state file.  Returns 0 if the file doesn't exist,
+ * is invalid, or is for a different version of the benchmark.
+ */
+static unsigned long
+state_read(const char *path)
+{
+    FILE *file;
+    int version;
+    unsigned long score;
+    int status;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        if (errno != ENOENT)
+            syswarn("cannot open %s", path);
+        return 0;
+    }
+    status = fscanf(file, "lbcd-capacity %d %lu", &version, &score);
+    fclose(file);
+    if (status != 2 || version != CAPACITY_VERSION || score < CAPACITY_MIN
+        || score > CAPACITY_MAX)
+        return 0;
+    return score;
+}
+
+
+/*
+ * Write the score to the state file, replacing it atomically so that a
+ * partial file is never read.  Failure is only worth a warning, since it
+ * only means that the benchmark will be run again next time.
+ */
+static void
+state_write(const char *path, unsigned long score)
+{
+    FILE *file;
+    char *tmp;
+
+    xasprintf(&tmp, "%s.new", path);
+    file = fopen(tmp, "w");
+    if (file == NULL) {
+        syswarn("cannot create %s", tmp);
+        free(tmp);
+        return;
+    }
+    fprintf(file, "lbcd-capacity %d %lu\n", CAPACITY_VERSION, score);
+    if (fclose(file) == EOF) {
+        syswarn("cannot write %s", tmp);
+        unlink(tmp);
+    } else if (rename(tmp, path) < 0) {
+        syswarn("cannot rename %s to %s", tmp, path);
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+
+/*
+ * Save a new score and use it.
+ */
+static void
+capacity_set(unsigned long score)
+{
+    capacity = score;
+    notice("capacity score is %lu", capacity);
+    state_write(state_file, capacity);
+}
+
+
+/*
+ * Run the benchmark again and save the new score in the state file.  Does
+ * nothing if no state file is configured.
+ */
+void
+lbcd_capacity_calibrate(void)
+{
+    if (state_file == NULL)
+        return;
+    capacity_set(benchmark());
+}
+
+
+/*
+ * Start running the benchmark again in a child process, which writes the
+ * score to a pipe.  Returns the file descriptor for the pipe, which becomes
+ * readable once the child is done and should then be passed to
+ * lbcd_capacity_event, or -1 if no state file is configured or the child
+ * can't be started.  If a benchmark is already running, returns its pipe.
+ */
+int
+lbcd_capacity_start(void)
+{
+    int fds[2];
+    pid_t pid;
+    unsigned long score;
+
+    if (state_file == NULL)
+        return -1;
+    if (child_fd >= 0) {
+        warn("capacity calibration already running");
+        return child_fd;
+    }
+    if (pipe(fds) < 0) {
+        syswarn("cannot create pipe for capacity calibration");
+        return -1;
+    }
+    pid = fork();
+    if (pid < 0) {
+        syswarn("cannot fork for capacity calibration");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    } else if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        close(fds[0]);
+        score = benchmark();
+        if (xwrite(fds[1], &score, sizeof(score)) < 0)
+            _exit(1);
+        _exit(0);
+    }
+    close(fds[1]);
+    fdflag_close_exec(fds[0], true);
+    child = pid;
+    child_fd = fds[0];
+    return child_fd;
+}
+
+
+/*
+ * Read the score from the child started by lbcd_capacity_start once its pipe
+ * is readable, save it, and reap the child.
+ */
+void
+lbcd_capacity_event(void)
+{
+    unsigned long score = 0;
+    ssize_t status;
+
+    if (child_fd < 0)
+        return;
+    status = read(child_fd, &score, sizeof(score));
+    close(child_fd);
+    child_fd = -1;
+    waitpid(child, NULL, 0);
+    child = -1;
+    if (status != sizeof(score) || score < CAPACITY_MIN
+        || score > CAPACITY_MAX) {
+        warn("capacity calibration failed");
+        return;
+    }
+    if (state_file != NULL)
+        capacity_set(score);
+}
+
+
+/*
+ * Stop any benchmark running in a child process.
+ */
+void
+lbcd_capacity_close(void)
+{
+    if (child_fd < 0)
+        return;
+    kill(child, SIGKILL);
+    close(child_fd);
+    child_fd = -1;
+    waitpid(child, NULL, 0);
+    child = -1;
+}
+
+
+/*
+ * Set the state file and load the score from it, running the benchmark if
+ * the file has no valid score.  If path is NULL, stop scaling weights.  If
+ * the state file is the same as before, keep the current score.
+ */
+void
+lbcd_capacity_init(const char *path)
+{
+    if (path == NULL) {
+        free(state_file);
+        state_file = NULL;
+        capacity = 0;
+        return;
+    }
+    if (state_file != NULL && strcmp(path, state_file) == 0)
+        return;
+    free(state_file);
+    state_file = xstrdup(path);
+    capacity = state_read(state_file);
+    if (capacity == 0)
+        lbcd_capacity_calibrate();
+}
+
+
+/*
+ * Return the capacity score, or 0 if capacity calibration isn't configured.
+ */
+unsigned long
+lbcd_capacity_get(void)
+{
+    return capacity;
+}
+
+
+/*
+ * Scale a weight and increment by the capacity score, so that a system twice
+ * as fast as the reference reports half the weight and increment.  The
+ * increment is never scaled below 1.  The maximum weight, which indicates
+ * that the system should not get more work, is left alone, and any other
+ * weight stops just short of it, since a slow system that is merely very
+ * busy is not down.
+ */
+void
+lbcd_capacity_scale(uint32_t *weight, uint32_t *incr)
+{
+    unsigned long long scaled;
+
+    if (capacity == 0)
+        return;
+    if (*weight != UINT32_MAX) {
+        scaled = (unsigned long long) *weight * 100 / capacity;
+        if (scaled > UINT32_MAX - 1)
+            scaled = UINT32_MAX - 1;
+        *weight = (uint32_t) scaled;
+    }
+    scaled = (unsigned long long) *incr * 100 / capacity;
+    if (scaled < 1)
+        scaled = 1;
+    *incr = (scaled > UINT32_MAX) ? UINT32_MAX : (uint32_t) scaled;
+}
@@ -0,0 +1,478 @@
+/*
+ * Resource usage of a cgroup.
+ *
+ * When lbcd runs in a container or balances a systemd slice, the load
+ * average and memory of the whole host say little about the capacity left
+ * to the workload, which is limited by the CPU quota and memory limit of its
+ * cgroup.  This reads the cgroup v2 interface files for a configured cgroup
+ * and turns them into metrics.  CPU usage and throttling are cumulative
+ * counters, so they're reported as the fraction of the time since the
+ * previous sample.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <server/internal.h>
+#include <server/procfile.h>
+#include <server/sample.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Where the cgroup v2 hierarchy is mounted, for relative paths. */
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+/* The longest interface file we read.  cpu.stat grows with each kernel. */
+#define CGROUP_FILE_MAX 2048
+
+/*
+ * The minimum time between samples of the CPU counters, in microseconds.
+ * Queries closer together than this reuse the previous results rather than
+ * computing percentages over a tiny interval.
+ */
+#define CGROUP_MIN_INTERVAL 1000000
+
+/* The interface files we read, in the order of the files array below. */
+enum cgroup_file {
+    CGROUP_CPU_STAT,
+    CGROUP_CPU_MAX,
+    CGROUP_MEMORY_CURRENT,
+    CGROUP_MEMORY_MAX,
+    CGROUP_CPU_PRESSURE,
+    CGROUP_CPUSET_CPUS,
+    CGROUP_FILE_COUNT
+};
+static const char *const cgroup_names[CGROUP_FILE_COUNT] = {
+    "cpu.stat", "cpu.max", "memory.current", "memory.max", "cpu.pressure",
+    "cpuset.cpus.effective"
+};
+
+/*
+ * The configured cgroup.  Files are kept open between samples, and files
+ * for controllers that aren't enabled for the cgroup are skipped.  The
+ * counters from the previous sample are kept to compute usage since then.
+ */
+struct cgroup {
+    char *name;
+    struct procfile files[CGROUP_FILE_COUNT];
+    bool available[CGROUP_FILE_COUNT];
+    unsigned long long sample_time;
+    unsigned long long usage_usec;
+    unsigned long long throttled_usec;
+    unsigned long cpuset;
+    struct cgroup_info info;
+};
+static struct cgroup *cgroup = NULL;
+
+/*
+ * The cgroup of a new configuration, which may be NULL for none, and whether
+ * there is a change to make.
+ */
+static struct cgroup *pending = NULL;
+static bool have_pending = false;
+
+
+/*
+ * Read one of the interface files.  Returns false if it isn't available or
+ * can't be read.
+ */
+static bool
+cgroup_read(enum cgroup_file which, char *buffer, size_t size)
+{
+    if (!cgroup->available[which])
+        return false;
+    return procfile_read(&cgroup->files[which], buffer, size) >= 0;
+}
+
+
+/*
+ * Parse a non-negative decimal number.  The counters and sizes in cgroup
+ * files don't fit in an unsigned long on 32-bit systems, so procfile_fixed
+ * won't do.  Returns a pointer to the character following the number or NULL
+ * if there is no number.
+ */
+static const char *
+parse_number(const char *p, unsigned long long *value)
+{
+    char *end;
+
+    while (*p == ' ')
+        p++;
+    if (*p < '0' || *p > '9')
+        return NULL;
+    *value = strtoull(p, &end, 10);
+    return end;
+}
+
+
+/*
+ * Parse a number from a file that may instead contain max.  Returns false
+ * and sets value to 0 if the value is max or can't be parsed.
+ */
+static bool
+parse_limit(const char *p, unsigned long long *value)
+{
+    *value = 0;
+    if (strncmp(p, "max", 3) == 0)
+        return false;
+    return (parse_number(p, value) != NULL);
+}
+
+
+/*
+ * Find the value of a key in a flat keyed file such as cpu.stat.  Returns
+ * false if the key isn't present.
+ */
+static bool
+parse_key(const char *buffer, const char *key, unsigned long long *value)
+{
+    const char *p;
+    size_t length = strlen(key);
+
+    for (p = buffer; p != NULL && *p != '\0'; p = strchr(p, '\n')) {
+        if (*p == '\n')
+            p++;
+        if (strncmp(p, key, length) == 0 && p[length] == ' ')
+            return (parse_number(p + length, value) != NULL);
+    }
+    return false;
+}
+
+
+/*
+ * Return the CPU quota from cpu.max as a number of CPUs, or 0 if there is no
+ * quota.
+ */
+static double
+quota_cpus(void)
+{
+    char buffer[CGROUP_FILE_MAX];
+    unsigned long long quota, period;
+    const char *p;
+
+    if (!cgroup_read(CGROUP_CPU_MAX, buffer, sizeof(buffer)))
+        return 0;
+    p = buffer + strcspn(buffer, " ");
+    if (!parse_limit(buffer, &quota) || parse_number(p, &period) == NULL
+        || period == 0)
+        return 0;
+    return (double) quota / period;
+}
+
+
+/*
+ * Return the number of CPUs in cpuset.cpus.effective, which is a list of
+ * CPU numbers and ranges such as 0-3,8, or 0 if it can't be read.
+ */
+static unsigned long
+cpuset_cpus(void)
+{
+    char buffer[CGROUP_FILE_MAX];
+    unsigned long long first, last;
+    unsigned long count = 0;
+    const char *p;
+
+    if (!cgroup_read(CGROUP_CPUSET_CPUS, buffer, sizeof(buffer)))
+        return 0;
+    p = buffer;
+    while ((p = parse_number(p, &first)) != NULL) {
+        last = first;
+        if (*p == '-' && (p = parse_number(p + 1, &last)) == NULL)
+            break;
+        if (last >= first)
+            count += (unsigned long) (last - first + 1);
+        if (*p != ',')
+            break;
+        p++;
+    }
+    return count;
+}
+
+
+/*
+ * Return the number of CPUs the configured cgroup may use, from its cpuset
+ * and its CPU quota, or 0 if no cgroup is configured or it has no limits.
+ */
+double
+lbcd_cgroup_cpus(void)
+{
+    double quota, cpuset;
+
+    if (cgroup == NULL)
+        return 0;
+    quota = quota_cpus();
+    cpuset = cpuset_cpus();
+    if (quota > 0 && (cpuset < 1 || quota < cpuset))
+        return quota;
+    return cpuset;
+}
+
+
+/*
+ * Update the CPU limit and the CPU usage since the last sample.  The limit
+ * is the quota from cpu.max, or the number of online CPUs if there is none.
+ * If the quota or the cpuset changed, the number of CPUs available has as
+ * well.  If the counters went backwards, the cgroup was recreated, so start
+ * over.
+ */
+static void
+update_cpu(struct cgroup_info *info)
+{
+    char buffer[CGROUP_FILE_MAX];
+    unsigned long long usage, throttled;
+    unsigned long long now, elapsed;
+    unsigned long old_limit, cpuset;
+    long cpus;
+
+    old_limit = info->cpu_limit;
+    info->cpu_limit = (unsigned long) (quota_cpus() * 100);
+    if (info->cpu_limit == 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        info->cpu_limit = (cpus > 0) ? (unsigned long) cpus * 100 : 100;
+    }
+    cpuset = cpuset_cpus();
+    if (old_limit != 0
+        && (info->cpu_limit != old_limit || cpuset != cgroup->cpuset))
+        lbcd_cpus_invalidate();
+    cgroup->cpuset = cpuset;
+
+    /* Compute usage relative to the last sample, if it's not too recent. */
+    now = sample_now();
+    if (cgroup->sample_time != 0
+        && now - cgroup->sample_time < CGROUP_MIN_INTERVAL)
+        return;
+    if (!cgroup_read(CGROUP_CPU_STAT, buffer, sizeof(buffer))
+        || !parse_key(buffer, "usage_usec", &usage))
+        return;
+    if (!parse_key(buffer, "throttled_usec", &throttled))
+        throttled = 0;
+    if (cgroup->sample_time != 0 && usage >= cgroup->usage_usec
+        && throttled >= cgroup->throttled_usec) {
+        elapsed = now - cgroup->sample_time;
+        info->cpu_util = (unsigned long)
+            ((double) (usage - cgroup->usage_usec) * 100 * 100 * 100
+             / ((double) elapsed * info->cpu_limit));
+        info->cpu_throttled = (unsigned long)
+            ((double) (throttled - cgroup->throttled_usec) * 100 * 100
+             / elapsed);
+        if (info->cpu_throttled > 100 * 100)
+            info->cpu_throttled = 100 * 100;
+    }
+    cgroup->sample_time = now;
+    cgroup->usage_usec = usage;
+    cgroup->throttled_usec = throttled;
+}
+
+
+/*
+ * Update the memory usage and limit.
+ */
+static void
+update_memory(struct cgroup_info *info)
+{
+    char buffer[CGROUP_FILE_MAX];
+    unsigned long long current, max;
+
+    info->mem_current = 0;
+    info->mem_max = 0;
+    info->mem_used = 0;
+    if (!cgroup_read(CGROUP_MEMORY_CURRENT, buffer, sizeof(buffer))
+        || parse_number(buffer, &current) == NULL)
+        return;
+    info->mem_current = (unsigned long) (current / (1024 * 1024));
+    if (!cgroup_read(CGROUP_MEMORY_MAX, buffer, sizeof(buffer))
+        || !parse_limit(buffer, &max) || max == 0)
+        return;
+    info->mem_max = (unsigned long) (max / (1024 * 1024));
+    info->mem_used = (unsigned long) ((double) current * 100 * 100 / max);
+}
+
+
+/*
+ * Read the resource usage of the configured cgroup into info.  Returns 0 on
+ * success and -1 if no cgroup is configured.  Values that can't be read,
+ * such as those for controllers not enabled for the cgroup, are zero.
+ */
+int
+lbcd_cgroup_read(struct cgroup_info *info)
+{
+    char buffer[CGROUP_FILE_MAX];
+
+    if (cgroup == NULL)
+        return -1;
+    update_cpu(&cgroup->info);
+    update_memory(&cgroup->info);
+    if (!cgroup_read(CGROUP_CPU_PRESSURE, buffer, sizeof(buffer))
+        || !lbcd_psi_parse(buffer, &cgroup->info.pressure))
+        memset(&cgroup->info.pressure, 0, sizeof(cgroup->info.pressure));
+    *info = cgroup->info;
+    return 0;
+}
+
+
+/*
+ * Find the cgroup of this process from /proc/self/cgroup, which contains a
+ * line of the form 0::<path> for the v2 hierarchy.  Returns a newly
+ * allocated path or NULL on failure.
+ */
+static char *
+cgroup_self(void)
+{
+    struct procfile self = PROCFILE_INIT("/proc/self/cgroup");
+    char buffer[CGROUP_FILE_MAX];
+    const char *p;
+
+    if (procfile_read(&self, buffer, sizeof(buffer)) < 0)
+        return NULL;
+    procfile_close(&self);
+    for (p = buffer; p != NULL; p = strchr(p, '\n')) {
+        if (*p == '\n')
+            p++;
+        if (strncmp(p, "0::", 3) == 0)
+            return xstrndup(p + 3, strcspn(p + 3, "\n"));
+    }
+    warn("no cgroup v2 entry in /proc/self/cgroup");
+    return NULL;
+}
+
+
+/*
+ * Free a cgroup, closing its files.
+ */
+static void
+cgroup_free(struct cgroup *group)
+{
+    size_t i;
+
+    for (i = 0; i < CGROUP_FILE_COUNT; i++) {
+        procfile_close(&group->files[i]);
+        free((char *) group->files[i].path);
+    }
+    free(group->name);
+    free(group);
+}
+
+
+/*
+ * Discard the cgroup from lbcd_cgroup_prepare.
+ */
+void
+lbcd_cgroup_abort(void)
+{
+    if (pending != NULL)
+        cgroup_free(pending);
+    pending = NULL;
+    have_pending = false;
+}
+
+
+/*
+ * Close the files for the configured cgroup and forget it.
+ */
+void
+lbcd_cgroup_close(void)
+{
+    lbcd_cgroup_abort();
+    if (cgroup != NULL)
+        cgroup_free(cgroup);
+    cgroup = NULL;
+    lbcd_cpus_invalidate();
+}
+
+
+/*
+ * Find the cgroup to report on and keep it to replace the current one once
+ * lbcd_cgroup_commit is called.  name may be an absolute path to the cgroup
+ * directory, a path relative to the root of the cgroup v2 hierarchy, or self
+ * for the cgroup of lbcd, and may be NULL to not report on any cgroup.  If
+ * the cgroup is unchanged, nothing is replaced, so that usage is still
+ * computed across the change.  Returns false after reporting the problem
+ * with warn if the cgroup doesn't exist.
+ */
+bool
+lbcd_cgroup_prepare(const char *name)
+{
+    struct cgroup *new;
+    char *path, *self, *file;
+    size_t i;
+
+    lbcd_cgroup_abort();
+    if (name == NULL) {
+        have_pending = true;
+        return true;
+    }
+    if (cgroup != NULL && strcmp(cgroup->name, name) == 0)
+        return true;
+
+    /* Find the directory for the cgroup. */
+    if (name[0] == '/')
+        path = xstrdup(name);
+    else if (strcmp(name, "self") == 0) {
+        self = cgroup_self();
+        if (self == NULL)
+            return false;
+        xasprintf(&path, "%s%s", CGROUP_ROOT,
+                  strcmp(self, "/") == 0 ? "" : self);
+        free(self);
+    } else
+        xasprintf(&path, "%s/%s", CGROUP_ROOT, name);
+
+    /* Every cgroup has cpu.stat.  The other files depend on controllers. */
+    new = xcalloc(1, sizeof(struct cgroup));
+    new->name = xstrdup(name);
+    for (i = 0; i < CGROUP_FILE_COUNT; i++) {
+        xasprintf(&file, "%s/%s", path, cgroup_names[i]);
+        new->files[i].path = file;
+        new->files[i].fd = -1;
+        new->available[i] = (access(file, R_OK) == 0);
+    }
+    if (!new->available[CGROUP_CPU_STAT]) {
+        warn("%s is not a cgroup v2 directory", path);
+        free(path);
+        cgroup_free(new);
+        return false;
+    }
+    free(path);
+    pending = new;
+    have_pending = true;
+    return true;
+}
+
+
+/*
+ * Switch to the cgroup from lbcd_cgroup_prepare, if it's a change.
+ */
+void
+lbcd_cgroup_commit(void)
+{
+    struct cgroup *new = pending;
+
+    if (!have_pending)
+        return;
+    pending = NULL;
+    have_pending = false;
+    lbcd_cgroup_close();
+    cgroup = new;
+}
+
+
+/*
+ * Set the cgroup to report on immediately, as with lbcd_cgroup_prepare.
+ * Returns false after reporting the problem with warn if the cgroup doesn't
+ * exist, in which case the previous cgroup is kept.
+ */
+bool
+lbcd_cgroup_init(const char *name)
+{
+    if (!lbcd_cgroup_prepare(name))
+        return false;
+    lbcd_cgroup_commit();
+    return true;
+}
@@ -0,0 +1,447 @@
+/*
+ * Composite services.
+ *
+ * A composite service combines the results of other services, so that a
+ * client can ask a single question such as "what is the load, unless the web
+ * server is down" without querying several services and combining them
+ * itself.  Composites are given on the command line with -W as name=expr,
+ * where expr is either the name of a service (including any :port argument)
+ * or one of:
+ *
+ *     max(expr, ...)      the result with the highest weight
+ *     sum(expr, ...)      the sum of the weights and of the increments
+ *     gate(check, expr)   the maximum weight if check fails, else expr
+ *     scale(expr, factor) the weight and increment multiplied by factor
+ *
+ * A service fails if it returns the maximum weight.  The operands are run
+ * through lbcd_service_weight, so each underlying service is run at most
+ * once per reply no matter how many composites or requested services use
+ * it, and results that the underlying service allows to be cached are
+ * reused across replies.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+
+#include <server/internal.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* The largest weight, which is also how services report failure. */
+#define COMPOSITE_MAX ((uint32_t) -1)
+
+/* Operations in a composite expression. */
+enum composite_op {
+    COMPOSITE_SERVICE,
+    COMPOSITE_MAX_OF,
+    COMPOSITE_SUM,
+    COMPOSITE_GATE,
+    COMPOSITE_SCALE
+};
+
+/* Names of the operations that take arguments and their operand counts. */
+static const struct {
+    const char *name;
+    enum composite_op op;
+    size_t min_args;
+    size_t max_args;
+} composite_ops[] = {
+    { "max",   COMPOSITE_MAX_OF, 1, (size_t) -1 },
+    { "sum",   COMPOSITE_SUM,    1, (size_t) -1 },
+    { "gate",  COMPOSITE_GATE,   2, 2           },
+    { "scale", COMPOSITE_SCALE,  1, 1           }
+};
+
+/* A node in a parsed composite expression. */
+struct composite_node {
+    enum composite_op op;
+    char *service;                      /* For COMPOSITE_SERVICE */
+    double factor;                      /* For COMPOSITE_SCALE */
+    struct composite_node **args;
+    size_t nargs;
+};
+
+/* A composite service. */
+struct composite {
+    char *name;
+    struct composite_node *root;
+    int mark;                           /* Used when checking for loops */
+};
+
+
+/*
+ * Free a composite expression.
+ */
+static void
+node_free(struct composite_node *node)
+{
+    size_t i;
+
+    if (node == NULL)
+        return;
+    for (i = 0; i < node->nargs; i++)
+        node_free(node->args[i]);
+    free(node->args);
+    free(node->service);
+    free(node);
+}
+
+
+/*
+ * Skip whitespace and return the new position.
+ */
+static const char *
+skip_space(const char *p)
+{
+    while (isspace((unsigned char) *p))
+        p++;
+    return p;
+}
+
+
+/*
+ * Return whether a character may be part of a service name.
+ */
+static bool
+is_service_char(char c)
+{
+    return (isalnum((unsigned char) c) || c == '_' || c == '-' || c == '.'
+            || c == ':');
+}
+
+
+/*
+ * Parse the factor argument of scale, which must be a non-negative number.
+ * Advances *p past it and returns true on success.
+ */
+static bool
+parse_factor(const char **p, double *factor)
+{
+    char *end;
+
+    *p = skip_space(*p);
+    if (!isdigit((unsigned char) **p) && **p != '.')
+        return false;
+    *factor = strtod(*p, &end);
+    if (end == *p)
+        return false;
+    *p = end;
+    return true;
+}
+
+
+/*
+ * Parse a composite expression starting at *p, advancing *p past it.  Returns
+ * the parsed node or NULL on a syntax error, which is reported with warn.
+ */
+static struct composite_node *
+parse_node(const char **p, const char *definition)
+{
+    struct composite_node *node;
+    const char *start;
+    size_t i, length, max_args;
+    bool have_factor = false;
+
+    *p = skip_space(*p);
+    start = *p;
+    while (is_service_char(**p))
+        (*p)++;
+    length = *p - start;
+    if (length == 0 || length >= sizeof(lbcd_name_type)) {
+        warn("invalid service name in composite %s", definition);
+        return NULL;
+    }
+    *p = skip_space(*p);
+
+    /* A plain service name. */
+    node = xcalloc(1, sizeof(struct composite_node));
+    if (**p != '(') {
+        node->op = COMPOSITE_SERVICE;
+        node->service = xstrndup(start, length);
+        return node;
+    }
+
+    /* An operation.  Find it and parse its arguments. */
+    for (i = 0; i < ARRAY_SIZE(composite_ops); i++)
+        if (strlen(composite_ops[i].name) == length
+            && strncmp(composite_ops[i].name, start, length) == 0)
+            break;
+    if (i == ARRAY_SIZE(composite_ops)) {
+        warn("unknown operation %.*s in composite %s", (int) length, start,
+             definition);
+        goto fail;
+    }
+    node->op = composite_ops[i].op;
+    max_args = composite_ops[i].max_args;
+    do {
+        (*p)++;
+        if (node->op == COMPOSITE_SCALE && node->nargs == max_args) {
+            if (have_factor || !parse_factor(p, &node->factor)) {
+                warn("invalid scale factor in composite %s", definition);
+                goto fail;
+            }
+            have_factor = true;
+        } else if (node->nargs == max_args) {
+            warn("too many arguments to %s in composite %s",
+                 composite_ops[i].name, definition);
+            goto fail;
+        } else {
+            node->args = xreallocarray(node->args, node->nargs + 1,
+                                       sizeof(struct composite_node *));
+            node->args[node->nargs] = parse_node(p, definition);
+            if (node->args[node->nargs] == NULL)
+                goto fail;
+            node->nargs++;
+        }
+        *p = skip_space(*p);
+    } while (**p == ',');
+    if (**p != ')') {
+        warn("expected ) in composite %s", definition);
+        goto fail;
+    }
+    (*p)++;
+    if (node->nargs < composite_ops[i].min_args
+        || (node->op == COMPOSITE_SCALE && !have_factor)) {
+        warn("too few arguments to %s in composite %s",
+             composite_ops[i].name, definition);
+        goto fail;
+    }
+    return node;
+
+fail:
+    node_free(node);
+    return NULL;
+}
+
+
+/*
+ * Add two weights, saturating at the maximum weight.
+ */
+static uint32_t
+add_weight(uint32_t a, uint32_t b)
+{
+    return (a > COMPOSITE_MAX - b) ? COMPOSITE_MAX : a + b;
+}
+
+
+/*
+ * Multiply a weight by a factor, saturating at the maximum weight.
+ */
+static uint32_t
+scale_weight(uint32_t weight, double factor)
+{
+    double result;
+
+    result = weight * factor;
+    if (result >= (double) COMPOSITE_MAX)
+        return COMPOSITE_MAX;
+    return (uint32_t) result;
+}
+
+
+/*
+ * Evaluate a composite expression, storing the weight and increment.
+ */
+static void
+node_eval(const struct composite_node *node, uint32_t *weight, uint32_t *incr,
+          struct lbcd_reply *lb)
+{
+    uint32_t sub_weight, sub_incr;
+    size_t i;
+
+    switch (node->op) {
+    case COMPOSITE_SERVICE:
+        lbcd_service_weight(node->service, weight, incr, lb);
+        break;
+    case COMPOSITE_MAX_OF:
+        node_eval(node->args[0], weight, incr, lb);
+        for (i = 1; i < node->nargs; i++) {
+            node_eval(node->args[i], &sub_weight, &sub_incr, lb);
+            if (sub_weight > *weight) {
+                *weight = sub_weight;
+                *incr = sub_incr;
+            }
+        }
+        break;
+    case COMPOSITE_SUM:
+        node_eval(node->args[0], weight, incr, lb);
+        for (i = 1; i < node->nargs; i++) {
+            node_eval(node->args[i], &sub_weight, &sub_incr, lb);
+            *weight = add_weight(*weight, sub_weight);
+            *incr = add_weight(*incr, sub_incr);
+        }
+        break;
+    case COMPOSITE_GATE:
+        node_eval(node->args[0], weight, incr, lb);
+        if (*weight == COMPOSITE_MAX) {
+            *incr = 0;
+            break;
+        }
+        node_eval(node->args[1], weight, incr, lb);
+        break;
+    case COMPOSITE_SCALE:
+        node_eval(node->args[0], weight, incr, lb);
+        if (*weight != COMPOSITE_MAX) {
+            *weight = scale_weight(*weight, node->factor);
+            *incr = scale_weight(*incr, node->factor);
+        }
+        break;
+    }
+}
+
+
+/*
+ * The weight function registered for each composite service.
+ */
+static int
+composite_weight(void *data, uint32_t *weight_val, uint32_t *incr_val,
+                 int timeout UNUSED, const char *portarg UNUSED,
+                 struct lbcd_reply *lb)
+{
+    const struct composite *composite = data;
+
+    node_eval(composite->root, weight_val, incr_val, lb);
+    return 0;
+}
+
+
+/*
+ * Free a composite service.  Called by the service registry, which owns the
+ * registered composites.
+ */
+static void
+composite_free(void *data)
+{
+    struct composite *composite = data;
+
+    node_free(composite->root);
+    free(composite->name);
+    free(composite);
+}
+
+
+/*
+ * Define a composite service from a definition of the form name=expr and
+ * register it.  Returns false after reporting the problem with warn if the
+ * definition is invalid.
+ */
+bool
+lbcd_composite_define(const char *definition)
+{
+    struct composite *composite;
+    struct composite_node *root;
+    const char *equals, *p;
+
+    equals = strchr(definition, '=');
+    if (equals == NULL || equals == definition
+        || (size_t) (equals - definition) >= sizeof(lbcd_name_type)) {
+        warn("invalid composite definition %s", definition);
+        return false;
+    }
+    for (p = definition; p < equals; p++)
+        if (!is_service_char(*p) || *p == ':') {
+            warn("invalid composite name in %s", definition);
+            return false;
+        }
+    if (strncmp(definition, "default=", 8) == 0) {
+        warn("composite may not be named default");
+        return false;
+    }
+    p = equals + 1;
+    root = parse_node(&p, definition);
+    if (root == NULL)
+        return false;
+    p = skip_space(p);
+    if (*p != '\0') {
+        warn("unexpected text after composite %s", definition);
+        node_free(root);
+        return false;
+    }
+    composite = xcalloc(1, sizeof(struct composite));
+    composite->name = xstrndup(definition, equals - definition);
+    composite->root = root;
+    lbcd_service_register(composite->name, composite_weight, composite, 0,
+                          composite_free);
+    return true;
+}
+
+
+/* Forward declaration for recursion. */
+static bool composite_visit(struct composite *);
+
+
+/*
+ * Check every composite referred to by an expression for loops.
+ */
+static bool
+node_visit(const struct composite_node *node)
+{
+    struct composite *composite;
+    size_t i;
+
+    if (node->op == COMPOSITE_SERVICE) {
+        composite = lbcd_service_data(node->service, composite_weight);
+        return (composite == NULL || composite_visit(composite));
+    }
+    for (i = 0; i < node->nargs; i++)
+        if (!node_visit(node->args[i]))
+            return false;
+    return true;
+}
+
+
+/*
+ * Depth-first search for loops starting at a composite.  mark is 0 for
+ * composites not yet visited, 1 for those being visited, and 2 for those
+ * known to be free of loops.
+ */
+static bool
+composite_visit(struct composite *composite)
+{
+    if (composite->mark == 2)
+        return true;
+    if (composite->mark == 1) {
+        warn("composite %s depends on itself", composite->name);
+        return false;
+    }
+    composite->mark = 1;
+    if (!node_visit(composite->root))
+        return false;
+    composite->mark = 2;
+    return true;
+}
+
+
+/*
+ * Check that no composite depends on itself, directly or indirectly.  This
+ * has to be done after all composites are defined since they may refer to
+ * composites defined later.  Returns false after reporting the problem with
+ * warn if there is a loop.
+ */
+bool
+lbcd_composite_check(void)
+{
+    struct composite *composite;
+    void **composites;
+    size_t count, i;
+    bool okay = true;
+
+    composites = lbcd_service_list(composite_weight, &count);
+    for (i = 0; i < count; i++) {
+        composite = composites[i];
+        composite->mark = 0;
+    }
+    for (i = 0; i < count && okay; i++)
+        okay = composite_visit(composites[i]);
+    free(composites);
+    return okay;
+}
@@ -0,0 +1,398 @@
+/*
+ * lbcd configuration.
+ *
+ * The configuration can come from a file, from the command line, or both.
+ * Every setting in the file corresponds to a command-line option, and both
+ * go through lbcd_config_set so that they're checked the same way.  The file
+ * contains one setting per line, consisting of the setting name, whitespace,
+ * and the value.  Blank lines and lines starting with # are ignored, and
+ * boolean settings may omit the value to turn them on.  Settings that can be
+ * given multiple times on the command line may be repeated in the file.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+#include <errno.h>
+
+#include <server/internal.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/vector.h>
+#include <util/xmalloc.h>
+
+/* The longest line allowed in a configuration file. */
+#define CONFIG_LINE_MAX 8192
+
+/* Settings, the equivalent command-line options, and whether they're flags. */
+static const struct {
+    const char *key;
+    int option;
+    bool flag;
+} config_keys[] = {
+    { "app-socket",    'A', false },
+    { "allow",         'a', false },
+    { "app-shm",       'B', false },
+    { "bind",          'b', false },
+    { "command",       'c', false },
+    { "filesystem",    'D', false },
+    { "probe-dir",     'E', false },
+    { "formula",       'F', false },
+    { "cgroup",        'G', false },
+    { "half-lives",    'H', false },
+    { "idle-time",     'I', false },
+    { "capacity-file", 'K', false },
+    { "memory-floor",  'L', false },
+    { "log",           'l', true  },
+    { "plugin-dir",    'M', false },
+    { "memory-penalty", 'm', false },
+    { "normalize",     'N', true  },
+    { "interface",     'n', false },
+    { "pid-file",      'P', false },
+    { "port",          'p', false },
+    { "round-robin",   'R', true  },
+    { "simple",        'S', true  },
+    { "timeout",       'T', false },
+    { "user-cpu",      'U', false },
+    { "composite",     'W', false },
+    { "weight",        'w', false },
+    { "disk",          'X', false },
+    { "psi-weights",   'Y', false },
+    { "upstart",       'Z', true  },
+};
+
+
+/*
+ * Create a new configuration with the default settings.
+ */
+struct lbcd_config *
+lbcd_config_new(void)
+{
+    struct lbcd_config *config;
+
+    config = xcalloc(1, sizeof(struct lbcd_config));
+    config->bindaddrs = vector_new();
+    config->port = LBCD_PORTNUM;
+    config->services = vector_new();
+    config->timeout = LBCD_TIMEOUT;
+    config->formulas = vector_new();
+    config->composites = vector_new();
+    config->filesystems = vector_new();
+    config->interfaces = vector_new();
+    config->disks = vector_new();
+    return config;
+}
+
+
+/*
+ * Free a configuration.
+ */
+void
+lbcd_config_free(struct lbcd_config *config)
+{
+    if (config == NULL)
+        return;
+    vector_free(config->bindaddrs);
+    vector_free(config->services);
+    vector_free(config->formulas);
+    vector_free(config->composites);
+    vector_free(config->filesystems);
+    vector_free(config->interfaces);
+    vector_free(config->disks);
+    free(config->pid_file);
+    free(config->command);
+    free(config->weight);
+    free(config->probe_dir);
+    free(config->plugin_dir);
+    free(config->psi_weights);
+    free(config->cgroup);
+    free(config->capacity_file);
+    free(config->half_lives);
+    free(config->user_cpu);
+    free(config->memory_penalty);
+    free(config->app_socket);
+    free(config->app_shm);
+    free(config);
+}
+
+
+/*
+ * Return the name of the setting corresponding to a command-line option, or
+ * NULL if the option has no corresponding setting.
+ */
+const char *
+lbcd_config_key(int option)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(config_keys); i++)
+        if (config_keys[i].option == option)
+            return config_keys[i].key;
+    return NULL;
+}
+
+
+/*
+ * Parse a boolean value.  Returns true on success and stores the value in
+ * result, and returns false if the value isn't a valid boolean.
+ */
+static bool
+parse_boolean(const char *value, bool *result)
+{
+    if (strcmp(value, "true") == 0 || strcmp(value, "yes") == 0
+        || strcmp(value, "on") == 0 || strcmp(value, "1") == 0)
+        *result = true;
+    else if (strcmp(value, "false") == 0 || strcmp(value, "no") == 0
+             || strcmp(value, "off") == 0 || strcmp(value, "0") == 0)
+        *result = false;
+    else
+        return false;
+    return true;
+}
+
+
+/*
+ * Parse a number no larger than max.  Returns true on success and stores the
+ * value in result, and returns false if the value isn't a valid number.
+ */
+static bool
+parse_number(const char *value, unsigned long max, unsigned long *result)
+{
+    char *end;
+
+    if (!isdigit((unsigned char) *value))
+        return false;
+    errno = 0;
+    *result = strtoul(value, &end, 10);
+    return (errno == 0 && *end == '\0' && *result <= max);
+}
+
+
+/*
+ * Replace a string setting.
+ */
+static void
+set_string(char **setting, const char *value)
+{
+    free(*setting);
+    *setting = xstrdup(value);
+}
+
+
+/*
+ * Apply one setting to a configuration.  value may be NULL for boolean
+ * settings, which turns them on.  Returns false after reporting the problem
+ * with warn if the setting or its value is invalid.
+ */
+bool
+lbcd_config_set(struct lbcd_config *config, const char *key,
+                const char *value)
+{
+    unsigned long number;
+    bool flag = false;
+    size_t i;
+
+    /* Check that the setting exists and handle missing values. */
+    for (i = 0; i < ARRAY_SIZE(config_keys); i++)
+        if (strcmp(config_keys[i].key, key) == 0)
+            break;
+    if (i == ARRAY_SIZE(config_keys)) {
+        warn("unknown setting %s", key);
+        return false;
+    }
+    if (config_keys[i].flag) {
+        if (value != NULL && !parse_boolean(value, &flag)) {
+            warn("invalid boolean value %s for %s", value, key);
+            return false;
+        } else if (value == NULL)
+            flag = true;
+    } else if (value == NULL) {
+        warn("missing value for %s", key);
+        return false;
+    }
+
+    /* Apply the setting. */
+    switch (config_keys[i].option) {
+    case 'A':
+        set_string(&config->app_socket, value);
+        break;
+    case 'a':
+        vector_add(config->services, value);
+        break;
+    case 'B':
+        set_string(&config->app_shm, value);
+        break;
+    case 'b':
+        vector_add(config->bindaddrs, value);
+        break;
+    case 'c':
+        if (access(value, X_OK) != 0) {
+            syswarn("cannot access %s", value);
+            return false;
+        }
+        set_string(&config->command, value);
+        break;
+    case 'D':
+        vector_add(config->filesystems, value);
+        break;
+    case 'E':
+        set_string(&config->probe_dir, value);
+        break;
+    case 'F':
+        vector_add(config->formulas, value);
+        break;
+    case 'G':
+        set_string(&config->cgroup, value);
+        break;
+    case 'H':
+        set_string(&config->half_lives, value);
+        break;
+    case 'I':
+        if (!parse_number(value, 31536000, &number)) {
+            warn("invalid idle time %s", value);
+            return false;
+        }
+        config->idle_time = number;
+        break;
+    case 'K':
+        set_string(&config->capacity_file, value);
+        break;
+    case 'L':
+        if (!parse_number(value, 16777216, &number)) {
+            warn("invalid memory floor %s", value);
+            return false;
+        }
+        config->memory_floor = number;
+        break;
+    case 'l':
+        config->log = flag;
+        break;
+    case 'M':
+        set_string(&config->plugin_dir, value);
+        break;
+    case 'm':
+        set_string(&config->memory_penalty, value);
+        break;
+    case 'N':
+        config->normalize = flag;
+        break;
+    case 'n':
+        vector_add(config->interfaces, value);
+        break;
+    case 'P':
+        set_string(&config->pid_file, value);
+        break;
+    case 'p':
+        if (!parse_number(value, 65535, &number)) {
+            warn("invalid port %s", value);
+            return false;
+        }
+        config->port = number;
+        break;
+    case 'R':
+        if (flag)
+            set_string(&config->weight, "rr");
+        break;
+    case 'S':
+        config->simple = flag;
+        break;
+    case 'T':
+        if (!parse_number(value, 300, &number) || number < 1) {
+            warn("timeout (%s) must be between 1 and 300 seconds", value);
+            return false;
+        }
+        config->timeout = number;
+        break;
+    case 'U':
+        set_string(&config->user_cpu, value);
+        break;
+    case 'W':
+        vector_add(config->composites, value);
+        break;
+    case 'w':
+        set_string(&config->weight, value);
+        vector_add(config->services, value);
+        break;
+    case 'X':
+        vector_add(config->disks, value);
+        break;
+    case 'Y':
+        set_string(&config->psi_weights, value);
+        break;
+    case 'Z':
+        config->upstart = flag;
+        break;
+    default:
+        die("internal error: unhandled setting %s", key);
+    }
+    return true;
+}
+
+
+/*
+ * Read a configuration file and apply its settings to a configuration.
+ * Returns false after reporting the problems with warn if the file can't be
+ * read or contains any invalid settings.
+ */
+bool
+lbcd_config_read(struct lbcd_config *config, const char *path)
+{
+    FILE *file;
+    char buffer[CONFIG_LINE_MAX];
+    char *key, *value, *end;
+    unsigned long line = 0;
+    bool okay = true;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        syswarn("cannot open %s", path);
+        return false;
+    }
+    while (fgets(buffer, sizeof(buffer), file) != NULL) {
+        line++;
+        if (strchr(buffer, '\n') == NULL && !feof(file)) {
+            warn("%s:%lu: line too long", path, line);
+            okay = false;
+            break;
+        }
+
+        /* Strip surrounding whitespace and skip blank lines and comments. */
+        for (key = buffer; isspace((unsigned char) *key); key++)
+            ;
+        end = key + strlen(key);
+        while (end > key && isspace((unsigned char) end[-1]))
+            end--;
+        *end = '\0';
+        if (*key == '\0' || *key == '#')
+            continue;
+
+        /* Split the setting from its value, if any. */
+        for (value = key; *value != '\0'; value++)
+            if (isspace((unsigned char) *value))
+                break;
+        if (*value == '\0')
+            value = NULL;
+        else {
+            *value++ = '\0';
+            while (isspace((unsigned char) *value))
+                value++;
+        }
+        if (!lbcd_config_set(config, key, value)) {
+            warn("%s:%lu: invalid setting", path, line);
+            okay = false;
+        }
+    }
+    if (ferror(file)) {
+        syswarn("cannot read %s", path);
+        okay = false;
+    }
+    fclose(file);
+    return okay;
+}
@@ -0,0 +1,199 @@
+/*
+ * The number of CPUs available to the workload.
+ *
+ * The load average counts runnable tasks across the whole host, so a load
+ * of 8 means something very different on a host with four CPUs than on one
+ * with a hundred.  To compare hosts fairly, the load is divided by the
+ * number of CPUs that are actually available: those in lbcd's CPU affinity
+ * mask, further limited by the cpuset and CPU quota of the configured cgroup,
+ * if any.  Quotas can allow fractional CPUs.
+ *
+ * Finding this is more work than we want to do for each query, and it
+ * rarely changes, so the result is cached.  It's recomputed when the kernel
+ * reports that a CPU was added or removed, when the quota of the cgroup
+ * changes, and when the configuration is reloaded.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#ifdef HAVE_SCHED_GETAFFINITY
+# include <sched.h>
+#endif
+#ifdef HAVE_LINUX_NETLINK_H
+# include <linux/netlink.h>
+#endif
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/messages.h>
+
+/* The largest kernel uevent message.  Larger messages are truncated. */
+#define UEVENT_MAX 8192
+
+/* The cached number of CPUs, or 0 if it needs to be recomputed. */
+static double cpus = 0;
+
+/* The socket on which we receive CPU hotplug events, or -1. */
+static int uevent_fd = -1;
+
+
+/*
+ * Return the number of CPUs in our affinity mask, or the number online if
+ * that isn't available.  Always returns at least 1.
+ */
+static unsigned long
+affinity_cpus(void)
+{
+    long online;
+#ifdef HAVE_SCHED_GETAFFINITY
+    cpu_set_t *set;
+    size_t size;
+    long configured;
+    int count = 0;
+
+    configured = sysconf(_SC_NPROCESSORS_CONF);
+    if (configured < 1)
+        configured = 1;
+    set = CPU_ALLOC(configured);
+    if (set != NULL) {
+        size = CPU_ALLOC_SIZE(configured);
+        CPU_ZERO_S(size, set);
+        if (sched_getaffinity(0, size, set) == 0)
+            count = CPU_COUNT_S(size, set);
+        else
+            syswarn("cannot get CPU affinity");
+        CPU_FREE(set);
+    }
+    if (count > 0)
+        return (unsigned long) count;
+#endif
+
+    online = sysconf(_SC_NPROCESSORS_ONLN);
+    return (online > 0) ? (unsigned long) online : 1;
+}
+
+
+/*
+ * Return the number of CPUs available, computing it if needed.
+ */
+double
+lbcd_cpus_get(void)
+{
+    double limit;
+
+    if (cpus > 0)
+        return cpus;
+    cpus = affinity_cpus();
+    limit = lbcd_cgroup_cpus();
+    if (limit > 0 && limit < cpus)
+        cpus = limit;
+    return cpus;
+}
+
+
+/*
+ * Forget the number of CPUs so that it's computed again on next use.
+ */
+void
+lbcd_cpus_invalidate(void)
+{
+    cpus = 0;
+}
+
+
+/*
+ * Open a socket on which the kernel reports CPU hotplug events and return
+ * it, or return -1 if that isn't possible.  The caller should wait for it to
+ * be readable and then call lbcd_cpus_event.
+ */
+int
+lbcd_cpus_watch(void)
+{
+#ifdef HAVE_LINUX_NETLINK_H
+    struct sockaddr_nl addr;
+
+    if (uevent_fd >= 0)
+        return uevent_fd;
+    uevent_fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    if (uevent_fd < 0) {
+        debug("cannot create uevent socket: %s", strerror(errno));
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    if (bind(uevent_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        debug("cannot bind uevent socket: %s", strerror(errno));
+        close(uevent_fd);
+        uevent_fd = -1;
+        return -1;
+    }
+    fdflag_close_exec(uevent_fd, true);
+    fdflag_nonblocking(uevent_fd, true);
+    return uevent_fd;
+#else
+    return -1;
+#endif
+}
+
+
+/*
+ * Read all pending kernel events from the hotplug socket and forget the
+ * number of CPUs and the NUMA nodes if any of them are for a CPU.  Memory
+ * events only affect the NUMA nodes.  Each event is a series of
+ * nul-separated strings, starting with action@devpath and followed by
+ * key=value pairs including SUBSYSTEM.
+ */
+void
+lbcd_cpus_event(void)
+{
+    char buffer[UEVENT_MAX];
+    const char *p, *end;
+    ssize_t length;
+
+    if (uevent_fd < 0)
+        return;
+    while ((length = recv(uevent_fd, buffer, sizeof(buffer) - 1, 0)) > 0) {
+        buffer[length] = '\0';
+        end = buffer + length;
+        for (p = buffer; p < end; p += strlen(p) + 1) {
+            if (strcmp(p, "SUBSYSTEM=cpu") == 0) {
+                lbcd_cpus_invalidate();
+                lbcd_numa_invalidate();
+                break;
+            } else if (strcmp(p, "SUBSYSTEM=memory") == 0) {
+                lbcd_numa_invalidate();
+                break;
+            }
+        }
+    }
+
+    /* If events were dropped, one of them could have been for a CPU. */
+    if (length < 0 && errno == ENOBUFS) {
+        lbcd_cpus_invalidate();
+        lbcd_numa_invalidate();
+    } else if (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+               && errno != EINTR)
+        syswarn("cannot read kernel events");
+}
+
+
+/*
+ * Close the hotplug socket.
+ */
+void
+lbcd_cpus_close(void)
+{
+    if (uevent_fd >= 0)
+        close(uevent_fd);
+    uevent_fd = -1;
+}
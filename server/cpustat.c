@@ -0,0 +1,344 @@
+/*
+ * High-resolution CPU utilization from /proc/stat.
+ *
+ * The one-minute load average takes tens of seconds to reflect a burst of
+ * new work, during which an apparently idle host keeps being handed more.
+ * It also doesn't show CPU time taken by the hypervisor, so a virtual machine
+ * can look idle while it's being starved.  To catch both, the CPU times in
+ * /proc/stat are sampled several times a second, and the fraction of time
+ * spent busy, waiting for I/O, stolen by the hypervisor, and handling
+ * software interrupts is tracked as exponentially-weighted moving averages
+ * with three configurable half-lives.
+ *
+ * Samples are taken from the main loop, which wakes up for them as needed,
+ * and when the metrics are updated if a sample is due.  On hosts with
+ * several NUMA nodes, each sample also includes the times of each CPU, from
+ * which numa.c computes the utilization of each node.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+
+#include <server/internal.h>
+#include <server/procfile.h>
+#include <server/sample.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/*
+ * The longest part of /proc/stat we read when only the first line, with the
+ * totals for all CPUs, is needed.  It's always much shorter than this.  When
+ * the times of each CPU are needed, we also allow this much for each CPU
+ * line, which is more than a line of ten 64-bit numbers takes.
+ */
+#define CPUSTAT_FILE_MAX 512
+#define CPUSTAT_LINE_MAX 256
+
+/* How often to sample, in microseconds. */
+#define CPUSTAT_INTERVAL 250000
+
+/* Half-lives used if none are configured, in seconds. */
+#define CPUSTAT_DEFAULT_HALF_LIVES "2,10,60"
+
+/* The file we sample. */
+static struct procfile stat_file = PROCFILE_INIT("/proc/stat");
+
+/* Whether /proc/stat has been checked for, and whether it exists. */
+static bool stat_checked = false;
+static bool stat_available = false;
+
+/*
+ * The buffer for /proc/stat and the times of each CPU, both grown as needed
+ * when the times of each CPU are needed to compute NUMA node utilization.
+ */
+static char *stat_buffer = NULL;
+static size_t stat_size = 0;
+static struct cpustat_times *cpu_times = NULL;
+static size_t cpu_times_count = 0;
+
+/* The configured half-lives in seconds, and those of a new configuration. */
+static double half_lives[CPUSTAT_RATES] = { 2, 10, 60 };
+static double pending_half_lives[CPUSTAT_RATES];
+static bool have_pending = false;
+
+/*
+ * The previous sample, when it was taken or 0 if there is none, and whether
+ * any averages have been computed yet.
+ */
+static struct cpustat_times last;
+static unsigned long long last_time = 0;
+static bool have_averages = false;
+
+/* The moving averages as fractions of the total CPU time. */
+static double util[CPUSTAT_RATES];
+static double iowait[CPUSTAT_RATES];
+static double steal[CPUSTAT_RATES];
+static double softirq[CPUSTAT_RATES];
+
+
+/*
+ * Add a sample to the moving averages.  The first sample only establishes a
+ * baseline, and the averages start at the values over the first interval.
+ * If the counters went backwards, which can happen when CPUs go offline,
+ * the sample becomes the new baseline.
+ */
+void
+lbcd_cpustat_update(const struct cpustat_times *times, unsigned long long now)
+{
+    unsigned long busy, idle, total;
+    double elapsed;
+    double value[4];
+    size_t i;
+
+    if (last_time == 0 || now <= last_time) {
+        last = *times;
+        last_time = now;
+        return;
+    }
+    if (times->user < last.user || times->nice < last.nice
+        || times->system < last.system || times->idle < last.idle
+        || times->iowait < last.iowait || times->irq < last.irq
+        || times->softirq < last.softirq || times->steal < last.steal) {
+        last = *times;
+        last_time = now;
+        return;
+    }
+    busy = (times->user - last.user) + (times->nice - last.nice)
+        + (times->system - last.system) + (times->irq - last.irq)
+        + (times->softirq - last.softirq) + (times->steal - last.steal);
+    idle = (times->idle - last.idle) + (times->iowait - last.iowait);
+    total = busy + idle;
+    if (total == 0)
+        return;
+
+    /* The fractions of time over this interval. */
+    value[0] = (double) busy / total;
+    value[1] = (double) (times->iowait - last.iowait) / total;
+    value[2] = (double) (times->steal - last.steal) / total;
+    value[3] = (double) (times->softirq - last.softirq) / total;
+
+    /*
+     * Decay each average by the time since the last sample, so that after
+     * one half-life the old value counts for half.
+     */
+    elapsed = (double) (now - last_time) / 1000000;
+    for (i = 0; i < CPUSTAT_RATES; i++) {
+        util[i] = sample_average(util[i], value[0], elapsed, half_lives[i],
+                                 have_averages);
+        iowait[i] = sample_average(iowait[i], value[1], elapsed,
+                                   half_lives[i], have_averages);
+        steal[i] = sample_average(steal[i], value[2], elapsed, half_lives[i],
+                                  have_averages);
+        softirq[i] = sample_average(softirq[i], value[3], elapsed,
+                                    half_lives[i], have_averages);
+    }
+    have_averages = true;
+    last = *times;
+    last_time = now;
+}
+
+
+/*
+ * Return the number of milliseconds until the next sample is due, or -1 if
+ * there will be no more samples.
+ */
+int
+lbcd_cpustat_timeout(void)
+{
+    unsigned long long now;
+
+    if (stat_checked && !stat_available)
+        return -1;
+    if (last_time == 0)
+        return 0;
+    now = sample_now();
+    if (now - last_time >= CPUSTAT_INTERVAL)
+        return 0;
+    return (int) ((CPUSTAT_INTERVAL - (now - last_time) + 999) / 1000);
+}
+
+
+/*
+ * Make sure that the buffer for /proc/stat and the array of per-CPU times
+ * are large enough for the given number of CPUs.
+ */
+static void
+buffers_resize(size_t ncpus)
+{
+    size_t size;
+
+    size = CPUSTAT_FILE_MAX + ncpus * CPUSTAT_LINE_MAX;
+    if (size > stat_size) {
+        stat_buffer = xrealloc(stat_buffer, size);
+        stat_size = size;
+    }
+    if (ncpus > cpu_times_count) {
+        cpu_times = xreallocarray(cpu_times, ncpus, sizeof(*cpu_times));
+        cpu_times_count = ncpus;
+    }
+}
+
+
+/*
+ * Take a sample if one is due.  A kernel without /proc/stat is not an error
+ * worth reporting, so if the file doesn't exist the first time we look, we
+ * quietly give up on it.  The times of each CPU are only parsed if there
+ * are several NUMA nodes, and are passed along with the totals to compute
+ * the utilization of each node using the middle half-life.
+ */
+void
+lbcd_cpustat_sample(void)
+{
+    struct cpustat_times times;
+    struct cpustat_times *cpus = NULL;
+    unsigned long long now;
+    size_t ncpus;
+    ssize_t length;
+
+    if (!stat_checked) {
+        stat_available = (access(stat_file.path, R_OK) == 0);
+        stat_checked = true;
+    }
+    if (!stat_available || lbcd_cpustat_timeout() != 0)
+        return;
+    ncpus = lbcd_numa_cpus();
+    buffers_resize(ncpus);
+    length = procfile_read(&stat_file, stat_buffer, stat_size);
+    if (length < 0)
+        return;
+    if (ncpus > 0) {
+        cpus = cpu_times;
+        memset(cpus, 0, ncpus * sizeof(*cpus));
+    }
+    if (lbcd_stat_parse(stat_buffer, (size_t) length, &times, cpus, ncpus)
+        < 0) {
+        warn("cannot parse %s", stat_file.path);
+        return;
+    }
+    now = sample_now();
+    lbcd_numa_update(&times, cpus, ncpus, now, half_lives[1]);
+    lbcd_cpustat_update(&times, now);
+}
+
+
+/*
+ * Store the current averages in info as percentages times 100.  The averages
+ * are zero until two samples have been taken.
+ */
+void
+lbcd_cpustat_read(struct cpustat_info *info)
+{
+    size_t i;
+
+    for (i = 0; i < CPUSTAT_RATES; i++) {
+        info->util[i]    = (unsigned long) (util[i] * 10000 + 0.5);
+        info->iowait[i]  = (unsigned long) (iowait[i] * 10000 + 0.5);
+        info->steal[i]   = (unsigned long) (steal[i] * 10000 + 0.5);
+        info->softirq[i] = (unsigned long) (softirq[i] * 10000 + 0.5);
+    }
+}
+
+
+/*
+ * Parse the half-lives of the averages from a comma-separated list of three
+ * times in seconds, or use the defaults if spec is NULL, and keep them to be
+ * used once lbcd_cpustat_commit is called.  Returns false after reporting
+ * the problem with warn if the list is invalid.
+ */
+bool
+lbcd_cpustat_prepare(const char *spec)
+{
+    double value[CPUSTAT_RATES];
+    const char *p;
+    char *end;
+    size_t i;
+
+    if (spec == NULL)
+        spec = CPUSTAT_DEFAULT_HALF_LIVES;
+    p = spec;
+    for (i = 0; i < CPUSTAT_RATES; i++) {
+        if (!isdigit((unsigned char) *p) && *p != '.')
+            break;
+        value[i] = strtod(p, &end);
+        if (value[i] <= 0 || *end != (i + 1 < CPUSTAT_RATES ? ',' : '\0'))
+            break;
+        p = end + 1;
+    }
+    if (i < CPUSTAT_RATES) {
+        warn("invalid half-lives %s (expected three times in seconds)",
+             spec);
+        return false;
+    }
+    memcpy(pending_half_lives, value, sizeof(pending_half_lives));
+    have_pending = true;
+    return true;
+}
+
+
+/*
+ * Switch to the half-lives from lbcd_cpustat_prepare.  The averages so far
+ * are kept.
+ */
+void
+lbcd_cpustat_commit(void)
+{
+    if (have_pending)
+        memcpy(half_lives, pending_half_lives, sizeof(half_lives));
+    have_pending = false;
+}
+
+
+/*
+ * Discard the half-lives from lbcd_cpustat_prepare.
+ */
+void
+lbcd_cpustat_abort(void)
+{
+    have_pending = false;
+}
+
+
+/*
+ * Set the half-lives of the averages immediately.  Returns false after
+ * reporting the problem with warn if the list is invalid, in which case the
+ * half-lives are unchanged.
+ */
+bool
+lbcd_cpustat_init(const char *spec)
+{
+    if (!lbcd_cpustat_prepare(spec))
+        return false;
+    lbcd_cpustat_commit();
+    return true;
+}
+
+
+/*
+ * Close /proc/stat and forget all samples.
+ */
+void
+lbcd_cpustat_close(void)
+{
+    procfile_close(&stat_file);
+    free(stat_buffer);
+    stat_buffer = NULL;
+    stat_size = 0;
+    free(cpu_times);
+    cpu_times = NULL;
+    cpu_times_count = 0;
+    stat_checked = false;
+    last_time = 0;
+    have_averages = false;
+    memset(util, 0, sizeof(util));
+    memset(iowait, 0, sizeof(iowait));
+    memset(steal, 0, sizeof(steal));
+    memset(softirq, 0, sizeof(softirq));
+}
@@ -0,0 +1,449 @@
+/*
+ * Disk I/O utilization from /proc/diskstats.
+ *
+ * A host doing heavy local I/O, such as batch jobs using scratch space,
+ * becomes unusable for interactive work long before its load average shows
+ * it.  For each configured block device, this samples /proc/diskstats from
+ * the main loop and tracks, as exponentially-weighted moving averages, the
+ * fraction of time the device was busy, the average number of requests
+ * queued or in flight, and the average time a request took to complete,
+ * the same values iostat -x reports as %util, aqu-sz, and await.
+ *
+ * Devices are found by name in each sample, so one that's added after lbcd
+ * starts is picked up when it appears.  One that disappears keeps its
+ * averages, and when it comes back, its counters start over from its next
+ * sample.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <server/internal.h>
+#include <server/procfile.h>
+#include <server/sample.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/vector.h>
+#include <util/xmalloc.h>
+
+/* The size to start with for the buffer for /proc/diskstats. */
+#define DISK_FILE_MIN 4096
+
+/* How often to sample, in microseconds. */
+#define DISK_INTERVAL 1000000
+
+/* The half-life of the moving averages, in seconds. */
+#define DISK_HALF_LIFE 10
+
+/* The longest device name we accept. */
+#define DISK_NAME_MAX 64
+
+/* The counters of a device from /proc/diskstats that we use. */
+struct disk_counters {
+    unsigned long long ios;     /* Reads and writes completed */
+    unsigned long long ticks;   /* Milliseconds spent on reads and writes */
+    unsigned long long busy;    /* Milliseconds with I/O in flight */
+    unsigned long long queue;   /* Weighted milliseconds of I/O in flight */
+};
+
+/* A monitored device. */
+struct disk {
+    char *name;
+    bool have_last;             /* Whether there is a previous sample */
+    bool have_averages;         /* Whether the averages have been started */
+    struct disk_counters last;
+    double util;                /* Fraction of time busy */
+    double queue;               /* Average requests in flight */
+    double await;               /* Average milliseconds per request */
+};
+
+/* The path to /proc/diskstats, which is under a different root for tests. */
+static char *stats_path = NULL;
+static struct procfile stats_file = PROCFILE_INIT(NULL);
+
+/* The buffer for /proc/diskstats, grown as needed. */
+static char *stats_buffer = NULL;
+static size_t stats_size = 0;
+
+/* Whether /proc/diskstats has been checked for, and whether it exists. */
+static bool stats_checked = false;
+static bool stats_available = false;
+
+/* The monitored devices and when the last sample was taken, or 0. */
+static struct disk *disks = NULL;
+static size_t disks_count = 0;
+static unsigned long long last_time = 0;
+
+/*
+ * The devices and path of /proc/diskstats of a new configuration, and
+ * whether there are any.
+ */
+static struct disk *pending = NULL;
+static size_t pending_count = 0;
+static char *pending_path = NULL;
+static bool have_pending = false;
+
+
+/*
+ * Find the counters of a device in the contents of /proc/diskstats.  Each
+ * line is the major and minor numbers, the device name, and at least
+ * eleven counters: reads completed, merged, sectors, and milliseconds, the
+ * same four for writes, requests in flight, milliseconds with requests in
+ * flight, and milliseconds weighted by the number in flight.  Newer kernels
+ * add counters for discards and flushes, which we ignore.  Returns false
+ * if the device isn't there.
+ */
+static bool
+stats_parse(const char *buffer, const char *name,
+            struct disk_counters *counters)
+{
+    unsigned long long value[11];
+    const char *p, *end;
+    size_t length = strlen(name);
+    size_t i;
+
+    for (p = buffer; *p != '\0'; p = end) {
+        end = p + strcspn(p, "\n");
+        if (*end == '\n')
+            end++;
+        p = procfile_counter(p, &value[0]);
+        if (p != NULL)
+            p = procfile_counter(p, &value[1]);
+        if (p == NULL)
+            continue;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (strncmp(p, name, length) != 0
+            || (p[length] != ' ' && p[length] != '\t'))
+            continue;
+        p += length;
+        for (i = 0; i < ARRAY_SIZE(value); i++) {
+            p = procfile_counter(p, &value[i]);
+            if (p == NULL)
+                return false;
+        }
+        counters->ios = value[0] + value[4];
+        counters->ticks = value[3] + value[7];
+        counters->busy = value[9];
+        counters->queue = value[10];
+        return true;
+    }
+    return false;
+}
+
+
+/*
+ * Add a sample of a device to its averages, given the time since the last
+ * sample in milliseconds.  The first sample only establishes a baseline.  If
+ * the counters went backwards, which happens if the device was removed and
+ * added again, the sample becomes the new baseline.  An interval without
+ * any completed requests has the same await as the one before it.
+ */
+static void
+disk_update(struct disk *disk, const struct disk_counters *counters,
+            double elapsed)
+{
+    const struct disk_counters *last = &disk->last;
+    double util, queue, await;
+    bool started;
+
+    if (disk->have_last && elapsed > 0 && counters->ios >= last->ios
+        && counters->ticks >= last->ticks && counters->busy >= last->busy
+        && counters->queue >= last->queue) {
+        util = (double) (counters->busy - last->busy) / elapsed;
+        if (util > 1)
+            util = 1;
+        await = disk->await;
+        if (counters->ios > last->ios)
+            await = (double) (counters->ticks - last->ticks)
+                / (double) (counters->ios - last->ios);
+        started = disk->have_averages;
+        disk->util = sample_average(disk->util, util, elapsed / 1000,
+                                    DISK_HALF_LIFE, started);
+        queue = (counters->queue - last->queue) / elapsed;
+        disk->queue = sample_average(disk->queue, queue, elapsed / 1000,
+                                     DISK_HALF_LIFE, started);
+        disk->await = sample_average(disk->await, await, elapsed / 1000,
+                                     DISK_HALF_LIFE, started);
+        disk->have_averages = true;
+    }
+    disk->last = *counters;
+    disk->have_last = true;
+}
+
+
+/*
+ * Read /proc/diskstats into the buffer, growing it until the whole file
+ * fits.  Returns false if it can't be read.
+ */
+static bool
+stats_read(void)
+{
+    ssize_t length;
+
+    if (stats_buffer == NULL) {
+        stats_size = DISK_FILE_MIN;
+        stats_buffer = xmalloc(stats_size);
+    }
+    for (;;) {
+        length = procfile_read(&stats_file, stats_buffer, stats_size);
+        if (length < 0)
+            return false;
+        if ((size_t) length < stats_size - 1)
+            return true;
+        stats_size *= 2;
+        stats_buffer = xrealloc(stats_buffer, stats_size);
+    }
+}
+
+
+/*
+ * Sample the configured devices at the given time in microseconds on the
+ * monotonic clock, regardless of whether a sample is due.  A device that
+ * isn't present keeps its averages but loses its last sample, so that if
+ * it's added again, its counters start over.
+ */
+void
+lbcd_disk_scan(unsigned long long now)
+{
+    struct disk_counters counters;
+    double elapsed = 0;
+    size_t i;
+
+    if (disks_count == 0 || !stats_read())
+        return;
+    if (last_time != 0 && now > last_time)
+        elapsed = (double) (now - last_time) / 1000;
+    for (i = 0; i < disks_count; i++) {
+        if (stats_parse(stats_buffer, disks[i].name, &counters))
+            disk_update(&disks[i], &counters, elapsed);
+        else
+            disks[i].have_last = false;
+    }
+    last_time = now;
+}
+
+
+/*
+ * Return the number of milliseconds until the next sample is due, or -1 if
+ * there will be no more samples.
+ */
+int
+lbcd_disk_timeout(void)
+{
+    unsigned long long now;
+
+    if (disks_count == 0 || (stats_checked && !stats_available))
+        return -1;
+    if (last_time == 0)
+        return 0;
+    now = sample_now();
+    if (now - last_time >= DISK_INTERVAL)
+        return 0;
+    return (int) ((DISK_INTERVAL - (now - last_time) + 999) / 1000);
+}
+
+
+/*
+ * Take a sample if one is due.  A kernel without /proc/diskstats is not an
+ * error worth reporting, so if it doesn't exist the first time we look, we
+ * quietly give up on it.
+ */
+void
+lbcd_disk_sample(void)
+{
+    if (disks_count == 0)
+        return;
+    if (!stats_checked) {
+        stats_available = (access(stats_path, R_OK) == 0);
+        stats_checked = true;
+    }
+    if (!stats_available || lbcd_disk_timeout() != 0)
+        return;
+    lbcd_disk_scan(sample_now());
+}
+
+
+/*
+ * Store the averages of the busiest device in info, each the largest of any
+ * configured device, times 100.  Utilization is a percentage and await is in
+ * milliseconds.
+ */
+void
+lbcd_disk_read(struct disk_info *info)
+{
+    double util = 0, queue = 0, await = 0;
+    size_t i;
+
+    for (i = 0; i < disks_count; i++) {
+        if (disks[i].util > util)
+            util = disks[i].util;
+        if (disks[i].queue > queue)
+            queue = disks[i].queue;
+        if (disks[i].await > await)
+            await = disks[i].await;
+    }
+    info->util = (unsigned long) (util * 10000 + 0.5);
+    info->queue = (unsigned long) (queue * 100 + 0.5);
+    info->await = (unsigned long) (await * 100 + 0.5);
+}
+
+
+/*
+ * Free a list of devices.
+ */
+static void
+disks_free(struct disk *list, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        free(list[i].name);
+    free(list);
+}
+
+
+/*
+ * Carry over the samples and averages of devices that were already being
+ * monitored to a new list, so that a reload doesn't start them over.
+ */
+static void
+disks_keep(struct disk *list, size_t count)
+{
+    char *name;
+    size_t i, j;
+
+    for (i = 0; i < count; i++)
+        for (j = 0; j < disks_count; j++)
+            if (strcmp(list[i].name, disks[j].name) == 0) {
+                name = list[i].name;
+                list[i] = disks[j];
+                list[i].name = name;
+                break;
+            }
+}
+
+
+/*
+ * Check a list of names of block devices to monitor as they appear in
+ * /proc/diskstats, such as sda or nvme0n1, or NULL for none, and keep them
+ * to be used once lbcd_disk_commit is called.  /proc/diskstats is found
+ * under dir instead of the root if it's not NULL, for testing.  Returns
+ * false after reporting the problem with warn if a name is invalid.
+ */
+bool
+lbcd_disk_prepare(const struct vector *names, const char *dir)
+{
+    const char *name;
+    size_t i, count = 0;
+
+    lbcd_disk_abort();
+    if (names != NULL)
+        count = names->count;
+    for (i = 0; i < count; i++) {
+        name = names->strings[i];
+        if (*name == '\0' || strlen(name) > DISK_NAME_MAX
+            || name[strcspn(name, " \t\n/")] != '\0') {
+            warn("invalid block device %s", name);
+            return false;
+        }
+    }
+    if (count > 0) {
+        pending = xcalloc(count, sizeof(struct disk));
+        for (i = 0; i < count; i++)
+            pending[i].name = xstrdup(names->strings[i]);
+    }
+    pending_count = count;
+    xasprintf(&pending_path, "%s/proc/diskstats", dir != NULL ? dir : "");
+    have_pending = true;
+    return true;
+}
+
+
+/*
+ * Switch to the devices from lbcd_disk_prepare.  The averages of devices
+ * that were already monitored are kept.
+ */
+void
+lbcd_disk_commit(void)
+{
+    struct disk *list = pending;
+    size_t count = pending_count;
+    char *path = pending_path;
+
+    if (!have_pending)
+        return;
+    pending = NULL;
+    pending_count = 0;
+    pending_path = NULL;
+    have_pending = false;
+    if (count == 0 || stats_path == NULL || strcmp(path, stats_path) != 0) {
+        lbcd_disk_close();
+        stats_path = path;
+        stats_file.path = stats_path;
+    } else {
+        disks_keep(list, count);
+        free(path);
+    }
+    disks_free(disks, disks_count);
+    disks = list;
+    disks_count = count;
+}
+
+
+/*
+ * Discard the devices from lbcd_disk_prepare.
+ */
+void
+lbcd_disk_abort(void)
+{
+    disks_free(pending, pending_count);
+    pending = NULL;
+    pending_count = 0;
+    free(pending_path);
+    pending_path = NULL;
+    have_pending = false;
+}
+
+
+/*
+ * Set the block devices to monitor immediately, as with lbcd_disk_prepare.
+ * Returns false after reporting the problem with warn if a name is invalid,
+ * in which case nothing is changed.
+ */
+bool
+lbcd_disk_init(const struct vector *names, const char *dir)
+{
+    if (!lbcd_disk_prepare(names, dir))
+        return false;
+    lbcd_disk_commit();
+    return true;
+}
+
+
+/*
+ * Close /proc/diskstats and forget all devices and samples.
+ */
+void
+lbcd_disk_close(void)
+{
+    lbcd_disk_abort();
+    procfile_close(&stats_file);
+    stats_file.path = NULL;
+    free(stats_path);
+    stats_path = NULL;
+    free(stats_buffer);
+    stats_buffer = NULL;
+    stats_size = 0;
+    stats_checked = false;
+    disks_free(disks, disks_count);
+    disks = NULL;
+    disks_count = 0;
+    last_time = 0;
+}
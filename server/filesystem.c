@@ -0,0 +1,432 @@
+/*
+ * Monitor how full filesystems are.
+ *
+ * Machines with a full /tmp are often unusable, as are machines where a
+ * local scratch or spool filesystem has filled up.  This monitors /tmp, the
+ * system temporary directory, and any other configured paths, and computes
+ * a penalty multiplier for the load service from how full each is.  Both the
+ * free space and the free inodes count, since running out of either stops
+ * new files from being created.
+ *
+ * Each path is opened once, without changing the working directory, and
+ * kept open, and the filesystem is checked with fstatvfs at most once per
+ * sampling interval.  If something is mounted on top of the path or it is
+ * replaced, it's opened again.  Paths that don't exist yet are tried again
+ * at the next sample.
+ *
+ * The penalty for each filesystem is 1 until the larger of its percent
+ * space used and percent inodes used reaches a threshold, and then is taken
+ * from a list of multipliers for each percent above the threshold, with the
+ * last multiplier used for anything fuller.  The default, for /tmp, is 2 at
+ * 90% full rising to 32 at 100%.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/statvfs.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <server/internal.h>
+#include <server/penalty.h>
+#include <server/sample.h>
+#include <util/fdflag.h>
+#include <util/messages.h>
+#include <util/vector.h>
+#include <util/xmalloc.h>
+
+/* The minimum time between checks of each filesystem, in microseconds. */
+#define FS_INTERVAL 2000000
+
+/*
+ * Open a directory only to refer to it, if the system supports that, which
+ * doesn't require read permission and doesn't count as a use of it.
+ */
+#ifdef O_PATH
+# define FS_OPEN_FLAGS (O_PATH | O_DIRECTORY)
+#elif defined(O_DIRECTORY)
+# define FS_OPEN_FLAGS (O_RDONLY | O_DIRECTORY)
+#else
+# define FS_OPEN_FLAGS O_RDONLY
+#endif
+
+/*
+ * The default penalty, used for /tmp and the system temporary directory,
+ * which is the default list of multipliers from 2 at 90% full to 32 at 100%.
+ */
+#define FS_DEFAULT_PENALTY "90"
+
+/*
+ * A monitored filesystem.  The device and inode of the directory when it
+ * was opened are kept to notice when something else is at the path.
+ */
+struct filesystem {
+    char *path;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    struct penalty penalty;
+    struct fs_usage usage;
+};
+
+/* The monitored filesystems, and when they were last checked or 0. */
+static struct filesystem *filesystems = NULL;
+static size_t fs_count = 0;
+static unsigned long long last_time = 0;
+
+/* The filesystems of a new configuration, and whether there are any. */
+static struct filesystem *pending = NULL;
+static size_t pending_count = 0;
+static bool have_pending = false;
+
+
+/*
+ * Free a list of filesystems, closing their directories.
+ */
+static void
+fs_free(struct filesystem *list, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (list[i].fd >= 0)
+            close(list[i].fd);
+        free(list[i].path);
+        penalty_free(&list[i].penalty);
+    }
+    free(list);
+}
+
+
+/*
+ * Parse a filesystem specification of the form path[=threshold[:list]],
+ * where list is a comma-separated list of multipliers, into fs.  Without a
+ * threshold, or without a list, the defaults are used.  Returns false after
+ * reporting the problem with warn if the specification is invalid.
+ */
+static bool
+fs_parse(const char *spec, struct filesystem *fs)
+{
+    const char *equals;
+    bool okay;
+
+    memset(fs, 0, sizeof(*fs));
+    fs->fd = -1;
+    if (spec[0] != '/') {
+        warn("filesystem %s is not an absolute path", spec);
+        return false;
+    }
+    equals = strchr(spec, '=');
+    if (equals == NULL)
+        okay = penalty_parse(FS_DEFAULT_PENALTY, &fs->penalty);
+    else
+        okay = penalty_parse(equals + 1, &fs->penalty);
+    if (!okay) {
+        warn("invalid filesystem penalty in %s (expected"
+             " path=threshold:multiplier,...)", spec);
+        return false;
+    }
+    if (equals == NULL)
+        fs->path = xstrdup(spec);
+    else
+        fs->path = xstrndup(spec, (size_t) (equals - spec));
+    return true;
+}
+
+
+/*
+ * Add a filesystem to a list, replacing any earlier one for the same path.
+ * Takes ownership of the contents of fs.
+ */
+static void
+fs_add(struct filesystem **list, size_t *count, struct filesystem *fs)
+{
+    size_t i;
+
+    for (i = 0; i < *count; i++)
+        if (strcmp((*list)[i].path, fs->path) == 0) {
+            free((*list)[i].path);
+            penalty_free(&(*list)[i].penalty);
+            (*list)[i] = *fs;
+            return;
+        }
+    *list = xreallocarray(*list, *count + 1, sizeof(struct filesystem));
+    (*list)[(*count)++] = *fs;
+}
+
+
+/*
+ * Open the directory of a filesystem if it isn't open or if something else
+ * is now at its path.  Returns false if it can't be opened.
+ */
+static bool
+fs_open(struct filesystem *fs)
+{
+    struct stat st;
+
+    if (stat(fs->path, &st) < 0) {
+        if (fs->fd >= 0)
+            close(fs->fd);
+        fs->fd = -1;
+        return false;
+    }
+    if (fs->fd >= 0 && st.st_dev == fs->dev && st.st_ino == fs->ino)
+        return true;
+    if (fs->fd >= 0)
+        close(fs->fd);
+    fs->fd = open(fs->path, FS_OPEN_FLAGS);
+    if (fs->fd < 0) {
+        syswarn("cannot open %s", fs->path);
+        return false;
+    }
+    fdflag_close_exec(fs->fd, true);
+    if (fstat(fs->fd, &st) < 0) {
+        syswarn("cannot stat %s", fs->path);
+        close(fs->fd);
+        fs->fd = -1;
+        return false;
+    }
+    fs->dev = st.st_dev;
+    fs->ino = st.st_ino;
+    return true;
+}
+
+
+/*
+ * Check one filesystem and update its usage.  The percent of space used
+ * counts space reserved for root as unavailable, as df does.  Filesystems
+ * that don't report inodes are treated as having no inodes used.  If the
+ * filesystem can't be checked, it has no usage and no penalty.
+ */
+static void
+fs_check(struct filesystem *fs)
+{
+    struct statvfs info;
+    double used, inodes;
+    unsigned long level;
+
+    memset(&fs->usage, 0, sizeof(fs->usage));
+    fs->usage.penalty = 1;
+    if (!fs_open(fs))
+        return;
+    if (fstatvfs(fs->fd, &info) < 0) {
+        syswarn("cannot get filesystem information for %s", fs->path);
+        return;
+    }
+    used = (double) info.f_blocks - (double) info.f_bfree;
+    if (used + info.f_bavail > 0)
+        fs->usage.full
+            = (unsigned long) (used * 100 / (used + info.f_bavail) + 0.5);
+    if (info.f_files > 0 && info.f_files >= info.f_ffree) {
+        inodes = (double) info.f_files - (double) info.f_ffree;
+        fs->usage.inodes
+            = (unsigned long) (inodes * 100 / info.f_files + 0.5);
+    }
+    if (fs->usage.full > 100)
+        fs->usage.full = 100;
+    fs->usage.available = true;
+    level = (fs->usage.full > fs->usage.inodes) ? fs->usage.full
+                                                : fs->usage.inodes;
+    fs->usage.penalty = penalty_get(&fs->penalty, level);
+}
+
+
+/*
+ * Check all filesystems if the sampling interval has passed since the last
+ * check.
+ */
+static void
+fs_sample(void)
+{
+    unsigned long long now;
+    size_t i;
+
+    now = sample_now();
+    if (last_time != 0 && now - last_time < FS_INTERVAL)
+        return;
+    for (i = 0; i < fs_count; i++)
+        fs_check(&filesystems[i]);
+    last_time = now;
+}
+
+
+/*
+ * Parse the filesystems to monitor from a list of specifications, each of
+ * the form path[=threshold[:multiplier,...]], and keep them to be used once
+ * lbcd_fs_commit is called.  /tmp and the system temporary directory are
+ * always monitored, with the default penalty unless given in specs.  specs
+ * may be NULL.  Returns false after reporting the problem with warn if a
+ * specification is invalid.
+ */
+bool
+lbcd_fs_prepare(const struct vector *specs)
+{
+    struct filesystem *list = NULL;
+    struct filesystem fs;
+    size_t count = 0;
+    size_t i;
+
+    lbcd_fs_abort();
+    fs_parse("/tmp", &fs);
+    fs_add(&list, &count, &fs);
+#ifdef P_tmpdir
+    fs_parse(P_tmpdir, &fs);
+    fs_add(&list, &count, &fs);
+#endif
+    for (i = 0; specs != NULL && i < specs->count; i++) {
+        if (!fs_parse(specs->strings[i], &fs)) {
+            fs_free(list, count);
+            return false;
+        }
+        fs_add(&list, &count, &fs);
+    }
+    pending = list;
+    pending_count = count;
+    have_pending = true;
+    return true;
+}
+
+
+/*
+ * Switch to the filesystems from lbcd_fs_prepare.
+ */
+void
+lbcd_fs_commit(void)
+{
+    if (!have_pending)
+        return;
+    fs_free(filesystems, fs_count);
+    filesystems = pending;
+    fs_count = pending_count;
+    last_time = 0;
+    pending = NULL;
+    pending_count = 0;
+    have_pending = false;
+}
+
+
+/*
+ * Discard the filesystems from lbcd_fs_prepare.
+ */
+void
+lbcd_fs_abort(void)
+{
+    fs_free(pending, pending_count);
+    pending = NULL;
+    pending_count = 0;
+    have_pending = false;
+}
+
+
+/*
+ * Set the monitored filesystems immediately, as with lbcd_fs_prepare.
+ * Returns false after reporting the problem with warn if a specification is
+ * invalid, in which case the monitored filesystems are unchanged.
+ */
+bool
+lbcd_fs_init(const struct vector *specs)
+{
+    if (!lbcd_fs_prepare(specs))
+        return false;
+    lbcd_fs_commit();
+    return true;
+}
+
+
+/*
+ * Store the usage of the filesystem at path in usage.  Returns false if it
+ * isn't monitored.  The usage may be out of date by up to the sampling
+ * interval.
+ */
+bool
+lbcd_fs_usage(const char *path, struct fs_usage *usage)
+{
+    size_t i;
+
+    fs_sample();
+    for (i = 0; i < fs_count; i++)
+        if (strcmp(filesystems[i].path, path) == 0) {
+            *usage = filesystems[i].usage;
+            return true;
+        }
+    memset(usage, 0, sizeof(*usage));
+    usage->penalty = 1;
+    return false;
+}
+
+
+/*
+ * Store a summary of the monitored filesystems in info: the usage of /tmp
+ * and the system temporary directory, the highest percent of space and of
+ * inodes used on any filesystem, and the largest penalty.
+ */
+void
+lbcd_fs_read(struct fs_info *info)
+{
+    const struct fs_usage *usage;
+    size_t i;
+
+    memset(info, 0, sizeof(*info));
+    info->penalty = 1;
+    fs_sample();
+    for (i = 0; i < fs_count; i++) {
+        usage = &filesystems[i].usage;
+        if (usage->full > info->full)
+            info->full = usage->full;
+        if (usage->inodes > info->inodes)
+            info->inodes = usage->inodes;
+        if (usage->penalty > info->penalty)
+            info->penalty = usage->penalty;
+    }
+    lbcd_fs_usage("/tmp", &info->tmp);
+#ifdef P_tmpdir
+    lbcd_fs_usage(P_tmpdir, &info->tmpdir);
+#else
+    info->tmpdir = info->tmp;
+#endif
+}
+
+
+/*
+ * Print the usage of each monitored filesystem, for lbcd -t.
+ */
+void
+lbcd_fs_print(void)
+{
+    const struct filesystem *fs;
+    size_t i;
+
+    fs_sample();
+    printf("FILESYSTEMS: %lu\n", (unsigned long) fs_count);
+    for (i = 0; i < fs_count; i++) {
+        fs = &filesystems[i];
+        if (!fs->usage.available) {
+            printf("%s: unavailable\n", fs->path);
+            continue;
+        }
+        printf("%s: %lu%% full, %lu%% inodes, penalty %lu\n", fs->path,
+               fs->usage.full, fs->usage.inodes, fs->usage.penalty);
+    }
+}
+
+
+/*
+ * Stop monitoring filesystems and close their directories.
+ */
+void
+lbcd_fs_close(void)
+{
+    lbcd_fs_abort();
+    fs_free(filesystems, fs_count);
+    filesystems = NULL;
+    fs_count = 0;
+    last_time = 0;
+}
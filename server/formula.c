@@ -0,0 +1,1010 @@
+/*
+ * Weight formulas.
+ *
+ * A weight formula is an arithmetic expression over the metrics in the
+ * current snapshot (see metrics.h), such as:
+ *
+ *     uniq * 100 + 3 * l1 + (tot - uniq) * 20
+ *
+ * Formulas are given on the command line with -F as name=weight or
+ * name=weight;increment and are registered as services under that name.
+ * Each formula is parsed into a tree and type-checked when lbcd starts,
+ * constant subexpressions are folded, and the tree is compiled into a short
+ * sequence of instructions for a small stack machine that is run for each
+ * query.  The tree is kept so that test mode can show the value of every
+ * subexpression.
+ *
+ * The grammar, from lowest to highest precedence, is:
+ *
+ *     expr    := or [ "?" expr ":" expr ]
+ *     or      := and { "||" and }
+ *     and     := compare { "&&" compare }
+ *     compare := sum [ ( "<" | "<=" | ">" | ">=" | "==" | "!=" ) sum ]
+ *     sum     := product { ( "+" | "-" ) product }
+ *     product := unary { ( "*" | "/" ) unary }
+ *     unary   := ( "-" | "!" ) unary | primary
+ *     primary := number | metric | "maxweight" | "true" | "false"
+ *              | ( "min" | "max" ) "(" expr { "," expr } ")"
+ *              | "(" expr ")"
+ *
+ * Arithmetic and ordering operands must be numbers, the operands of ||, &&,
+ * and ! and the condition of ?: must be booleans, and the operands of == and
+ * != and the branches of ?: must have the same type.  The weight and
+ * increment must be numbers.  Division by zero yields zero, and results are
+ * clamped to the range of a weight.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+#include <math.h>
+
+#include <server/internal.h>
+#include <server/metrics.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/vector.h>
+#include <util/xmalloc.h>
+
+/* The largest weight, which is also the value of maxweight. */
+#define FORMULA_MAX 4294967295.0
+
+/* The increment used if a formula doesn't specify one. */
+#define FORMULA_INCREMENT 200
+
+/* The longest identifier in a formula. */
+#define FORMULA_IDENT_MAX 32
+
+/* Operations, used both for tree nodes and for instructions. */
+enum formula_op {
+    OP_CONST,
+    OP_METRIC,
+    OP_NEG,
+    OP_NOT,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_AND,
+    OP_OR,
+    OP_COND,
+    OP_MIN,
+    OP_MAX
+};
+
+/* Types of subexpressions.  Booleans are represented as 0 or 1. */
+enum formula_type {
+    TYPE_NUMBER,
+    TYPE_BOOLEAN
+};
+
+/* A node in the parse tree. */
+struct node {
+    enum formula_op op;
+    enum formula_type type;
+    double value;               /* Value of an OP_CONST node */
+    unsigned int metric;        /* Metric of an OP_METRIC node */
+    struct node **args;         /* Operands */
+    size_t nargs;
+    size_t start, end;          /* Span of the source text */
+};
+
+/*
+ * A compiled instruction.  Constants and metrics push a value, and every
+ * other operation pops arg operands and pushes its result.
+ */
+struct insn {
+    enum formula_op op;
+    unsigned int arg;           /* Metric or operand count */
+    double value;               /* Value for OP_CONST */
+};
+
+/* A compiled formula. */
+struct formula {
+    char *source;
+    struct node *root;
+    struct insn *code;
+    size_t length;
+    double *stack;              /* Scratch space for evaluation */
+};
+
+/* State while parsing. */
+struct parser {
+    const char *source;
+    size_t pos;                 /* Current position */
+    size_t last;                /* End of the last token consumed */
+    char *error;                /* First error encountered */
+};
+
+/* Binary operators and their precedence levels. */
+static const struct {
+    const char *token;
+    enum formula_op op;
+    int level;
+} operators[] = {
+    { "||", OP_OR,  0 },
+    { "&&", OP_AND, 1 },
+    { "<=", OP_LE,  2 },
+    { ">=", OP_GE,  2 },
+    { "==", OP_EQ,  2 },
+    { "!=", OP_NE,  2 },
+    { "<",  OP_LT,  2 },
+    { ">",  OP_GT,  2 },
+    { "+",  OP_ADD, 3 },
+    { "-",  OP_SUB, 3 },
+    { "*",  OP_MUL, 4 },
+    { "/",  OP_DIV, 4 }
+};
+#define LEVEL_COMPARE 2
+#define LEVEL_UNARY   5
+
+/* A formula registered as a service. */
+struct formula_service {
+    char *name;
+    struct formula *weight;
+    struct formula *incr;
+};
+
+
+/*
+ * Apply an operation other than OP_CONST or OP_METRIC to its operands.
+ * Shared by constant folding, tracing, and the stack machine.
+ */
+static double
+apply(enum formula_op op, const double *args, size_t nargs)
+{
+    double result;
+    size_t i;
+
+    switch (op) {
+    case OP_NEG: return -args[0];
+    case OP_NOT: return (args[0] > 0) ? 0 : 1;
+    case OP_ADD: return args[0] + args[1];
+    case OP_SUB: return args[0] - args[1];
+    case OP_MUL: return args[0] * args[1];
+    case OP_DIV:
+        if (args[1] > 0 || args[1] < 0)
+            return args[0] / args[1];
+        return 0;
+    case OP_LT:  return (args[0] < args[1]) ? 1 : 0;
+    case OP_LE:  return (args[0] <= args[1]) ? 1 : 0;
+    case OP_GT:  return (args[0] > args[1]) ? 1 : 0;
+    case OP_GE:  return (args[0] >= args[1]) ? 1 : 0;
+    case OP_EQ:  return (args[0] < args[1] || args[0] > args[1]) ? 0 : 1;
+    case OP_NE:  return (args[0] < args[1] || args[0] > args[1]) ? 1 : 0;
+    case OP_AND: return (args[0] > 0 && args[1] > 0) ? 1 : 0;
+    case OP_OR:  return (args[0] > 0 || args[1] > 0) ? 1 : 0;
+    case OP_COND: return (args[0] > 0) ? args[1] : args[2];
+    case OP_MIN:
+        result = args[0];
+        for (i = 1; i < nargs; i++)
+            if (args[i] < result)
+                result = args[i];
+        return result;
+    case OP_MAX:
+        result = args[0];
+        for (i = 1; i < nargs; i++)
+            if (args[i] > result)
+                result = args[i];
+        return result;
+    case OP_CONST:
+    case OP_METRIC:
+    default:
+        return 0;
+    }
+}
+
+
+/*
+ * Free a parse tree.
+ */
+static void
+node_free(struct node *node)
+{
+    size_t i;
+
+    if (node == NULL)
+        return;
+    for (i = 0; i < node->nargs; i++)
+        node_free(node->args[i]);
+    free(node->args);
+    free(node);
+}
+
+
+/*
+ * Create a new parse tree node with room for the given number of operands.
+ */
+static struct node *
+node_new(enum formula_op op, size_t start, size_t nargs)
+{
+    struct node *node;
+
+    node = xcalloc(1, sizeof(struct node));
+    node->op = op;
+    node->type = TYPE_NUMBER;
+    node->start = start;
+    node->end = start;
+    node->nargs = nargs;
+    if (nargs > 0)
+        node->args = xcalloc(nargs, sizeof(struct node *));
+    return node;
+}
+
+
+/*
+ * Evaluate a parse tree directly against a snapshot of metrics, which may be
+ * NULL if the tree contains no metrics.
+ */
+static double
+node_eval(const struct node *node, const struct lbcd_metrics *metrics)
+{
+    double *args;
+    double result;
+    size_t i;
+
+    if (node->op == OP_CONST)
+        return node->value;
+    if (node->op == OP_METRIC)
+        return metrics->value[node->metric];
+    args = xcalloc(node->nargs, sizeof(double));
+    for (i = 0; i < node->nargs; i++)
+        args[i] = node_eval(node->args[i], metrics);
+    result = apply(node->op, args, node->nargs);
+    free(args);
+    return result;
+}
+
+
+/*
+ * Record a parse error at the given position unless one was already
+ * recorded, since the first error is the most useful.
+ */
+static void
+parse_error(struct parser *parser, size_t pos, const char *message)
+{
+    if (parser->error != NULL)
+        return;
+    xasprintf(&parser->error, "%s at position %lu", message,
+              (unsigned long) pos + 1);
+}
+
+
+/*
+ * Skip whitespace.
+ */
+static void
+skip_space(struct parser *parser)
+{
+    while (isspace((unsigned char) parser->source[parser->pos]))
+        parser->pos++;
+}
+
+
+/*
+ * If the next token is the given string, consume it and return true.
+ */
+static bool
+accept(struct parser *parser, const char *token)
+{
+    size_t length = strlen(token);
+
+    skip_space(parser);
+    if (strncmp(parser->source + parser->pos, token, length) != 0)
+        return false;
+    parser->pos += length;
+    parser->last = parser->pos;
+    return true;
+}
+
+
+/*
+ * Check the types of the operands of a node and set the type of its result.
+ * Returns false and records an error if the operands are the wrong type.
+ */
+static bool
+node_check(struct parser *parser, struct node *node)
+{
+    enum formula_type want;
+    size_t i;
+
+    switch (node->op) {
+    case OP_CONST:
+    case OP_METRIC:
+        return true;
+    case OP_NOT:
+    case OP_AND:
+    case OP_OR:
+        want = TYPE_BOOLEAN;
+        break;
+    case OP_COND:
+        if (node->args[0]->type != TYPE_BOOLEAN) {
+            parse_error(parser, node->args[0]->start, "expected a boolean");
+            return false;
+        }
+        if (node->args[1]->type != node->args[2]->type) {
+            parse_error(parser, node->args[2]->start,
+                        "branches have different types");
+            return false;
+        }
+        node->type = node->args[1]->type;
+        return true;
+    case OP_EQ:
+    case OP_NE:
+        if (node->args[0]->type != node->args[1]->type) {
+            parse_error(parser, node->args[1]->start,
+                        "operands have different types");
+            return false;
+        }
+        node->type = TYPE_BOOLEAN;
+        return true;
+    case OP_NEG:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+    case OP_MIN:
+    case OP_MAX:
+    default:
+        want = TYPE_NUMBER;
+        break;
+    }
+    for (i = 0; i < node->nargs; i++)
+        if (node->args[i]->type != want) {
+            parse_error(parser, node->args[i]->start,
+                        want == TYPE_NUMBER ? "expected a number"
+                                            : "expected a boolean");
+            return false;
+        }
+    if (want == TYPE_BOOLEAN)
+        node->type = TYPE_BOOLEAN;
+    else if (node->op == OP_LT || node->op == OP_LE || node->op == OP_GT
+             || node->op == OP_GE)
+        node->type = TYPE_BOOLEAN;
+    else
+        node->type = TYPE_NUMBER;
+    return true;
+}
+
+
+/*
+ * Finish a node with operands: record the end of its span and check its
+ * types.  Frees the node and returns NULL if any operand is missing or the
+ * types are wrong.
+ */
+static struct node *
+node_finish(struct parser *parser, struct node *node)
+{
+    size_t i;
+
+    node->end = parser->last;
+    for (i = 0; i < node->nargs; i++)
+        if (node->args[i] == NULL) {
+            node_free(node);
+            return NULL;
+        }
+    if (!node_check(parser, node)) {
+        node_free(node);
+        return NULL;
+    }
+    return node;
+}
+
+
+/* Forward declaration for recursion. */
+static struct node *parse_expr(struct parser *);
+
+
+/*
+ * Parse a call to min or max, after the opening parenthesis.
+ */
+static struct node *
+parse_call(struct parser *parser, enum formula_op op, size_t start)
+{
+    struct node *node;
+
+    node = node_new(op, start, 0);
+    do {
+        node->args = xreallocarray(node->args, node->nargs + 1,
+                                   sizeof(struct node *));
+        node->args[node->nargs++] = parse_expr(parser);
+        if (node->args[node->nargs - 1] == NULL)
+            return node_finish(parser, node);
+    } while (accept(parser, ","));
+    if (!accept(parser, ")")) {
+        parse_error(parser, parser->pos, "expected )");
+        node_free(node);
+        return NULL;
+    }
+    return node_finish(parser, node);
+}
+
+
+/*
+ * Parse an identifier, which is a metric, a constant, or a function call.
+ */
+static struct node *
+parse_identifier(struct parser *parser)
+{
+    char name[FORMULA_IDENT_MAX];
+    struct node *node;
+    size_t start = parser->pos;
+    size_t length = 0;
+    int metric;
+    const char *p;
+
+    for (p = parser->source + start; isalnum((unsigned char) *p) || *p == '_';
+         p++)
+        length++;
+    if (length >= sizeof(name)) {
+        parse_error(parser, start, "identifier too long");
+        return NULL;
+    }
+    memcpy(name, parser->source + start, length);
+    name[length] = '\0';
+    parser->pos += length;
+    parser->last = parser->pos;
+
+    /* Function calls. */
+    if (strcmp(name, "min") == 0 && accept(parser, "("))
+        return parse_call(parser, OP_MIN, start);
+    if (strcmp(name, "max") == 0 && accept(parser, "("))
+        return parse_call(parser, OP_MAX, start);
+
+    /* Constants and metrics. */
+    node = node_new(OP_CONST, start, 0);
+    node->end = parser->last;
+    if (strcmp(name, "maxweight") == 0)
+        node->value = FORMULA_MAX;
+    else if (strcmp(name, "true") == 0 || strcmp(name, "false") == 0) {
+        node->type = TYPE_BOOLEAN;
+        node->value = (name[0] == 't') ? 1 : 0;
+    } else {
+        metric = lbcd_metric_lookup(name);
+        if (metric < 0) {
+            parse_error(parser, start, "unknown metric");
+            node_free(node);
+            return NULL;
+        }
+        node->op = OP_METRIC;
+        node->metric = metric;
+        if (lbcd_metric_type(metric) == METRIC_BOOLEAN)
+            node->type = TYPE_BOOLEAN;
+    }
+    return node;
+}
+
+
+/*
+ * Parse a primary expression: a number, an identifier, or a parenthesized
+ * expression.
+ */
+static struct node *
+parse_primary(struct parser *parser)
+{
+    struct node *node;
+    const char *p;
+    char *end;
+    double value;
+
+    skip_space(parser);
+    p = parser->source + parser->pos;
+    if (accept(parser, "(")) {
+        node = parse_expr(parser);
+        if (node != NULL && !accept(parser, ")")) {
+            parse_error(parser, parser->pos, "expected )");
+            node_free(node);
+            return NULL;
+        }
+        return node;
+    } else if (isdigit((unsigned char) *p) || *p == '.') {
+        value = strtod(p, &end);
+        if (end == p) {
+            parse_error(parser, parser->pos, "invalid number");
+            return NULL;
+        }
+        node = node_new(OP_CONST, parser->pos, 0);
+        node->value = value;
+        parser->pos += end - p;
+        parser->last = parser->pos;
+        node->end = parser->last;
+        return node;
+    } else if (isalpha((unsigned char) *p) || *p == '_') {
+        return parse_identifier(parser);
+    } else if (*p == '\0') {
+        parse_error(parser, parser->pos, "unexpected end of formula");
+        return NULL;
+    } else {
+        parse_error(parser, parser->pos, "expected an expression");
+        return NULL;
+    }
+}
+
+
+/*
+ * Parse a unary expression.
+ */
+static struct node *
+parse_unary(struct parser *parser)
+{
+    struct node *node;
+    size_t start;
+
+    skip_space(parser);
+    start = parser->pos;
+    if (accept(parser, "-"))
+        node = node_new(OP_NEG, start, 1);
+    else if (strncmp(parser->source + start, "!=", 2) != 0
+             && accept(parser, "!"))
+        node = node_new(OP_NOT, start, 1);
+    else
+        return parse_primary(parser);
+    node->args[0] = parse_unary(parser);
+    return node_finish(parser, node);
+}
+
+
+/*
+ * If the next token is a binary operator at the given precedence level,
+ * consume it and return true, storing the operation in op.
+ */
+static bool
+accept_operator(struct parser *parser, int level, enum formula_op *op)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(operators); i++) {
+        if (operators[i].level != level)
+            continue;
+        if (accept(parser, operators[i].token)) {
+            *op = operators[i].op;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*
+ * Parse a sequence of binary operations at the given precedence level or
+ * higher.  Operators at the same level associate to the left, except that
+ * comparisons don't chain.
+ */
+static struct node *
+parse_binary(struct parser *parser, int level)
+{
+    struct node *left, *node;
+    enum formula_op op;
+    size_t start;
+
+    if (level == LEVEL_UNARY)
+        return parse_unary(parser);
+    skip_space(parser);
+    start = parser->pos;
+    left = parse_binary(parser, level + 1);
+    while (left != NULL && accept_operator(parser, level, &op)) {
+        node = node_new(op, start, 2);
+        node->args[0] = left;
+        node->args[1] = parse_binary(parser, level + 1);
+        left = node_finish(parser, node);
+        if (level == LEVEL_COMPARE)
+            break;
+    }
+    return left;
+}
+
+
+/*
+ * Parse a full expression, including the conditional operator.
+ */
+static struct node *
+parse_expr(struct parser *parser)
+{
+    struct node *cond, *node;
+    size_t start;
+
+    skip_space(parser);
+    start = parser->pos;
+    cond = parse_binary(parser, 0);
+    if (cond == NULL || !accept(parser, "?"))
+        return cond;
+    node = node_new(OP_COND, start, 3);
+    node->args[0] = cond;
+    node->args[1] = parse_expr(parser);
+    if (node->args[1] != NULL && !accept(parser, ":")) {
+        parse_error(parser, parser->pos, "expected :");
+        node_free(node);
+        return NULL;
+    }
+    if (node->args[1] != NULL)
+        node->args[2] = parse_expr(parser);
+    return node_finish(parser, node);
+}
+
+
+/*
+ * Fold constant subexpressions of a parse tree in place.  A conditional with
+ * a constant condition is replaced by the branch it selects.
+ */
+static void
+node_fold(struct node *node)
+{
+    struct node *pick;
+    bool constant = true;
+    size_t i;
+
+    for (i = 0; i < node->nargs; i++) {
+        node_fold(node->args[i]);
+        if (node->args[i]->op != OP_CONST)
+            constant = false;
+    }
+    if (node->op == OP_COND && node->args[0]->op == OP_CONST) {
+        i = (node->args[0]->value > 0) ? 1 : 2;
+        pick = node->args[i];
+        node->args[i] = NULL;
+        for (i = 0; i < node->nargs; i++)
+            node_free(node->args[i]);
+        free(node->args);
+        *node = *pick;
+        free(pick);
+        return;
+    }
+    if (node->nargs == 0 || !constant)
+        return;
+    node->value = node_eval(node, NULL);
+    for (i = 0; i < node->nargs; i++)
+        node_free(node->args[i]);
+    free(node->args);
+    node->args = NULL;
+    node->nargs = 0;
+    node->op = OP_CONST;
+}
+
+
+/*
+ * Count the nodes in a parse tree, which is the number of instructions it
+ * compiles to.
+ */
+static size_t
+node_count(const struct node *node)
+{
+    size_t i, count = 1;
+
+    for (i = 0; i < node->nargs; i++)
+        count += node_count(node->args[i]);
+    return count;
+}
+
+
+/*
+ * Compile a parse tree into instructions, operands first.  depth tracks the
+ * current stack depth and max_depth the deepest it gets.
+ */
+static void
+node_compile(struct formula *formula, const struct node *node, size_t *depth,
+             size_t *max_depth)
+{
+    struct insn *insn;
+    size_t i;
+
+    for (i = 0; i < node->nargs; i++)
+        node_compile(formula, node->args[i], depth, max_depth);
+    insn = &formula->code[formula->length++];
+    insn->op = node->op;
+    insn->value = node->value;
+    if (node->op == OP_METRIC)
+        insn->arg = node->metric;
+    else
+        insn->arg = node->nargs;
+    *depth = *depth - node->nargs + 1;
+    if (*depth > *max_depth)
+        *max_depth = *depth;
+}
+
+
+/*
+ * Parse, check, fold, and compile a formula, which must produce a number.
+ * Returns the formula, or NULL and sets error to a newly allocated
+ * description of the problem.
+ */
+struct formula *
+lbcd_formula_compile(const char *source, char **error)
+{
+    struct parser parser;
+    struct formula *formula;
+    struct node *root;
+    size_t depth = 0, max_depth = 0;
+
+    memset(&parser, 0, sizeof(parser));
+    parser.source = source;
+    root = parse_expr(&parser);
+    if (root != NULL) {
+        skip_space(&parser);
+        if (source[parser.pos] != '\0')
+            parse_error(&parser, parser.pos, "unexpected text");
+        else if (root->type != TYPE_NUMBER)
+            parse_error(&parser, 0, "formula must be a number");
+    }
+    if (parser.error != NULL) {
+        node_free(root);
+        *error = parser.error;
+        return NULL;
+    }
+    node_fold(root);
+    formula = xcalloc(1, sizeof(struct formula));
+    formula->source = xstrdup(source);
+    formula->root = root;
+    formula->code = xcalloc(node_count(root), sizeof(struct insn));
+    node_compile(formula, root, &depth, &max_depth);
+    formula->stack = xcalloc(max_depth, sizeof(double));
+    *error = NULL;
+    return formula;
+}
+
+
+/*
+ * Evaluate a compiled formula against a snapshot of metrics.
+ */
+double
+lbcd_formula_eval(const struct formula *formula,
+                  const struct lbcd_metrics *metrics)
+{
+    const struct insn *insn, *end;
+    double *stack = formula->stack;
+    size_t sp = 0;
+
+    end = formula->code + formula->length;
+    for (insn = formula->code; insn < end; insn++)
+        if (insn->op == OP_CONST)
+            stack[sp++] = insn->value;
+        else if (insn->op == OP_METRIC)
+            stack[sp++] = metrics->value[insn->arg];
+        else {
+            sp -= insn->arg;
+            stack[sp] = apply(insn->op, stack + sp, insn->arg);
+            sp++;
+        }
+    return stack[0];
+}
+
+
+/*
+ * Return the number of instructions in a compiled formula.  Used by the test
+ * suite to check constant folding.
+ */
+size_t
+lbcd_formula_size(const struct formula *formula)
+{
+    return formula->length;
+}
+
+
+/*
+ * Free a compiled formula.
+ */
+void
+lbcd_formula_free(struct formula *formula)
+{
+    if (formula == NULL)
+        return;
+    node_free(formula->root);
+    free(formula->code);
+    free(formula->stack);
+    free(formula->source);
+    free(formula);
+}
+
+
+/*
+ * Convert the result of a formula to a weight, clamping it to the valid range
+ * and treating a result that isn't a number as the maximum.
+ */
+static uint32_t
+formula_clamp(double value)
+{
+    if (isnan(value) || value >= FORMULA_MAX)
+        return (uint32_t) -1;
+    if (value <= 0)
+        return 0;
+    return (uint32_t) value;
+}
+
+
+/*
+ * The weight function registered for each formula.
+ */
+static int
+formula_weight(void *data, uint32_t *weight_val, uint32_t *incr_val,
+               int timeout UNUSED, const char *portarg UNUSED,
+               struct lbcd_reply *lb UNUSED)
+{
+    const struct formula_service *service = data;
+    const struct lbcd_metrics *metrics;
+
+    metrics = lbcd_metrics_get();
+    *weight_val = formula_clamp(lbcd_formula_eval(service->weight, metrics));
+    if (service->incr == NULL)
+        *incr_val = FORMULA_INCREMENT;
+    else
+        *incr_val = formula_clamp(lbcd_formula_eval(service->incr, metrics));
+    return 0;
+}
+
+
+/*
+ * Free a formula service.  Called by the service registry, which owns the
+ * registered formulas.
+ */
+static void
+formula_service_free(void *data)
+{
+    struct formula_service *service = data;
+
+    lbcd_formula_free(service->weight);
+    lbcd_formula_free(service->incr);
+    free(service->name);
+    free(service);
+}
+
+
+/*
+ * Define a formula service from a definition of the form name=weight or
+ * name=weight;increment and register it.  Returns false after reporting the
+ * problem with warn if the definition is invalid.
+ */
+bool
+lbcd_formula_define(const char *definition)
+{
+    struct formula_service *service;
+    const char *equals, *semicolon, *p;
+    char *source, *error;
+
+    /* Split out and check the name. */
+    equals = strchr(definition, '=');
+    if (equals == NULL || equals == definition
+        || (size_t) (equals - definition) >= sizeof(lbcd_name_type)) {
+        warn("invalid formula definition %s", definition);
+        return false;
+    }
+    for (p = definition; p < equals; p++)
+        if (!isalnum((unsigned char) *p) && *p != '_' && *p != '-'
+            && *p != '.') {
+            warn("invalid formula name in %s", definition);
+            return false;
+        }
+    service = xcalloc(1, sizeof(struct formula_service));
+    service->name = xstrndup(definition, equals - definition);
+    if (strcmp(service->name, "default") == 0) {
+        warn("formula may not be named default");
+        goto fail;
+    }
+
+    /* Compile the weight and the increment, if any. */
+    semicolon = strchr(equals + 1, ';');
+    if (semicolon == NULL)
+        source = xstrdup(equals + 1);
+    else
+        source = xstrndup(equals + 1, semicolon - equals - 1);
+    service->weight = lbcd_formula_compile(source, &error);
+    free(source);
+    if (service->weight == NULL) {
+        warn("invalid weight formula for %s: %s", service->name, error);
+        free(error);
+        goto fail;
+    }
+    if (semicolon != NULL) {
+        service->incr = lbcd_formula_compile(semicolon + 1, &error);
+        if (service->incr == NULL) {
+            warn("invalid increment formula for %s: %s", service->name,
+                 error);
+            free(error);
+            goto fail;
+        }
+    }
+
+    /* Register the service. */
+    lbcd_service_register(service->name, formula_weight, service, 0,
+                          formula_service_free);
+    return true;
+
+fail:
+    formula_service_free(service);
+    return false;
+}
+
+
+/*
+ * Print the value of each non-constant subexpression of a parse tree, one
+ * per line, indented by depth.
+ */
+static void
+node_trace(const struct node *node, const struct formula *formula,
+           const struct lbcd_metrics *metrics, int depth)
+{
+    size_t i;
+    double value;
+
+    if (node->op == OP_CONST)
+        return;
+    value = node_eval(node, metrics);
+    printf("%*s%.*s = ", depth * 2 + 4, "", (int) (node->end - node->start),
+           formula->source + node->start);
+    if (node->type == TYPE_BOOLEAN)
+        printf("%s\n", (value > 0) ? "true" : "false");
+    else
+        printf("%g\n", value);
+    for (i = 0; i < node->nargs; i++)
+        node_trace(node->args[i], formula, metrics, depth + 1);
+}
+
+
+/*
+ * Return true if a service name, ignoring any argument after a colon, is the
+ * name of the given formula service.
+ */
+static bool
+formula_matches(const struct formula_service *service, const char *name)
+{
+    size_t length;
+
+    length = strcspn(name, ":");
+    return (strlen(service->name) == length
+            && strncmp(service->name, name, length) == 0);
+}
+
+
+/*
+ * Print to standard output how the weight and increment of each formula
+ * service among the default service and the requested services are computed
+ * from the current snapshot.  Each formula is shown once.  Used by test mode.
+ */
+void
+lbcd_formula_trace(const char *default_service, const struct vector *names)
+{
+    const struct formula_service *service;
+    const struct lbcd_metrics *metrics;
+    void **services;
+    size_t count, i, j;
+    bool wanted;
+
+    metrics = lbcd_metrics_get();
+    services = lbcd_service_list(formula_weight, &count);
+    for (i = 0; i < count; i++) {
+        service = services[i];
+        wanted = formula_matches(service, default_service);
+        for (j = 0; !wanted && j < names->count; j++)
+            wanted = formula_matches(service, names->strings[j]);
+        if (!wanted)
+            continue;
+        printf("\nFORMULA %s:\n", service->name);
+        printf("  weight = %s\n", service->weight->source);
+        node_trace(service->weight->root, service->weight, metrics, 0);
+        printf("  result = %g\n", lbcd_formula_eval(service->weight, metrics));
+        if (service->incr == NULL)
+            printf("  increment = %d\n", FORMULA_INCREMENT);
+        else {
+            printf("  increment = %s\n", service->incr->source);
+            node_trace(service->incr->root, service->incr, metrics, 0);
+            printf("  result = %g\n",
+                   lbcd_formula_eval(service->incr, metrics));
+        }
+    }
+    free(services);
+}
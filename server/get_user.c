@@ -1,9 +1,29 @@
 /*
  * Get statistics about logged-in users.
  *
+ * On systems with inotify, where the utmp file is an array of struct utmpx,
+ * the file is mapped into memory and watched, and nothing is read on a query
+ * unless it has changed.  When it has, each record is compared with what was
+ * seen in it before, and only the records that changed are parsed and
+ * applied to the counts.  The unique users are kept in a hash set keyed by
+ * the full username with the number of sessions of each, so that logins and
+ * logouts only touch their own entries.  Elsewhere, the records are read
+ * with getutxent whenever the modification time of utmp changes, and
+ * compared in the same way.
+ *
+ * Records may be read while another process is writing them.  A partial
+ * record is corrected when the event for that write is seen.
+ *
+ * If an idle threshold is set, each session is also checked for idleness,
+ * using the access time of its terminal or, for sessions without one, the
+ * idle hint of systemd-logind.  A session is only checked again once it
+ * could have become idle, or every few seconds once it is idle, so that this
+ * stays cheap with many sessions.  A user is idle if all of their sessions
+ * are.
+ *
  * Written by Larry Schwimmer
  * Updates by Russ Allbery <eagle@eyrie.org>
- * Copyright 1996, 1997, 1998, 2006, 2008, 2012, 2013
+ * Copyright 1996, 1997, 1998, 2006, 2008, 2012, 2013, 2026
  *     The Board of Trustees of the Leland Stanford Junior University
  *
  * See LICENSE for licensing terms.
@@ -12,20 +32,30 @@
 #include <config.h>
 #include <portable/system.h>
 
+#include <errno.h>
 #include <fcntl.h>
-#ifdef HAVE_SEARCH_H
-# include <search.h>
-#endif
 #include <sys/stat.h>
+#include <time.h>
 #if defined(HAVE_UTMPX_H)
 # include <utmpx.h>
 #elif defined(HAVE_UTMP_H)
 # include <utmp.h>
 #endif
 
+/*
+ * Whether to watch the utmp file and read its records directly.  This is
+ * only done where utmp is known to be an array of struct utmpx, which is
+ * true of every system with inotify.
+ */
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_INOTIFY_INIT1) \
+    && defined(HAVE_SYS_MMAN_H) && defined(HAVE_UTMPX_H)
+# define LBCD_UTMP_WATCH 1
+# include <sys/inotify.h>
+# include <sys/mman.h>
+#endif
+
 #include <server/internal.h>
 #include <util/messages.h>
-#include <util/vector.h>
 #include <util/xmalloc.h>
 
 /*
@@ -36,6 +66,18 @@
 # define utmpx       utmp
 # define getutxent() getutent()
 # define setutxent() setutent()
+# define endutxent() endutent()
+#endif
+
+/*
+ * Whether we see each record as a struct utmpx and so can remember what was
+ * counted from it.  Only systems without getutent, which have to read utmp
+ * themselves in its native format, count the users from scratch each time
+ * and don't support idle detection.
+ */
+#if defined(LBCD_UTMP_WATCH) || defined(HAVE_GETUTXENT) \
+    || defined(HAVE_GETUTENT)
+# define LBCD_UTMP_SLOTS 1
 #endif
 
 /* The logged-in user database.  We want to stat it for modification time. */
@@ -56,194 +98,807 @@
 #endif
 static const char *utmp = LBCD_UTMP_FILE;
 
-/* Stores the list of unique users found so far. */
-static struct vector *users = NULL;
+/* The initial size of the hash set of users, which must be a power of two. */
+#define USERS_MIN_SIZE 64
+
+/* How often to check whether an idle session is still idle, in seconds. */
+#define IDLE_INTERVAL 10
+
+/*
+ * An entry in the hash set of unique users.  name is NULL for an empty slot.
+ * Names aren't nul-terminated in utmp, so the length is kept.
+ */
+struct user_entry {
+    char *name;
+    size_t length;
+    uint32_t hash;
+    unsigned long sessions;
+    unsigned long active;       /* Sessions that aren't idle */
+};
+
+/* The hash set, using linear probing, and the number of users in it. */
+static struct user_entry *users = NULL;
+static size_t users_size = 0;
+static size_t users_count = 0;
+
+/* Totals for the users in the hash set. */
+static int total_sessions = 0;
+static int console_sessions = 0;
+static int idle_sessions = 0;
+static int idle_users = 0;
+
+/* Whether a non-root user owns a console device, and the utmp mtime. */
+static bool console_owned = false;
+static time_t last_mtime = 0;
+
+/* Seconds without activity after which a session is idle, or 0. */
+static unsigned long idle_threshold = 0;
+
+/* The directory holding terminal devices, if not /dev. */
+static char *idle_devdir = NULL;
+
+/* When sessions were last checked for idleness. */
+static time_t idle_time = 0;
+
+
+/*
+ * Return the FNV-1a hash of a username.
+ */
+static uint32_t
+user_hash(const char *name, size_t length)
+{
+    uint32_t hash = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
 
 
 /*
- * Create the (one, global) static hash table used to track users and
- * initialize variables.
+ * Return the index of the entry for a user, or of the empty slot where it
+ * would go.  The set always has at least one empty slot.
+ */
+static size_t
+user_find(const char *name, size_t length, uint32_t hash)
+{
+    size_t mask = users_size - 1;
+    size_t i;
+
+    for (i = hash & mask; users[i].name != NULL; i = (i + 1) & mask)
+        if (users[i].hash == hash && users[i].length == length
+            && memcmp(users[i].name, name, length) == 0)
+            break;
+    return i;
+}
+
+
+/*
+ * Double the size of the hash set, or allocate it if it's empty.
  */
 static void
-uniq_start(void)
+users_grow(void)
 {
-#ifdef HAVE_HSEARCH
-    hcreate(211);
-#endif
-    users = vector_new();
+    struct user_entry *old = users;
+    size_t old_size = users_size;
+    size_t i, j;
+
+    users_size = (old_size == 0) ? USERS_MIN_SIZE : old_size * 2;
+    users = xcalloc(users_size, sizeof(struct user_entry));
+    for (i = 0; i < old_size; i++)
+        if (old[i].name != NULL) {
+            j = user_find(old[i].name, old[i].length, old[i].hash);
+            users[j] = old[i];
+        }
+    free(old);
 }
 
 
 /*
- * Clean up.  Free the users stored in the global users variable.
+ * Add a session for a user, adding the user if they don't have one yet.
+ * The set is kept at most half full.
  */
 static void
-uniq_end(void)
+user_add(const char *name, size_t length)
 {
-#ifdef HAVE_HSEARCH
-    hdestroy();
-#endif
-    if (users != NULL)
-        vector_free(users);
+    uint32_t hash = user_hash(name, length);
+    size_t i;
+
+    if ((users_count + 1) * 2 > users_size)
+        users_grow();
+    i = user_find(name, length, hash);
+    if (users[i].name == NULL) {
+        users[i].name = xstrndup(name, length);
+        users[i].length = length;
+        users[i].hash = hash;
+        users[i].sessions = 0;
+        users[i].active = 0;
+        users_count++;
+    }
+    users[i].sessions++;
+}
+
+
+/*
+ * Remove a session for a user, removing the user when it was their last.
+ * Later entries in the same run are shifted back into the freed slot so that
+ * lookups never need to skip deleted entries.
+ */
+static void
+user_remove(const char *name, size_t length)
+{
+    size_t mask, i, j, home;
+
+    if (users_size == 0)
+        return;
+    i = user_find(name, length, user_hash(name, length));
+    if (users[i].name == NULL || --users[i].sessions > 0)
+        return;
+    free(users[i].name);
+    users_count--;
+    mask = users_size - 1;
+    for (j = (i + 1) & mask; users[j].name != NULL; j = (j + 1) & mask) {
+        home = users[j].hash & mask;
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        users[i] = users[j];
+        i = j;
+    }
+    users[i].name = NULL;
+}
+
+
+/*
+ * Remove every user from the hash set and reset the totals.
+ */
+static void
+users_clear(void)
+{
+    size_t i;
+
+    for (i = 0; i < users_size; i++)
+        free(users[i].name);
+    free(users);
+    users = NULL;
+    users_size = 0;
+    users_count = 0;
+    total_sessions = 0;
+    console_sessions = 0;
+    idle_sessions = 0;
+    idle_users = 0;
+}
+
+
+/*
+ * Return the length of the username in a utmp name field, which is
+ * nul-terminated only if it's shorter than the field.
+ */
+static size_t
+name_length(const char *name, size_t size)
+{
+    const char *end;
+
+    end = memchr(name, '\0', size);
+    return (end == NULL) ? size : (size_t) (end - name);
+}
+
+
+/*
+ * Check two common names for console devices and note whether either is
+ * owned by a non-root user, which we take to mean someone is on console.
+ */
+static void
+console_check(void)
+{
+    struct stat st;
+
+    console_owned = false;
+    if (stat("/dev/console", &st) == 0 && st.st_uid != 0)
+        console_owned = true;
+    if (stat("/dev/tty1", &st) == 0 && st.st_uid != 0)
+        console_owned = true;
 }
 
 
+#ifdef LBCD_UTMP_SLOTS
+
+/* The sizes of the name and terminal fields of a record. */
+#define UTMP_NAME_SIZE sizeof(((struct utmpx *) 0)->ut_user)
+#define UTMP_LINE_SIZE sizeof(((struct utmpx *) 0)->ut_line)
+
+/*
+ * What we counted from a utmp record, so that we can tell whether it has
+ * changed and remove what it contributed when it does, and what we know
+ * about whether the session is idle.
+ */
+struct utmp_slot {
+    bool user;
+    bool console;
+    char name[UTMP_NAME_SIZE];
+    char line[UTMP_LINE_SIZE];
+    pid_t pid;
+    bool idle;                  /* Whether the session was idle */
+    time_t active;              /* Last activity, or 0 if not checked */
+    time_t checked;             /* When idleness was last checked */
+};
+
+/* What was counted from each record, and the space allocated. */
+static struct utmp_slot *slots = NULL;
+static size_t slot_count = 0;
+static size_t slot_size = 0;
+
+
 /*
- * Count a given user.  See if they're already in our hash and, if not, add
- * them and count them.
+ * Return the slot for a record, growing the slots as needed.  New slots
+ * haven't counted anything.
  */
-#ifdef HAVE_HSEARCH
+static struct utmp_slot *
+slot_get(size_t index)
+{
+    size_t size;
+
+    if (index >= slot_size) {
+        size = (slot_size == 0) ? 64 : slot_size;
+        while (size <= index)
+            size *= 2;
+        slots = xreallocarray(slots, size, sizeof(struct utmp_slot));
+        memset(slots + slot_size, 0,
+               (size - slot_size) * sizeof(struct utmp_slot));
+        slot_size = size;
+    }
+    if (index >= slot_count)
+        slot_count = index + 1;
+    return &slots[index];
+}
 
+
+/*
+ * Remove what a slot contributed to the counts.
+ */
 static void
-uniq_add(char *name)
+slot_clear(struct utmp_slot *slot)
 {
-    ENTRY item, *i;
-
-    item.key = name;
-    item.data = NULL;
-    i = hsearch(item, FIND);
-    if (i == NULL) {
-        vector_add(users, name);
-        item.key = users->strings[users->count - 1];
-        hsearch(item, ENTER);
+    if (slot->user) {
+        user_remove(slot->name, name_length(slot->name, UTMP_NAME_SIZE));
+        total_sessions--;
+        if (slot->console)
+            console_sessions--;
     }
+    memset(slot, 0, sizeof(*slot));
 }
 
-#else /* !HAVE_HSEARCH */
 
+/*
+ * Compare a record with what was counted from it before, and if it changed,
+ * remove the old contribution and add the new one.
+ */
 static void
-uniq_add(char *name)
+slot_update(struct utmp_slot *slot, const struct utmpx *ut)
+{
+    bool user, console;
+
+    user = (ut->ut_type == USER_PROCESS);
+    if (!user && !slot->user)
+        return;
+    console = user
+        && (strncmp(ut->ut_line, "console", 7) == 0
+            || strncmp(ut->ut_host, ":0", 2) == 0);
+    if (user == slot->user && console == slot->console
+        && (!user
+            || (slot->pid == ut->ut_pid
+                && memcmp(slot->name, ut->ut_user, UTMP_NAME_SIZE) == 0
+                && memcmp(slot->line, ut->ut_line, UTMP_LINE_SIZE) == 0)))
+        return;
+    slot_clear(slot);
+    if (user) {
+        slot->user = true;
+        slot->console = console;
+        slot->pid = ut->ut_pid;
+        memcpy(slot->name, ut->ut_user, UTMP_NAME_SIZE);
+        memcpy(slot->line, ut->ut_line, UTMP_LINE_SIZE);
+        user_add(slot->name, name_length(slot->name, UTMP_NAME_SIZE));
+        total_sessions++;
+        if (console)
+            console_sessions++;
+    }
+}
+
+
+/*
+ * Forget the records past the given count, which are no longer in utmp.
+ */
+static void
+slots_truncate(size_t count)
 {
     size_t i;
 
-    if (i = 0; i < users->count; i++)
-        if (strcmp(users->strings[i], name) == 0)
-            return;
-    vector_add(users, name);
+    for (i = count; i < slot_count; i++)
+        slot_clear(&slots[i]);
+    if (count < slot_count)
+        slot_count = count;
 }
 
-#endif /* !HAVE_HSEARCH */
+
+/*
+ * Forget all the records and free the slots.
+ */
+static void
+slots_free(void)
+{
+    slots_truncate(0);
+    free(slots);
+    slots = NULL;
+    slot_size = 0;
+}
 
 
 /*
- * Return the count of unique users.
+ * Return the time of the last activity in a session, from the access time
+ * of its terminal or the idle hint of systemd-logind, or 0 if neither is
+ * known.  Sessions on an X display don't have a terminal device.
  */
-static size_t
-uniq_count(void)
+static time_t
+session_active(const struct utmp_slot *slot)
 {
-    return users->count;
+    const char *devdir = (idle_devdir != NULL) ? idle_devdir : "/dev";
+    struct stat st;
+    char *path;
+    size_t length;
+    time_t active;
+    int status;
+
+    length = name_length(slot->line, UTMP_LINE_SIZE);
+    if (length > 0 && slot->line[0] != ':') {
+        xasprintf(&path, "%s/%.*s", devdir, (int) length, slot->line);
+        status = stat(path, &st);
+        free(path);
+        if (status == 0)
+            return st.st_atime;
+    }
+    if (slot->pid > 0 && lbcd_logind_active(slot->pid, &active))
+        return active;
+    return 0;
 }
 
 
 /*
- * The public entry point.  Returns the total users, the unique users, a flag
- * indicating whether there is a user on console, and the time of the last
- * change.  Returns 0 on success and a negative value on error.
- *
- * Currently, this implementation ignores all characters after the first eight
- * when counting uniqueness.
+ * Check each session for idleness and count the idle sessions and users.
+ * A session known to have been active within the threshold isn't checked
+ * again until it could have become idle, and an idle session is checked at
+ * most every IDLE_INTERVAL seconds.  Sessions whose activity can't be found
+ * are never idle.
  */
-int
-get_user_stats(int *total, int *uniq, int *on_console, time_t *user_mtime)
+static void
+idle_update(time_t now, bool changed)
 {
-    char *name;
-    struct stat sbuf;
-    static int last_total = 0;
-    static int last_uniq = 0;
-    static int last_on_console = 0;
-    static time_t last_user_mtime = 0;
-
-    *total      = 0;
-    *uniq       = 0;
-    *on_console = 0;
-    *user_mtime = 0;
-
-    /*
-     * Stat the utmp file to see if it's changed.  If it hasn't, use our
-     * static cached values to save resources.
-     */
-    if (stat(utmp, &sbuf) == 0)
-        *user_mtime = sbuf.st_mtime;
-    if (*user_mtime > 0 && *user_mtime == last_user_mtime) {
-        *total      = last_total;
-        *uniq       = last_uniq;
-        *on_console = last_on_console;
-        return 0;
+    struct utmp_slot *slot;
+    time_t threshold = (time_t) idle_threshold;
+    size_t i, j, length;
+
+    if (idle_threshold == 0 || (now == idle_time && !changed))
+        return;
+    idle_time = now;
+    for (i = 0; i < users_size; i++)
+        users[i].active = 0;
+    idle_sessions = 0;
+    for (i = 0; i < slot_count; i++) {
+        slot = &slots[i];
+        if (!slot->user)
+            continue;
+        if (now - slot->active >= threshold
+            && (!slot->idle || now - slot->checked >= IDLE_INTERVAL)) {
+            slot->active = session_active(slot);
+            slot->checked = now;
+            if (slot->active == 0)
+                slot->active = now;
+            slot->idle = (now - slot->active >= threshold);
+        }
+        if (slot->idle) {
+            idle_sessions++;
+            continue;
+        }
+        length = name_length(slot->name, UTMP_NAME_SIZE);
+        j = user_find(slot->name, length, user_hash(slot->name, length));
+        if (users[j].name != NULL)
+            users[j].active++;
     }
+    idle_users = 0;
+    for (i = 0; i < users_size; i++)
+        if (users[i].name != NULL && users[i].active == 0)
+            idle_users++;
+}
+
+#endif /* LBCD_UTMP_SLOTS */
+
+
+#ifdef LBCD_UTMP_WATCH
+
+/* The events that mean the utmp file or a console device has changed. */
+#define UTMP_EVENTS (IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* The utmp file set by lbcd_users_init, if any. */
+static char *utmp_path = NULL;
 
-    /*
-     * Check two common names for console devices and assume we have a user on
-     * console if they're owned by a non-root user.
-     */
-    if (stat("/dev/console", &sbuf) == 0 && sbuf.st_uid != 0)
-        *on_console = 1;
-    if (stat("/dev/tty1", &sbuf) == 0 && sbuf.st_uid  != 0)
-        *on_console = 1;
-
-    /*
-     * Now count the number of unique users.  There are two implementations
-     * depending on whether we have getutent or have to read the utmp file
-     * ourselves.
-     */
-    uniq_start();
-#if defined(HAVE_GETUTXENT) || defined(HAVE_GETUTENT)
+/* The inotify descriptor and the watch on utmp, or -1. */
+static int watch_fd = -1;
+static int utmp_wd = -1;
+
+/* The open utmp file and its mapping. */
+static int utmp_fd = -1;
+static void *utmp_map = NULL;
+static size_t utmp_map_size = 0;
+
+/* Whether utmp may have changed since it was last read. */
+static bool utmp_changed = true;
+
+
+/*
+ * Unmap and close the utmp file.
+ */
+static void
+utmp_close(void)
+{
+    if (utmp_map != NULL)
+        munmap(utmp_map, utmp_map_size);
+    utmp_map = NULL;
+    utmp_map_size = 0;
+    if (utmp_fd >= 0)
+        close(utmp_fd);
+    utmp_fd = -1;
+    if (utmp_wd >= 0)
+        inotify_rm_watch(watch_fd, utmp_wd);
+    utmp_wd = -1;
+}
+
+
+/*
+ * Set up the inotify descriptor with watches on the console devices.  If
+ * this fails, utmp is instead checked on each query.
+ */
+static void
+watch_start(void)
+{
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd < 0) {
+        syswarn("cannot watch %s for changes", utmp);
+        return;
+    }
+    inotify_add_watch(watch_fd, "/dev/console", IN_ATTRIB);
+    inotify_add_watch(watch_fd, "/dev/tty1", IN_ATTRIB);
+}
+
+
+/*
+ * Open and watch the utmp file.  If it can't be opened, such as when it
+ * doesn't exist, we try again on the next query.
+ */
+static void
+utmp_open(void)
+{
+    if (watch_fd >= 0) {
+        utmp_wd = inotify_add_watch(watch_fd, utmp, UTMP_EVENTS);
+        if (utmp_wd < 0 && errno != ENOENT)
+            syswarn("cannot watch %s for changes", utmp);
+    }
+    utmp_fd = open(utmp, O_RDONLY | O_CLOEXEC);
+    if (utmp_fd < 0) {
+        if (errno != ENOENT)
+            syswarn("cannot open %s", utmp);
+        utmp_close();
+    }
+}
+
+
+/*
+ * Return whether the open utmp file is still the one at its path.  It is
+ * replaced rather than removed if we have it open, so the watch doesn't see
+ * it go away.
+ */
+static bool
+utmp_current(void)
+{
+    struct stat path_st, fd_st;
+
+    if (stat(utmp, &path_st) < 0 || fstat(utmp_fd, &fd_st) < 0)
+        return false;
+    return (path_st.st_dev == fd_st.st_dev && path_st.st_ino == fd_st.st_ino);
+}
+
+
+/*
+ * Read any pending events and note whether utmp changed.  If utmp was
+ * removed or renamed, close it so that the new file is opened.
+ */
+static void
+watch_read(void)
+{
+    union {
+        struct inotify_event event;
+        char buffer[4096];
+    } events;
+    const struct inotify_event *event;
+    ssize_t status;
+    size_t offset;
+    uint32_t gone = IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED;
+
+    while ((status = read(watch_fd, &events, sizeof(events))) > 0) {
+        utmp_changed = true;
+        offset = 0;
+        while (offset < (size_t) status) {
+            event = (const void *) (events.buffer + offset);
+            if (utmp_wd >= 0 && event->wd == utmp_wd
+                && (event->mask & gone) != 0)
+                utmp_close();
+            offset += sizeof(*event) + event->len;
+        }
+    }
+    if (status < 0 && errno != EAGAIN && errno != EINTR)
+        syswarn("cannot read changes to %s", utmp);
+}
+
+
+/*
+ * Bring the counts up to date with the utmp file, remapping it if its size
+ * changed.  A missing file has no users.
+ */
+static void
+utmp_update(void)
+{
+    const struct utmpx *records;
+    struct stat st;
+    size_t count = 0;
+    size_t i;
+
+    utmp_changed = false;
+    console_check();
+    last_mtime = 0;
+    if (utmp_fd >= 0 && !utmp_current())
+        utmp_close();
+    if (utmp_fd < 0)
+        utmp_open();
+    if (utmp_fd >= 0) {
+        if (fstat(utmp_fd, &st) < 0) {
+            syswarn("cannot stat %s", utmp);
+            st.st_mtime = 0;
+            st.st_size = 0;
+        }
+        last_mtime = st.st_mtime;
+        count = (size_t) st.st_size / sizeof(struct utmpx);
+        if (count * sizeof(struct utmpx) != utmp_map_size) {
+            if (utmp_map != NULL)
+                munmap(utmp_map, utmp_map_size);
+            utmp_map = NULL;
+            utmp_map_size = count * sizeof(struct utmpx);
+            if (count > 0) {
+                utmp_map = mmap(NULL, utmp_map_size, PROT_READ, MAP_SHARED,
+                                utmp_fd, 0);
+                if (utmp_map == MAP_FAILED) {
+                    syswarn("cannot map %s", utmp);
+                    utmp_map = NULL;
+                    utmp_map_size = 0;
+                    count = 0;
+                }
+            }
+        }
+    }
+    records = utmp_map;
+    for (i = 0; i < count; i++)
+        slot_update(slot_get(i), &records[i]);
+    slots_truncate(count);
+}
+
+
+/*
+ * Update the counts if utmp has changed, and return whether it did.  If it
+ * isn't being watched, such as before it exists, we can't tell, so we always
+ * check.
+ */
+static bool
+users_update(void)
+{
+    if (watch_fd < 0)
+        watch_start();
+    if (watch_fd >= 0)
+        watch_read();
+    if (utmp_fd < 0 || utmp_wd < 0)
+        utmp_changed = true;
+    if (!utmp_changed)
+        return false;
+    utmp_update();
+    return true;
+}
+
+
+/*
+ * Use a different utmp file, or the default if path is NULL, and forget
+ * everything counted so far.  Returns true since the file is read directly.
+ */
+bool
+lbcd_users_init(const char *path)
+{
+    lbcd_users_close();
+    utmp_path = (path != NULL) ? xstrdup(path) : NULL;
+    utmp = (path != NULL) ? utmp_path : LBCD_UTMP_FILE;
+    return true;
+}
+
+
+/*
+ * Close the utmp file and stop watching it, and forget everything counted.
+ */
+void
+lbcd_users_close(void)
+{
+    utmp_close();
+    if (watch_fd >= 0)
+        close(watch_fd);
+    watch_fd = -1;
+    slots_free();
+    users_clear();
+    lbcd_logind_close();
+    utmp_changed = true;
+    idle_time = 0;
+    free(utmp_path);
+    utmp_path = NULL;
+    utmp = LBCD_UTMP_FILE;
+}
+
+#else /* !LBCD_UTMP_WATCH */
+
+/*
+ * Count the users in the utmp file again if its modification time changed,
+ * and return whether it did.  There are two implementations depending on
+ * whether we have getutent or have to read the utmp file ourselves.
+ */
+static bool
+users_update(void)
+{
+    struct stat st;
+    time_t mtime = 0;
+
+    if (stat(utmp, &st) == 0)
+        mtime = st.st_mtime;
+    if (mtime > 0 && mtime == last_mtime)
+        return false;
+    last_mtime = mtime;
+    console_check();
+# ifdef LBCD_UTMP_SLOTS
     {
         struct utmpx *ut;
+        size_t count = 0;
 
         setutxent();
-        while ((ut = getutxent()) != NULL) {
-            if (ut->ut_type != USER_PROCESS)
-                continue;
-            (*total)++;
-            if (strncmp(ut->ut_line, "console", 7) == 0)
-                *on_console = 1;
-            if (strncmp(ut->ut_host, ":0", 2) == 0)
-                *on_console = 1;
-            name = xstrndup(ut->ut_user, sizeof(ut->ut_user));
-            uniq_add(name);
-            free(name);
-        }
+        while ((ut = getutxent()) != NULL)
+            slot_update(slot_get(count++), ut);
         endutxent();
+        slots_truncate(count);
     }
-#else
+# else
     {
         struct utmp ut;
+        char *name;
         int fd;
 
+        users_clear();
         fd = open(utmp, O_RDONLY);
         if (fd < 0) {
             syswarn("cannot open %s", utmp);
-            return -1;
+            return true;
         }
         while (read(fd, &ut, sizeof(ut)) > 0) {
-# ifndef USER_PROCESS
+#  ifndef USER_PROCESS
             if (ut.ut_name[0] == '\0')
                 continue;
-# else
+#  else
             if (ut.ut_type != USER_PROCESS)
                 continue;
-# endif
-            (*total)++;
-            if (strncmp(ut.ut_line, "console", 7) == 0)
-                *on_console = 1;
-            if (strncmp(ut->ut_host, ":0", 2) == 0)
-                *on_console = 1;
-            name = xstrndup(ut.ut_name, sizeof(ut.ut_name));
-            uniq_add(name);
-            free(name);
+#  endif
+            total_sessions++;
+            if (strncmp(ut.ut_line, "console", 7) == 0
+                || strncmp(ut.ut_host, ":0", 2) == 0)
+                console_sessions++;
+            name = ut.ut_name;
+            user_add(name, name_length(name, sizeof(ut.ut_name)));
         }
         close(fd);
     }
-#endif /* !HAVE_GETUTENT */
-    *uniq = uniq_count();
-    uniq_end();
+# endif /* !LBCD_UTMP_SLOTS */
+    return true;
+}
+
+
+/*
+ * Use a different utmp file, which isn't supported since the system library
+ * reads it.  Returns false for any path other than NULL, the default.
+ */
+bool
+lbcd_users_init(const char *path)
+{
+    lbcd_users_close();
+    return (path == NULL);
+}
+
+
+/*
+ * Forget everything counted.
+ */
+void
+lbcd_users_close(void)
+{
+# ifdef LBCD_UTMP_SLOTS
+    slots_free();
+# endif
+    users_clear();
+    lbcd_logind_close();
+    last_mtime = 0;
+    idle_time = 0;
+}
+
+#endif /* !LBCD_UTMP_WATCH */
+
+
+/*
+ * Set the number of seconds without activity after which a session is idle,
+ * or 0 to not check for idle sessions, and the directory in which to find
+ * terminal devices, or NULL for /dev.  Everything is checked again on the
+ * next query.
+ */
+void
+lbcd_users_idle_init(unsigned long threshold, const char *devdir)
+{
+    idle_threshold = threshold;
+    free(idle_devdir);
+    idle_devdir = (devdir != NULL) ? xstrdup(devdir) : NULL;
+    idle_time = 0;
+    idle_sessions = 0;
+    idle_users = 0;
+#ifdef LBCD_UTMP_SLOTS
+    {
+        size_t i;
+
+        for (i = 0; i < slot_count; i++) {
+            slots[i].idle = false;
+            slots[i].active = 0;
+            slots[i].checked = 0;
+        }
+    }
+#endif
+}
 
-    /* Save our cached values. */
-    last_total      = *total;
-    last_uniq       = *uniq;
-    last_on_console = *on_console;
-    last_user_mtime = *user_mtime;
 
+/*
+ * Return the number of idle sessions and the number of users all of whose
+ * sessions are idle, as of the last call to get_user_stats.
+ */
+void
+lbcd_users_idle(int *sessions, int *uniq)
+{
+    *sessions = idle_sessions;
+    *uniq = idle_users;
+}
+
+
+/*
+ * The public entry point.  Returns the total users, the unique users, a flag
+ * indicating whether there is a user on console, and the time of the last
+ * change.  Always returns 0, since problems reading utmp are reported and
+ * treated as no users.
+ */
+int
+get_user_stats(int *total, int *uniq, int *on_console, time_t *user_mtime)
+{
+#ifdef LBCD_UTMP_SLOTS
+    idle_update(time(NULL), users_update());
+#else
+    users_update();
+#endif
+    *total      = total_sessions;
+    *uniq       = (int) users_count;
+    *on_console = (console_owned || console_sessions > 0) ? 1 : 0;
+    *user_mtime = last_mtime;
     return 0;
 }
 
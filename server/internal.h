@@ -13,6 +13,7 @@
 
 #include <config.h>
 #include <portable/macros.h>
+#include <portable/stdbool.h>
 
 #if HAVE_INTTYPES_H
 # include <inttypes.h>
@@ -29,6 +30,10 @@
 #include <server/protocol.h>
 
 /* Forward declarations to avoid includes. */
+struct formula;
+struct lbcd_metrics;
+struct lbcd_upgrade;
+struct probe_script;
 struct vector;
 
 /*
@@ -38,29 +43,433 @@ struct vector;
 typedef int weight_func_type(uint32_t *, uint32_t *, int, const char *,
                              struct lbcd_reply *);
 
+/*
+ * A service function registered at runtime is the same as a weight function
+ * except that it also takes the opaque data pointer given at registration.
+ */
+typedef int service_func_type(void *, uint32_t *, uint32_t *, int,
+                              const char *, struct lbcd_reply *);
+
+/* Frees the opaque data of a service registered at runtime. */
+typedef void service_free_type(void *);
+
+/* The configuration, from a configuration file, the command line, or both. */
+struct lbcd_config {
+    struct vector *bindaddrs;   /* Addresses to listen on */
+    bool log;                   /* Log each request */
+    bool normalize;             /* Divide the load by the number of CPUs */
+    unsigned short port;        /* Port to listen on */
+    char *pid_file;             /* Write the daemon PID to this path */
+    struct vector *services;    /* Allowed services */
+    bool simple;                /* Do not adjust results for version 2 */
+    bool upstart;               /* Raise SIGSTOP when ready for upstart */
+    char *command;              /* External command to get the weight */
+    char *weight;               /* Default service or weight:increment */
+    char *probe_dir;            /* Directory of probe scripts */
+    char *plugin_dir;           /* Directory of weight plugins */
+    int timeout;                /* Timeout for service checks */
+    struct vector *formulas;    /* Weight formula definitions */
+    struct vector *composites;  /* Composite service definitions */
+    char *psi_weights;          /* Coefficients for the psi service */
+    char *cgroup;               /* cgroup whose resource usage to report */
+    char *capacity_file;        /* State file for the capacity score */
+    char *half_lives;           /* Half-lives of CPU utilization averages */
+    struct vector *filesystems; /* Filesystems to monitor and penalties */
+    unsigned long idle_time;    /* Seconds until a session is idle, or 0 */
+    char *user_cpu;             /* Interval and threshold for per-user CPU */
+    char *memory_penalty;       /* Penalty for memory pressure */
+    unsigned long memory_floor; /* MiB available below which to refuse */
+    struct vector *interfaces;  /* Network interfaces to monitor */
+    struct vector *disks;       /* Block devices to monitor */
+    char *app_socket;           /* Socket for application load reports */
+    char *app_shm;              /* Shared memory for application reports */
+};
+
 BEGIN_DECLS
 
+/* System information beyond the load, if the kernel code can provide it. */
+struct kernel_info {
+    unsigned long procs;        /* Number of processes */
+    unsigned long mem_total;    /* Total memory in MiB */
+    unsigned long mem_free;     /* Free memory in MiB */
+    unsigned long swap_total;   /* Total swap in MiB */
+    unsigned long swap_free;    /* Free swap in MiB */
+};
+
+/*
+ * Usage of a monitored filesystem.  Percentages are rounded, and the penalty
+ * is the multiplier the load service applies for it, 1 if it isn't full.
+ */
+struct fs_usage {
+    bool available;             /* Whether the filesystem could be checked */
+    unsigned long full;         /* Percent of space used */
+    unsigned long inodes;       /* Percent of inodes used */
+    unsigned long penalty;      /* Penalty multiplier */
+};
+
+/* Summary of all monitored filesystems. */
+struct fs_info {
+    struct fs_usage tmp;        /* Usage of /tmp */
+    struct fs_usage tmpdir;     /* Usage of the system temporary directory */
+    unsigned long full;         /* Highest percent of space used */
+    unsigned long inodes;       /* Highest percent of inodes used */
+    unsigned long penalty;      /* Largest penalty multiplier */
+};
+
+/* Pressure stall averages for one resource, as percentages times 100. */
+enum psi_resource {
+    PSI_CPU,
+    PSI_MEMORY,
+    PSI_IO,
+    PSI_RESOURCE_COUNT
+};
+struct psi_info {
+    unsigned long some10;       /* Some tasks stalled, 10 second average */
+    unsigned long some60;       /* Some tasks stalled, 60 second average */
+    unsigned long full10;       /* All tasks stalled, 10 second average */
+    unsigned long full60;       /* All tasks stalled, 60 second average */
+};
+
+/* Resource usage of a cgroup, as percentages times 100 where noted. */
+struct cgroup_info {
+    unsigned long cpu_util;     /* Percent of CPU limit used since last read */
+    unsigned long cpu_throttled; /* Percent of time throttled since then */
+    unsigned long cpu_limit;    /* CPUs available times 100 */
+    unsigned long mem_current;  /* Memory used in MiB */
+    unsigned long mem_max;      /* Memory limit in MiB, or 0 if none */
+    unsigned long mem_used;     /* Percent of memory limit used */
+    struct psi_info pressure;   /* CPU pressure in the cgroup */
+};
+
+/* Total CPU times from /proc/stat, in clock ticks. */
+struct cpustat_times {
+    unsigned long user;
+    unsigned long nice;
+    unsigned long system;
+    unsigned long idle;
+    unsigned long iowait;
+    unsigned long irq;
+    unsigned long softirq;
+    unsigned long steal;
+};
+
+/*
+ * Moving averages of CPU time, as percentages times 100, with short, medium,
+ * and long half-lives.
+ */
+#define CPUSTAT_RATES 3
+struct cpustat_info {
+    unsigned long util[CPUSTAT_RATES];    /* Busy, including steal */
+    unsigned long iowait[CPUSTAT_RATES];  /* Idle waiting for I/O */
+    unsigned long steal[CPUSTAT_RATES];   /* Taken by the hypervisor */
+    unsigned long softirq[CPUSTAT_RATES]; /* Handling software interrupts */
+};
+
+/* The raw numbers from /proc/meminfo and /proc/vmstat, in KiB. */
+struct memory_sample {
+    unsigned long total;        /* Total memory */
+    unsigned long available;    /* Memory available without swapping */
+    unsigned long swap_total;   /* Total swap */
+    unsigned long swap_free;    /* Free swap */
+    unsigned long majfaults;    /* Major page faults since boot */
+};
+
+/* Memory and swap pressure, computed from the last two samples. */
+struct memory_info {
+    unsigned long available;    /* Memory available in MiB */
+    unsigned long used;         /* Percent of memory not available */
+    unsigned long swap_used;    /* Percent of swap used */
+    unsigned long majfaults;    /* Major page faults per second */
+    unsigned long pressure;     /* Pressure score from 0 to 100 */
+    unsigned long penalty;      /* Penalty multiplier for the pressure */
+    bool low;                   /* Whether available is below the floor */
+};
+
+/*
+ * Moving averages of disk I/O of the busiest device, times 100.  Utilization
+ * is a percentage and await is in milliseconds.
+ */
+struct disk_info {
+    unsigned long util;         /* Percent of time with I/O in flight */
+    unsigned long queue;        /* Average requests in flight */
+    unsigned long await;        /* Average time to complete a request */
+};
+
+/*
+ * Moving averages of network throughput and errors.  Utilization and
+ * retransmissions are percentages times 100.
+ */
+struct netdev_info {
+    unsigned long rx;           /* KiB/s received on all interfaces */
+    unsigned long tx;           /* KiB/s transmitted on all interfaces */
+    unsigned long util;         /* Utilization of the busiest interface */
+    unsigned long errors;       /* Errors and drops per second */
+    unsigned long retrans;      /* TCP segments retransmitted */
+};
+
+/* A TCP port as seen by the listen service, from a sock_diag dump. */
+struct listen_port {
+    unsigned short port;
+    bool listening;             /* Whether a socket is listening on it */
+    unsigned long queue;        /* Connections waiting to be accepted */
+    unsigned long backlog;      /* Maximum length of the accept queue */
+    unsigned long established;  /* Established connections to the port */
+};
+
+/*
+ * The listening TCP ports in a sock_diag dump, as a hash table by port with
+ * size slots, count of which are used.  Initialize it to all zeroes.
+ */
+struct listen_table {
+    struct listen_port *ports;
+    size_t count;
+    size_t size;
+};
+
+/*
+ * The spread of load and free memory across NUMA nodes.  Utilization is a
+ * percentage times 100 and free memory is in MiB.
+ */
+struct numa_info {
+    unsigned long nodes;        /* Number of NUMA nodes */
+    unsigned long util_max;     /* Utilization of the busiest node */
+    unsigned long util_min;     /* Utilization of the least busy node */
+    unsigned long free_min;     /* Free memory of the fullest node */
+    unsigned long free_max;     /* Free memory of the emptiest node */
+};
+
+/*
+ * CPU time used by each user since the previous walk of /proc.  Utilization
+ * and shares are percentages times 100.
+ */
+struct usercpu_info {
+    unsigned long users;        /* Users who used any CPU time */
+    unsigned long heavy;        /* Users who used more than the threshold */
+    unsigned long top_share;    /* Share of CPU time used by the top user */
+    unsigned long top_util;     /* Utilization of one CPU by the top user */
+};
+
 /* kernel.c */
 extern int kernel_getload(double *l1, double *l5, double *l15);
 extern int kernel_getboottime(time_t *boottime);
+extern int kernel_getinfo(struct kernel_info *);
+
+/* app.c */
+extern bool lbcd_app_report(const char *report, size_t length,
+                            unsigned long long now);
+extern bool lbcd_app_lookup(const char *name, unsigned long long now,
+                            uint32_t *weight, uint32_t *incr);
+extern bool lbcd_app_init(const char *path, const char *shm_file);
+extern bool lbcd_app_prepare(const char *path, const char *shm_file);
+extern void lbcd_app_commit(void);
+extern void lbcd_app_abort(void);
+extern int lbcd_app_open(void);
+extern void lbcd_app_event(void);
+extern void lbcd_app_close(void);
+
+/* capacity.c */
+extern void lbcd_capacity_init(const char *path);
+extern void lbcd_capacity_calibrate(void);
+extern int lbcd_capacity_start(void);
+extern void lbcd_capacity_event(void);
+extern void lbcd_capacity_close(void);
+extern unsigned long lbcd_capacity_get(void);
+extern void lbcd_capacity_scale(uint32_t *weight, uint32_t *incr);
+
+/* cgroup.c */
+extern bool lbcd_cgroup_init(const char *name);
+extern bool lbcd_cgroup_prepare(const char *name);
+extern void lbcd_cgroup_commit(void);
+extern void lbcd_cgroup_abort(void);
+extern int lbcd_cgroup_read(struct cgroup_info *);
+extern double lbcd_cgroup_cpus(void);
+extern void lbcd_cgroup_close(void);
+
+/* composite.c */
+extern bool lbcd_composite_define(const char *definition);
+extern bool lbcd_composite_check(void);
+
+/* config.c */
+extern struct lbcd_config *lbcd_config_new(void);
+extern void lbcd_config_free(struct lbcd_config *);
+extern const char *lbcd_config_key(int option);
+extern bool lbcd_config_set(struct lbcd_config *, const char *key,
+                            const char *value);
+extern bool lbcd_config_read(struct lbcd_config *, const char *path);
+
+/* cpus.c */
+extern double lbcd_cpus_get(void);
+extern void lbcd_cpus_invalidate(void);
+extern int lbcd_cpus_watch(void);
+extern void lbcd_cpus_event(void);
+extern void lbcd_cpus_close(void);
+
+/* cpustat.c */
+extern bool lbcd_cpustat_init(const char *half_lives);
+extern bool lbcd_cpustat_prepare(const char *half_lives);
+extern void lbcd_cpustat_commit(void);
+extern void lbcd_cpustat_abort(void);
+extern void lbcd_cpustat_update(const struct cpustat_times *,
+                                unsigned long long now);
+extern int lbcd_cpustat_timeout(void);
+extern void lbcd_cpustat_sample(void);
+extern void lbcd_cpustat_read(struct cpustat_info *);
+extern void lbcd_cpustat_close(void);
+
+/* diskstats.c */
+extern bool lbcd_disk_init(const struct vector *names, const char *dir);
+extern bool lbcd_disk_prepare(const struct vector *names, const char *dir);
+extern void lbcd_disk_commit(void);
+extern void lbcd_disk_abort(void);
+extern void lbcd_disk_scan(unsigned long long now);
+extern int lbcd_disk_timeout(void);
+extern void lbcd_disk_sample(void);
+extern void lbcd_disk_read(struct disk_info *);
+extern void lbcd_disk_close(void);
+
+/* filesystem.c */
+extern bool lbcd_fs_init(const struct vector *specs);
+extern bool lbcd_fs_prepare(const struct vector *specs);
+extern void lbcd_fs_commit(void);
+extern void lbcd_fs_abort(void);
+extern bool lbcd_fs_usage(const char *path, struct fs_usage *);
+extern void lbcd_fs_read(struct fs_info *);
+extern void lbcd_fs_print(void);
+extern void lbcd_fs_close(void);
+
+/* formula.c */
+extern struct formula *lbcd_formula_compile(const char *source,
+                                            char **error);
+extern double lbcd_formula_eval(const struct formula *,
+                                const struct lbcd_metrics *);
+extern size_t lbcd_formula_size(const struct formula *);
+extern void lbcd_formula_free(struct formula *);
+extern bool lbcd_formula_define(const char *definition);
+extern void lbcd_formula_trace(const char *default_service,
+                               const struct vector *services);
 
 /* get_user.c */
 extern int get_user_stats(int *total, int *unique, int *onconsole,
                           time_t *user_mtime);
+extern bool lbcd_users_init(const char *path);
+extern void lbcd_users_idle_init(unsigned long threshold, const char *devdir);
+extern void lbcd_users_idle(int *sessions, int *unique);
+extern void lbcd_users_close(void);
+
+/* logind.c */
+extern bool lbcd_logind_active(pid_t pid, time_t *active);
+extern void lbcd_logind_close(void);
+
+/* memory.c */
+extern bool lbcd_memory_init(const char *spec, unsigned long floor);
+extern bool lbcd_memory_prepare(const char *spec, unsigned long floor);
+extern void lbcd_memory_commit(void);
+extern void lbcd_memory_abort(void);
+extern bool lbcd_memory_parse(const char *meminfo, const char *vmstat,
+                              struct memory_sample *);
+extern void lbcd_memory_update(const struct memory_sample *,
+                               unsigned long long now);
+extern void lbcd_memory_sample(void);
+extern void lbcd_memory_read(struct memory_info *);
+extern void lbcd_memory_close(void);
+
+/* plugin.c */
+extern bool lbcd_plugin_init(const char *dir);
+
+/* probe.c */
+extern bool lbcd_probe_init(const char *dir);
+extern struct probe_script *lbcd_probe_compile(const char *name,
+                                               const char *path);
+extern int lbcd_probe_run(const struct probe_script *, int timeout,
+                          uint32_t *weight);
+extern void lbcd_probe_script_free(struct probe_script *);
+
+/* load.c */
+extern void lbcd_load_normalize(bool);
 
-/* tmp_free.c */
-extern int tmp_full(const char *path);
+/* netdev.c */
+extern bool lbcd_netdev_init(const struct vector *specs, const char *dir);
+extern bool lbcd_netdev_prepare(const struct vector *specs, const char *dir);
+extern void lbcd_netdev_commit(void);
+extern void lbcd_netdev_abort(void);
+extern void lbcd_netdev_scan(unsigned long long now);
+extern int lbcd_netdev_timeout(void);
+extern void lbcd_netdev_sample(void);
+extern void lbcd_netdev_read(struct netdev_info *);
+extern void lbcd_netdev_close(void);
+
+/* numa.c */
+extern void lbcd_numa_init(const char *dir);
+extern void lbcd_numa_invalidate(void);
+extern size_t lbcd_numa_cpus(void);
+extern void lbcd_numa_update(const struct cpustat_times *total,
+                             const struct cpustat_times *cpus, size_t count,
+                             unsigned long long now, double half_life);
+extern int lbcd_numa_read(struct numa_info *);
+extern void lbcd_numa_close(void);
+
+/* psi.c */
+extern bool lbcd_psi_parse(const char *, struct psi_info *);
+extern int lbcd_psi_read(enum psi_resource, struct psi_info *);
+extern size_t lbcd_psi_triggers(int *fds, size_t size);
+extern void lbcd_psi_event(int fd, bool error);
+extern bool lbcd_psi_stalled(void);
+extern void lbcd_psi_close(void);
+extern bool lbcd_psi_init(const char *weights);
+
+/* statparse.c */
+extern ssize_t lbcd_stat_parse(const char *, size_t,
+                               struct cpustat_times *total,
+                               struct cpustat_times *cpus, size_t ncpus);
+extern bool lbcd_stat_simd(bool enable);
 
 /* server.c */
 extern void lbcd_pack_info(struct lbcd_reply *lb, unsigned int protocol,
                            struct vector *services, int simple);
+extern size_t lbcd_pack_ext(struct lbcd_ext *ext);
 extern void lbcd_test(int argc, char *argv[]);
 
+/* usercpu.c */
+extern bool lbcd_usercpu_init(const char *spec, const char *dir);
+extern bool lbcd_usercpu_prepare(const char *spec, const char *dir);
+extern void lbcd_usercpu_commit(void);
+extern void lbcd_usercpu_abort(void);
+extern void lbcd_usercpu_scan(unsigned long long now);
+extern int lbcd_usercpu_timeout(void);
+extern void lbcd_usercpu_sample(void);
+extern void lbcd_usercpu_read(struct usercpu_info *);
+extern void lbcd_usercpu_close(void);
+
+/* upgrade.c */
+extern struct lbcd_upgrade *lbcd_upgrade_start(char *const argv[],
+                                               const int *fds,
+                                               unsigned int count);
+extern int lbcd_upgrade_fd(const struct lbcd_upgrade *);
+extern bool lbcd_upgrade_finish(struct lbcd_upgrade *);
+extern void lbcd_upgrade_abort(struct lbcd_upgrade *);
+extern bool lbcd_upgrade_receive(int **fds, unsigned int *count);
+extern bool lbcd_upgrade_ready(void);
+
 /* weight.c */
 int lbcd_default_weight(struct lbcd_reply *lb, uint32_t *weight,
                         uint32_t *incr);
 int lbcd_weight_init(const char *cmd, const char *service, int timeout);
 void lbcd_setweight(struct lbcd_reply *lb, int offset, const char *service);
+void lbcd_service_begin(void);
+void lbcd_service_weight(const char *service, uint32_t *weight, uint32_t *incr,
+                         struct lbcd_reply *lb);
+const char *lbcd_default_service_name(void);
+void lbcd_service_register(const char *service, service_func_type *,
+                           void *data, unsigned int ttl, service_free_type *);
+void *lbcd_service_data(const char *service, service_func_type *);
+void **lbcd_service_list(service_func_type *, size_t *count);
+void lbcd_service_prepare(void);
+void lbcd_service_commit(void);
+void lbcd_service_abort(void);
+void lbcd_service_clear(void);
+void lbcd_service_save(struct vector *state);
+void lbcd_service_restore(const char *service, time_t expires,
+                          uint32_t weight, uint32_t incr);
 
 /* weight.c -- generic routines */
 extern weight_func_type lbcd_rr_weight;      /* Round robin */
@@ -70,6 +479,14 @@ extern weight_func_type lbcd_unknown_weight; /* Error function */
 /* tcp.c -- arbitrary tcp port */
 extern weight_func_type lbcd_tcp_weight;
 
+/* listen.c -- listening tcp port from the kernel */
+extern weight_func_type lbcd_listen_weight;
+extern int lbcd_listen_parse(struct listen_table *, const void *buffer,
+                             size_t length);
+extern const struct listen_port *lbcd_listen_find(const struct listen_table *,
+                                                  unsigned short port);
+extern void lbcd_listen_close(void);
+
 /* load.c -- Default module */
 extern weight_func_type lbcd_load_weight;
 
@@ -102,11 +519,12 @@ extern weight_func_type lbcd_smtp_weight;
 /*
  * Extending lbcd locally
  *
- * lbcd contains a decent set of modules and extension mechanisms.  If you
- * wish to extend lbcd, it is pretty simple to write a new module and add it
- * to your local lbcd distribution.  Either as modules/local.c or as something
- * else.  Just include the prototype in lbcdload.h, the .c file in
- * Makefile.am, and the entry in weight.c.
+ * lbcd contains a decent set of modules and extension mechanisms.  The
+ * easiest way to add a local module is to build it as a plugin against the
+ * interface in server/plugin.h and load it with -M, which requires no
+ * changes to lbcd.  Alternately, add it to your local lbcd distribution as
+ * modules/local.c or as something else.  Just include the prototype here,
+ * the .c file in Makefile.am, and the entry in weight.c.
  */
 #ifdef HAVE_LOCAL
 extern weight_func_type lbcd_local_weight;
@@ -2,7 +2,7 @@
  * Include the appropriate kernel code for the local operating system.
  *
  * Written by Larry Schwimmer
- * Copyright 1996, 1997, 1998, 2000, 2008, 2009, 2012, 2013
+ * Copyright 1996, 1997, 1998, 2000, 2008, 2009, 2012, 2013, 2026
  *     The Board of Trustees of the Leland Stanford Junior University
  *
  * See LICENSE for licensing terms.
@@ -32,3 +32,20 @@
 #elif defined(__linux__) || defined(__FreeBSD_kernel__) || defined(__FreeBSD__)
 # include "arch/linux.c"
 #endif
+
+/*
+ * Fallback for systems whose kernel code can't provide the additional system
+ * information, which is then reported as zero.
+ */
+#ifndef KERNEL_HAVE_GETINFO
+# include <portable/system.h>
+
+# include <server/internal.h>
+
+int
+kernel_getinfo(struct kernel_info *info)
+{
+    memset(info, 0, sizeof(struct kernel_info));
+    return -1;
+}
+#endif
@@ -6,7 +6,7 @@
  *
  * Written by Larry Schwimmer
  * Extensively modified by Russ Allbery <eagle@eyrie.org>
- * Copyright 1996, 1997, 1998, 2005, 2006, 2008, 2012, 2013, 2014
+ * Copyright 1996, 1997, 1998, 2005, 2006, 2008, 2012, 2013, 2014, 2026
  *     The Board of Trustees of the Leland Stanford Junior University
  *
  * See LICENSE for licensing terms.
@@ -18,6 +18,7 @@
 #include <portable/system.h>
 
 #include <errno.h>
+#include <poll.h>
 #include <signal.h>
 #include <syslog.h>
 
@@ -29,38 +30,61 @@
 #include <util/vector.h>
 #include <util/xmalloc.h>
 
-/* Flag indicating whether we've received a signal asking us to exit. */
+/* Flags indicating whether we've received a signal we act on. */
 static volatile sig_atomic_t exit_signaled = 0;
+static volatile sig_atomic_t reload_signaled = 0;
+static volatile sig_atomic_t calibrate_signaled = 0;
+static volatile sig_atomic_t upgrade_signaled = 0;
 
 /* The usage message. */
 const char usage_message[] = "\
 Usage: lbcd [options] [-d] [-p <port>]\n\
+   -A <path>    receive application load reports on a socket at <path>\n\
+   -B <file>    read application load reports from shared memory in <file>\n\
    -b <addr>    bind to <addr> instead of all available addresses\n\
+   -C <file>    read settings from <file>, rereading it on SIGHUP\n\
    -c <cmd>     run <cmd> (full path) to obtain load values\n\
+   -D <def>     monitor a filesystem as path[=threshold:multiplier,...]\n\
    -d           debug mode, don't fork or log to syslog\n\
+   -E <dir>     load probe scripts from <dir>\n\
+   -F <def>     define a weight formula as name=weight[;increment]\n\
    -f           run in the foreground\n\
+   -G <cgroup>  report the resource usage of <cgroup> to weight formulas\n\
+   -H <times>   half-lives of CPU utilization averages (default 2,10,60)\n\
    -h, --help   print usage\n\
+   -I <seconds> count sessions idle for <seconds> separately (default 0)\n\
+   -K <file>    calibrate capacity, caching the score in <file>\n\
+   -L <MiB>     report the maximum weight with less memory available\n\
    -l           log various requests\n\
+   -M <dir>     load weight plugins from <dir>\n\
+   -m <def>     penalize memory pressure as threshold[:multiplier,...]\n\
+   -N           divide the load by the number of available CPUs\n\
+   -n <def>     monitor a network interface as name[=speed in Mb/s]\n\
    -P <file>    write PID to <file>\n\
    -p <port>    run using different port number\n\
    -R           round-robin polling\n\
    -S           don't adjust version two responses for custom services\n\
    -T <seconds> timeout (1-300 seconds, default 5)\n\
    -t           test mode (print stats and exit)\n\
+   -U <spec>    sample CPU time per user as interval[,threshold]\n\
+   -W <def>     define a composite service as name=expression\n\
    -w <option>  specify returned weight; options:\n\
                   either \"load:incr\" or \"service\"\n\
    --version    print protocol version and exit\n\
+   -X <device>  monitor the I/O of a block device such as sda\n\
+   -Y <coeffs>  coefficients for the psi service as metric=value,...\n\
    -Z           raise SIGSTOP once ready to answer queries\n";
 
-/* Stores configuration information for lbcd. */
-struct lbcd_config {
-    struct vector *bindaddrs;   /* Address to listen on */
-    bool log;                   /* Log each request */
-    unsigned short port;        /* Port to listen on */
-    const char *pid_file;       /* Write the daemon PID to this path */
-    struct vector *services;    /* Allowed services */
-    bool simple;                /* Do not adjust results for version 2 */
-    bool upstart;               /* Raise SIGSTOP when ready for upstart */
+/*
+ * The sources of the configuration, kept so that it can be rebuilt on
+ * SIGHUP.  Settings from the command line are applied after those from the
+ * configuration file.
+ */
+struct lbcd_options {
+    char **argv;                /* Command line, used again on upgrade */
+    const char *config_file;    /* Configuration file, if any */
+    struct vector *keys;        /* Settings from the command line */
+    struct vector *values;      /* Their values, parallel to keys */
 };
 
 /*
@@ -114,6 +138,40 @@ exit_handler(int sig UNUSED)
 }
 
 
+/*
+ * Signal handler for SIGHUP.  Set the reload_signaled global so that we
+ * reload the configuration the next time through the processing loop.
+ */
+static void
+reload_handler(int sig UNUSED)
+{
+    reload_signaled = 1;
+}
+
+
+/*
+ * Signal handler for SIGUSR1.  Set the calibrate_signaled global so that we
+ * measure the capacity of the system again the next time through the
+ * processing loop.
+ */
+static void
+calibrate_handler(int sig UNUSED)
+{
+    calibrate_signaled = 1;
+}
+
+
+/*
+ * Signal handler for SIGUSR2.  Set the upgrade_signaled global so that we
+ * start a new lbcd binary the next time through the processing loop.
+ */
+static void
+upgrade_handler(int sig UNUSED)
+{
+    upgrade_signaled = 1;
+}
+
+
 /*
  * Free the request information.
  */
@@ -298,7 +356,9 @@ handle_lb_request(struct lbcd_config *config, struct request *request,
                   socket_type fd)
 {
     struct lbcd_reply reply;
-    size_t size, unused;
+    struct lbcd_ext ext;
+    char packet[sizeof(struct lbcd_reply) + sizeof(struct lbcd_ext)];
+    size_t size, unused, ext_size;
     ssize_t result;
 
     /* Log the request. */
@@ -320,8 +380,16 @@ handle_lb_request(struct lbcd_config *config, struct request *request,
     unused = LBCD_MAX_SERVICES - request->services->count;
     size = sizeof(reply) - unused * sizeof(struct lbcd_service);
 
+    /* Extended requests get the extended fields following the reply. */
+    memcpy(packet, &reply, size);
+    if (request->operation == LBCD_OP_LBINFO_EXT) {
+        ext_size = lbcd_pack_ext(&ext);
+        memcpy(packet + size, &ext, ext_size);
+        size += ext_size;
+    }
+
     /* Send reply */
-    result = sendto(fd, &reply, size, 0, request->addr, request->addrlen);
+    result = sendto(fd, packet, size, 0, request->addr, request->addrlen);
     if (result < 0 || (size_t) result != size)
         syswarn("client %s: cannot send reply", request->source);
 }
@@ -405,27 +473,268 @@ bind_sockets(struct lbcd_config *config, socket_type **fds,
 
 
 /*
- * Set up our network connection and handle incoming requests.  This function
- * loops until we receive a signal telling us to exit, and then returns.
+ * Build the configuration from its sources.  Returns the new configuration,
+ * or NULL after reporting the problems with warn if any setting is invalid.
+ */
+static struct lbcd_config *
+config_build(const struct lbcd_options *options)
+{
+    struct lbcd_config *config;
+    size_t i;
+    bool okay = true;
+
+    config = lbcd_config_new();
+    if (options->config_file != NULL)
+        okay = lbcd_config_read(config, options->config_file);
+    for (i = 0; i < options->keys->count; i++)
+        if (!lbcd_config_set(config, options->keys->strings[i],
+                             options->values->strings[i]))
+            okay = false;
+    if (!okay) {
+        lbcd_config_free(config);
+        return NULL;
+    }
+    return config;
+}
+
+
+/*
+ * Discard the settings of the sampling modules from services_load.
  */
 static void
-handle_requests(struct lbcd_config *config)
+modules_abort(void)
+{
+    lbcd_netdev_abort();
+    lbcd_app_abort();
+    lbcd_cgroup_abort();
+    lbcd_cpustat_abort();
+    lbcd_usercpu_abort();
+    lbcd_fs_abort();
+    lbcd_memory_abort();
+    lbcd_disk_abort();
+}
+
+
+/*
+ * Load all of the services defined by a configuration and make them the
+ * ones used to answer queries.  The new services and the settings of the
+ * sampling modules are built alongside the current ones, which are only
+ * replaced once everything loads successfully.  Returns false after
+ * reporting the problem with warn otherwise, leaving the current services
+ * and settings in place.
+ */
+static bool
+services_load(struct lbcd_config *config)
 {
+    size_t i;
+
+    lbcd_service_prepare();
+
+    /* Load any probe scripts and plugins so they're available as services. */
+    if (config->probe_dir != NULL)
+        if (!lbcd_probe_init(config->probe_dir)) {
+            warn("cannot load probe scripts from %s", config->probe_dir);
+            goto fail;
+        }
+    if (config->plugin_dir != NULL)
+        if (!lbcd_plugin_init(config->plugin_dir)) {
+            warn("cannot load plugins from %s", config->plugin_dir);
+            goto fail;
+        }
+
+    /*
+     * The psi, net, and app services, which formulas and composites may also
+     * replace.
+     */
+    if (!lbcd_psi_init(config->psi_weights))
+        goto fail;
+    if (!lbcd_netdev_prepare(config->interfaces, NULL))
+        goto fail;
+    if (!lbcd_app_prepare(config->app_socket, config->app_shm))
+        goto fail;
+
+    /*
+     * Formulas and composites come last so that they can replace any other
+     * service.  Composites may refer to each other in any order, so check
+     * for loops once they're all defined.
+     */
+    for (i = 0; i < config->formulas->count; i++)
+        if (!lbcd_formula_define(config->formulas->strings[i]))
+            goto fail;
+    for (i = 0; i < config->composites->count; i++)
+        if (!lbcd_composite_define(config->composites->strings[i]))
+            goto fail;
+    if (!lbcd_composite_check())
+        goto fail;
+
+    /* The settings of the other sampling modules. */
+    if (!lbcd_cgroup_prepare(config->cgroup))
+        goto fail;
+    if (!lbcd_cpustat_prepare(config->half_lives))
+        goto fail;
+    if (!lbcd_usercpu_prepare(config->user_cpu, NULL))
+        goto fail;
+    if (!lbcd_fs_prepare(config->filesystems))
+        goto fail;
+    if (!lbcd_memory_prepare(config->memory_penalty, config->memory_floor))
+        goto fail;
+    if (!lbcd_disk_prepare(config->disks, NULL))
+        goto fail;
+
+    /*
+     * Everything loaded.  Switch over to the new services and settings.
+     * lbcd_weight_init keeps pointers into config, so it must not be called
+     * until nothing else can fail.
+     */
+    lbcd_weight_init(config->command, config->weight, config->timeout);
+    lbcd_netdev_commit();
+    lbcd_app_commit();
+    lbcd_cgroup_commit();
+    lbcd_cpustat_commit();
+    lbcd_usercpu_commit();
+    lbcd_fs_commit();
+    lbcd_memory_commit();
+    lbcd_disk_commit();
+    lbcd_load_normalize(config->normalize);
+    lbcd_users_idle_init(config->idle_time, NULL);
+    lbcd_capacity_init(config->capacity_file);
+    lbcd_numa_invalidate();
+    lbcd_service_commit();
+    return true;
+
+fail:
+    modules_abort();
+    lbcd_service_abort();
+    return false;
+}
+
+
+/*
+ * Return true if two lists of bind addresses are the same.
+ */
+static bool
+bindaddrs_equal(const struct vector *a, const struct vector *b)
+{
+    size_t i;
+
+    if (a->count != b->count)
+        return false;
+    for (i = 0; i < a->count; i++)
+        if (strcmp(a->strings[i], b->strings[i]) != 0)
+            return false;
+    return true;
+}
+
+
+/*
+ * Reload the configuration in response to SIGHUP.  The new configuration is
+ * built and its services are loaded while the old configuration stays in
+ * effect, and it only replaces the old one if all of that succeeds.  The
+ * bound sockets are kept, so changes to the bind addresses or port, the PID
+ * file, or upstart support require a restart.
+ */
+static void
+reload(struct lbcd_config **config, const struct lbcd_options *options)
+{
+    struct lbcd_config *old = *config;
+    struct lbcd_config *new;
+    struct vector *bindaddrs;
+    char *pid_file;
+
+    notice("reloading configuration");
+    lbcd_cpus_invalidate();
+    new = config_build(options);
+    if (new == NULL) {
+        warn("invalid configuration, keeping previous configuration");
+        return;
+    }
+    if (!services_load(new)) {
+        warn("cannot load services, keeping previous configuration");
+        lbcd_config_free(new);
+        return;
+    }
+
+    /* Carry over the settings that can't change without a restart. */
+    if (new->port != old->port
+        || !bindaddrs_equal(new->bindaddrs, old->bindaddrs))
+        warn("bind address or port changed, restart lbcd to apply");
+    new->port = old->port;
+    new->upstart = old->upstart;
+    bindaddrs = new->bindaddrs;
+    new->bindaddrs = old->bindaddrs;
+    old->bindaddrs = bindaddrs;
+    pid_file = new->pid_file;
+    new->pid_file = old->pid_file;
+    old->pid_file = pid_file;
+    lbcd_config_free(old);
+    *config = new;
+    notice("configuration reloaded");
+}
+
+
+/*
+ * Take any samples that are due and return the number of milliseconds until
+ * the next one, or -1 if there are none.
+ */
+static int
+sample(void)
+{
+    int timeout[4];
+    int result = -1;
+    size_t i;
+
+    lbcd_cpustat_sample();
+    lbcd_usercpu_sample();
+    lbcd_netdev_sample();
+    lbcd_disk_sample();
+    timeout[0] = lbcd_cpustat_timeout();
+    timeout[1] = lbcd_usercpu_timeout();
+    timeout[2] = lbcd_netdev_timeout();
+    timeout[3] = lbcd_disk_timeout();
+    for (i = 0; i < ARRAY_SIZE(timeout); i++)
+        if (timeout[i] >= 0 && (result < 0 || timeout[i] < result))
+            result = timeout[i];
+    return result;
+}
+
+
+/*
+ * Handle incoming requests on the bound sockets.  This function loops until
+ * we receive a signal telling us to exit or a new lbcd binary has taken over
+ * the sockets, and then returns.  The configuration is replaced if it is
+ * reloaded.
+ */
+static void
+handle_requests(struct lbcd_config **configp,
+                const struct lbcd_options *options, socket_type *fds,
+                unsigned int count)
+{
+    struct lbcd_config *config = *configp;
+    struct lbcd_upgrade *upgrade = NULL;
+    bool handed_off = false;
     int status;
-    socket_type *fds;
-    unsigned int count, i;
+    struct pollfd *waitfds;
+    int triggers[PSI_RESOURCE_COUNT];
+    size_t ntriggers, nwait;
+    int ready;
+    size_t i;
     FILE *pid;
     struct sigaction sa;
 
     /*
-     * Ignore SIGHUP.  This is used to tell a daemon to reload its
-     * configuration and we have no configuration, so ignoring it seems to
-     * make the most sense.
+     * Reload the configuration on SIGHUP, calibrate capacity on SIGUSR1, and
+     * upgrade on SIGUSR2.
      */
     memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = SIG_IGN;
+    sa.sa_handler = reload_handler;
     if (sigaction(SIGHUP, &sa, NULL) < 0)
         syswarn("cannot set SIGHUP handler");
+    sa.sa_handler = calibrate_handler;
+    if (sigaction(SIGUSR1, &sa, NULL) < 0)
+        syswarn("cannot set SIGUSR1 handler");
+    sa.sa_handler = upgrade_handler;
+    if (sigaction(SIGUSR2, &sa, NULL) < 0)
+        syswarn("cannot set SIGUSR2 handler");
 
     /* Set up exit handlers for signals that call for a clean shutdown. */
     sa.sa_handler = exit_handler;
@@ -434,8 +743,33 @@ handle_requests(struct lbcd_config *config)
     if (sigaction(SIGTERM, &sa, NULL) < 0)
         syswarn("cannot set SIGTERM handler");
 
-    /* Open listening sockets. */
-    bind_sockets(config, &fds, &count);
+    /*
+     * While an upgrade is in progress, we also wait for the new process to
+     * report that it's ready.  Its socket goes first so that it's noticed
+     * even if we're busy.  It's followed by the socket for CPU hotplug
+     * events, if any, the socket for application reports, if any, the pipe
+     * from a capacity calibration in progress, if any, any pressure
+     * triggers, and then our bound sockets.
+     */
+    ntriggers = lbcd_psi_triggers(triggers, ARRAY_SIZE(triggers));
+    nwait = 4 + ntriggers + count;
+    waitfds = xcalloc(nwait, sizeof(struct pollfd));
+    waitfds[0].fd = -1;
+    waitfds[0].events = POLLIN;
+    waitfds[1].fd = lbcd_cpus_watch();
+    waitfds[1].events = POLLIN;
+    waitfds[2].fd = lbcd_app_open();
+    waitfds[2].events = POLLIN;
+    waitfds[3].fd = -1;
+    waitfds[3].events = POLLIN;
+    for (i = 0; i < ntriggers; i++) {
+        waitfds[i + 4].fd = triggers[i];
+        waitfds[i + 4].events = POLLPRI;
+    }
+    for (i = 0; i < count; i++) {
+        waitfds[i + 4 + ntriggers].fd = fds[i];
+        waitfds[i + 4 + ntriggers].events = POLLIN;
+    }
 
     /* Indicate to the world that we're ready to answer requests. */
     if (config->pid_file != NULL) {
@@ -449,13 +783,20 @@ handle_requests(struct lbcd_config *config)
     }
     notice("ready to accept requests");
 
-    /* Indicate to systemd that we're ready to answer requests. */
-    status = sd_notify(true, "READY=1");
+    /*
+     * Indicate to systemd that we're ready to answer requests.  Leave the
+     * notification socket in the environment so that a new lbcd started for
+     * an upgrade can use it.
+     */
+    status = sd_notify(false, "READY=1");
     if (status < 0)
         warn("cannot notify systemd of startup: %s", strerror(-status));
 
-    /* Indicate to upstart that we're ready to answer requests. */
-    if (config->upstart)
+    /*
+     * Let the old lbcd know we're ready if this is an upgrade, and otherwise
+     * indicate to upstart that we're ready to answer requests.
+     */
+    if (!lbcd_upgrade_ready() && config->upstart)
         if (raise(SIGSTOP) < 0)
             syswarn("cannot notify upstart of startup");
 
@@ -470,17 +811,100 @@ handle_requests(struct lbcd_config *config)
             break;
         }
 
+        /* If a reload was signaled, rebuild the configuration. */
+        if (reload_signaled) {
+            reload_signaled = 0;
+            reload(configp, options);
+            config = *configp;
+            waitfds[2].fd = lbcd_app_open();
+        }
+
         /*
-         * Wait for an incoming message to one of our bound sockets.  If we
-         * get a signal, restart at the beginning of the loop, which will
-         * then break out of the loop if we were signaled to exit.
+         * If calibration was signaled, run the benchmark again in a child
+         * process so that we can keep answering queries.
          */
-        fd = network_wait_any(fds, count);
-        if (fd == INVALID_SOCKET) {
+        if (calibrate_signaled) {
+            calibrate_signaled = 0;
+            waitfds[3].fd = lbcd_capacity_start();
+        }
+
+        /* If an upgrade was signaled, start the new binary. */
+        if (upgrade_signaled) {
+            upgrade_signaled = 0;
+            if (upgrade != NULL)
+                warn("upgrade already in progress");
+            else {
+                upgrade = lbcd_upgrade_start(options->argv, fds, count);
+                if (upgrade != NULL)
+                    waitfds[0].fd = lbcd_upgrade_fd(upgrade);
+            }
+        }
+
+        /*
+         * Wait for an incoming message to one of our bound sockets, waking
+         * up in time to sample CPU utilization and the CPU time of each
+         * user.  If we get a signal, restart at the beginning of the loop,
+         * which will then break out of the loop if we were signaled to exit.
+         */
+        ready = poll(waitfds, nwait, sample());
+        if (ready < 0) {
             if (errno != EINTR)
                 sysdie("cannot wait for incoming connections");
             continue;
         }
+        if (ready == 0)
+            continue;
+
+        /*
+         * The new process has either taken over or failed.  We've finished
+         * any requests we were handling, so if it took over, we're done.
+         */
+        if (upgrade != NULL && waitfds[0].revents != 0) {
+            handed_off = lbcd_upgrade_finish(upgrade);
+            upgrade = NULL;
+            waitfds[0].fd = -1;
+            if (handed_off)
+                break;
+            continue;
+        }
+
+        /* Note any CPUs added or removed. */
+        if (waitfds[1].revents != 0)
+            lbcd_cpus_event();
+
+        /* Apply any reports from applications. */
+        if (waitfds[2].revents != 0)
+            lbcd_app_event();
+
+        /* Use the new capacity score once calibration finishes. */
+        if (waitfds[3].revents != 0) {
+            lbcd_capacity_event();
+            waitfds[3].fd = -1;
+        }
+
+        /*
+         * Note any pressure stalls.  A trigger that reports an error is
+         * closed, and poll ignores negative file descriptors.
+         */
+        for (i = 4; i < 4 + ntriggers; i++) {
+            if (waitfds[i].revents == 0)
+                continue;
+            if (waitfds[i].revents & POLLERR) {
+                lbcd_psi_event(waitfds[i].fd, true);
+                waitfds[i].fd = -1;
+            } else
+                lbcd_psi_event(waitfds[i].fd, false);
+        }
+
+        /* Find a socket with a waiting message, if any. */
+        fd = INVALID_SOCKET;
+        for (i = 4 + ntriggers; i < nwait; i++)
+            if (waitfds[i].revents != 0) {
+                fd = waitfds[i].fd;
+                break;
+            }
+        if (fd == INVALID_SOCKET)
+            continue;
 
         /* Accept and process the message. */
         request = request_recv(config, fd);
@@ -488,6 +912,7 @@ handle_requests(struct lbcd_config *config)
             continue;
         switch (request->operation) {
         case LBCD_OP_LBINFO:
+        case LBCD_OP_LBINFO_EXT:
             handle_lb_request(config, request, fd);
             break;
         default:
@@ -499,12 +924,19 @@ handle_requests(struct lbcd_config *config)
         request_free(request);
     }
 
-    /* Signaled to exit.  Free our resources and remove our PID file. */
-    if (config->pid_file != NULL)
+    /*
+     * Free our resources and remove our PID file, unless a new lbcd has
+     * taken over, in which case the PID file is now its.  If we exit during
+     * an upgrade, stop the new process as well.
+     */
+    if (config->pid_file != NULL && !handed_off)
         unlink(config->pid_file);
+    if (upgrade != NULL)
+        lbcd_upgrade_abort(upgrade);
     for (i = 0; i < count; i++)
         close(fds[i]);
     free(fds);
+    free(waitfds);
 }
 
 
@@ -515,13 +947,15 @@ handle_requests(struct lbcd_config *config)
 int
 main(int argc, char **argv)
 {
-    struct lbcd_config config;
+    struct lbcd_config *config;
+    struct lbcd_options options;
+    const char *key;
+    socket_type *fds = NULL;
+    unsigned int count = 0;
+    bool upgrading;
     int debugging = 0;
     int testmode = 0;
     int foreground = 0;
-    char *lbcd_helper = NULL;
-    const char *service_weight = NULL;
-    int service_timeout = LBCD_TIMEOUT;
     int c;
 
     /* Establish identity. */
@@ -540,26 +974,23 @@ main(int argc, char **argv)
             }
         }
 
-    /* Initialize options. */
-    memset(&config, 0, sizeof(config));
-    config.bindaddrs = vector_new();
-    config.port = LBCD_PORTNUM;
-    config.services = vector_new();
-
-    /* Parse the regular command-line options. */
+    /*
+     * Parse the regular command-line options.  Options that correspond to
+     * settings are saved and applied after the configuration file, both now
+     * and when the configuration is reloaded.
+     */
+    memset(&options, 0, sizeof(options));
+    options.argv = argv;
+    options.keys = vector_new();
+    options.values = vector_new();
     opterr = 1;
-    while ((c = getopt(argc, argv, "a:b:c:dfhlP:p:RStT:w:Z")) != EOF) {
+    while ((c = getopt(argc, argv,
+                       "A:a:B:b:C:c:D:dE:F:fG:H:hI:K:L:lM:m:Nn:"
+                       "P:p:RStT:U:W:w:X:Y:Z"))
+           != EOF) {
         switch (c) {
-        case 'a': /* allowed service */
-            vector_add(config.services, optarg);
-            break;
-        case 'b': /* bind address */
-            vector_add(config.bindaddrs, optarg);
-            break;
-        case 'c': /* helper command -- must be full path to command */
-            lbcd_helper = optarg;
-            if (access(lbcd_helper, X_OK) != 0)
-                sysdie("cannot access %s", optarg);
+        case 'C': /* configuration file */
+            options.config_file = optarg;
             break;
         case 'd': /* debugging mode */
             debugging = 1;
@@ -571,57 +1002,44 @@ main(int argc, char **argv)
         case 'h': /* usage */
             usage(0);
             break;
-        case 'l': /* log requests */
-            config.log = true;
-            break;
-        case 'P': /* pid file */
-            config.pid_file = optarg;
-            break;
-        case 'p': /* port number */
-            config.port = atoi(optarg);
-            break;
-        case 'R': /* round-robin */
-            service_weight = "rr";
-            break;
-        case 'S': /* simple, no version two adjustments */
-            config.simple = true;
-            break;
         case 't': /* test mode */
             testmode = 1;
             break;
-        case 'T': /* timeout */
-            service_timeout = atoi(optarg);
-            if (service_timeout < 1 || service_timeout > 300)
-                die("timeout (%d) must be between 1 and 300 seconds",
-                    service_timeout);
-            break;
-        case 'w': /* weight or service */
-            service_weight = optarg;
-            vector_add(config.services, optarg);
-            break;
-        case 'Z': /* raise(SIGSTOP) when ready for connections */
-            config.upstart = true;
-            break;
-        default:
-            usage(1);
+        default: /* a setting, handled by lbcd_config_set */
+            key = lbcd_config_key(c);
+            if (key == NULL)
+                usage(1);
+            vector_add(options.keys, key);
+            vector_add(options.values, optarg != NULL ? optarg : "true");
             break;
         }
     }
 
-    /* Initialize default load handler. */
-    if (lbcd_weight_init(lbcd_helper, service_weight, service_timeout) != 0)
-        die("cannot initialize service handler");
+    /* Build the configuration and load the services it defines. */
+    config = config_build(&options);
+    if (config == NULL)
+        die("invalid configuration");
+    if (!services_load(config))
+        die("cannot load services");
 
     /* If testing, print default output and terminate */
     if (testmode)
         lbcd_test(argc - optind, argv + optind);
 
     /*
-     * Background ourself unless running in the foreground.  Do not chdir in
+     * If we were started by another lbcd to replace it, take over its sockets
+     * and state.  This has to happen after the services are loaded so that
+     * the state can be matched with them.
+     */
+    upgrading = lbcd_upgrade_receive(&fds, &count);
+
+    /*
+     * Background ourself unless running in the foreground or replacing
+     * another lbcd, which will have already done so.  Do not chdir in
      * case we're running external probe programs that care about the current
      * working directory (although that's inadvisable).
      */
-    if (!foreground)
+    if (!foreground && !upgrading)
         if (daemon(1, 0) < 0)
             sysdie("cannot daemonize");
 
@@ -633,8 +1051,12 @@ main(int argc, char **argv)
         message_handlers_die(1, message_log_syslog_err);
     }
 
+    /* Open listening sockets unless we got them from another lbcd. */
+    if (!upgrading)
+        bind_sockets(config, &fds, &count);
+
     /* Become a daemon.  handle_requests only returns when signaled. */
-    handle_requests(&config);
+    handle_requests(&config, &options, fds, count);
 
     /*
      * Free resources.  This really isn't necessary, but it means that we can
@@ -642,7 +1064,24 @@ main(int argc, char **argv)
      * sure that we've caught all leaks, since sometimes reachable memory is
      * actually a leak.
      */
-    vector_free(config.bindaddrs);
-    vector_free(config.services);
+    lbcd_service_clear();
+    lbcd_psi_close();
+    lbcd_capacity_close();
+    lbcd_cgroup_close();
+    lbcd_cpus_close();
+    lbcd_capacity_init(NULL);
+    lbcd_cpustat_close();
+    lbcd_usercpu_close();
+    lbcd_numa_close();
+    lbcd_fs_close();
+    lbcd_memory_close();
+    lbcd_netdev_close();
+    lbcd_disk_close();
+    lbcd_listen_close();
+    lbcd_app_close();
+    lbcd_users_close();
+    lbcd_config_free(config);
+    vector_free(options.keys);
+    vector_free(options.values);
     return 0;
 }
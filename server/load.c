@@ -2,11 +2,15 @@
  * Default load computation module.
  *
  * This factors in current load, total users, unique users, and how full /tmp
- * is.  It also penalizes systems with /etc/nologin set.  It is suitable for
- * balancing a multiuser compute server.
+ * and any other monitored filesystems are, and, if configured, how short of
+ * memory the system is.  It also penalizes systems with /etc/nologin set or
+ * less memory available than the configured floor.  It is suitable for
+ * balancing a multiuser compute server.  If idle detection is enabled, idle
+ * users and sessions count for less than active ones, since they rarely use
+ * the system.
  *
  * Written by Larry Schwimmer
- * Copyright 1998, 2008, 2012
+ * Copyright 1998, 2008, 2012, 2026
  *     The Board of Trustees of the Leland Stanford Junior University
  *
  * See LICENSE for licensing terms.
@@ -17,55 +21,112 @@
 #include <portable/system.h>
 
 #include <server/internal.h>
+#include <server/metrics.h>
 #include <util/macros.h>
 
-#ifndef MAX
-# define MAX(a,b) (((a) > (b)) ? (a) : (b))
-#endif
+/*
+ * The weight of each active user and each additional active session, and the
+ * same for users all of whose sessions are idle and for additional idle
+ * sessions.
+ */
+#define WEIGHT_USER         100
+#define WEIGHT_SESSION      20
+#define WEIGHT_IDLE_USER    25
+#define WEIGHT_IDLE_SESSION 5
+
+/*
+ * The largest weight the penalties can produce.  The maximum weight means
+ * that the system is down, so a system that is merely very busy stops just
+ * short of it.
+ */
+#define WEIGHT_MAX (UINT32_MAX - 1)
+
+/* Whether to use the load per CPU rather than the raw load. */
+static bool normalize = false;
+
+
+/*
+ * Set whether the load service uses the load per CPU, so that hosts with
+ * different numbers of CPUs can be compared.
+ */
+void
+lbcd_load_normalize(bool flag)
+{
+    normalize = flag;
+}
+
+
+/*
+ * Multiply a weight no larger than WEIGHT_MAX by a penalty multiplier, which
+ * is at most a million, saturating at WEIGHT_MAX.
+ */
+static uint64_t
+penalize(uint64_t weight, double penalty)
+{
+    weight *= (uint64_t) penalty;
+    return (weight > WEIGHT_MAX) ? WEIGHT_MAX : weight;
+}
 
-/* Multiplier penalty for nearly full tmp directory. */
-static int penalty[] = {
-    2, 2, 2, 2,                 /* 90-93% */
-    4, 4, 4,                    /* 94-96% */
-    8, 8,                       /* 97-98% */
-    16,                         /* 99% */
-    32                          /* 100% */
-};
 
 /*
  * Determine the weight for the node and store it in weight_val.  Always use
- * an increment of 100.
+ * an increment of 200.
  *
  * Since this deals with the raw struct lbcd_reply packet, it must convert
  * from network to host order and is thus dependent on the data types in
  * protcol.h.  A more elegant approach would be desirable; it might not be so
- * bad just to call the kernel routines twice.
+ * bad just to call the kernel routines twice.  Sites that want a different
+ * calculation can define one with a weight formula (see formula.c) instead.
  */
 int
 lbcd_load_weight(uint32_t *weight_val, uint32_t *incr_val, int timeout UNUSED,
                  const char *portarg UNUSED, struct lbcd_reply *lb)
 {
-    int fudge, weight;
-    int tmp_used;
-
-    fudge = (ntohs(lb->tot_users) - ntohs(lb->uniq_users)) * 20;
-    weight = (ntohs(lb->uniq_users) * 100) + (3 * ntohs(lb->l1)) + fudge;
-
-    /* Heavy penalty for a full /tmp partition. */
-    tmp_used = MAX(lb->tmp_full, lb->tmpdir_full);
-    if (tmp_used >= 90) {
-        if (tmp_used > 100)
-            weight = (uint32_t) -1;
-        else
-            weight *= penalty[tmp_used - 90];
-    }
-
-    /* Do not hand out if /etc/nologin exists. */
-    if (access("/etc/nologin", F_OK) == 0)
-        weight = (uint32_t) -1;
-
-    /* Return weight and increment. */
-    *weight_val = weight;
+    const struct lbcd_metrics *metrics;
+    int base, load, users, sessions, idle_users, idle_sessions;
+    uint64_t weight;
+
+    /* The metrics snapshot has already been updated from this reply. */
+    metrics = lbcd_metrics_get();
+    if (normalize)
+        load = (int) metrics->value[METRIC_NL1];
+    else
+        load = ntohs(lb->l1);
+
+    /*
+     * Users with an active session and additional sessions beyond the first
+     * of each user, split into active and idle.  Without idle detection, the
+     * idle counts are zero.
+     */
+    idle_users = (int) metrics->value[METRIC_UNIQ_IDLE];
+    idle_sessions = (int) metrics->value[METRIC_IDLE] - idle_users;
+    users = ntohs(lb->uniq_users) - idle_users;
+    sessions = ntohs(lb->tot_users) - ntohs(lb->uniq_users) - idle_sessions;
+    base = users * WEIGHT_USER + sessions * WEIGHT_SESSION
+        + idle_users * WEIGHT_IDLE_USER + idle_sessions * WEIGHT_IDLE_SESSION
+        + 3 * load;
+    weight = (base > 0) ? (uint64_t) base : 0;
+
+    /*
+     * Heavy penalty for a full /tmp or other monitored filesystem, which can
+     * be as large as a million, so saturate rather than overflow.
+     */
+    weight = penalize(weight, metrics->value[METRIC_TMP_PENALTY]);
+
+    /*
+     * Penalty for memory pressure, which is 1 unless configured but can be
+     * just as large, so it saturates the same way.
+     */
+    weight = penalize(weight, metrics->value[METRIC_MEM_PENALTY]);
+
+    /* Do not hand out if /etc/nologin exists or memory is too low. */
+    if (access("/etc/nologin", F_OK) == 0
+        || metrics->value[METRIC_MEM_LOW] > 0)
+        weight = UINT32_MAX;
+
+    /* Return weight and increment, scaled by the capacity of the system. */
+    *weight_val = (uint32_t) weight;
     *incr_val = 200;
-    return weight;
+    lbcd_capacity_scale(weight_val, incr_val);
+    return (int) *weight_val;
 }
@@ -0,0 +1,179 @@
+/*
+ * Ask systemd-logind whether a session is idle.
+ *
+ * Sessions without a terminal device, such as graphical logins, have no
+ * access time to show when they were last used.  systemd-logind tracks
+ * idleness for these sessions itself, so we find the session of the process
+ * that logged in and read its idle hints over D-Bus.  Without sd-bus, this
+ * always reports that nothing is known.
+ *
+ * This is called while answering a query, so each call to logind is given a
+ * short timeout, and if logind doesn't answer in time, we stop asking it for
+ * a while rather than delay every reply.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <time.h>
+#if defined(HAVE_SYSTEMD_SD_BUS_H) && defined(HAVE_SD_BUS_OPEN_SYSTEM)
+# define LBCD_LOGIND 1
+# include <systemd/sd-bus.h>
+#endif
+
+#include <server/internal.h>
+#include <util/macros.h>
+#include <util/messages.h>
+
+#ifdef LBCD_LOGIND
+
+/* The names of systemd-logind on the bus. */
+#define LOGIND_SERVICE   "org.freedesktop.login1"
+#define LOGIND_PATH      "/org/freedesktop/login1"
+#define LOGIND_MANAGER   "org.freedesktop.login1.Manager"
+#define LOGIND_SESSION   "org.freedesktop.login1.Session"
+
+/* How long to wait for an answer from logind, in microseconds. */
+#define LOGIND_TIMEOUT 200000
+
+/* How long to stop asking logind after it doesn't answer, in seconds. */
+#define LOGIND_BACKOFF 60
+
+/* The connection to the system bus, opened on first use. */
+static sd_bus *bus = NULL;
+
+/* Whether the bus couldn't be opened, so that we only warn once. */
+static bool bus_failed = false;
+
+/* When to start asking logind again after a timeout, or 0 to ask now. */
+static time_t bus_retry = 0;
+
+
+/*
+ * Open the connection to the system bus if necessary, returning false if
+ * that fails.
+ */
+static bool
+bus_open(void)
+{
+    int status;
+
+    if (bus != NULL)
+        return true;
+    if (bus_failed)
+        return false;
+    status = sd_bus_open_system(&bus);
+    if (status < 0) {
+        warn("cannot connect to the system bus: %s", strerror(-status));
+        bus_failed = true;
+        bus = NULL;
+        return false;
+    }
+#ifdef HAVE_SD_BUS_SET_METHOD_CALL_TIMEOUT
+    sd_bus_set_method_call_timeout(bus, LOGIND_TIMEOUT);
+#endif
+    return true;
+}
+
+
+/*
+ * Find when the session containing the given process was last active.  If
+ * logind doesn't consider it idle, that's now.  Returns false if the
+ * process has no session or logind can't be asked, including for
+ * LOGIND_BACKOFF seconds after it doesn't answer in time.
+ */
+bool
+lbcd_logind_active(pid_t pid, time_t *active)
+{
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    const char *session;
+    int idle, status;
+    uint64_t since;
+    time_t now;
+    bool okay = false;
+
+    now = time(NULL);
+    if (bus_retry != 0 && now < bus_retry)
+        return false;
+    bus_retry = 0;
+    if (!bus_open())
+        return false;
+    status = sd_bus_call_method(bus, LOGIND_SERVICE, LOGIND_PATH,
+                                LOGIND_MANAGER, "GetSessionByPID", &error,
+                                &reply, "u", (uint32_t) pid);
+    if (status < 0)
+        goto done;
+    if (sd_bus_message_read(reply, "o", &session) < 0)
+        goto done;
+    status = sd_bus_get_property_trivial(bus, LOGIND_SERVICE, session,
+                                         LOGIND_SESSION, "IdleHint", &error,
+                                         'b', &idle);
+    if (status < 0)
+        goto done;
+    if (!idle) {
+        *active = now;
+        okay = true;
+        goto done;
+    }
+    status = sd_bus_get_property_trivial(bus, LOGIND_SERVICE, session,
+                                         LOGIND_SESSION, "IdleSinceHint",
+                                         &error, 't', &since);
+    if (status < 0)
+        goto done;
+    *active = (time_t) (since / 1000000);
+    okay = true;
+
+done:
+    if (status == -ETIMEDOUT) {
+        warn("systemd-logind did not answer, not asking for %d seconds",
+             LOGIND_BACKOFF);
+        bus_retry = now + LOGIND_BACKOFF;
+    }
+    sd_bus_message_unref(reply);
+    sd_bus_error_free(&error);
+    return okay;
+}
+
+
+/*
+ * Close the connection to the system bus.
+ */
+void
+lbcd_logind_close(void)
+{
+    if (bus != NULL)
+        sd_bus_flush_close_unref(bus);
+    bus = NULL;
+    bus_failed = false;
+    bus_retry = 0;
+}
+
+#else /* !LBCD_LOGIND */
+
+/*
+ * Without sd-bus, we never know when a session was last active.
+ */
+bool
+lbcd_logind_active(pid_t pid UNUSED, time_t *active UNUSED)
+{
+    return false;
+}
+
+
+/*
+ * Nothing to close.
+ */
+void
+lbcd_logind_close(void)
+{
+}
+
+#endif /* !LBCD_LOGIND */
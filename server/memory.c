@@ -0,0 +1,302 @@
+/*
+ * Memory and swap pressure.
+ *
+ * The load average says nothing about memory, so a host that is nearly out
+ * of memory and swapping heavily can still report a low weight and be given
+ * more users.  This reads the memory available and the swap used from
+ * /proc/meminfo and the count of major page faults from /proc/vmstat, both
+ * kept open between reads, and combines them into a pressure score from 0
+ * to 100: the percent of memory that isn't available, plus one for every
+ * MEMORY_FAULT_SCALE major faults per second, which is how heavy swapping
+ * shows up.
+ *
+ * The load service multiplies its weight by a penalty for the score, given
+ * as a threshold and a list of multipliers in the same way as the penalty
+ * for a full filesystem, and reports the maximum weight if the memory
+ * available falls below a floor.  Both are off unless configured, and the
+ * values are also available to weight formulas.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <server/internal.h>
+#include <server/penalty.h>
+#include <server/procfile.h>
+#include <server/sample.h>
+#include <util/messages.h>
+
+/* The longest /proc/meminfo and /proc/vmstat we read. */
+#define MEMORY_MEMINFO_MAX 4096
+#define MEMORY_VMSTAT_MAX  16384
+
+/* The minimum time between samples, in microseconds. */
+#define MEMORY_INTERVAL 1000000
+
+/* Major faults per second that add one to the pressure score. */
+#define MEMORY_FAULT_SCALE 10
+
+/* The files we sample. */
+static struct procfile meminfo_file = PROCFILE_INIT("/proc/meminfo");
+static struct procfile vmstat_file = PROCFILE_INIT("/proc/vmstat");
+
+/* Whether the files have been checked for, and whether they exist. */
+static bool files_checked = false;
+static bool files_available = false;
+
+/* The penalty, if any, and the floor in MiB. */
+static struct penalty penalty;
+static unsigned long floor_mib = 0;
+
+/* The same settings for a new configuration, and whether there are any. */
+static struct penalty pending_penalty;
+static unsigned long pending_floor = 0;
+static bool have_pending = false;
+
+/*
+ * The count of major faults at the start of the current rate interval and
+ * when that was, and when the last sample was taken, each 0 if none.
+ */
+static unsigned long last_faults = 0;
+static unsigned long long fault_time = 0;
+static unsigned long long last_time = 0;
+
+/* The results of the last sample. */
+static struct memory_info results;
+
+
+/*
+ * Find a line starting with the given key in a buffer and parse the number
+ * following it.  Returns false if the line isn't there.
+ */
+static bool
+find_value(const char *buffer, const char *key, unsigned long *value)
+{
+    size_t length = strlen(key);
+    const char *p;
+
+    for (p = buffer; p != NULL; p = strchr(p, '\n')) {
+        if (*p == '\n')
+            p++;
+        if (strncmp(p, key, length) == 0)
+            return procfile_fixed(p + length, 0, value) != NULL;
+    }
+    return false;
+}
+
+
+/*
+ * Parse the contents of /proc/meminfo and /proc/vmstat into a sample.
+ * Kernels before 3.14 don't report MemAvailable, so for them the free
+ * memory plus the page cache is used instead.  Returns false if the total
+ * memory can't be found.
+ */
+bool
+lbcd_memory_parse(const char *meminfo, const char *vmstat,
+                  struct memory_sample *sample)
+{
+    unsigned long buffers, cached;
+
+    memset(sample, 0, sizeof(*sample));
+    if (!find_value(meminfo, "MemTotal:", &sample->total)
+        || sample->total == 0)
+        return false;
+    if (!find_value(meminfo, "MemAvailable:", &sample->available)) {
+        find_value(meminfo, "MemFree:", &sample->available);
+        if (find_value(meminfo, "Buffers:", &buffers))
+            sample->available += buffers;
+        if (find_value(meminfo, "Cached:", &cached))
+            sample->available += cached;
+    }
+    if (sample->available > sample->total)
+        sample->available = sample->total;
+    find_value(meminfo, "SwapTotal:", &sample->swap_total);
+    find_value(meminfo, "SwapFree:", &sample->swap_free);
+    if (sample->swap_free > sample->swap_total)
+        sample->swap_free = sample->swap_total;
+    if (vmstat != NULL)
+        find_value(vmstat, "pgmajfault ", &sample->majfaults);
+    return true;
+}
+
+
+/*
+ * Compute the results from a sample taken at the given time in microseconds
+ * on the monotonic clock.  The rate of major faults is measured over at
+ * least MEMORY_INTERVAL and is zero until then.  If the count went
+ * backwards, it becomes the new baseline.
+ */
+void
+lbcd_memory_update(const struct memory_sample *sample, unsigned long long now)
+{
+    unsigned long used, faults;
+    unsigned long long elapsed;
+
+    results.available = sample->available / 1024;
+    used = (sample->total - sample->available) * 100 / sample->total;
+    results.used = used;
+    results.swap_used = 0;
+    if (sample->swap_total > 0)
+        results.swap_used = (sample->swap_total - sample->swap_free) * 100
+            / sample->swap_total;
+    if (fault_time == 0 || now <= fault_time
+        || sample->majfaults < last_faults) {
+        last_faults = sample->majfaults;
+        fault_time = now;
+        results.majfaults = 0;
+    } else if (now - fault_time >= MEMORY_INTERVAL) {
+        elapsed = now - fault_time;
+        faults = sample->majfaults - last_faults;
+        results.majfaults
+            = (unsigned long) ((double) faults * 1000000 / elapsed + 0.5);
+        last_faults = sample->majfaults;
+        fault_time = now;
+    }
+    results.pressure = used + results.majfaults / MEMORY_FAULT_SCALE;
+    if (results.pressure > 100)
+        results.pressure = 100;
+    results.penalty = penalty_get(&penalty, results.pressure);
+    results.low = (results.available < floor_mib);
+    last_time = now;
+}
+
+
+/*
+ * Take a sample if one is due.  A kernel without /proc/meminfo is not an
+ * error worth reporting, so if it doesn't exist the first time we look, we
+ * quietly give up on it.  /proc/vmstat is optional.
+ */
+void
+lbcd_memory_sample(void)
+{
+    char meminfo[MEMORY_MEMINFO_MAX];
+    static char vmstat[MEMORY_VMSTAT_MAX];
+    struct memory_sample sample;
+    unsigned long long now;
+    bool have_vmstat;
+
+    if (!files_checked) {
+        files_available = (access(meminfo_file.path, R_OK) == 0);
+        files_checked = true;
+    }
+    if (!files_available)
+        return;
+    now = sample_now();
+    if (last_time != 0 && now - last_time < MEMORY_INTERVAL)
+        return;
+    if (procfile_read(&meminfo_file, meminfo, sizeof(meminfo)) < 0)
+        return;
+    have_vmstat = (procfile_read(&vmstat_file, vmstat, sizeof(vmstat)) >= 0);
+    if (!lbcd_memory_parse(meminfo, have_vmstat ? vmstat : NULL, &sample)) {
+        warn("cannot parse %s", meminfo_file.path);
+        return;
+    }
+    lbcd_memory_update(&sample, now);
+}
+
+
+/*
+ * Store the memory pressure as of the last sample in info.  Without memory
+ * information, everything is zero and the penalty is 1.
+ */
+void
+lbcd_memory_read(struct memory_info *info)
+{
+    *info = results;
+    if (info->penalty == 0)
+        info->penalty = 1;
+}
+
+
+/*
+ * Parse the penalty for memory pressure from a specification of the form
+ * threshold[:list], where list is a comma-separated list of multipliers, or
+ * NULL to turn it off, along with the floor below which the load service
+ * reports the maximum weight in MiB, or 0 for none, and keep them to be used
+ * once lbcd_memory_commit is called.  Without a list, the same multipliers
+ * as for a full filesystem are used.  Returns false after reporting the
+ * problem with warn if the specification is invalid.
+ */
+bool
+lbcd_memory_prepare(const char *spec, unsigned long floor)
+{
+    lbcd_memory_abort();
+    if (spec != NULL && !penalty_parse(spec, &pending_penalty)) {
+        warn("invalid memory penalty %s (expected threshold:multiplier,...)",
+             spec);
+        return false;
+    }
+    pending_floor = floor;
+    have_pending = true;
+    return true;
+}
+
+
+/*
+ * Switch to the settings from lbcd_memory_prepare, applying them to the
+ * last sample.
+ */
+void
+lbcd_memory_commit(void)
+{
+    if (!have_pending)
+        return;
+    penalty_free(&penalty);
+    penalty = pending_penalty;
+    floor_mib = pending_floor;
+    memset(&pending_penalty, 0, sizeof(pending_penalty));
+    have_pending = false;
+    results.penalty = penalty_get(&penalty, results.pressure);
+    results.low = (last_time != 0 && results.available < floor_mib);
+}
+
+
+/*
+ * Discard the settings from lbcd_memory_prepare.
+ */
+void
+lbcd_memory_abort(void)
+{
+    penalty_free(&pending_penalty);
+    have_pending = false;
+}
+
+
+/*
+ * Set the penalty and floor immediately, as with lbcd_memory_prepare.
+ * Returns false after reporting the problem with warn if the specification
+ * is invalid, in which case nothing is changed.
+ */
+bool
+lbcd_memory_init(const char *spec, unsigned long floor)
+{
+    if (!lbcd_memory_prepare(spec, floor))
+        return false;
+    lbcd_memory_commit();
+    return true;
+}
+
+
+/*
+ * Close the files and forget all samples and settings.
+ */
+void
+lbcd_memory_close(void)
+{
+    lbcd_memory_abort();
+    procfile_close(&meminfo_file);
+    procfile_close(&vmstat_file);
+    files_checked = false;
+    penalty_free(&penalty);
+    floor_mib = 0;
+    last_faults = 0;
+    fault_time = 0;
+    last_time = 0;
+    memset(&results, 0, sizeof(results));
+}
@@ -0,0 +1,315 @@
+/*
+ * Snapshot of system metrics available to weight computations.
+ *
+ * The snapshot is refreshed once per reply, after the system information in
+ * the reply has been gathered and before any weights are computed, so every
+ * weight in one reply sees the same values.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <server/internal.h>
+#include <server/metrics.h>
+#include <util/macros.h>
+
+/* Names and types of the metrics, in the same order as enum lbcd_metric. */
+static const struct {
+    const char *name;
+    enum lbcd_metric_type type;
+} metric_table[METRIC_COUNT] = {
+    { "l1",                METRIC_NUMBER  },
+    { "l5",                METRIC_NUMBER  },
+    { "l15",               METRIC_NUMBER  },
+    { "cpus",              METRIC_NUMBER  },
+    { "nl1",               METRIC_NUMBER  },
+    { "nl5",               METRIC_NUMBER  },
+    { "nl15",              METRIC_NUMBER  },
+    { "capacity",          METRIC_NUMBER  },
+    { "tot",               METRIC_NUMBER  },
+    { "uniq",              METRIC_NUMBER  },
+    { "idle",              METRIC_NUMBER  },
+    { "uniq_idle",         METRIC_NUMBER  },
+    { "console",           METRIC_BOOLEAN },
+    { "tmp_full",          METRIC_NUMBER  },
+    { "tmpdir_full",       METRIC_NUMBER  },
+    { "tmp_penalty",       METRIC_NUMBER  },
+    { "tmp_inodes",        METRIC_NUMBER  },
+    { "tmpdir_inodes",     METRIC_NUMBER  },
+    { "fs_full",           METRIC_NUMBER  },
+    { "fs_inodes",         METRIC_NUMBER  },
+    { "nologin",           METRIC_BOOLEAN },
+    { "boot_time",         METRIC_NUMBER  },
+    { "current_time",      METRIC_NUMBER  },
+    { "user_mtime",        METRIC_NUMBER  },
+    { "procs",             METRIC_NUMBER  },
+    { "mem_total",         METRIC_NUMBER  },
+    { "mem_free",          METRIC_NUMBER  },
+    { "swap_total",        METRIC_NUMBER  },
+    { "swap_free",         METRIC_NUMBER  },
+    { "mem_available",     METRIC_NUMBER  },
+    { "mem_used",          METRIC_NUMBER  },
+    { "swap_used",         METRIC_NUMBER  },
+    { "mem_majfaults",     METRIC_NUMBER  },
+    { "mem_pressure",      METRIC_NUMBER  },
+    { "mem_penalty",       METRIC_NUMBER  },
+    { "mem_low",           METRIC_BOOLEAN },
+    { "net_rx",            METRIC_NUMBER  },
+    { "net_tx",            METRIC_NUMBER  },
+    { "net_util",          METRIC_NUMBER  },
+    { "net_errors",        METRIC_NUMBER  },
+    { "tcp_retrans",       METRIC_NUMBER  },
+    { "disk_util",         METRIC_NUMBER  },
+    { "disk_queue",        METRIC_NUMBER  },
+    { "disk_await",        METRIC_NUMBER  },
+    { "cpu_util_fast",     METRIC_NUMBER  },
+    { "cpu_util_mid",      METRIC_NUMBER  },
+    { "cpu_util_slow",     METRIC_NUMBER  },
+    { "cpu_iowait_fast",   METRIC_NUMBER  },
+    { "cpu_iowait_mid",    METRIC_NUMBER  },
+    { "cpu_iowait_slow",   METRIC_NUMBER  },
+    { "cpu_steal_fast",    METRIC_NUMBER  },
+    { "cpu_steal_mid",     METRIC_NUMBER  },
+    { "cpu_steal_slow",    METRIC_NUMBER  },
+    { "cpu_softirq_fast",  METRIC_NUMBER  },
+    { "cpu_softirq_mid",   METRIC_NUMBER  },
+    { "cpu_softirq_slow",  METRIC_NUMBER  },
+    { "user_cpu_users",    METRIC_NUMBER  },
+    { "user_cpu_heavy",    METRIC_NUMBER  },
+    { "user_cpu_top_share", METRIC_NUMBER },
+    { "user_cpu_top_util", METRIC_NUMBER  },
+    { "numa_nodes",        METRIC_NUMBER  },
+    { "numa_util_max",     METRIC_NUMBER  },
+    { "numa_util_min",     METRIC_NUMBER  },
+    { "numa_free_min",     METRIC_NUMBER  },
+    { "numa_free_max",     METRIC_NUMBER  },
+    { "psi_cpu_some10",    METRIC_NUMBER  },
+    { "psi_cpu_some60",    METRIC_NUMBER  },
+    { "psi_cpu_full10",    METRIC_NUMBER  },
+    { "psi_cpu_full60",    METRIC_NUMBER  },
+    { "psi_memory_some10", METRIC_NUMBER  },
+    { "psi_memory_some60", METRIC_NUMBER  },
+    { "psi_memory_full10", METRIC_NUMBER  },
+    { "psi_memory_full60", METRIC_NUMBER  },
+    { "psi_io_some10",     METRIC_NUMBER  },
+    { "psi_io_some60",     METRIC_NUMBER  },
+    { "psi_io_full10",     METRIC_NUMBER  },
+    { "psi_io_full60",     METRIC_NUMBER  },
+    { "psi_stall",         METRIC_BOOLEAN },
+    { "cg_cpu_util",       METRIC_NUMBER  },
+    { "cg_cpu_throttled",  METRIC_NUMBER  },
+    { "cg_cpu_limit",      METRIC_NUMBER  },
+    { "cg_mem_current",    METRIC_NUMBER  },
+    { "cg_mem_max",        METRIC_NUMBER  },
+    { "cg_mem_used",       METRIC_NUMBER  },
+    { "cg_cpu_some10",     METRIC_NUMBER  },
+    { "cg_cpu_some60",     METRIC_NUMBER  },
+    { "cg_cpu_full10",     METRIC_NUMBER  },
+    { "cg_cpu_full60",     METRIC_NUMBER  }
+};
+
+/* The current snapshot. */
+static struct lbcd_metrics snapshot;
+
+
+/*
+ * Update the snapshot from the system information in a reply, and from the
+ * kernel for information not in the reply.  The reply is in network byte
+ * order.
+ */
+void
+lbcd_metrics_update(const struct lbcd_reply *lb)
+{
+    double *value = snapshot.value;
+    struct kernel_info info;
+    struct psi_info psi;
+    struct cgroup_info cgroup;
+    struct cpustat_info cpustat;
+    struct numa_info numa;
+    struct usercpu_info usercpu;
+    struct memory_info memory;
+    struct netdev_info netdev;
+    struct disk_info disk;
+    struct fs_info fs;
+    enum psi_resource resource;
+    double *pressure;
+    int idle, uniq_idle;
+    size_t i;
+
+    value[METRIC_L1]           = ntohs(lb->l1);
+    value[METRIC_L5]           = ntohs(lb->l5);
+    value[METRIC_L15]          = ntohs(lb->l15);
+    value[METRIC_TOT]          = ntohs(lb->tot_users);
+    value[METRIC_UNIQ]         = ntohs(lb->uniq_users);
+    value[METRIC_CONSOLE]      = lb->on_console ? 1 : 0;
+    value[METRIC_TMP_FULL]     = lb->tmp_full;
+    value[METRIC_TMPDIR_FULL]  = lb->tmpdir_full;
+    value[METRIC_NOLOGIN]      = (access("/etc/nologin", F_OK) == 0) ? 1 : 0;
+    value[METRIC_BOOT_TIME]    = ntohl(lb->boot_time);
+    value[METRIC_CURRENT_TIME] = ntohl(lb->current_time);
+    value[METRIC_USER_MTIME]   = ntohl(lb->user_mtime);
+
+    /* Idle users, counted when the users were. */
+    lbcd_users_idle(&idle, &uniq_idle);
+    value[METRIC_IDLE]      = idle;
+    value[METRIC_UNIQ_IDLE] = uniq_idle;
+
+    /* The monitored filesystems, checked at most once per interval. */
+    lbcd_fs_read(&fs);
+    value[METRIC_TMP_PENALTY]   = fs.penalty;
+    value[METRIC_TMP_INODES]    = fs.tmp.inodes;
+    value[METRIC_TMPDIR_INODES] = fs.tmpdir.inodes;
+    value[METRIC_FS_FULL]       = fs.full;
+    value[METRIC_FS_INODES]     = fs.inodes;
+
+    /* Everything is zero if the kernel information isn't available. */
+    kernel_getinfo(&info);
+    value[METRIC_PROCS]        = info.procs;
+    value[METRIC_MEM_TOTAL]    = info.mem_total;
+    value[METRIC_MEM_FREE]     = info.mem_free;
+    value[METRIC_SWAP_TOTAL]   = info.swap_total;
+    value[METRIC_SWAP_FREE]    = info.swap_free;
+
+    /* Memory pressure, sampled at most once a second. */
+    lbcd_memory_sample();
+    lbcd_memory_read(&memory);
+    value[METRIC_MEM_AVAILABLE] = memory.available;
+    value[METRIC_MEM_USED]      = memory.used;
+    value[METRIC_SWAP_USED]     = memory.swap_used;
+    value[METRIC_MEM_MAJFAULTS] = memory.majfaults;
+    value[METRIC_MEM_PRESSURE]  = memory.pressure;
+    value[METRIC_MEM_PENALTY]   = memory.penalty;
+    value[METRIC_MEM_LOW]       = memory.low ? 1 : 0;
+
+    /* Network throughput, all zero unless interfaces are configured. */
+    lbcd_netdev_sample();
+    lbcd_netdev_read(&netdev);
+    value[METRIC_NET_RX]      = netdev.rx;
+    value[METRIC_NET_TX]      = netdev.tx;
+    value[METRIC_NET_UTIL]    = netdev.util;
+    value[METRIC_NET_ERRORS]  = netdev.errors;
+    value[METRIC_TCP_RETRANS] = netdev.retrans;
+
+    /* Disk I/O, likewise zero unless devices are configured. */
+    lbcd_disk_sample();
+    lbcd_disk_read(&disk);
+    value[METRIC_DISK_UTIL]  = disk.util;
+    value[METRIC_DISK_QUEUE] = disk.queue;
+    value[METRIC_DISK_AWAIT] = disk.await;
+
+    /* The moving averages of CPU time, zero until there are two samples. */
+    lbcd_cpustat_sample();
+    lbcd_cpustat_read(&cpustat);
+    for (i = 0; i < CPUSTAT_RATES; i++) {
+        value[METRIC_CPU_UTIL_FAST + i]    = cpustat.util[i];
+        value[METRIC_CPU_IOWAIT_FAST + i]  = cpustat.iowait[i];
+        value[METRIC_CPU_STEAL_FAST + i]   = cpustat.steal[i];
+        value[METRIC_CPU_SOFTIRQ_FAST + i] = cpustat.softirq[i];
+    }
+
+    /*
+     * The CPU time of each user, sampled from the main loop and all zero
+     * unless enabled.
+     */
+    lbcd_usercpu_read(&usercpu);
+    value[METRIC_USER_CPU_USERS]     = usercpu.users;
+    value[METRIC_USER_CPU_HEAVY]     = usercpu.heavy;
+    value[METRIC_USER_CPU_TOP_SHARE] = usercpu.top_share;
+    value[METRIC_USER_CPU_TOP_UTIL]  = usercpu.top_util;
+
+    /* The spread across NUMA nodes, all zero without NUMA information. */
+    lbcd_numa_read(&numa);
+    value[METRIC_NUMA_NODES]    = numa.nodes;
+    value[METRIC_NUMA_UTIL_MAX] = numa.util_max;
+    value[METRIC_NUMA_UTIL_MIN] = numa.util_min;
+    value[METRIC_NUMA_FREE_MIN] = numa.free_min;
+    value[METRIC_NUMA_FREE_MAX] = numa.free_max;
+
+    /* Likewise for pressure stall information. */
+    pressure = &value[METRIC_PSI_CPU_SOME10];
+    for (resource = PSI_CPU; resource < PSI_RESOURCE_COUNT; resource++) {
+        if (lbcd_psi_read(resource, &psi) < 0)
+            memset(&psi, 0, sizeof(psi));
+        *pressure++ = psi.some10;
+        *pressure++ = psi.some60;
+        *pressure++ = psi.full10;
+        *pressure++ = psi.full60;
+    }
+    value[METRIC_PSI_STALL]    = lbcd_psi_stalled() ? 1 : 0;
+
+    /* And for the configured cgroup, if any. */
+    if (lbcd_cgroup_read(&cgroup) < 0)
+        memset(&cgroup, 0, sizeof(cgroup));
+    value[METRIC_CG_CPU_UTIL]      = cgroup.cpu_util;
+    value[METRIC_CG_CPU_THROTTLED] = cgroup.cpu_throttled;
+    value[METRIC_CG_CPU_LIMIT]     = cgroup.cpu_limit;
+    value[METRIC_CG_MEM_CURRENT]   = cgroup.mem_current;
+    value[METRIC_CG_MEM_MAX]       = cgroup.mem_max;
+    value[METRIC_CG_MEM_USED]      = cgroup.mem_used;
+    value[METRIC_CG_CPU_SOME10]    = cgroup.pressure.some10;
+    value[METRIC_CG_CPU_SOME60]    = cgroup.pressure.some60;
+    value[METRIC_CG_CPU_FULL10]    = cgroup.pressure.full10;
+    value[METRIC_CG_CPU_FULL60]    = cgroup.pressure.full60;
+
+    /*
+     * The load per CPU.  This comes last since reading the cgroup notices
+     * if its CPU quota changed.
+     */
+    value[METRIC_CPUS]         = lbcd_cpus_get();
+    value[METRIC_NL1]          = value[METRIC_L1] / value[METRIC_CPUS];
+    value[METRIC_NL5]          = value[METRIC_L5] / value[METRIC_CPUS];
+    value[METRIC_NL15]         = value[METRIC_L15] / value[METRIC_CPUS];
+    value[METRIC_CAPACITY]     = lbcd_capacity_get();
+}
+
+
+/*
+ * Return the current snapshot.
+ */
+const struct lbcd_metrics *
+lbcd_metrics_get(void)
+{
+    return &snapshot;
+}
+
+
+/*
+ * Look up a metric by name, returning its index or -1 if it's not known.
+ */
+int
+lbcd_metric_lookup(const char *name)
+{
+    int i;
+
+    for (i = 0; i < METRIC_COUNT; i++)
+        if (strcmp(metric_table[i].name, name) == 0)
+            return i;
+    return -1;
+}
+
+
+/*
+ * Return the name of a metric.
+ */
+const char *
+lbcd_metric_name(enum lbcd_metric metric)
+{
+    return metric_table[metric].name;
+}
+
+
+/*
+ * Return the type of a metric.
+ */
+enum lbcd_metric_type
+lbcd_metric_type(enum lbcd_metric metric)
+{
+    return metric_table[metric].type;
+}
@@ -0,0 +1,144 @@
+/*
+ * Snapshot of system metrics available to weight computations.
+ *
+ * Each time lbcd builds a reply, it collects everything it knows about the
+ * system into a snapshot of named metrics.  Weight formulas refer to these
+ * metrics by name, so this is the complete list of what a formula can use.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef SERVER_METRICS_H
+#define SERVER_METRICS_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+
+struct lbcd_reply;
+
+/* The known metrics.  Keep in sync with the table in metrics.c. */
+enum lbcd_metric {
+    METRIC_L1,                  /* One-minute load times 100 */
+    METRIC_L5,                  /* Five-minute load times 100 */
+    METRIC_L15,                 /* Fifteen-minute load times 100 */
+    METRIC_CPUS,                /* Number of CPUs available */
+    METRIC_NL1,                 /* One-minute load per CPU times 100 */
+    METRIC_NL5,                 /* Five-minute load per CPU times 100 */
+    METRIC_NL15,                /* Fifteen-minute load per CPU times 100 */
+    METRIC_CAPACITY,            /* Calibrated capacity score */
+    METRIC_TOT,                 /* Total logged-in users */
+    METRIC_UNIQ,                /* Unique logged-in users */
+    METRIC_IDLE,                /* Idle sessions */
+    METRIC_UNIQ_IDLE,           /* Users all of whose sessions are idle */
+    METRIC_CONSOLE,             /* Whether someone is on console */
+    METRIC_TMP_FULL,            /* Percent full of /tmp */
+    METRIC_TMPDIR_FULL,         /* Percent full of P_tmpdir */
+    METRIC_TMP_PENALTY,         /* Largest filesystem penalty multiplier */
+    METRIC_TMP_INODES,          /* Percent of inodes used in /tmp */
+    METRIC_TMPDIR_INODES,       /* Percent of inodes used in P_tmpdir */
+    METRIC_FS_FULL,             /* Percent full of the fullest filesystem */
+    METRIC_FS_INODES,           /* Highest percent of inodes used */
+    METRIC_NOLOGIN,             /* Whether /etc/nologin exists */
+    METRIC_BOOT_TIME,           /* Boot time in seconds since epoch */
+    METRIC_CURRENT_TIME,        /* Current time in seconds since epoch */
+    METRIC_USER_MTIME,          /* Last change to logged-in users */
+    METRIC_PROCS,               /* Number of processes */
+    METRIC_MEM_TOTAL,           /* Total memory in MiB */
+    METRIC_MEM_FREE,            /* Free memory in MiB */
+    METRIC_SWAP_TOTAL,          /* Total swap in MiB */
+    METRIC_SWAP_FREE,           /* Free swap in MiB */
+    METRIC_MEM_AVAILABLE,       /* Memory available in MiB */
+    METRIC_MEM_USED,            /* Percent of memory not available */
+    METRIC_SWAP_USED,           /* Percent of swap used */
+    METRIC_MEM_MAJFAULTS,       /* Major page faults per second */
+    METRIC_MEM_PRESSURE,        /* Memory pressure score from 0 to 100 */
+    METRIC_MEM_PENALTY,         /* Memory pressure penalty multiplier */
+    METRIC_MEM_LOW,             /* Whether memory is below the floor */
+    METRIC_NET_RX,              /* KiB/s received */
+    METRIC_NET_TX,              /* KiB/s transmitted */
+    METRIC_NET_UTIL,            /* Busiest interface percent times 100 */
+    METRIC_NET_ERRORS,          /* Network errors and drops per second */
+    METRIC_TCP_RETRANS,         /* Percent retransmitted times 100 */
+    METRIC_DISK_UTIL,           /* Busiest disk percent busy times 100 */
+    METRIC_DISK_QUEUE,          /* Longest disk queue times 100 */
+    METRIC_DISK_AWAIT,          /* Slowest disk milliseconds times 100 */
+    METRIC_CPU_UTIL_FAST,       /* Percent busy times 100, fast */
+    METRIC_CPU_UTIL_MID,        /* Percent busy times 100, mid */
+    METRIC_CPU_UTIL_SLOW,       /* Percent busy times 100, slow */
+    METRIC_CPU_IOWAIT_FAST,     /* Percent iowait times 100, fast */
+    METRIC_CPU_IOWAIT_MID,      /* Percent iowait times 100, mid */
+    METRIC_CPU_IOWAIT_SLOW,     /* Percent iowait times 100, slow */
+    METRIC_CPU_STEAL_FAST,      /* Percent stolen times 100, fast */
+    METRIC_CPU_STEAL_MID,       /* Percent stolen times 100, mid */
+    METRIC_CPU_STEAL_SLOW,      /* Percent stolen times 100, slow */
+    METRIC_CPU_SOFTIRQ_FAST,    /* Percent in softirqs times 100, fast */
+    METRIC_CPU_SOFTIRQ_MID,     /* Percent in softirqs times 100, mid */
+    METRIC_CPU_SOFTIRQ_SLOW,    /* Percent in softirqs times 100, slow */
+    METRIC_USER_CPU_USERS,      /* Users who used any CPU time */
+    METRIC_USER_CPU_HEAVY,      /* Users above the CPU threshold */
+    METRIC_USER_CPU_TOP_SHARE,  /* Top user's share of CPU time times 100 */
+    METRIC_USER_CPU_TOP_UTIL,   /* Top user's percent of a CPU times 100 */
+    METRIC_NUMA_NODES,          /* Number of NUMA nodes */
+    METRIC_NUMA_UTIL_MAX,       /* Percent busy of busiest node times 100 */
+    METRIC_NUMA_UTIL_MIN,       /* Percent busy of idlest node times 100 */
+    METRIC_NUMA_FREE_MIN,       /* Free memory of fullest node in MiB */
+    METRIC_NUMA_FREE_MAX,       /* Free memory of emptiest node in MiB */
+    METRIC_PSI_CPU_SOME10,      /* CPU some pressure avg10 times 100 */
+    METRIC_PSI_CPU_SOME60,      /* CPU some pressure avg60 times 100 */
+    METRIC_PSI_CPU_FULL10,      /* CPU full pressure avg10 times 100 */
+    METRIC_PSI_CPU_FULL60,      /* CPU full pressure avg60 times 100 */
+    METRIC_PSI_MEMORY_SOME10,   /* Memory some pressure avg10 times 100 */
+    METRIC_PSI_MEMORY_SOME60,   /* Memory some pressure avg60 times 100 */
+    METRIC_PSI_MEMORY_FULL10,   /* Memory full pressure avg10 times 100 */
+    METRIC_PSI_MEMORY_FULL60,   /* Memory full pressure avg60 times 100 */
+    METRIC_PSI_IO_SOME10,       /* I/O some pressure avg10 times 100 */
+    METRIC_PSI_IO_SOME60,       /* I/O some pressure avg60 times 100 */
+    METRIC_PSI_IO_FULL10,       /* I/O full pressure avg10 times 100 */
+    METRIC_PSI_IO_FULL60,       /* I/O full pressure avg60 times 100 */
+    METRIC_PSI_STALL,           /* Whether a pressure trigger fired */
+    METRIC_CG_CPU_UTIL,         /* cgroup percent of CPU limit times 100 */
+    METRIC_CG_CPU_THROTTLED,    /* cgroup percent time throttled times 100 */
+    METRIC_CG_CPU_LIMIT,        /* cgroup CPU limit times 100 */
+    METRIC_CG_MEM_CURRENT,      /* cgroup memory use in MiB */
+    METRIC_CG_MEM_MAX,          /* cgroup memory limit in MiB */
+    METRIC_CG_MEM_USED,         /* cgroup percent of memory limit times 100 */
+    METRIC_CG_CPU_SOME10,       /* cgroup CPU some pressure avg10 times 100 */
+    METRIC_CG_CPU_SOME60,       /* cgroup CPU some pressure avg60 times 100 */
+    METRIC_CG_CPU_FULL10,       /* cgroup CPU full pressure avg10 times 100 */
+    METRIC_CG_CPU_FULL60,       /* cgroup CPU full pressure avg60 times 100 */
+    METRIC_COUNT
+};
+
+/* Metrics are either numbers or booleans (stored as 0 or 1). */
+enum lbcd_metric_type {
+    METRIC_NUMBER,
+    METRIC_BOOLEAN
+};
+
+/* A snapshot of all metrics. */
+struct lbcd_metrics {
+    double value[METRIC_COUNT];
+};
+
+BEGIN_DECLS
+
+/* Update the current snapshot from a reply whose system fields are set. */
+void lbcd_metrics_update(const struct lbcd_reply *);
+
+/* Return the current snapshot. */
+const struct lbcd_metrics *lbcd_metrics_get(void);
+
+/* Look up a metric by name, returning its index or -1 if unknown. */
+int lbcd_metric_lookup(const char *name);
+
+/* Return the name and type of a metric. */
+const char *lbcd_metric_name(enum lbcd_metric);
+enum lbcd_metric_type lbcd_metric_type(enum lbcd_metric);
+
+END_DECLS
+
+#endif /* !SERVER_METRICS_H */
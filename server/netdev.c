@@ -0,0 +1,705 @@
+/*
+ * Network throughput and errors.
+ *
+ * On file-transfer servers and proxies, the network interface runs out long
+ * before the CPU does, so neither the load average nor the CPU utilization
+ * shows when a host is full.  For each configured interface, this samples
+ * the byte, error, and drop counters in /proc/net/dev from the main loop and
+ * tracks the receive and transmit rates and the rate of errors and drops as
+ * exponentially-weighted moving averages.  The rates are compared with the
+ * link speed from /sys/class/net/<interface>/speed, or a configured speed
+ * for virtual interfaces that don't report one, to get the utilization of
+ * the interface.  The fraction of TCP segments retransmitted, from
+ * /proc/net/snmp, is tracked the same way as a second sign of a congested
+ * network.
+ *
+ * The results are available to weight formulas and as the net service,
+ * whose weight is the utilization of the busiest interface, raised by
+ * errors and retransmissions.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+#include <fcntl.h>
+
+#include <server/internal.h>
+#include <server/metrics.h>
+#include <server/procfile.h>
+#include <server/sample.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/vector.h>
+#include <util/xmalloc.h>
+
+/* The size to start with for the buffer for /proc/net/dev. */
+#define NETDEV_FILE_MIN 4096
+
+/* The longest /proc/net/snmp we read. */
+#define NETDEV_SNMP_MAX 8192
+
+/* How often to sample, in microseconds. */
+#define NETDEV_INTERVAL 1000000
+
+/* How often to check the link speed, in microseconds. */
+#define NETDEV_SPEED_INTERVAL 60000000
+
+/* The half-life of the moving averages, in seconds. */
+#define NETDEV_HALF_LIFE 10
+
+/* The largest configured link speed, in Mb/s. */
+#define NETDEV_SPEED_MAX 10000000
+
+/*
+ * The weight added by the net service for each error or drop per second and
+ * for each hundredth of a percent of TCP segments retransmitted, and its
+ * increment.
+ */
+#define NETDEV_ERROR_WEIGHT   100
+#define NETDEV_RETRANS_WEIGHT 10
+#define NETDEV_INCREMENT      200
+
+/* A monitored interface. */
+struct netdev {
+    char *name;
+    char *speed_path;           /* Path to the link speed in sysfs */
+    unsigned long speed;        /* Configured speed in Mb/s, or 0 */
+    unsigned long link;         /* Link speed in Mb/s, or 0 if unknown */
+    unsigned long long checked; /* When the link speed was last checked */
+    bool have_last;             /* Whether there is a previous sample */
+    bool have_averages;         /* Whether the averages have been started */
+    unsigned long long rx_bytes;
+    unsigned long long tx_bytes;
+    unsigned long long errors;  /* Receive and transmit errors and drops */
+    double rx;                  /* Bytes per second received */
+    double tx;                  /* Bytes per second transmitted */
+    double error_rate;          /* Errors and drops per second */
+};
+
+/* The counters of one interface from /proc/net/dev. */
+struct netdev_counters {
+    unsigned long long rx_bytes;
+    unsigned long long tx_bytes;
+    unsigned long long errors;
+};
+
+/* The paths to the files, which are under a different root for testing. */
+static char *dev_path = NULL;
+static char *snmp_path = NULL;
+static struct procfile dev_file = PROCFILE_INIT(NULL);
+static struct procfile snmp_file = PROCFILE_INIT(NULL);
+
+/* The buffer for /proc/net/dev, grown as needed. */
+static char *dev_buffer = NULL;
+static size_t dev_size = 0;
+
+/* Whether /proc/net/dev has been checked for, and whether it exists. */
+static bool dev_checked = false;
+static bool dev_available = false;
+
+/* The monitored interfaces. */
+static struct netdev *netdevs = NULL;
+static size_t netdevs_count = 0;
+
+/*
+ * The interfaces and root directory of a new configuration, and whether
+ * there are any.
+ */
+static struct netdev *pending = NULL;
+static size_t pending_count = 0;
+static char *pending_dir = NULL;
+static bool have_pending = false;
+
+/*
+ * When the last sample was taken, or 0 if none, and the TCP counters then
+ * and their average.
+ */
+static unsigned long long last_time = 0;
+static bool have_tcp = false;
+static bool have_retrans = false;
+static unsigned long long last_out = 0;
+static unsigned long long last_retrans = 0;
+static double retrans = 0;
+
+
+/*
+ * Find the counters of an interface in the contents of /proc/net/dev.  Each
+ * line after the two header lines is the interface name, a colon, eight
+ * receive counters, and eight transmit counters.  Returns false if the
+ * interface isn't there.
+ */
+static bool
+dev_parse(const char *buffer, const char *name,
+          struct netdev_counters *counters)
+{
+    unsigned long long value[16];
+    const char *p, *colon;
+    size_t length = strlen(name);
+    size_t i;
+
+    for (p = buffer; p != NULL; p = strchr(p, '\n')) {
+        if (*p == '\n')
+            p++;
+        while (*p == ' ')
+            p++;
+        colon = strchr(p, ':');
+        if (colon == NULL)
+            return false;
+        if ((size_t) (colon - p) != length || strncmp(p, name, length) != 0)
+            continue;
+        p = colon + 1;
+        for (i = 0; i < ARRAY_SIZE(value); i++) {
+            p = procfile_counter(p, &value[i]);
+            if (p == NULL)
+                return false;
+        }
+        counters->rx_bytes = value[0];
+        counters->tx_bytes = value[8];
+        counters->errors = value[2] + value[3] + value[10] + value[11];
+        return true;
+    }
+    return false;
+}
+
+
+/*
+ * Find the counts of TCP segments sent and retransmitted in the contents of
+ * /proc/net/snmp, where a line of field names starting with "Tcp:" is
+ * followed by a line of their values.  MaxConn is -1, so skip the signs of
+ * values we don't use.  Returns false if they aren't there.
+ */
+static bool
+snmp_parse(const char *buffer, unsigned long long *out,
+           unsigned long long *retransmitted)
+{
+    const char *names, *values, *p, *end;
+    unsigned long long value;
+    bool found_out = false;
+    bool found_retrans = false;
+
+    names = strstr(buffer, "Tcp:");
+    if (names == NULL)
+        return false;
+    values = strstr(names + 4, "Tcp:");
+    if (values == NULL)
+        return false;
+    p = names + 4;
+    values += 4;
+    while (*p == ' ') {
+        p++;
+        end = p + strcspn(p, " \n");
+        while (*values == ' ')
+            values++;
+        if (*values == '-')
+            values++;
+        values = procfile_counter(values, &value);
+        if (values == NULL)
+            return false;
+        if (end - p == 7 && strncmp(p, "OutSegs", 7) == 0) {
+            *out = value;
+            found_out = true;
+        } else if (end - p == 11 && strncmp(p, "RetransSegs", 11) == 0) {
+            *retransmitted = value;
+            found_retrans = true;
+        }
+        p = end;
+    }
+    return found_out && found_retrans;
+}
+
+
+/*
+ * Read the link speed of an interface in Mb/s, or return 0 if it's unknown.
+ * The file can't be read while the link is down and contains -1 for virtual
+ * interfaces, neither of which is worth reporting.
+ */
+static unsigned long
+speed_read(const char *path)
+{
+    char buffer[64];
+    unsigned long speed;
+    ssize_t length;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0)
+        return 0;
+    buffer[length] = '\0';
+    if (procfile_fixed(buffer, 0, &speed) == NULL)
+        return 0;
+    return speed;
+}
+
+
+/*
+ * Add a sample of an interface to its averages.  The first sample only
+ * establishes a baseline.  If the counters went backwards, which happens if
+ * the interface is removed and created again, the sample becomes the new
+ * baseline.
+ */
+static void
+netdev_update(struct netdev *netdev, const struct netdev_counters *counters,
+              double elapsed)
+{
+    double rate;
+    bool started;
+
+    if (netdev->have_last && elapsed > 0
+        && counters->rx_bytes >= netdev->rx_bytes
+        && counters->tx_bytes >= netdev->tx_bytes
+        && counters->errors >= netdev->errors) {
+        started = netdev->have_averages;
+        rate = (counters->rx_bytes - netdev->rx_bytes) / elapsed;
+        netdev->rx = sample_average(netdev->rx, rate, elapsed,
+                                    NETDEV_HALF_LIFE, started);
+        rate = (counters->tx_bytes - netdev->tx_bytes) / elapsed;
+        netdev->tx = sample_average(netdev->tx, rate, elapsed,
+                                    NETDEV_HALF_LIFE, started);
+        rate = (counters->errors - netdev->errors) / elapsed;
+        netdev->error_rate = sample_average(netdev->error_rate, rate, elapsed,
+                                            NETDEV_HALF_LIFE, started);
+        netdev->have_averages = true;
+    }
+    netdev->rx_bytes = counters->rx_bytes;
+    netdev->tx_bytes = counters->tx_bytes;
+    netdev->errors = counters->errors;
+    netdev->have_last = true;
+}
+
+
+/*
+ * Add a sample of the TCP counters to the average fraction of segments
+ * retransmitted, handled the same way as the interface counters.
+ */
+static void
+tcp_update(unsigned long long out, unsigned long long retransmitted,
+           double elapsed)
+{
+    double value;
+
+    if (have_tcp && elapsed > 0 && out >= last_out
+        && retransmitted >= last_retrans) {
+        value = 0;
+        if (out > last_out)
+            value = (double) (retransmitted - last_retrans)
+                / (double) (out - last_out);
+        if (value > 1)
+            value = 1;
+        retrans = sample_average(retrans, value, elapsed, NETDEV_HALF_LIFE,
+                                 have_retrans);
+        have_retrans = true;
+    }
+    last_out = out;
+    last_retrans = retransmitted;
+    have_tcp = true;
+}
+
+
+/*
+ * Read /proc/net/dev into the buffer, growing it until the whole file fits.
+ * Returns false if it can't be read.
+ */
+static bool
+dev_read(void)
+{
+    ssize_t length;
+
+    if (dev_buffer == NULL) {
+        dev_size = NETDEV_FILE_MIN;
+        dev_buffer = xmalloc(dev_size);
+    }
+    for (;;) {
+        length = procfile_read(&dev_file, dev_buffer, dev_size);
+        if (length < 0)
+            return false;
+        if ((size_t) length < dev_size - 1)
+            return true;
+        dev_size *= 2;
+        dev_buffer = xrealloc(dev_buffer, dev_size);
+    }
+}
+
+
+/*
+ * Sample the configured interfaces and the TCP counters at the given time in
+ * microseconds on the monotonic clock, regardless of whether a sample is due.
+ * Interfaces that aren't present are skipped, keeping their averages.
+ */
+void
+lbcd_netdev_scan(unsigned long long now)
+{
+    char snmp[NETDEV_SNMP_MAX];
+    struct netdev_counters counters;
+    struct netdev *netdev;
+    unsigned long long out = 0, retransmitted = 0;
+    double elapsed = 0;
+    size_t i;
+
+    if (netdevs_count == 0 || !dev_read())
+        return;
+    if (last_time != 0 && now > last_time)
+        elapsed = (double) (now - last_time) / 1000000;
+    for (i = 0; i < netdevs_count; i++) {
+        netdev = &netdevs[i];
+        if (netdev->checked == 0
+            || now - netdev->checked >= NETDEV_SPEED_INTERVAL) {
+            netdev->link = netdev->speed;
+            if (netdev->link == 0)
+                netdev->link = speed_read(netdev->speed_path);
+            netdev->checked = now;
+        }
+        if (dev_parse(dev_buffer, netdev->name, &counters))
+            netdev_update(netdev, &counters, elapsed);
+    }
+    if (procfile_read(&snmp_file, snmp, sizeof(snmp)) >= 0)
+        if (snmp_parse(snmp, &out, &retransmitted))
+            tcp_update(out, retransmitted, elapsed);
+    last_time = now;
+}
+
+
+/*
+ * Return the number of milliseconds until the next sample is due, or -1 if
+ * there will be no more samples.
+ */
+int
+lbcd_netdev_timeout(void)
+{
+    unsigned long long now;
+
+    if (netdevs_count == 0 || (dev_checked && !dev_available))
+        return -1;
+    if (last_time == 0)
+        return 0;
+    now = sample_now();
+    if (now - last_time >= NETDEV_INTERVAL)
+        return 0;
+    return (int) ((NETDEV_INTERVAL - (now - last_time) + 999) / 1000);
+}
+
+
+/*
+ * Take a sample if one is due.  A kernel without /proc/net/dev is not an
+ * error worth reporting, so if it doesn't exist the first time we look, we
+ * quietly give up on it.
+ */
+void
+lbcd_netdev_sample(void)
+{
+    if (netdevs_count == 0)
+        return;
+    if (!dev_checked) {
+        dev_available = (access(dev_path, R_OK) == 0);
+        dev_checked = true;
+    }
+    if (!dev_available || lbcd_netdev_timeout() != 0)
+        return;
+    lbcd_netdev_scan(sample_now());
+}
+
+
+/*
+ * Store the current averages in info.  Throughput is the total over all
+ * configured interfaces in KiB/s, and the utilization is that of the
+ * busiest direction of the busiest interface whose speed is known, as a
+ * percentage times 100.  Errors and drops are per second over all
+ * interfaces, and retransmissions are a percentage of TCP segments sent
+ * times 100.
+ */
+void
+lbcd_netdev_read(struct netdev_info *info)
+{
+    const struct netdev *netdev;
+    double rx = 0, tx = 0, errors = 0, util = 0, busiest;
+    size_t i;
+
+    for (i = 0; i < netdevs_count; i++) {
+        netdev = &netdevs[i];
+        rx += netdev->rx;
+        tx += netdev->tx;
+        errors += netdev->error_rate;
+        if (netdev->link > 0) {
+            busiest = (netdev->rx > netdev->tx) ? netdev->rx : netdev->tx;
+            busiest /= (double) netdev->link * 125000;
+            if (busiest > util)
+                util = busiest;
+        }
+    }
+    if (util > 1)
+        util = 1;
+    info->rx = (unsigned long) (rx / 1024 + 0.5);
+    info->tx = (unsigned long) (tx / 1024 + 0.5);
+    info->util = (unsigned long) (util * 10000 + 0.5);
+    info->errors = (unsigned long) (errors + 0.5);
+    info->retrans = (unsigned long) (retrans * 10000 + 0.5);
+}
+
+
+/*
+ * The net service.  The weight is the utilization of the busiest interface
+ * as a percentage times 100, plus NETDEV_ERROR_WEIGHT for each error or drop
+ * per second and NETDEV_RETRANS_WEIGHT for each hundredth of a percent of
+ * TCP segments retransmitted.
+ */
+static int
+netdev_weight(void *data UNUSED, uint32_t *weight_val, uint32_t *incr_val,
+              int timeout UNUSED, const char *portarg UNUSED,
+              struct lbcd_reply *lb UNUSED)
+{
+    const struct lbcd_metrics *metrics;
+    double weight;
+
+    metrics = lbcd_metrics_get();
+    weight = metrics->value[METRIC_NET_UTIL]
+        + metrics->value[METRIC_NET_ERRORS] * NETDEV_ERROR_WEIGHT
+        + metrics->value[METRIC_TCP_RETRANS] * NETDEV_RETRANS_WEIGHT;
+    if (weight > UINT32_MAX)
+        weight = UINT32_MAX;
+    *weight_val = (uint32_t) weight;
+    *incr_val = NETDEV_INCREMENT;
+    return (int) *weight_val;
+}
+
+
+/*
+ * Parse the specification of an interface, name[=speed] with the speed in
+ * Mb/s, into netdev, finding its link speed under dir.  Returns false after
+ * reporting the problem with warn if it's invalid.
+ */
+static bool
+netdev_parse(const char *spec, const char *dir, struct netdev *netdev)
+{
+    const char *equals, *end;
+    unsigned long speed = 0;
+    size_t length;
+
+    memset(netdev, 0, sizeof(*netdev));
+    equals = strchr(spec, '=');
+    length = (equals == NULL) ? strlen(spec) : (size_t) (equals - spec);
+    if (length == 0 || memchr(spec, '/', length) != NULL
+        || memchr(spec, ':', length) != NULL)
+        goto fail;
+    if (equals != NULL) {
+        if (!isdigit((unsigned char) equals[1]))
+            goto fail;
+        end = procfile_fixed(equals + 1, 0, &speed);
+        if (end == NULL || *end != '\0' || speed == 0
+            || speed > NETDEV_SPEED_MAX)
+            goto fail;
+    }
+    netdev->name = xstrndup(spec, length);
+    xasprintf(&netdev->speed_path, "%s/sys/class/net/%s/speed", dir,
+              netdev->name);
+    netdev->speed = speed;
+    return true;
+
+fail:
+    warn("invalid interface %s (expected name[=speed in Mb/s])", spec);
+    return false;
+}
+
+
+/*
+ * Free a list of interfaces.
+ */
+static void
+netdevs_free(struct netdev *list, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        free(list[i].name);
+        free(list[i].speed_path);
+    }
+    free(list);
+}
+
+
+/*
+ * Return whether the files being sampled are those under dir.
+ */
+static bool
+files_match(const char *dir)
+{
+    size_t length = strlen(dir);
+
+    return strncmp(dev_path, dir, length) == 0
+        && strcmp(dev_path + length, "/proc/net/dev") == 0;
+}
+
+
+/*
+ * Carry over the samples and averages of interfaces that were already being
+ * monitored to a new list, so that a reload doesn't start them over.
+ */
+static void
+netdevs_keep(struct netdev *list, size_t count)
+{
+    struct netdev *netdev;
+    size_t i, j;
+
+    for (i = 0; i < count; i++) {
+        netdev = &list[i];
+        for (j = 0; j < netdevs_count; j++)
+            if (strcmp(netdev->name, netdevs[j].name) == 0)
+                break;
+        if (j == netdevs_count)
+            continue;
+        if (netdev->speed == netdevs[j].speed) {
+            netdev->link = netdevs[j].link;
+            netdev->checked = netdevs[j].checked;
+        }
+        netdev->have_last = netdevs[j].have_last;
+        netdev->have_averages = netdevs[j].have_averages;
+        netdev->rx_bytes = netdevs[j].rx_bytes;
+        netdev->tx_bytes = netdevs[j].tx_bytes;
+        netdev->errors = netdevs[j].errors;
+        netdev->rx = netdevs[j].rx;
+        netdev->tx = netdevs[j].tx;
+        netdev->error_rate = netdevs[j].error_rate;
+    }
+}
+
+
+/*
+ * Parse the interfaces to monitor from a list of specifications of the form
+ * name[=speed], where speed is the link speed in Mb/s to use instead of the
+ * one reported by the kernel, and keep them to be used once
+ * lbcd_netdev_commit is called.  The files are found under dir instead of
+ * the root if it's not NULL, for testing.  Registers the net service if any
+ * interfaces are given.  Returns false after reporting the problem with warn
+ * if a specification is invalid.
+ */
+bool
+lbcd_netdev_prepare(const struct vector *specs, const char *dir)
+{
+    struct netdev *parsed = NULL;
+    size_t count = 0;
+
+    lbcd_netdev_abort();
+    if (dir == NULL)
+        dir = "";
+    if (specs != NULL && specs->count > 0) {
+        parsed = xcalloc(specs->count, sizeof(struct netdev));
+        for (; count < specs->count; count++)
+            if (!netdev_parse(specs->strings[count], dir, &parsed[count]))
+                break;
+        if (count < specs->count) {
+            netdevs_free(parsed, count);
+            return false;
+        }
+    }
+    pending = parsed;
+    pending_count = count;
+    pending_dir = xstrdup(dir);
+    have_pending = true;
+    if (count > 0)
+        lbcd_service_register("net", netdev_weight, NULL, 0, NULL);
+    return true;
+}
+
+
+/*
+ * Switch to the interfaces from lbcd_netdev_prepare.  The averages of
+ * interfaces that were already monitored are kept.
+ */
+void
+lbcd_netdev_commit(void)
+{
+    struct netdev *list = pending;
+    size_t count = pending_count;
+    char *dir = pending_dir;
+
+    if (!have_pending)
+        return;
+    pending = NULL;
+    pending_count = 0;
+    pending_dir = NULL;
+    have_pending = false;
+    if (count == 0 || dev_path == NULL || !files_match(dir))
+        lbcd_netdev_close();
+    else
+        netdevs_keep(list, count);
+    netdevs_free(netdevs, netdevs_count);
+    netdevs = list;
+    netdevs_count = count;
+    if (count > 0 && dev_path == NULL) {
+        xasprintf(&dev_path, "%s/proc/net/dev", dir);
+        xasprintf(&snmp_path, "%s/proc/net/snmp", dir);
+        dev_file.path = dev_path;
+        snmp_file.path = snmp_path;
+    }
+    free(dir);
+}
+
+
+/*
+ * Discard the interfaces from lbcd_netdev_prepare.
+ */
+void
+lbcd_netdev_abort(void)
+{
+    netdevs_free(pending, pending_count);
+    pending = NULL;
+    pending_count = 0;
+    free(pending_dir);
+    pending_dir = NULL;
+    have_pending = false;
+}
+
+
+/*
+ * Set the interfaces to monitor immediately, as with lbcd_netdev_prepare.
+ * Returns false after reporting the problem with warn if a specification is
+ * invalid, in which case nothing is changed.
+ */
+bool
+lbcd_netdev_init(const struct vector *specs, const char *dir)
+{
+    if (!lbcd_netdev_prepare(specs, dir))
+        return false;
+    lbcd_netdev_commit();
+    return true;
+}
+
+
+/*
+ * Close the files and forget all interfaces and samples.
+ */
+void
+lbcd_netdev_close(void)
+{
+    lbcd_netdev_abort();
+    procfile_close(&dev_file);
+    procfile_close(&snmp_file);
+    dev_file.path = NULL;
+    snmp_file.path = NULL;
+    free(dev_path);
+    dev_path = NULL;
+    free(snmp_path);
+    snmp_path = NULL;
+    free(dev_buffer);
+    dev_buffer = NULL;
+    dev_size = 0;
+    dev_checked = false;
+    netdevs_free(netdevs, netdevs_count);
+    netdevs = NULL;
+    netdevs_count = 0;
+    last_time = 0;
+    have_tcp = false;
+    have_retrans = false;
+    last_out = 0;
+    last_retrans = 0;
+    retrans = 0;
+}
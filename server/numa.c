@@ -0,0 +1,413 @@
+/*
+ * Load and free memory of each NUMA node.
+ *
+ * On a host with several NUMA nodes, one node can be saturated while the
+ * others are idle, and the load and free memory of the whole host hide
+ * that.  A job placed on such a host either waits for the busy node or runs
+ * with remote memory.  To let weight formulas penalize hosts where no single
+ * node can take another job, this tracks the CPU utilization and free memory
+ * of each node and reports the busiest and least busy node and the nodes
+ * with the least and most free memory.
+ *
+ * The nodes, and which CPUs belong to each, come from sysfs and are only
+ * looked up again after CPU or memory hotplug events or a reload.  The CPU
+ * utilization of each node is a moving average computed from the per-CPU
+ * times that cpustat.c samples from /proc/stat.  Free memory is read from
+ * the meminfo file of each node whenever the metrics are updated.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <errno.h>
+
+#include <server/internal.h>
+#include <server/procfile.h>
+#include <server/sample.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Where the kernel lists the NUMA nodes. */
+#define NUMA_ROOT "/sys/devices/system/node"
+
+/* The longest cpulist or meminfo file of a node that we read. */
+#define NUMA_FILE_MAX 4096
+
+/* CPU numbers at least this large in a cpulist file are ignored. */
+#define NUMA_MAX_CPUS 65536
+
+/* Marks a CPU that isn't in any node. */
+#define NUMA_NO_NODE ((size_t) -1)
+
+/*
+ * A NUMA node.  The meminfo file is kept open between reads.  The sums of
+ * the CPU times of its CPUs in the previous sample are kept to compute the
+ * utilization since then.
+ */
+struct numa_node {
+    char *meminfo_path;
+    struct procfile meminfo;
+    size_t cpus;                /* Number of CPUs in the node */
+    struct cpustat_times last;  /* Times at the last sample */
+    bool have_last;             /* Whether last is set */
+    bool have_util;             /* Whether util is set */
+    double util;                /* Moving average of the busy fraction */
+};
+
+/* Where to look for nodes, and whether we've looked since invalidated. */
+static char *root = NULL;
+static bool scanned = false;
+
+/* The nodes, and the index of the node of each CPU or NUMA_NO_NODE. */
+static struct numa_node *nodes = NULL;
+static size_t node_count = 0;
+static size_t *cpu_node = NULL;
+static size_t cpu_count = 0;
+
+/* When per-node utilization was last updated, or 0. */
+static unsigned long long last_time = 0;
+
+
+/*
+ * Free the nodes and the map of CPUs to nodes.
+ */
+static void
+nodes_free(void)
+{
+    size_t i;
+
+    for (i = 0; i < node_count; i++) {
+        procfile_close(&nodes[i].meminfo);
+        free(nodes[i].meminfo_path);
+    }
+    free(nodes);
+    nodes = NULL;
+    node_count = 0;
+    free(cpu_node);
+    cpu_node = NULL;
+    cpu_count = 0;
+    last_time = 0;
+}
+
+
+/*
+ * Record that a CPU is in a node, growing the map of CPUs to nodes as
+ * needed.
+ */
+static void
+cpu_add(unsigned long cpu, size_t node)
+{
+    size_t i, size;
+
+    if (cpu >= cpu_count) {
+        size = cpu + 1;
+        cpu_node = xreallocarray(cpu_node, size, sizeof(size_t));
+        for (i = cpu_count; i < size; i++)
+            cpu_node[i] = NUMA_NO_NODE;
+        cpu_count = size;
+    }
+    if (cpu_node[cpu] == NUMA_NO_NODE) {
+        cpu_node[cpu] = node;
+        nodes[node].cpus++;
+    }
+}
+
+
+/*
+ * Read the cpulist file of a node, which is a list of CPU numbers and ranges
+ * such as 0-3,8-11 and empty for a node with only memory, and add its CPUs
+ * to the map.  Returns false if the file can't be read or parsed.
+ */
+static bool
+read_cpulist(const char *dir, size_t node)
+{
+    char buffer[NUMA_FILE_MAX];
+    struct procfile file;
+    unsigned long first, last, cpu;
+    const char *p;
+    char *path;
+    ssize_t status;
+
+    xasprintf(&path, "%s/cpulist", dir);
+    file.path = path;
+    file.fd = -1;
+    status = procfile_read(&file, buffer, sizeof(buffer));
+    procfile_close(&file);
+    free(path);
+    if (status < 0)
+        return false;
+    p = buffer;
+    while (*p >= '0' && *p <= '9') {
+        p = procfile_fixed(p, 0, &first);
+        last = first;
+        if (*p == '-') {
+            p = procfile_fixed(p + 1, 0, &last);
+            if (p == NULL)
+                return false;
+        }
+        for (cpu = first; cpu <= last && cpu < NUMA_MAX_CPUS; cpu++)
+            cpu_add(cpu, node);
+        if (*p == ',')
+            p++;
+    }
+    return (*p == '\n' || *p == '\0');
+}
+
+
+/*
+ * Find the nodes and their CPUs.  A system without the sysfs directory has
+ * no NUMA information, which isn't an error.
+ */
+static void
+nodes_scan(void)
+{
+    const char *dir = (root != NULL) ? root : NUMA_ROOT;
+    DIR *nodedir;
+    struct dirent *entry;
+    char *path;
+    size_t size = 0;
+
+    nodes_free();
+    scanned = true;
+    nodedir = opendir(dir);
+    if (nodedir == NULL) {
+        if (errno != ENOENT)
+            syswarn("cannot open %s", dir);
+        return;
+    }
+    while ((entry = readdir(nodedir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) != 0
+            || entry->d_name[4] < '0' || entry->d_name[4] > '9')
+            continue;
+        if (node_count == size) {
+            size = (size == 0) ? 4 : size * 2;
+            nodes = xreallocarray(nodes, size, sizeof(struct numa_node));
+        }
+        memset(&nodes[node_count], 0, sizeof(struct numa_node));
+        xasprintf(&path, "%s/%s", dir, entry->d_name);
+        xasprintf(&nodes[node_count].meminfo_path, "%s/meminfo", path);
+        nodes[node_count].meminfo.path = nodes[node_count].meminfo_path;
+        nodes[node_count].meminfo.fd = -1;
+        node_count++;
+        if (!read_cpulist(path, node_count - 1))
+            warn("cannot parse %s/cpulist", path);
+        free(path);
+    }
+    closedir(nodedir);
+}
+
+
+/*
+ * Set the directory in which to look for nodes, or the default if dir is
+ * NULL, and forget any nodes found so far.
+ */
+void
+lbcd_numa_init(const char *dir)
+{
+    free(root);
+    root = (dir != NULL) ? xstrdup(dir) : NULL;
+    lbcd_numa_invalidate();
+}
+
+
+/*
+ * Forget the nodes and their CPUs so that they're found again on next use.
+ * Called when CPUs or memory are added or removed.
+ */
+void
+lbcd_numa_invalidate(void)
+{
+    nodes_free();
+    scanned = false;
+}
+
+
+/*
+ * Return the number of per-CPU entries that should be passed to
+ * lbcd_numa_update, or 0 if there are fewer than two nodes, in which case
+ * the totals for all CPUs are enough.
+ */
+size_t
+lbcd_numa_cpus(void)
+{
+    if (!scanned)
+        nodes_scan();
+    return (node_count > 1) ? cpu_count : 0;
+}
+
+
+/*
+ * Add the times of one CPU to a sum.
+ */
+static void
+times_add(struct cpustat_times *sum, const struct cpustat_times *times)
+{
+    sum->user    += times->user;
+    sum->nice    += times->nice;
+    sum->system  += times->system;
+    sum->idle    += times->idle;
+    sum->iowait  += times->iowait;
+    sum->irq     += times->irq;
+    sum->softirq += times->softirq;
+    sum->steal   += times->steal;
+}
+
+
+/*
+ * Add a sample of the times of a node to its moving average, given the
+ * seconds since the last sample, or 0 if there was none, and the half-life
+ * of the average in seconds.  The first sample only sets a baseline,
+ * and so does a sample whose counters went backwards, which happens when one
+ * of its CPUs goes offline.
+ */
+static void
+node_update(struct numa_node *node, const struct cpustat_times *times,
+            double elapsed, double half_life)
+{
+    const struct cpustat_times *last = &node->last;
+    unsigned long busy, total;
+
+    if (!node->have_last || times->user < last->user
+        || times->nice < last->nice || times->system < last->system
+        || times->idle < last->idle || times->iowait < last->iowait
+        || times->irq < last->irq || times->softirq < last->softirq
+        || times->steal < last->steal) {
+        node->last = *times;
+        node->have_last = true;
+        return;
+    }
+    busy = (times->user - last->user) + (times->nice - last->nice)
+        + (times->system - last->system) + (times->irq - last->irq)
+        + (times->softirq - last->softirq) + (times->steal - last->steal);
+    total = busy + (times->idle - last->idle)
+        + (times->iowait - last->iowait);
+    if (total == 0)
+        return;
+    node->util = sample_average(node->util, (double) busy / total, elapsed,
+                                half_life, node->have_util && elapsed > 0);
+    node->have_util = true;
+    node->last = *times;
+}
+
+
+/*
+ * Update the utilization of each node from a sample of /proc/stat taken at
+ * now, in microseconds, with moving averages of the given half-life in
+ * seconds.  total is the times for all CPUs, and cpus, if not NULL, is count
+ * entries of times of each CPU, which should be zero for offline CPUs.
+ * With a single node, its times are the totals.
+ */
+void
+lbcd_numa_update(const struct cpustat_times *total,
+                 const struct cpustat_times *cpus, size_t count,
+                 unsigned long long now, double half_life)
+{
+    struct cpustat_times *sums;
+    double elapsed = 0;
+    size_t i;
+
+    if (!scanned)
+        nodes_scan();
+    if (node_count == 0)
+        return;
+    if (last_time != 0 && now > last_time)
+        elapsed = (double) (now - last_time) / 1000000;
+    last_time = now;
+    if (node_count == 1) {
+        node_update(&nodes[0], total, elapsed, half_life);
+        return;
+    }
+    if (cpus == NULL)
+        return;
+    sums = xcalloc(node_count, sizeof(struct cpustat_times));
+    for (i = 0; i < count && i < cpu_count; i++)
+        if (cpu_node[i] != NUMA_NO_NODE)
+            times_add(&sums[cpu_node[i]], &cpus[i]);
+    for (i = 0; i < node_count; i++)
+        if (nodes[i].cpus > 0)
+            node_update(&nodes[i], &sums[i], elapsed, half_life);
+    free(sums);
+}
+
+
+/*
+ * Read the free memory of a node from its meminfo file, which has lines like
+ * "Node 0 MemFree: 1234 kB", in MiB.  Returns false if it can't be read or
+ * the node has no memory.
+ */
+static bool
+node_free(struct numa_node *node, unsigned long *free_mib)
+{
+    char buffer[NUMA_FILE_MAX];
+    unsigned long total, value;
+    const char *p;
+
+    if (procfile_read(&node->meminfo, buffer, sizeof(buffer)) < 0)
+        return false;
+    p = strstr(buffer, " MemTotal:");
+    if (p == NULL || procfile_fixed(p + 10, 0, &total) == NULL || total == 0)
+        return false;
+    p = strstr(buffer, " MemFree:");
+    if (p == NULL || procfile_fixed(p + 9, 0, &value) == NULL)
+        return false;
+    *free_mib = value / 1024;
+    return true;
+}
+
+
+/*
+ * Store the number of nodes, the highest and lowest utilization of any node
+ * with CPUs, and the lowest and highest free memory of any node with memory
+ * in info.  Returns 0 on success and -1 if there is no NUMA information.
+ * Utilizations are zero until two samples have been taken.
+ */
+int
+lbcd_numa_read(struct numa_info *info)
+{
+    unsigned long util, free_mib;
+    bool have_util = false;
+    bool have_free = false;
+    size_t i;
+
+    memset(info, 0, sizeof(*info));
+    if (!scanned)
+        nodes_scan();
+    if (node_count == 0)
+        return -1;
+    info->nodes = node_count;
+    for (i = 0; i < node_count; i++) {
+        if (nodes[i].have_util) {
+            util = (unsigned long) (nodes[i].util * 10000 + 0.5);
+            if (!have_util || util > info->util_max)
+                info->util_max = util;
+            if (!have_util || util < info->util_min)
+                info->util_min = util;
+            have_util = true;
+        }
+        if (node_free(&nodes[i], &free_mib)) {
+            if (!have_free || free_mib < info->free_min)
+                info->free_min = free_mib;
+            if (!have_free || free_mib > info->free_max)
+                info->free_max = free_mib;
+            have_free = true;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Close the meminfo files and forget the nodes.
+ */
+void
+lbcd_numa_close(void)
+{
+    lbcd_numa_init(NULL);
+}
@@ -0,0 +1,117 @@
+/*
+ * Penalty multipliers for a level above a threshold.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <server/penalty.h>
+#include <util/macros.h>
+#include <util/xmalloc.h>
+
+/* The most multipliers in a list, one for each percent. */
+#define PENALTY_MAX_COUNT 101
+
+/* The multipliers used with a threshold but no list. */
+static const unsigned long default_multiplier[] = {
+    2, 2, 2, 2,                 /* threshold to threshold + 3 */
+    4, 4, 4,                    /* threshold + 4 to threshold + 6 */
+    8, 8,                       /* threshold + 7 and threshold + 8 */
+    16,                         /* threshold + 9 */
+    32                          /* threshold + 10 and above */
+};
+
+
+/*
+ * Parse a non-negative decimal number no larger than max.  Returns a pointer
+ * to the character following it, or NULL if there is no number or it's too
+ * large.
+ */
+static const char *
+parse_number(const char *p, unsigned long max, unsigned long *value)
+{
+    unsigned long result = 0;
+
+    if (*p < '0' || *p > '9')
+        return NULL;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        result = result * 10 + (unsigned long) (*p - '0');
+        if (result > max)
+            return NULL;
+    }
+    *value = result;
+    return p;
+}
+
+
+/*
+ * Parse a penalty specification.  The threshold is a percentage, and each
+ * multiplier must be at least 1 and no more than PENALTY_MAX_MULTIPLIER.
+ */
+bool
+penalty_parse(const char *spec, struct penalty *penalty)
+{
+    unsigned long value[PENALTY_MAX_COUNT];
+    unsigned long threshold;
+    const char *p;
+    size_t count = 0;
+
+    memset(penalty, 0, sizeof(*penalty));
+    p = parse_number(spec, 100, &threshold);
+    if (p != NULL && *p == ':') {
+        do {
+            if (count == PENALTY_MAX_COUNT)
+                return false;
+            p = parse_number(p + 1, PENALTY_MAX_MULTIPLIER, &value[count]);
+            if (p == NULL || value[count] == 0)
+                return false;
+            count++;
+        } while (*p == ',');
+    }
+    if (p == NULL || *p != '\0')
+        return false;
+    if (count == 0) {
+        count = ARRAY_SIZE(default_multiplier);
+        memcpy(value, default_multiplier, sizeof(default_multiplier));
+    }
+    penalty->threshold = threshold;
+    penalty->multiplier = xcalloc(count, sizeof(unsigned long));
+    memcpy(penalty->multiplier, value, count * sizeof(unsigned long));
+    penalty->count = count;
+    return true;
+}
+
+
+/*
+ * Return the multiplier for a level.  Anything beyond the end of the list
+ * gets the last multiplier.
+ */
+unsigned long
+penalty_get(const struct penalty *penalty, unsigned long level)
+{
+    size_t index;
+
+    if (penalty->count == 0 || level < penalty->threshold)
+        return 1;
+    index = level - penalty->threshold;
+    if (index >= penalty->count)
+        index = penalty->count - 1;
+    return penalty->multiplier[index];
+}
+
+
+/*
+ * Free the multipliers of a penalty.
+ */
+void
+penalty_free(struct penalty *penalty)
+{
+    free(penalty->multiplier);
+    memset(penalty, 0, sizeof(*penalty));
+}
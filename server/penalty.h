@@ -0,0 +1,54 @@
+/*
+ * Penalty multipliers for a level above a threshold.
+ *
+ * The load service multiplies its weight by penalties for full filesystems
+ * and for memory pressure.  Both are configured the same way: a threshold
+ * percentage and a comma-separated list of multipliers, one for each
+ * percent at and above the threshold, with the last multiplier used for
+ * anything higher.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef SERVER_PENALTY_H
+#define SERVER_PENALTY_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+#include <portable/stdbool.h>
+
+#include <stddef.h>
+
+/* The largest penalty multiplier allowed. */
+#define PENALTY_MAX_MULTIPLIER 1000000
+
+/* A threshold and its multipliers.  No multipliers means no penalty. */
+struct penalty {
+    unsigned long threshold;
+    unsigned long *multiplier;
+    size_t count;
+};
+
+BEGIN_DECLS
+
+/*
+ * Parse a specification of the form threshold[:list] into a newly allocated
+ * penalty.  Without a list, the default multipliers of 2 at the threshold
+ * rising to 32 ten percent above it are used.  Returns false without
+ * reporting anything if the specification is invalid.
+ */
+bool penalty_parse(const char *spec, struct penalty *);
+
+/* Return the multiplier for a level, which is 1 below the threshold. */
+unsigned long penalty_get(const struct penalty *, unsigned long level);
+
+/* Free the multipliers of a penalty, leaving no penalty. */
+void penalty_free(struct penalty *);
+
+END_DECLS
+
+#endif /* !SERVER_PENALTY_H */
@@ -0,0 +1,229 @@
+/*
+ * Load weight plugins from shared objects.
+ *
+ * Each shared object in the plugin directory is opened with dlopen and must
+ * export a struct lbcd_plugin descriptor, defined in server/plugin.h.  Each
+ * plugin is then registered as a service under the name in its descriptor,
+ * alongside the built-in modules and probe scripts.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#ifdef HAVE_DLFCN_H
+# include <dlfcn.h>
+#endif
+#include <errno.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#include <sys/time.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <server/plugin.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+#ifdef HAVE_DLOPEN
+
+/* A loaded plugin. */
+struct plugin {
+    void *handle;                       /* Handle from dlopen */
+    const struct lbcd_plugin *desc;     /* Plugin descriptor */
+    void *data;                         /* Plugin-private data */
+};
+
+/*
+ * Wait for a file descriptor to become readable, but no later than the
+ * deadline.  Returns true if it's readable and false on timeout or error.
+ */
+static bool
+plugin_wait(int fd, time_t deadline)
+{
+    fd_set set;
+    struct timeval tv;
+    time_t now;
+    int status;
+
+    do {
+        now = time(NULL);
+        if (now >= deadline)
+            return false;
+        tv.tv_sec = deadline - now;
+        tv.tv_usec = 0;
+        FD_ZERO(&set);
+        FD_SET(fd, &set);
+        status = select(fd + 1, &set, NULL, NULL, &tv);
+    } while (status < 0 && errno == EINTR);
+    return status > 0;
+}
+
+
+/*
+ * The weight function registered for each plugin.  Calls the plugin's weight
+ * function, waiting on its file descriptor for as long as it reports that
+ * its check is pending, and returns the maximum weight on failure.
+ */
+static int
+plugin_weight(void *data, uint32_t *weight_val, uint32_t *incr_val,
+              int timeout, const char *portarg, struct lbcd_reply *lb UNUSED)
+{
+    const struct plugin *plugin = data;
+    time_t deadline;
+    int status, fd;
+
+    deadline = time(NULL) + timeout;
+    do {
+        fd = -1;
+        status = plugin->desc->weight(plugin->data, weight_val, incr_val, &fd,
+                                      portarg, timeout);
+        if (status == LBCD_PLUGIN_PENDING)
+            if (fd < 0 || !plugin_wait(fd, deadline)) {
+                if (plugin->desc->cancel != NULL)
+                    plugin->desc->cancel(plugin->data);
+                status = LBCD_PLUGIN_ERROR;
+            }
+    } while (status == LBCD_PLUGIN_PENDING);
+    if (status != LBCD_PLUGIN_OK) {
+        *weight_val = (uint32_t) -1;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Tear down and unload a plugin.  Called by the service registry, which owns
+ * the registered plugins.
+ */
+static void
+plugin_free(void *data)
+{
+    struct plugin *plugin = data;
+
+    if (plugin->desc->teardown != NULL)
+        plugin->desc->teardown(plugin->data);
+    dlclose(plugin->handle);
+    free(plugin);
+}
+
+
+/*
+ * Load a single plugin from the given path.  Returns the new plugin or NULL
+ * on error, after reporting the error with warn.
+ */
+static struct plugin *
+plugin_load(const char *path)
+{
+    void *handle;
+    const struct lbcd_plugin *desc;
+    struct plugin *plugin;
+    void *data = NULL;
+
+    handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        warn("cannot load plugin %s: %s", path, dlerror());
+        return NULL;
+    }
+    desc = dlsym(handle, LBCD_PLUGIN_SYMBOL);
+    if (desc == NULL) {
+        warn("plugin %s has no %s symbol", path, LBCD_PLUGIN_SYMBOL);
+        goto fail;
+    }
+    if (desc->version != LBCD_PLUGIN_VERSION) {
+        warn("plugin %s has interface version %u, need %u", path,
+             desc->version, LBCD_PLUGIN_VERSION);
+        goto fail;
+    }
+    if (desc->name == NULL || desc->name[0] == '\0'
+        || strlen(desc->name) >= sizeof(lbcd_name_type)
+        || strchr(desc->name, ':') != NULL) {
+        warn("plugin %s has an invalid service name", path);
+        goto fail;
+    }
+    if (desc->weight == NULL) {
+        warn("plugin %s has no weight function", path);
+        goto fail;
+    }
+    if (desc->init != NULL && desc->init(&data) != 0) {
+        warn("plugin %s failed to initialize", path);
+        goto fail;
+    }
+    plugin = xmalloc(sizeof(struct plugin));
+    plugin->handle = handle;
+    plugin->desc = desc;
+    plugin->data = data;
+    return plugin;
+
+fail:
+    dlclose(handle);
+    return NULL;
+}
+
+
+/*
+ * Load every shared object in a directory as a plugin and register each one
+ * as a service.  Only files ending in .so are considered.  Returns true on
+ * success and false if any plugin could not be loaded.
+ */
+bool
+lbcd_plugin_init(const char *dir)
+{
+    DIR *modules;
+    struct dirent *entry;
+    struct plugin *plugin;
+    unsigned int ttl;
+    size_t length;
+    char *path;
+    bool okay = true;
+
+    modules = opendir(dir);
+    if (modules == NULL) {
+        syswarn("cannot open plugin directory %s", dir);
+        return false;
+    }
+    while ((entry = readdir(modules)) != NULL) {
+        length = strlen(entry->d_name);
+        if (entry->d_name[0] == '.' || length < 4
+            || strcmp(entry->d_name + length - 3, ".so") != 0)
+            continue;
+        xasprintf(&path, "%s/%s", dir, entry->d_name);
+        plugin = plugin_load(path);
+        free(path);
+        if (plugin == NULL) {
+            okay = false;
+            continue;
+        }
+        ttl = 0;
+        if (plugin->desc->cacheable != NULL)
+            ttl = plugin->desc->cacheable(plugin->data);
+        lbcd_service_register(plugin->desc->name, plugin_weight, plugin, ttl,
+                              plugin_free);
+    }
+    closedir(modules);
+    return okay;
+}
+
+#else /* !HAVE_DLOPEN */
+
+/*
+ * Without dlopen, plugins are not supported.  Report an error if the user
+ * tries to load any.
+ */
+bool
+lbcd_plugin_init(const char *dir UNUSED)
+{
+    warn("plugins are not supported on this system");
+    return false;
+}
+
+#endif /* !HAVE_DLOPEN */
@@ -0,0 +1,91 @@
+/*
+ * Interface for dynamically loaded lbcd weight plugins.
+ *
+ * A plugin is a shared object placed in the directory given to lbcd with -M.
+ * It must export a symbol named lbcd_plugin (LBCD_PLUGIN_SYMBOL) that is a
+ * struct lbcd_plugin with the version field set to LBCD_PLUGIN_VERSION.  The
+ * plugin is then available as a service with the name given in the
+ * descriptor, just like the built-in modules.
+ *
+ * This header is installed and is the only interface between lbcd and its
+ * plugins, so it deliberately does not depend on any other lbcd header.  Any
+ * incompatible change to this structure must increment LBCD_PLUGIN_VERSION.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef LBCD_PLUGIN_H
+#define LBCD_PLUGIN_H 1
+
+#include <stdint.h>
+
+/* The version of the plugin interface described by this header. */
+#define LBCD_PLUGIN_VERSION 1
+
+/* The name of the symbol lbcd looks for in each plugin. */
+#define LBCD_PLUGIN_SYMBOL "lbcd_plugin"
+
+/* Return values of the weight function. */
+#define LBCD_PLUGIN_OK       0  /* Weight and increment have been set */
+#define LBCD_PLUGIN_ERROR   -1  /* The service is down or the check failed */
+#define LBCD_PLUGIN_PENDING  1  /* Call again once *fd is readable */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct lbcd_plugin {
+    /* Must be LBCD_PLUGIN_VERSION. */
+    unsigned int version;
+
+    /*
+     * The service name, which must be shorter than 32 characters and must not
+     * contain a colon.
+     */
+    const char *name;
+
+    /*
+     * Called once after the plugin is loaded.  May store a pointer to
+     * plugin-private data in *data, which is passed to the other functions.
+     * Returns 0 on success and anything else to refuse to load.  May be NULL.
+     */
+    int (*init)(void **data);
+
+    /*
+     * Compute the weight and increment.  portarg is whatever followed a colon
+     * in the requested service name, or NULL, and timeout is the number of
+     * seconds the check may take.  *incr is preset to the default increment.
+     *
+     * A plugin that has to wait for something, such as a reply from a
+     * service, may store a file descriptor in *fd and return
+     * LBCD_PLUGIN_PENDING.  lbcd will call the weight function again with the
+     * same arguments once that descriptor is readable, so the plugin must
+     * remember its own progress.  If the timeout expires first, lbcd calls
+     * cancel instead.
+     */
+    int (*weight)(void *data, uint32_t *weight, uint32_t *incr, int *fd,
+                  const char *portarg, int timeout);
+
+    /* Abandon a pending check after a timeout.  May be NULL. */
+    void (*cancel)(void *data);
+
+    /* Called before the plugin is unloaded.  May be NULL. */
+    void (*teardown)(void *data);
+
+    /*
+     * Returns the number of seconds for which a result may be reused for
+     * later queries, or 0 if results must not be cached.  Queried once after
+     * init.  May be NULL, which means results are not cached.
+     */
+    unsigned int (*cacheable)(void *data);
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !LBCD_PLUGIN_H */
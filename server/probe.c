@@ -0,0 +1,631 @@
+/*
+ * Declarative send/expect service probes.
+ *
+ * Rather than writing a new module in C for every locally-run TCP service,
+ * lbcd can load small probe scripts from a directory.  Each script is named
+ * after the service it provides and contains a sequence of directives: data
+ * to send, prefixes or regular expressions to expect in the reply, and
+ * optionally a regular expression from which the weight is extracted.  For
+ * example:
+ *
+ *     # Check the in-house queue daemon.
+ *     port 7010
+ *     timeout 2
+ *     send "STATUS\r\n"
+ *     expect "200 "
+ *     weight "depth=([0-9]+)"
+ *
+ * Each script is compiled once, when loaded, into an array of operations with
+ * the regular expressions already compiled.  Running a probe is then a single
+ * pass through that state machine over a non-blocking socket, accumulating
+ * replies in a buffer so that replies split across several reads are handled
+ * correctly, with one deadline for the whole exchange.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <regex.h>
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#include <sys/time.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Size of the buffer used to accumulate replies from the service. */
+#define PROBE_BUFSIZ 4096
+
+/* Maximum length of a line in a probe script. */
+#define PROBE_LINE 1024
+
+/* The types of operations in a compiled probe. */
+enum probe_op_type {
+    PROBE_SEND,                 /* Send data to the service */
+    PROBE_EXPECT,               /* Expect a reply starting with a prefix */
+    PROBE_MATCH,                /* Expect a reply matching a regex */
+    PROBE_WEIGHT                /* Match a regex and extract the weight */
+};
+
+/* A single step in a compiled probe. */
+struct probe_op {
+    enum probe_op_type type;
+    char *data;                 /* Data to send or prefix to expect */
+    size_t length;              /* Length of data */
+    regex_t regex;              /* Compiled regex for match and weight */
+};
+
+/* A compiled probe script. */
+struct probe_script {
+    char *name;                 /* Service name (the file name) */
+    char *host;                 /* Host to probe, default localhost */
+    char *port;                 /* Port number or service name */
+    int timeout;                /* Timeout in seconds, 0 for the default */
+    uint32_t increment;         /* Increment to return */
+    bool have_increment;        /* Whether increment was set */
+    struct probe_op *ops;       /* The operations to perform */
+    size_t count;               /* Count of operations */
+};
+
+/*
+ * The state of a running probe.  The buffer holds data read from the service
+ * that hasn't yet been consumed by an expect, match, or weight operation.
+ */
+struct probe_state {
+    const struct probe_script *script;
+    size_t op;                  /* Index of the current operation */
+    size_t sent;                /* Bytes of the current send already sent */
+    char buffer[PROBE_BUFSIZ];  /* Data read but not yet consumed */
+    size_t used;                /* Bytes in buffer */
+    bool eof;                   /* Whether the service closed the socket */
+    uint32_t weight;            /* Weight extracted from the reply */
+};
+
+/* What a probe step needs to continue. */
+enum probe_status {
+    PROBE_DONE,                 /* The probe succeeded */
+    PROBE_FAIL,                 /* The probe failed */
+    PROBE_READ,                 /* Wait for the socket to be readable */
+    PROBE_WRITE                 /* Wait for the socket to be writable */
+};
+
+/*
+ * Free a compiled probe script.
+ */
+void
+lbcd_probe_script_free(struct probe_script *script)
+{
+    size_t i;
+
+    if (script == NULL)
+        return;
+    for (i = 0; i < script->count; i++) {
+        free(script->ops[i].data);
+        if (script->ops[i].type == PROBE_MATCH
+            || script->ops[i].type == PROBE_WEIGHT)
+            regfree(&script->ops[i].regex);
+    }
+    free(script->ops);
+    free(script->name);
+    free(script->host);
+    free(script->port);
+    free(script);
+}
+
+
+/*
+ * Parse a quoted string argument, handling the usual backslash escapes (\r,
+ * \n, \t, \\, \", and \xHH).  Stores the newly-allocated result in data and
+ * its length in length.  Returns false if the string is not properly quoted.
+ */
+static bool
+parse_string(const char *arg, char **data, size_t *length)
+{
+    const char *p;
+    char *out;
+    size_t i = 0;
+    unsigned int hex;
+
+    if (*arg != '"')
+        return false;
+    out = xmalloc(strlen(arg) + 1);
+    for (p = arg + 1; *p != '\0' && *p != '"'; p++) {
+        if (*p != '\\') {
+            out[i++] = *p;
+            continue;
+        }
+        p++;
+        switch (*p) {
+        case 'r':  out[i++] = '\r'; break;
+        case 'n':  out[i++] = '\n'; break;
+        case 't':  out[i++] = '\t'; break;
+        case '\\': out[i++] = '\\'; break;
+        case '"':  out[i++] = '"';  break;
+        case 'x':
+            if (!isxdigit((int) p[1]) || !isxdigit((int) p[2])
+                || sscanf(p + 1, "%2x", &hex) != 1)
+                goto fail;
+            out[i++] = (char) hex;
+            p += 2;
+            break;
+        default:
+            goto fail;
+        }
+    }
+    if (*p != '"')
+        goto fail;
+    for (p++; isspace((int) *p); p++)
+        ;
+    if (*p != '\0')
+        goto fail;
+    out[i] = '\0';
+    *data = out;
+    *length = i;
+    return true;
+
+fail:
+    free(out);
+    return false;
+}
+
+
+/*
+ * Parse a non-negative integer argument, returning false if it isn't one.
+ */
+static bool
+parse_number(const char *arg, unsigned long *value)
+{
+    char *end;
+
+    if (!isdigit((int) *arg))
+        return false;
+    errno = 0;
+    *value = strtoul(arg, &end, 10);
+    if (errno != 0)
+        return false;
+    while (isspace((int) *end))
+        end++;
+    return *end == '\0';
+}
+
+
+/*
+ * Add a new operation to a script being compiled.  Takes the operation type
+ * and the quoted argument and returns false if the argument could not be
+ * parsed or compiled.  Writes a warning with the file and line on error.
+ */
+static bool
+probe_add_op(struct probe_script *script, enum probe_op_type type,
+             const char *arg, const char *path, unsigned int line)
+{
+    struct probe_op *op;
+    int status;
+    char error[BUFSIZ];
+
+    script->ops = xreallocarray(script->ops, script->count + 1,
+                                sizeof(struct probe_op));
+    op = &script->ops[script->count];
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+    if (!parse_string(arg, &op->data, &op->length)) {
+        warn("%s:%u: invalid quoted string", path, line);
+        return false;
+    }
+    if (type == PROBE_MATCH || type == PROBE_WEIGHT) {
+        status = regcomp(&op->regex, op->data, REG_EXTENDED);
+        if (status != 0) {
+            regerror(status, &op->regex, error, sizeof(error));
+            warn("%s:%u: invalid regex: %s", path, line, error);
+            free(op->data);
+            return false;
+        }
+        if (type == PROBE_WEIGHT && op->regex.re_nsub < 1) {
+            warn("%s:%u: weight regex has no subexpression", path, line);
+            regfree(&op->regex);
+            free(op->data);
+            return false;
+        }
+    }
+    script->count++;
+    return true;
+}
+
+
+/*
+ * Compile a probe script from a file.  Takes the service name for the script
+ * and the path to the file.  Returns the newly-allocated compiled script or
+ * NULL on error, after reporting the error with warn.
+ */
+struct probe_script *
+lbcd_probe_compile(const char *name, const char *path)
+{
+    FILE *file;
+    struct probe_script *script;
+    char buffer[PROBE_LINE];
+    char *p, *directive, *arg;
+    unsigned int line = 0;
+    unsigned long value;
+    bool okay = true;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        syswarn("cannot open %s", path);
+        return NULL;
+    }
+    script = xcalloc(1, sizeof(struct probe_script));
+    script->name = xstrdup(name);
+    while (okay && fgets(buffer, sizeof(buffer), file) != NULL) {
+        line++;
+        p = strchr(buffer, '\n');
+        if (p == NULL && !feof(file)) {
+            warn("%s:%u: line too long", path, line);
+            okay = false;
+            break;
+        }
+        if (p != NULL)
+            *p = '\0';
+
+        /* Split into the directive and its argument, skipping comments. */
+        for (directive = buffer; isspace((int) *directive); directive++)
+            ;
+        if (*directive == '\0' || *directive == '#')
+            continue;
+        for (arg = directive; *arg != '\0' && !isspace((int) *arg); arg++)
+            ;
+        if (*arg != '\0')
+            *arg++ = '\0';
+        while (isspace((int) *arg))
+            arg++;
+        for (p = arg + strlen(arg); p > arg && isspace((int) p[-1]); p--)
+            p[-1] = '\0';
+        if (*arg == '\0') {
+            warn("%s:%u: missing argument to %s", path, line, directive);
+            okay = false;
+            break;
+        }
+
+        /* Handle each directive. */
+        if (strcmp(directive, "host") == 0) {
+            free(script->host);
+            script->host = xstrdup(arg);
+        } else if (strcmp(directive, "port") == 0) {
+            free(script->port);
+            script->port = xstrdup(arg);
+        } else if (strcmp(directive, "timeout") == 0) {
+            if (!parse_number(arg, &value) || value < 1 || value > 300) {
+                warn("%s:%u: invalid timeout %s", path, line, arg);
+                okay = false;
+            } else
+                script->timeout = (int) value;
+        } else if (strcmp(directive, "increment") == 0) {
+            if (!parse_number(arg, &value) || value > UINT32_MAX) {
+                warn("%s:%u: invalid increment %s", path, line, arg);
+                okay = false;
+            } else {
+                script->increment = (uint32_t) value;
+                script->have_increment = true;
+            }
+        } else if (strcmp(directive, "send") == 0)
+            okay = probe_add_op(script, PROBE_SEND, arg, path, line);
+        else if (strcmp(directive, "expect") == 0)
+            okay = probe_add_op(script, PROBE_EXPECT, arg, path, line);
+        else if (strcmp(directive, "match") == 0)
+            okay = probe_add_op(script, PROBE_MATCH, arg, path, line);
+        else if (strcmp(directive, "weight") == 0)
+            okay = probe_add_op(script, PROBE_WEIGHT, arg, path, line);
+        else {
+            warn("%s:%u: unknown directive %s", path, line, directive);
+            okay = false;
+        }
+    }
+    if (okay && ferror(file)) {
+        syswarn("cannot read %s", path);
+        okay = false;
+    }
+    fclose(file);
+    if (okay && script->port == NULL) {
+        warn("%s: no port specified", path);
+        okay = false;
+    }
+    if (!okay) {
+        lbcd_probe_script_free(script);
+        return NULL;
+    }
+    return script;
+}
+
+
+/*
+ * Consume the first length bytes of the probe buffer.
+ */
+static void
+probe_consume(struct probe_state *state, size_t length)
+{
+    memmove(state->buffer, state->buffer + length, state->used - length);
+    state->used -= length;
+}
+
+
+/*
+ * Run as much of the probe as possible without blocking.  Returns PROBE_DONE
+ * or PROBE_FAIL when the probe is finished or PROBE_READ or PROBE_WRITE if
+ * the probe has to wait for the socket.
+ */
+static enum probe_status
+probe_step(struct probe_state *state, socket_type fd)
+{
+    const struct probe_op *op;
+    ssize_t status;
+    size_t length;
+    regmatch_t match[2];
+    unsigned long value;
+    char *end;
+
+    while (state->op < state->script->count) {
+        op = &state->script->ops[state->op];
+
+        /* Sends write as much as possible and then move on. */
+        if (op->type == PROBE_SEND) {
+            status = socket_write(fd, op->data + state->sent,
+                                  op->length - state->sent);
+            if (status < 0) {
+                if (errno == EAGAIN || errno == EINTR)
+                    return PROBE_WRITE;
+                return PROBE_FAIL;
+            }
+            state->sent += status;
+            if (state->sent < op->length)
+                return PROBE_WRITE;
+            state->sent = 0;
+            state->op++;
+            continue;
+        }
+
+        /* Everything else matches against the buffered reply. */
+        if (op->type == PROBE_EXPECT) {
+            length = (state->used < op->length) ? state->used : op->length;
+            if (memcmp(state->buffer, op->data, length) != 0)
+                return PROBE_FAIL;
+            if (length == op->length) {
+                probe_consume(state, length);
+                state->op++;
+                continue;
+            }
+        } else {
+            state->buffer[state->used] = '\0';
+            if (regexec(&op->regex, state->buffer, 2, match, 0) == 0) {
+                if (op->type == PROBE_WEIGHT) {
+                    if (match[1].rm_so < 0)
+                        return PROBE_FAIL;
+                    errno = 0;
+                    value = strtoul(state->buffer + match[1].rm_so, &end, 10);
+                    if (errno != 0 || value > UINT32_MAX
+                        || end == state->buffer + match[1].rm_so)
+                        return PROBE_FAIL;
+                    state->weight = (uint32_t) value;
+                }
+                probe_consume(state, (size_t) match[0].rm_eo);
+                state->op++;
+                continue;
+            }
+            if (state->used >= sizeof(state->buffer) - 1)
+                return PROBE_FAIL;
+        }
+
+        /* We need more data.  Try to read it. */
+        if (state->eof)
+            return PROBE_FAIL;
+        status = socket_read(fd, state->buffer + state->used,
+                             sizeof(state->buffer) - 1 - state->used);
+        if (status < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return PROBE_READ;
+            return PROBE_FAIL;
+        } else if (status == 0)
+            state->eof = true;
+        else
+            state->used += status;
+    }
+    return PROBE_DONE;
+}
+
+
+/*
+ * Wait for a socket to become readable or writable, but no later than the
+ * deadline.  Returns true if the socket is ready and false on timeout or
+ * error.
+ */
+static bool
+probe_wait(socket_type fd, enum probe_status want, time_t deadline)
+{
+    fd_set set;
+    struct timeval tv;
+    time_t now;
+    int status;
+
+    do {
+        now = time(NULL);
+        if (now >= deadline)
+            return false;
+        tv.tv_sec = deadline - now;
+        tv.tv_usec = 0;
+        FD_ZERO(&set);
+        FD_SET(fd, &set);
+        if (want == PROBE_READ)
+            status = select(fd + 1, &set, NULL, NULL, &tv);
+        else
+            status = select(fd + 1, NULL, &set, NULL, &tv);
+    } while (status < 0 && errno == EINTR);
+    return status > 0;
+}
+
+
+/*
+ * Open a non-blocking connection to the service described by a script,
+ * waiting no later than the deadline for the connection to complete.
+ * Returns the connected socket or INVALID_SOCKET on failure.
+ */
+static socket_type
+probe_connect(const struct probe_script *script, time_t deadline)
+{
+    struct addrinfo hints, *ai, *res;
+    socket_type fd = INVALID_SOCKET;
+    int error;
+    socklen_t length;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(script->host ? script->host : "localhost", script->port,
+                    &hints, &res) != 0)
+        return INVALID_SOCKET;
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == INVALID_SOCKET)
+            continue;
+        if (!fdflag_nonblocking(fd, true))
+            goto next;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        if (errno != EINPROGRESS)
+            goto next;
+        if (!probe_wait(fd, PROBE_WRITE, deadline))
+            goto next;
+        length = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0
+            && error == 0)
+            break;
+    next:
+        socket_close(fd);
+        fd = INVALID_SOCKET;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+
+/*
+ * Run a compiled probe script with the given default timeout.  On success,
+ * stores the weight extracted from the reply (or 0 if the script doesn't
+ * extract one) in weight and returns 0.  Returns -1 on failure.
+ */
+int
+lbcd_probe_run(const struct probe_script *script, int timeout,
+               uint32_t *weight)
+{
+    struct probe_state *state;
+    socket_type fd;
+    enum probe_status status;
+    time_t deadline;
+
+    if (script->timeout > 0)
+        timeout = script->timeout;
+    deadline = time(NULL) + timeout;
+    fd = probe_connect(script, deadline);
+    if (fd == INVALID_SOCKET)
+        return -1;
+    state = xcalloc(1, sizeof(struct probe_state));
+    state->script = script;
+    do {
+        status = probe_step(state, fd);
+        if (status == PROBE_READ || status == PROBE_WRITE)
+            if (!probe_wait(fd, status, deadline))
+                status = PROBE_FAIL;
+    } while (status == PROBE_READ || status == PROBE_WRITE);
+    socket_close(fd);
+    *weight = state->weight;
+    free(state);
+    return (status == PROBE_DONE) ? 0 : -1;
+}
+
+
+/*
+ * The weight function registered for each probe script.  Runs the probe and
+ * returns the extracted weight, or the maximum weight if the probe fails.
+ */
+static int
+probe_weight(void *data, uint32_t *weight_val, uint32_t *incr_val,
+             int timeout, const char *portarg UNUSED,
+             struct lbcd_reply *lb UNUSED)
+{
+    const struct probe_script *script = data;
+
+    if (script->have_increment)
+        *incr_val = script->increment;
+    if (lbcd_probe_run(script, timeout, weight_val) < 0) {
+        *weight_val = (uint32_t) -1;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Free a probe script registered as a service.  Called by the service
+ * registry, which owns the registered scripts.
+ */
+static void
+probe_free(void *data)
+{
+    lbcd_probe_script_free(data);
+}
+
+
+/*
+ * Load every probe script in a directory and register each one as a service
+ * named after its file.  Files whose names start with a period or end in a
+ * tilde are ignored, as are names that can't be sent in a protocol request.
+ * Returns true on success and false if any script could not be compiled.
+ */
+bool
+lbcd_probe_init(const char *dir)
+{
+    DIR *probes;
+    struct dirent *entry;
+    struct probe_script *script;
+    const char *name;
+    char *path;
+    size_t length;
+    bool okay = true;
+
+    probes = opendir(dir);
+    if (probes == NULL) {
+        syswarn("cannot open probe directory %s", dir);
+        return false;
+    }
+    while ((entry = readdir(probes)) != NULL) {
+        name = entry->d_name;
+        length = strlen(name);
+        if (name[0] == '.' || name[length - 1] == '~')
+            continue;
+        if (length >= sizeof(lbcd_name_type) || strchr(name, ':') != NULL) {
+            warn("ignoring probe %s: invalid service name", name);
+            continue;
+        }
+        xasprintf(&path, "%s/%s", dir, name);
+        script = lbcd_probe_compile(name, path);
+        free(path);
+        if (script == NULL) {
+            okay = false;
+            continue;
+        }
+        lbcd_service_register(script->name, probe_weight, script, 0,
+                              probe_free);
+    }
+    closedir(probes);
+    return okay;
+}
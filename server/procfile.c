@@ -0,0 +1,133 @@
+/*
+ * Reading small files under /proc.
+ *
+ * Files under /proc are generated when read, so reading from offset zero
+ * again returns the current contents without reopening the file.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+
+#include <server/procfile.h>
+#include <util/fdflag.h>
+#include <util/messages.h>
+
+
+/*
+ * Open the file if needed.  Returns false after reporting the problem with
+ * syswarn on failure.
+ */
+static bool
+procfile_open(struct procfile *file)
+{
+    if (file->fd >= 0)
+        return true;
+    file->fd = open(file->path, O_RDONLY);
+    if (file->fd < 0) {
+        syswarn("cannot open %s", file->path);
+        return false;
+    }
+    if (!fdflag_close_exec(file->fd, true)) {
+        syswarn("cannot set %s close on exec", file->path);
+        procfile_close(file);
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Read the file into buffer, opening it first if needed, and nul-terminate
+ * it.  On a read error, close the file so that it's reopened next time.
+ */
+ssize_t
+procfile_read(struct procfile *file, char *buffer, size_t size)
+{
+    ssize_t status;
+
+    if (size == 0 || !procfile_open(file))
+        return -1;
+    do {
+        status = pread(file->fd, buffer, size - 1, 0);
+    } while (status < 0 && errno == EINTR);
+    if (status < 0) {
+        syswarn("cannot read %s", file->path);
+        procfile_close(file);
+        return -1;
+    }
+    buffer[status] = '\0';
+    return status;
+}
+
+
+/*
+ * Close the file if it's open.
+ */
+void
+procfile_close(struct procfile *file)
+{
+    if (file->fd >= 0)
+        close(file->fd);
+    file->fd = -1;
+}
+
+
+/*
+ * Parse a non-negative decimal number as a fixed-point number with the given
+ * number of places after the decimal point.
+ */
+const char *
+procfile_fixed(const char *p, unsigned int places, unsigned long *value)
+{
+    unsigned long result = 0;
+    unsigned int i;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p < '0' || *p > '9')
+        return NULL;
+    for (; *p >= '0' && *p <= '9'; p++)
+        result = result * 10 + (unsigned long) (*p - '0');
+    if (*p == '.')
+        p++;
+    for (i = 0; i < places; i++) {
+        result *= 10;
+        if (*p >= '0' && *p <= '9') {
+            result += (unsigned long) (*p - '0');
+            p++;
+        }
+    }
+    while (*p >= '0' && *p <= '9')
+        p++;
+    *value = result;
+    return p;
+}
+
+
+/*
+ * Parse a non-negative decimal counter, which may be larger than an unsigned
+ * long on 32-bit systems.
+ */
+const char *
+procfile_counter(const char *p, unsigned long long *value)
+{
+    unsigned long long result = 0;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p < '0' || *p > '9')
+        return NULL;
+    for (; *p >= '0' && *p <= '9'; p++)
+        result = result * 10 + (unsigned long long) (*p - '0');
+    *value = result;
+    return p;
+}
@@ -0,0 +1,63 @@
+/*
+ * Reading small files under /proc.
+ *
+ * lbcd reads the same files under /proc for every reply.  Rather than
+ * opening and parsing them with stdio each time, a procfile keeps the file
+ * open for the life of the daemon and rereads it from the beginning with
+ * pread into a buffer provided by the caller.  The numbers in it are parsed
+ * by hand, as fixed-point integers, so that the parsing doesn't depend on the
+ * locale.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef SERVER_PROCFILE_H
+#define SERVER_PROCFILE_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+
+#include <sys/types.h>
+
+/* A file that's kept open.  Initialize with PROCFILE_INIT. */
+struct procfile {
+    const char *path;
+    int fd;
+};
+#define PROCFILE_INIT(path) { (path), -1 }
+
+BEGIN_DECLS
+
+/*
+ * Read the file into buffer, opening it first if needed, and nul-terminate
+ * it.  If the file is larger than the buffer, only its beginning is read.
+ * Returns the length read, or -1 after reporting the problem with syswarn.
+ */
+ssize_t procfile_read(struct procfile *, char *buffer, size_t size);
+
+/* Close the file if it's open. */
+void procfile_close(struct procfile *);
+
+/*
+ * Parse a non-negative decimal number, skipping leading spaces and tabs, as
+ * a fixed-point number with the given number of places after the decimal
+ * point.  Extra places are truncated.  Returns a pointer to the character
+ * following the number, or NULL if there is no number.
+ */
+const char *procfile_fixed(const char *, unsigned int places,
+                           unsigned long *value);
+
+/*
+ * Parse a non-negative decimal counter, skipping leading spaces and tabs.
+ * Returns a pointer to the character following it, or NULL if there is no
+ * number.
+ */
+const char *procfile_counter(const char *, unsigned long long *value);
+
+END_DECLS
+
+#endif /* !SERVER_PROCFILE_H */
@@ -30,9 +30,10 @@
 #define LBCD_VERSION 3          /* Protocol version client speaks */
 #define LBCD_TIMEOUT 5          /* Default service poll timeout */
 
-/* Protocol operation codes.  Currently, there's only one. */
+/* Protocol operation codes. */
 enum lbcd_op {
-    LBCD_OP_LBINFO = 1          /* Load balance info, request and reply */
+    LBCD_OP_LBINFO     = 1,     /* Load balance info, request and reply */
+    LBCD_OP_LBINFO_EXT = 2      /* Load balance info with extended fields */
 };
 
 /* Status codes returned in the header.  Some of these aren't used. */
@@ -92,4 +93,33 @@ struct lbcd_reply {
                                 /* Host service weight/increment pairs */
 };
 
+/*
+ * Extended fields.  The reply to an LBCD_OP_LBINFO_EXT request is the same as
+ * the reply to LBCD_OP_LBINFO followed by a count of extended fields and that
+ * many fields, each a type and a value.  Clients should skip fields with
+ * types they don't recognize.
+ */
+#define LBCD_MAX_EXT 16         /* Max extended fields in a reply */
+enum lbcd_ext_type {
+    LBCD_EXT_CPUS = 1,          /* Number of CPUs available times 100 */
+    LBCD_EXT_NL1  = 2,          /* 1 minute load per CPU times 100 */
+    LBCD_EXT_NL5  = 3,          /* 5 minute load per CPU times 100 */
+    LBCD_EXT_NL15 = 4,          /* 15 minute load per CPU times 100 */
+    LBCD_EXT_CAPACITY = 5,      /* Capacity score, 100 for the reference */
+    LBCD_EXT_NUMA_UTIL_MAX = 6, /* Percent busy of busiest node times 100 */
+    LBCD_EXT_NUMA_UTIL_MIN = 7, /* Percent busy of idlest node times 100 */
+    LBCD_EXT_NUMA_FREE_MIN = 8, /* Free MiB of the fullest node */
+    LBCD_EXT_NUMA_FREE_MAX = 9  /* Free MiB of the emptiest node */
+};
+struct lbcd_ext_field {
+    uint16_t type;              /* Type of field */
+    uint16_t reserved;          /* Future use, padding ... */
+    uint32_t value;             /* Value of field */
+};
+struct lbcd_ext {
+    uint16_t count;             /* Number of extended fields */
+    uint16_t reserved;          /* Future use, padding ... */
+    struct lbcd_ext_field fields[LBCD_MAX_EXT];
+};
+
 #endif /* !LBCD_PROTOCOL_H */
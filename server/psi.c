@@ -0,0 +1,370 @@
+/*
+ * Pressure stall information.
+ *
+ * Linux reports how much of the time tasks were stalled waiting for CPU,
+ * memory, and I/O in /proc/pressure.  Unlike the load average, this measures
+ * work that isn't getting done, so it catches systems that are thrashing
+ * while their load looks reasonable.  The averages are exposed as metrics,
+ * and the psi service combines them into a weight using configurable
+ * coefficients.
+ *
+ * The averages only change every two seconds and avg10 takes ten seconds to
+ * catch up with a sudden stall, so we also register PSI triggers where the
+ * kernel allows it.  The kernel notifies us as soon as stall time in a short
+ * window crosses a threshold, and the psi_stall metric is set for the next
+ * ten seconds.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <server/metrics.h>
+#include <server/procfile.h>
+#include <util/fdflag.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* The longest pressure file we expect.  Each has at most two short lines. */
+#define PSI_FILE_MAX 256
+
+/* How long psi_stall stays set after a trigger fires, in seconds. */
+#define PSI_STALL_TIME 10
+
+/* Coefficients used if none are configured. */
+#define PSI_DEFAULT_WEIGHTS \
+    "cpu_some10=1,memory_full10=4,io_full10=2,stall=5000"
+
+/* The increment returned by the psi service. */
+#define PSI_INCREMENT 200
+
+/* The pressure files, in the same order as enum psi_resource. */
+static struct procfile psi_files[PSI_RESOURCE_COUNT] = {
+    PROCFILE_INIT("/proc/pressure/cpu"),
+    PROCFILE_INIT("/proc/pressure/memory"),
+    PROCFILE_INIT("/proc/pressure/io")
+};
+
+/* Whether we've checked that each file exists, and whether it does. */
+static bool psi_checked[PSI_RESOURCE_COUNT];
+static bool psi_available[PSI_RESOURCE_COUNT];
+
+/*
+ * The triggers we register: stall time that should wake us, in microseconds
+ * out of a one-second window.  Unprivileged processes may only use windows
+ * that are a multiple of two seconds, so if the kernel rejects a one-second
+ * window, we fall back to two seconds and double the threshold.
+ */
+static const struct {
+    enum psi_resource resource;
+    const char *type;
+    unsigned long threshold;
+} psi_triggers[] = {
+    { PSI_CPU,    "some", 100000 },
+    { PSI_MEMORY, "full",  50000 },
+    { PSI_IO,     "full", 100000 },
+};
+static const unsigned long psi_windows[] = { 1000000, 2000000 };
+
+/* Open trigger file descriptors, or -1, and whether we've opened them. */
+static int trigger_fds[ARRAY_SIZE(psi_triggers)];
+static bool triggers_open = false;
+
+/* When a trigger last fired. */
+static time_t stall_time = 0;
+
+/*
+ * The names of the coefficients for the psi service, in the same order as
+ * the pressure metrics starting with METRIC_PSI_CPU_SOME10.
+ */
+static const char *const psi_names[] = {
+    "cpu_some10",    "cpu_some60",    "cpu_full10",    "cpu_full60",
+    "memory_some10", "memory_some60", "memory_full10", "memory_full60",
+    "io_some10",     "io_some60",     "io_full10",     "io_full60",
+    "stall"
+};
+
+/* Configured coefficients for the psi service. */
+struct psi_weights {
+    double coefficient[ARRAY_SIZE(psi_names)];
+};
+
+
+/*
+ * Parse the contents of a pressure file into info.  Each line starts with
+ * some or full followed by avg10, avg60, avg300, and total settings.  Older
+ * kernels have no full line for CPU, in which case those values are zero.
+ * Returns false if the contents can't be parsed.
+ */
+bool
+lbcd_psi_parse(const char *buffer, struct psi_info *info)
+{
+    const char *p, *avg;
+    unsigned long *avg10, *avg60;
+
+    memset(info, 0, sizeof(*info));
+    for (p = buffer; *p != '\0'; p = strchr(p, '\n') + 1) {
+        if (strncmp(p, "some ", 5) == 0) {
+            avg10 = &info->some10;
+            avg60 = &info->some60;
+        } else if (strncmp(p, "full ", 5) == 0) {
+            avg10 = &info->full10;
+            avg60 = &info->full60;
+        } else
+            return false;
+        avg = strstr(p, " avg10=");
+        if (avg == NULL || procfile_fixed(avg + 7, 2, avg10) == NULL)
+            return false;
+        avg = strstr(p, " avg60=");
+        if (avg == NULL || procfile_fixed(avg + 7, 2, avg60) == NULL)
+            return false;
+        if (strchr(p, '\n') == NULL)
+            break;
+    }
+    return true;
+}
+
+
+/*
+ * Read the pressure averages for a resource.  Returns 0 on success and -1 on
+ * failure.  A kernel without PSI support is not an error worth reporting, so
+ * if the file doesn't exist the first time we look, we quietly give up on it.
+ */
+int
+lbcd_psi_read(enum psi_resource resource, struct psi_info *info)
+{
+    struct procfile *file = &psi_files[resource];
+    char buffer[PSI_FILE_MAX];
+
+    if (!psi_checked[resource]) {
+        psi_available[resource] = (access(file->path, R_OK) == 0);
+        psi_checked[resource] = true;
+    }
+    if (!psi_available[resource])
+        return -1;
+    if (procfile_read(file, buffer, sizeof(buffer)) < 0)
+        return -1;
+    if (!lbcd_psi_parse(buffer, info)) {
+        warn("cannot parse %s", file->path);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Open a trigger on a pressure file.  Returns the file descriptor or -1 if
+ * the kernel doesn't support triggers or won't let us have one.
+ */
+static int
+trigger_open(size_t n)
+{
+    const char *path = psi_files[psi_triggers[n].resource].path;
+    char *spec;
+    size_t i;
+    ssize_t status;
+    int fd, oerrno;
+
+    fd = open(path, O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        debug("cannot open %s for a trigger: %s", path, strerror(errno));
+        return -1;
+    }
+    fdflag_close_exec(fd, true);
+    for (i = 0; i < ARRAY_SIZE(psi_windows); i++) {
+        xasprintf(&spec, "%s %lu %lu", psi_triggers[n].type,
+                  psi_triggers[n].threshold * (i + 1), psi_windows[i]);
+        status = write(fd, spec, strlen(spec) + 1);
+        oerrno = errno;
+        free(spec);
+        if (status >= 0)
+            return fd;
+    }
+    debug("cannot register trigger on %s: %s", path, strerror(oerrno));
+    close(fd);
+    return -1;
+}
+
+
+/*
+ * Store the file descriptors of the pressure triggers in fds, registering
+ * the triggers the first time we're called, and return the number of
+ * descriptors.  There is at most one trigger per resource.  Callers should
+ * poll them for POLLPRI and call lbcd_psi_event when that happens.
+ */
+size_t
+lbcd_psi_triggers(int *fds, size_t size)
+{
+    size_t i, count;
+
+    if (!triggers_open) {
+        for (i = 0; i < ARRAY_SIZE(psi_triggers); i++)
+            trigger_fds[i] = trigger_open(i);
+        triggers_open = true;
+    }
+    count = 0;
+    for (i = 0; i < ARRAY_SIZE(psi_triggers) && count < size; i++)
+        if (trigger_fds[i] >= 0)
+            fds[count++] = trigger_fds[i];
+    return count;
+}
+
+
+/*
+ * Handle an event on a trigger file descriptor.  If the trigger is no longer
+ * usable, close it so that it's no longer returned by lbcd_psi_triggers.
+ */
+void
+lbcd_psi_event(int fd, bool error)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(psi_triggers); i++)
+        if (trigger_fds[i] == fd)
+            break;
+    if (i == ARRAY_SIZE(psi_triggers))
+        return;
+    if (error) {
+        warn("pressure trigger on %s failed",
+             psi_files[psi_triggers[i].resource].path);
+        close(fd);
+        trigger_fds[i] = -1;
+        return;
+    }
+    stall_time = time(NULL);
+}
+
+
+/*
+ * Return true if a trigger has fired recently.
+ */
+bool
+lbcd_psi_stalled(void)
+{
+    return (stall_time != 0 && time(NULL) - stall_time < PSI_STALL_TIME);
+}
+
+
+/*
+ * Close all of the pressure files and triggers.
+ */
+void
+lbcd_psi_close(void)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(psi_files); i++) {
+        procfile_close(&psi_files[i]);
+        psi_checked[i] = false;
+    }
+    if (triggers_open)
+        for (i = 0; i < ARRAY_SIZE(psi_triggers); i++)
+            if (trigger_fds[i] >= 0)
+                close(trigger_fds[i]);
+    triggers_open = false;
+}
+
+
+/*
+ * The psi service.  The weight is the sum of each pressure metric times its
+ * coefficient.
+ */
+static int
+psi_weight(void *data, uint32_t *weight_val, uint32_t *incr_val,
+           int timeout UNUSED, const char *portarg UNUSED,
+           struct lbcd_reply *lb UNUSED)
+{
+    const struct psi_weights *weights = data;
+    const struct lbcd_metrics *metrics;
+    double weight = 0;
+    size_t i;
+
+    metrics = lbcd_metrics_get();
+    for (i = 0; i < ARRAY_SIZE(psi_names); i++)
+        weight += weights->coefficient[i]
+            * metrics->value[METRIC_PSI_CPU_SOME10 + i];
+    if (weight < 0)
+        weight = 0;
+    else if (weight > UINT32_MAX)
+        weight = UINT32_MAX;
+    *weight_val = (uint32_t) weight;
+    *incr_val = PSI_INCREMENT;
+    return (int) *weight_val;
+}
+
+
+/*
+ * Parse coefficients for the psi service, a comma-separated list of
+ * name=value pairs.  Pressure metrics not listed get a coefficient of zero.
+ * Returns false after reporting the problem with warn if the list is
+ * invalid.
+ */
+static bool
+psi_parse_weights(const char *spec, struct psi_weights *weights)
+{
+    const char *p, *end, *equals;
+    char *number_end;
+    size_t i;
+
+    memset(weights, 0, sizeof(*weights));
+    for (p = spec; *p != '\0'; p = (*end == ',') ? end + 1 : end) {
+        end = p + strcspn(p, ",");
+        equals = memchr(p, '=', end - p);
+        if (equals == NULL) {
+            warn("invalid pressure coefficient in %s", spec);
+            return false;
+        }
+        for (i = 0; i < ARRAY_SIZE(psi_names); i++)
+            if (strlen(psi_names[i]) == (size_t) (equals - p)
+                && strncmp(psi_names[i], p, equals - p) == 0)
+                break;
+        if (i == ARRAY_SIZE(psi_names)) {
+            warn("unknown pressure metric in %s", spec);
+            return false;
+        }
+        if (equals + 1 == end
+            || !(isdigit((unsigned char) equals[1]) || equals[1] == '-')) {
+            warn("invalid pressure coefficient in %s", spec);
+            return false;
+        }
+        weights->coefficient[i] = strtod(equals + 1, &number_end);
+        if (number_end != end) {
+            warn("invalid pressure coefficient in %s", spec);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Register the psi service with the given coefficients, or the default ones
+ * if spec is NULL.  Returns false after reporting the problem with warn if
+ * the coefficients are invalid.
+ */
+bool
+lbcd_psi_init(const char *spec)
+{
+    struct psi_weights *weights;
+
+    weights = xmalloc(sizeof(struct psi_weights));
+    if (!psi_parse_weights(spec == NULL ? PSI_DEFAULT_WEIGHTS : spec,
+                           weights)) {
+        free(weights);
+        return false;
+    }
+    lbcd_service_register("psi", psi_weight, weights, 0, free);
+    return true;
+}
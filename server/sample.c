@@ -0,0 +1,44 @@
+/*
+ * Timing and averaging periodic samples.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <math.h>
+#include <time.h>
+
+#include <server/sample.h>
+
+
+/*
+ * Return the current monotonic time in microseconds.
+ */
+unsigned long long
+sample_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/*
+ * Decay an average by the time since the last sample and add a new value.
+ */
+double
+sample_average(double old, double value, double elapsed, double half_life,
+               bool started)
+{
+    double weight;
+
+    weight = started ? pow(0.5, elapsed / half_life) : 0;
+    return old * weight + value * (1 - weight);
+}
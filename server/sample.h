@@ -0,0 +1,38 @@
+/*
+ * Timing and averaging periodic samples.
+ *
+ * Most of what lbcd reports is sampled at most once per interval and turned
+ * into rates or averages over the time between samples, measured on the
+ * monotonic clock so that changes to the system time don't disturb them.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef SERVER_SAMPLE_H
+#define SERVER_SAMPLE_H 1
+
+#include <config.h>
+#include <portable/macros.h>
+#include <portable/stdbool.h>
+
+BEGIN_DECLS
+
+/* Return the current monotonic time in microseconds. */
+unsigned long long sample_now(void);
+
+/*
+ * Decay an average by the time elapsed since the last sample, so that after
+ * half_life (in the same units) the old value counts for half, and add a new
+ * value.  If started is false, there is no old value and the result is the
+ * new value.
+ */
+double sample_average(double old, double value, double elapsed,
+                      double half_life, bool started);
+
+END_DECLS
+
+#endif /* !SERVER_SAMPLE_H */
@@ -4,7 +4,7 @@
  * Obtains and sends polling information.  Also acts as a test driver.
  *
  * Written by Larry Schwimmer
- * Copyright 1996, 1997, 1998, 2004, 2006, 2012, 2013
+ * Copyright 1996, 1997, 1998, 2004, 2006, 2012, 2013, 2026
  *     The Board of Trustees of the Leland Stanford Junior University
  *
  * See LICENSE for licensing terms.
@@ -17,6 +17,7 @@
 #include <time.h>
 
 #include <server/internal.h>
+#include <server/metrics.h>
 #include <util/vector.h>
 
 
@@ -28,6 +29,9 @@ lbcd_set_load(struct lbcd_reply *lb, struct vector *services)
 {
     int i, numserv;
 
+    /* Each service is computed at most once for this reply. */
+    lbcd_service_begin();
+
     /* Clear pad and set number of requested services */
     lb->pad = 0;
     lb->services = numserv = services->count;
@@ -98,6 +102,7 @@ lbcd_pack_info(struct lbcd_reply *lb, unsigned int protocol,
     time_t bt, ct;
     int tu, uu, oc;
     time_t umtime;
+    struct fs_info fs;
 
     /* Timestamps. */
     kernel_getboottime(&bt);
@@ -120,14 +125,12 @@ lbcd_pack_info(struct lbcd_reply *lb, unsigned int protocol,
 
     /* Additional fields. */
     lb->reserved = 0;
-    lb->tmp_full = tmp_full("/tmp");
-#ifdef P_tmpdir
-    lb->tmpdir_full = tmp_full(P_tmpdir);
-#else
-    lb->tmpdir_full = lb->tmp_full;
-#endif
-
-    /* Weights and increments. */
+    lbcd_fs_read(&fs);
+    lb->tmp_full = (uint8_t) fs.tmp.full;
+    lb->tmpdir_full = (uint8_t) fs.tmpdir.full;
+
+    /* Weights and increments, which may use any of the above. */
+    lbcd_metrics_update(lb);
     lbcd_set_load(lb, services);
 
     /* Backward compatibility. */
@@ -136,12 +139,66 @@ lbcd_pack_info(struct lbcd_reply *lb, unsigned int protocol,
 }
 
 
+/*
+ * Add an extended field to an extended reply.
+ */
+static void
+ext_add(struct lbcd_ext *ext, enum lbcd_ext_type type, double value)
+{
+    struct lbcd_ext_field *field;
+
+    if (ext->count >= LBCD_MAX_EXT)
+        return;
+    if (value < 0)
+        value = 0;
+    else if (value > UINT32_MAX)
+        value = UINT32_MAX;
+    field = &ext->fields[ext->count++];
+    field->type = htons(type);
+    field->reserved = 0;
+    field->value = htonl((uint32_t) (value + 0.5));
+}
+
+
+/*
+ * Fill in the extended fields for a reply in network byte order.  Must be
+ * called after lbcd_pack_info, which updates the metrics.  Returns the size
+ * of the extended fields to send.
+ */
+size_t
+lbcd_pack_ext(struct lbcd_ext *ext)
+{
+    const struct lbcd_metrics *metrics = lbcd_metrics_get();
+    size_t count;
+
+    ext->count = 0;
+    ext->reserved = 0;
+    ext_add(ext, LBCD_EXT_CPUS, metrics->value[METRIC_CPUS] * 100);
+    ext_add(ext, LBCD_EXT_NL1, metrics->value[METRIC_NL1]);
+    ext_add(ext, LBCD_EXT_NL5, metrics->value[METRIC_NL5]);
+    ext_add(ext, LBCD_EXT_NL15, metrics->value[METRIC_NL15]);
+    ext_add(ext, LBCD_EXT_CAPACITY, metrics->value[METRIC_CAPACITY]);
+    ext_add(ext, LBCD_EXT_NUMA_UTIL_MAX,
+            metrics->value[METRIC_NUMA_UTIL_MAX]);
+    ext_add(ext, LBCD_EXT_NUMA_UTIL_MIN,
+            metrics->value[METRIC_NUMA_UTIL_MIN]);
+    ext_add(ext, LBCD_EXT_NUMA_FREE_MIN,
+            metrics->value[METRIC_NUMA_FREE_MIN]);
+    ext_add(ext, LBCD_EXT_NUMA_FREE_MAX,
+            metrics->value[METRIC_NUMA_FREE_MAX]);
+    count = ext->count;
+    ext->count = htons(ext->count);
+    return sizeof(*ext) - (LBCD_MAX_EXT - count) * sizeof(ext->fields[0]);
+}
+
+
 /*
  * Test lbcd by looking for the same data that we would return over the
  * network but print it to standard output instead.  Takes the non-option
  * arguments, which are taken to be a list of services whose weight modules
  * should be run.  The special module "v2" means to do protocol version 2
- * instead of 3 (the default).
+ * instead of 3 (the default).  For any service computed by a weight formula,
+ * also show the value of each part of the formula.
  */
 void
 lbcd_test(int argc, char *argv[])
@@ -149,6 +206,7 @@ lbcd_test(int argc, char *argv[])
     struct lbcd_reply lb;
     struct lbcd_request ph;
     struct vector *services;
+    const struct lbcd_metrics *metrics;
     int i;
 
     /* Create query packet. */
@@ -187,21 +245,33 @@ lbcd_test(int argc, char *argv[])
     printf("l1           = %u\n",  (unsigned int) ntohs(lb.l1));
     printf("l5           = %u\n",  (unsigned int) ntohs(lb.l5));
     printf("l15          = %u\n",  (unsigned int) ntohs(lb.l15));
+    metrics = lbcd_metrics_get();
+    printf("cpus         = %.2f\n", metrics->value[METRIC_CPUS]);
+    printf("nl1          = %.0f\n", metrics->value[METRIC_NL1]);
+    printf("nl5          = %.0f\n", metrics->value[METRIC_NL5]);
+    printf("nl15         = %.0f\n", metrics->value[METRIC_NL15]);
+    printf("capacity     = %lu\n", lbcd_capacity_get());
     printf("current_time = %lu\n", (unsigned long) ntohl(lb.current_time));
     printf("boot_time    = %lu\n", (unsigned long) ntohl(lb.boot_time));
     printf("user_mtime   = %lu\n", (unsigned long) ntohl(lb.user_mtime));
     printf("tot_users    = %u\n",  (unsigned int) ntohs(lb.tot_users));
     printf("uniq_users   = %u\n",  (unsigned int) ntohs(lb.uniq_users));
+    printf("idle_users   = %.0f\n", metrics->value[METRIC_IDLE]);
+    printf("uniq_idle    = %.0f\n", metrics->value[METRIC_UNIQ_IDLE]);
     printf("on_console   = %u\n",  (unsigned int) lb.on_console);
     printf("tmp_full     = %u\n",  (unsigned int) lb.tmp_full);
     printf("tmpdir_full  = %u\n",  (unsigned int) lb.tmpdir_full);
+    printf("mem_pressure = %.0f\n", metrics->value[METRIC_MEM_PRESSURE]);
+    printf("\n");
+    lbcd_fs_print();
     printf("\n");
     printf("SERVICES: %u\n", (unsigned int) lb.services);
     for (i = 0; i <= lb.services; i++)
         printf("%d: weight %10lu increment %10lu name %s\n", i,
                (unsigned long) ntohl(lb.weights[i].host_weight),
                (unsigned long) ntohl(lb.weights[i].host_incr),
-               i ? ph.names[i - 1] : "default");
+               i ? services->strings[i - 1] : "default");
+    lbcd_formula_trace(lbcd_default_service_name(), services);
     vector_free(services);
     exit(0);
 }
@@ -0,0 +1,385 @@
+/*
+ * Shared-memory interface for applications reporting their load to lbcd.
+ *
+ * Given -B <path>, lbcd maps a file at that path containing a header and a
+ * fixed number of slots, each on its own 64-byte cache line.  An application
+ * claims a slot by name and then publishes its weight, increment, and a ttl
+ * in it as often as it likes.  Each publication also records a heartbeat,
+ * the time of the update from CLOCK_MONOTONIC, and lbcd returns the weight
+ * and increment as the service app:<name> until the heartbeat is more than
+ * ttl seconds old, after which the application is presumed to be down.
+ *
+ * Publishing writes a few words of memory and reads the clock, which
+ * normally doesn't need a system call, so it's cheap enough to do on every
+ * change of load.  Each slot is protected by a sequence lock: the writer
+ * makes the sequence number odd, updates the slot, and makes it even again,
+ * and a reader retries if the sequence number was odd or changed while it
+ * was reading, so lbcd never sees a weight from one update and an increment
+ * from another.  A writer that finds the sequence number already odd, left
+ * by a writer that died part way through, keeps it odd while writing, so the
+ * next publication makes the slot readable again.  Only one process or
+ * thread may publish to a slot at a time.
+ *
+ * This header is installed as <lbcd/shm.h> and is the entire client
+ * interface; there is no library to link with.  It uses the GCC __atomic
+ * builtins and attributes, which Clang also provides.  Any incompatible
+ * change to the layout must increment LBCD_SHM_VERSION.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef LBCD_SHM_H
+#define LBCD_SHM_H 1
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The magic number and version of the layout described by this header. */
+#define LBCD_SHM_MAGIC   0x6c626364U    /* "lbcd" */
+#define LBCD_SHM_VERSION 1
+
+/*
+ * The number of slots lbcd creates, chosen so that the file is 16KiB, and
+ * the size of the name field, which holds a name of up to 27 characters so
+ * that app:<name> fits in an lbcd service name.
+ */
+#define LBCD_SHM_SLOTS    255
+#define LBCD_SHM_NAME_MAX 28
+
+/* How often a reader retries a slot being written before giving up. */
+#define LBCD_SHM_RETRIES  1000
+
+/*
+ * How long, in seconds, the last report in a claimed slot must have been
+ * expired before the slot may be claimed by another name when none are free,
+ * recovering slots of applications that exited without releasing them.  An
+ * application that may go longer than this without publishing should claim
+ * its slot again before publishing.  May be defined before including this
+ * header to change it.
+ */
+#ifndef LBCD_SHM_STALE
+# define LBCD_SHM_STALE   86400
+#endif
+
+/* The state of a slot. */
+#define LBCD_SHM_FREE     0     /* Not in use */
+#define LBCD_SHM_CLAIMING 1     /* Being claimed, name not yet set */
+#define LBCD_SHM_CLAIMED  2     /* In use by the application named */
+
+/*
+ * How the functions below are declared.  They're defined here so that there
+ * is no library to link with, but all but the smallest are left to the
+ * compiler to inline or not, and they're marked unused so that a program
+ * that doesn't call all of them doesn't get warnings.
+ */
+#define LBCD_SHM_FUNCTION static __attribute__((__unused__))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The start of the file, one cache line long. */
+struct lbcd_shm_header {
+    uint32_t magic;             /* LBCD_SHM_MAGIC */
+    uint32_t version;           /* LBCD_SHM_VERSION */
+    uint32_t slots;             /* Number of slots following the header */
+    uint32_t slot_size;         /* sizeof(struct lbcd_shm_slot) */
+    unsigned char reserved[48];
+};
+
+/* One slot, also one cache line long. */
+struct lbcd_shm_slot {
+    uint32_t state;             /* LBCD_SHM_FREE, CLAIMING, or CLAIMED */
+    uint32_t sequence;          /* Odd while the slot is being written */
+    uint32_t weight;
+    uint32_t incr;
+    uint64_t heartbeat;         /* Monotonic time of the update in usec */
+    uint32_t ttl;               /* Seconds the update is valid */
+    char name[LBCD_SHM_NAME_MAX];
+    unsigned char reserved[8];
+};
+
+
+/*
+ * Return the current time from CLOCK_MONOTONIC in microseconds, the clock
+ * used for heartbeats.
+ */
+LBCD_SHM_FUNCTION uint64_t
+lbcd_shm_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000;
+}
+
+
+/*
+ * Return the slots following a header.
+ */
+static inline struct lbcd_shm_slot *
+lbcd_shm_slots(struct lbcd_shm_header *header)
+{
+    return (struct lbcd_shm_slot *) (void *) (header + 1);
+}
+
+
+/*
+ * Return the size of a file with the given number of slots.
+ */
+static inline size_t
+lbcd_shm_size(uint32_t slots)
+{
+    return sizeof(struct lbcd_shm_header)
+        + (size_t) slots * sizeof(struct lbcd_shm_slot);
+}
+
+
+/*
+ * Map the file created by lbcd at path for writing.  Returns NULL if it
+ * can't be opened or mapped or wasn't created by a compatible lbcd.
+ */
+LBCD_SHM_FUNCTION struct lbcd_shm_header *
+lbcd_shm_map(const char *path)
+{
+    struct lbcd_shm_header *header;
+    struct stat st;
+    void *region;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0
+        || (size_t) st.st_size < sizeof(struct lbcd_shm_header)) {
+        close(fd);
+        return NULL;
+    }
+    region = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+        return NULL;
+    header = (struct lbcd_shm_header *) region;
+    if (header->magic != LBCD_SHM_MAGIC || header->version != LBCD_SHM_VERSION
+        || header->slot_size != sizeof(struct lbcd_shm_slot)
+        || lbcd_shm_size(header->slots) > (size_t) st.st_size) {
+        munmap(region, (size_t) st.st_size);
+        return NULL;
+    }
+    return header;
+}
+
+
+/*
+ * Unmap a file mapped with lbcd_shm_map.  Slots claimed through it stay
+ * claimed, so the application can map the file again and continue.
+ */
+LBCD_SHM_FUNCTION void
+lbcd_shm_unmap(struct lbcd_shm_header *header)
+{
+    munmap(header, lbcd_shm_size(header->slots));
+}
+
+
+/*
+ * Return the slot claimed by the application name among the first count
+ * slots, or NULL if there is none.  Only slots whose name is complete are
+ * considered.  lbcd passes the number of slots it created, since any
+ * application can change the header.
+ */
+LBCD_SHM_FUNCTION struct lbcd_shm_slot *
+lbcd_shm_find_in(struct lbcd_shm_header *header, uint32_t count,
+                 const char *name)
+{
+    struct lbcd_shm_slot *slots = lbcd_shm_slots(header);
+    uint32_t i;
+
+    for (i = 0; i < count; i++)
+        if (__atomic_load_n(&slots[i].state, __ATOMIC_ACQUIRE)
+                == LBCD_SHM_CLAIMED
+            && strncmp(slots[i].name, name, LBCD_SHM_NAME_MAX) == 0)
+            return &slots[i];
+    return NULL;
+}
+
+
+/*
+ * Return the slot claimed by the application name, or NULL if there is
+ * none.
+ */
+LBCD_SHM_FUNCTION struct lbcd_shm_slot *
+lbcd_shm_find(struct lbcd_shm_header *header, const char *name)
+{
+    return lbcd_shm_find_in(header, header->slots, name);
+}
+
+
+/*
+ * Publish the weight and increment of an application, valid for ttl seconds
+ * from now.  A ttl of 0 marks the application down immediately.  The
+ * sequence number is made odd while writing and even afterwards, even if an
+ * earlier writer left it odd.
+ */
+LBCD_SHM_FUNCTION void
+lbcd_shm_publish(struct lbcd_shm_slot *slot, uint32_t weight, uint32_t incr,
+                 uint32_t ttl)
+{
+    uint32_t sequence;
+    uint64_t now;
+
+    now = lbcd_shm_now();
+    sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) | 1;
+    __atomic_store_n(&slot->sequence, sequence, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->weight, weight, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->incr, incr, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->heartbeat, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->ttl, ttl, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Return true if the last report in a slot expired more than LBCD_SHM_STALE
+ * seconds before now.  Claiming a slot counts as a report that expires
+ * immediately.
+ */
+LBCD_SHM_FUNCTION int
+lbcd_shm_stale(const struct lbcd_shm_slot *slot, uint64_t now)
+{
+    uint64_t heartbeat;
+    uint32_t ttl;
+
+    heartbeat = __atomic_load_n(&slot->heartbeat, __ATOMIC_RELAXED);
+    ttl = __atomic_load_n(&slot->ttl, __ATOMIC_RELAXED);
+    return now > heartbeat
+        && now - heartbeat > ((uint64_t) ttl + LBCD_SHM_STALE) * 1000000;
+}
+
+
+/*
+ * Take over a slot in state from for the application name of the given
+ * length, returning true on success.  A claimed slot is taken only if its
+ * last report is stale.  Claiming a slot publishes a report that expires
+ * immediately, so that it isn't stale for LBCD_SHM_STALE seconds.
+ */
+LBCD_SHM_FUNCTION int
+lbcd_shm_take(struct lbcd_shm_slot *slot, uint32_t from, const char *name,
+              size_t length, uint64_t now)
+{
+    uint32_t state = from;
+
+    if (from == LBCD_SHM_CLAIMED && !lbcd_shm_stale(slot, now))
+        return 0;
+    if (!__atomic_compare_exchange_n(&slot->state, &state, LBCD_SHM_CLAIMING,
+                                     0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+
+    /* The owner of a stale slot may have published since it was checked. */
+    if (from == LBCD_SHM_CLAIMED && !lbcd_shm_stale(slot, now)) {
+        __atomic_store_n(&slot->state, from, __ATOMIC_RELEASE);
+        return 0;
+    }
+    lbcd_shm_publish(slot, 0, 0, 0);
+    memset(slot->name, 0, sizeof(slot->name));
+    memcpy(slot->name, name, length);
+    __atomic_store_n(&slot->state, LBCD_SHM_CLAIMED, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+/*
+ * Claim a slot for the application name, which must be at most 27
+ * characters of letters, digits, -, _, and ., or return the slot it already
+ * has, such as from before the application restarted.  If no slot is free,
+ * takes over a slot whose last report is stale.  Returns NULL if the name is
+ * invalid or all slots are in use.
+ *
+ * A claimer that dies part way through leaves its slot being claimed, and
+ * nothing can safely tell it apart from a claim still in progress, so that
+ * slot stays unusable until lbcd creates the file again.
+ */
+LBCD_SHM_FUNCTION struct lbcd_shm_slot *
+lbcd_shm_claim(struct lbcd_shm_header *header, const char *name)
+{
+    struct lbcd_shm_slot *slots = lbcd_shm_slots(header);
+    struct lbcd_shm_slot *slot;
+    uint32_t i;
+    uint64_t now;
+    size_t length;
+
+    length = strlen(name);
+    if (length == 0 || length >= LBCD_SHM_NAME_MAX
+        || strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                  "0123456789-_.") != length)
+        return NULL;
+    slot = lbcd_shm_find(header, name);
+    if (slot != NULL)
+        return slot;
+    now = lbcd_shm_now();
+    for (i = 0; i < header->slots; i++)
+        if (lbcd_shm_take(&slots[i], LBCD_SHM_FREE, name, length, now))
+            return &slots[i];
+    for (i = 0; i < header->slots; i++)
+        if (lbcd_shm_take(&slots[i], LBCD_SHM_CLAIMED, name, length, now))
+            return &slots[i];
+    return NULL;
+}
+
+
+/*
+ * Give up a slot, such as when the application shuts down for good.  The
+ * application is down until it claims a slot and publishes again.
+ */
+LBCD_SHM_FUNCTION void
+lbcd_shm_release(struct lbcd_shm_slot *slot)
+{
+    lbcd_shm_publish(slot, 0, 0, 0);
+    __atomic_store_n(&slot->state, LBCD_SHM_FREE, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Read a consistent copy of a slot.  Returns 0 on success and -1 if a writer
+ * kept the slot busy through every retry, such as because it died while
+ * writing it.  Used by lbcd.
+ */
+LBCD_SHM_FUNCTION int
+lbcd_shm_read(const struct lbcd_shm_slot *slot, uint32_t *weight,
+              uint32_t *incr, uint64_t *heartbeat, uint32_t *ttl)
+{
+    uint32_t before, after;
+    int i;
+
+    for (i = 0; i < LBCD_SHM_RETRIES; i++) {
+        before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (before % 2 != 0)
+            continue;
+        *weight = __atomic_load_n(&slot->weight, __ATOMIC_RELAXED);
+        *incr = __atomic_load_n(&slot->incr, __ATOMIC_RELAXED);
+        *heartbeat = __atomic_load_n(&slot->heartbeat, __ATOMIC_RELAXED);
+        *ttl = __atomic_load_n(&slot->ttl, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+        if (before == after)
+            return 0;
+    }
+    return -1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !LBCD_SHM_H */
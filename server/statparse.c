@@ -0,0 +1,257 @@
+/*
+ * Fast parser for /proc/stat.
+ *
+ * On hosts with hundreds of CPUs, /proc/stat has a line for each CPU, and
+ * parsing them several times a second adds up.  Each line is mostly short
+ * decimal numbers separated by single spaces, so the parser finds the end
+ * of each number with SSE2 where available, sixteen bytes at a time, and
+ * converts up to sixteen digits with a few multiplications rather than a
+ * loop over each digit.  Lines that aren't needed are skipped with memchr,
+ * and parsing stops at the first line that isn't a cpu line, so the long
+ * interrupt counts that follow are never looked at.  Callers that only need
+ * the totals for all CPUs can stop after the first line.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#include <server/internal.h>
+#include <util/macros.h>
+
+/* The number of times on a cpu line that we use, and the fewest we accept. */
+#define STAT_FIELDS     8
+#define STAT_MIN_FIELDS 4
+
+/* Whether to use SSE2 to find the end of numbers. */
+#ifdef __SSE2__
+static bool use_simd = true;
+#endif
+
+
+/*
+ * Convert the first n decimal digits at p, which must be followed by at
+ * least 8 - n more readable bytes.  On a little-endian system, loading eight
+ * bytes and shifting out the ones after the number leaves the digits in the
+ * high bytes, with zeroes (and therefore leading zeroes) below them.  Then
+ * the digits are combined in pairs, fours, and eights, each with one
+ * multiplication.
+ */
+#ifndef WORDS_BIGENDIAN
+static unsigned long long
+convert8(const char *p, size_t n)
+{
+    unsigned long long chunk;
+
+    memcpy(&chunk, p, 8);
+    chunk <<= 8 * (8 - n);
+    chunk = ((chunk & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+    chunk = ((chunk & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    return ((chunk & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+}
+#endif
+
+
+/*
+ * Convert the n digits at p, with end marking the end of the buffer, and
+ * return a pointer to the character after them or NULL if n is zero.
+ */
+static const char *
+convert(const char *p, const char *end, size_t n, unsigned long *value)
+{
+    unsigned long long result;
+    size_t i;
+
+    if (n == 0)
+        return NULL;
+#ifndef WORDS_BIGENDIAN
+    if (n <= 8 && end - p >= 8) {
+        *value = (unsigned long) convert8(p, n);
+        return p + n;
+    } else if (n <= 16 && end - p >= 16) {
+        result = convert8(p, n - 8) * 100000000 + convert8(p + n - 8, 8);
+        *value = (unsigned long) result;
+        return p + n;
+    }
+#endif
+    result = 0;
+    for (i = 0; i < n; i++)
+        result = result * 10 + (unsigned long long) (p[i] - '0');
+    *value = (unsigned long) result;
+    return p + n;
+}
+
+
+/*
+ * Return the number of digits at p, looking at one byte at a time.
+ */
+static size_t
+digits_scalar(const char *p, const char *end)
+{
+    const char *start = p;
+
+    while (p < end && *p >= '0' && *p <= '9')
+        p++;
+    return (size_t) (p - start);
+}
+
+
+/*
+ * Return the number of digits at p, looking at sixteen bytes at once if
+ * there are that many left in the buffer.  The movemask has a bit set for
+ * each byte that is a digit, so the number of trailing set bits is the
+ * length of the number.
+ */
+#ifdef __SSE2__
+static size_t
+digits_sse2(const char *p, const char *end)
+{
+    __m128i chunk, low, high;
+    unsigned int mask;
+
+    if (end - p < 16)
+        return digits_scalar(p, end);
+    chunk = _mm_loadu_si128((const __m128i *) (const void *) p);
+    low = _mm_cmpgt_epi8(chunk, _mm_set1_epi8('0' - 1));
+    high = _mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1));
+    mask = (unsigned int) _mm_movemask_epi8(_mm_and_si128(low, high));
+    mask = ~mask & 0xffff;
+    if (mask == 0)
+        return 16 + digits_scalar(p + 16, end);
+    return (size_t) __builtin_ctz(mask);
+}
+#endif
+
+
+/*
+ * Parse a number at p, skipping leading spaces.  Returns a pointer to the
+ * character following it, or NULL if there is no number.
+ */
+static const char *
+parse_number(const char *p, const char *end, unsigned long *value)
+{
+    size_t n;
+
+    while (p < end && *p == ' ')
+        p++;
+#ifdef __SSE2__
+    if (use_simd)
+        n = digits_sse2(p, end);
+    else
+        n = digits_scalar(p, end);
+#else
+    n = digits_scalar(p, end);
+#endif
+    return convert(p, end, n, value);
+}
+
+
+/*
+ * Parse the times on a cpu line, starting after the CPU number.  Returns a
+ * pointer to the start of the next line, or NULL if the line is invalid or
+ * doesn't end in a newline, which means the buffer was too short for it.
+ */
+static const char *
+parse_times(const char *p, const char *end, struct cpustat_times *times)
+{
+    unsigned long value[STAT_FIELDS];
+    const char *next;
+    size_t i;
+
+    memset(value, 0, sizeof(value));
+    for (i = 0; i < STAT_FIELDS; i++) {
+        next = parse_number(p, end, &value[i]);
+        if (next == NULL)
+            break;
+        p = next;
+    }
+    if (i < STAT_MIN_FIELDS)
+        return NULL;
+    p = memchr(p, '\n', (size_t) (end - p));
+    if (p == NULL)
+        return NULL;
+    times->user    = value[0];
+    times->nice    = value[1];
+    times->system  = value[2];
+    times->idle    = value[3];
+    times->iowait  = value[4];
+    times->irq     = value[5];
+    times->softirq = value[6];
+    times->steal   = value[7];
+    return p + 1;
+}
+
+
+/*
+ * Parse length bytes of /proc/stat in buffer.  Stores the totals for all
+ * CPUs in total and, if cpus is not NULL, the times for each CPU in cpus,
+ * indexed by CPU number.  CPUs numbered ncpus or higher are ignored, as are
+ * lines that were cut off at the end of the buffer.  Returns one more than
+ * the highest CPU number stored (0 if cpus is NULL), or -1 if the totals
+ * can't be parsed.  Entries in cpus for offline CPUs are not touched.
+ */
+ssize_t
+lbcd_stat_parse(const char *buffer, size_t length,
+                struct cpustat_times *total, struct cpustat_times *cpus,
+                size_t ncpus)
+{
+    const char *p = buffer;
+    const char *end = buffer + length;
+    unsigned long cpu;
+    size_t count = 0;
+
+    if (length < 4 || memcmp(p, "cpu ", 4) != 0)
+        return -1;
+    p = parse_times(p + 4, end, total);
+    if (p == NULL)
+        return -1;
+    if (cpus == NULL)
+        return 0;
+    while (end - p > 3 && memcmp(p, "cpu", 3) == 0) {
+        p = convert(p + 3, end, digits_scalar(p + 3, end), &cpu);
+        if (p == NULL)
+            break;
+        if (cpu >= ncpus) {
+            p = memchr(p, '\n', (size_t) (end - p));
+            if (p == NULL)
+                break;
+            p++;
+            continue;
+        }
+        p = parse_times(p, end, &cpus[cpu]);
+        if (p == NULL)
+            break;
+        if (cpu + 1 > count)
+            count = cpu + 1;
+    }
+    return (ssize_t) count;
+}
+
+
+/*
+ * Set whether to use SIMD instructions, if they're available, and return
+ * whether they will be used.  This is for testing against the scalar code.
+ */
+#ifdef __SSE2__
+bool
+lbcd_stat_simd(bool enable)
+{
+    use_simd = enable;
+    return use_simd;
+}
+#else
+bool
+lbcd_stat_simd(bool enable UNUSED)
+{
+    return false;
+}
+#endif
@@ -0,0 +1,357 @@
+/*
+ * Upgrading the running lbcd binary without closing its sockets.
+ *
+ * On SIGUSR2, lbcd starts a new copy of its binary with the same arguments,
+ * passing it one end of a socketpair whose file descriptor number is stored
+ * in the LBCD_UPGRADE_FD environment variable.  The old process sends the
+ * bound sockets over it with SCM_RIGHTS, followed by state that lets the new
+ * process avoid starting cold, and keeps answering queries until the new
+ * process says it's ready.  The old process then exits without closing the
+ * sockets from the point of view of clients, since the new process holds
+ * copies, so no queries are dropped.  If the new process fails, it closes
+ * its end of the socketpair and the old process carries on.
+ *
+ * The state is a series of lines, each starting with a word saying what kind
+ * of state it is.  Lines of unknown kinds are ignored so that upgrades work
+ * between versions that save different state.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/sd-daemon.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <server/internal.h>
+#include <util/fdflag.h>
+#include <util/messages.h>
+#include <util/network.h>
+#include <util/vector.h>
+#include <util/xmalloc.h>
+#include <util/xwrite.h>
+
+/* The environment variable holding the socketpair in the new process. */
+#define UPGRADE_ENV "LBCD_UPGRADE_FD"
+
+/* The most sockets that can be passed to the new process. */
+#define UPGRADE_MAX_FDS 64
+
+/* How long to wait for the state once the sockets have been received. */
+#define UPGRADE_TIMEOUT 30
+
+/* Sent along with the sockets, followed by length bytes of state. */
+struct upgrade_header {
+    uint32_t count;
+    uint32_t length;
+};
+
+/* An upgrade in progress in the old process. */
+struct lbcd_upgrade {
+    pid_t pid;                  /* PID of the new process */
+    int fd;                     /* Our end of the socketpair */
+};
+
+/* Our end of the socketpair in the new process, or -1 if not upgrading. */
+static int inherited_fd = -1;
+
+
+/*
+ * Send the sockets and the state over the socketpair.  Returns false after
+ * reporting the problem with syswarn on failure.
+ */
+static bool
+send_sockets(int fd, const int *fds, unsigned int count)
+{
+    struct upgrade_header header;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    } control;
+    struct vector *state;
+    char *data;
+    bool okay;
+
+    /* Gather the state. */
+    state = vector_new();
+    lbcd_service_save(state);
+    data = vector_join(state, "\n");
+    vector_free(state);
+
+    /* Send the header with the sockets attached. */
+    header.count = count;
+    header.length = strlen(data);
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    if (sendmsg(fd, &msg, 0) != (ssize_t) sizeof(header)) {
+        syswarn("cannot send sockets to new process");
+        free(data);
+        return false;
+    }
+
+    /* Send the state. */
+    okay = (header.length == 0
+            || network_write(fd, data, header.length, UPGRADE_TIMEOUT));
+    if (!okay)
+        syswarn("cannot send state to new process");
+    free(data);
+    return okay;
+}
+
+
+/*
+ * Start a new lbcd process from the binary given in argv[0] with the same
+ * arguments and pass it our sockets.  Returns the upgrade in progress, or
+ * NULL after reporting the problem with warn.  The caller should wait for
+ * the file descriptor returned by lbcd_upgrade_fd to become readable and
+ * then call lbcd_upgrade_finish.
+ */
+struct lbcd_upgrade *
+lbcd_upgrade_start(char *const argv[], const int *fds, unsigned int count)
+{
+    struct lbcd_upgrade *upgrade;
+    int pair[2];
+    char *value;
+    pid_t pid;
+
+    if (count > UPGRADE_MAX_FDS) {
+        warn("too many sockets to pass to new process");
+        return NULL;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+        syswarn("cannot create socketpair for upgrade");
+        return NULL;
+    }
+    if (!fdflag_close_exec(pair[0], true)) {
+        syswarn("cannot set file descriptor close on exec");
+        goto fail;
+    }
+    notice("starting new lbcd from %s", argv[0]);
+    pid = fork();
+    if (pid < 0) {
+        syswarn("cannot fork new lbcd");
+        goto fail;
+    } else if (pid == 0) {
+        close(pair[0]);
+        xasprintf(&value, "%d", pair[1]);
+        if (setenv(UPGRADE_ENV, value, 1) < 0)
+            sysdie("cannot set %s", UPGRADE_ENV);
+        execvp(argv[0], argv);
+        sysdie("cannot execute %s", argv[0]);
+    }
+
+    /* In the old process.  Pass over the sockets. */
+    close(pair[1]);
+    if (!send_sockets(pair[0], fds, count)) {
+        close(pair[0]);
+        waitpid(pid, NULL, 0);
+        return NULL;
+    }
+    upgrade = xmalloc(sizeof(struct lbcd_upgrade));
+    upgrade->pid = pid;
+    upgrade->fd = pair[0];
+    return upgrade;
+
+fail:
+    close(pair[0]);
+    close(pair[1]);
+    return NULL;
+}
+
+
+/*
+ * Return the file descriptor to wait on for an upgrade in progress.
+ */
+int
+lbcd_upgrade_fd(const struct lbcd_upgrade *upgrade)
+{
+    return upgrade->fd;
+}
+
+
+/*
+ * Called when the file descriptor for an upgrade in progress is readable.
+ * Returns true if the new process has taken over, in which case the caller
+ * should exit without removing the PID file, and false after reporting the
+ * problem with warn if it failed.  Frees the upgrade either way.
+ */
+bool
+lbcd_upgrade_finish(struct lbcd_upgrade *upgrade)
+{
+    char ready;
+    char *message;
+    ssize_t status;
+    bool okay;
+
+    do {
+        status = read(upgrade->fd, &ready, 1);
+    } while (status < 0 && errno == EINTR);
+    okay = (status == 1);
+    close(upgrade->fd);
+    if (okay) {
+        notice("new lbcd (PID %lu) has taken over",
+               (unsigned long) upgrade->pid);
+        xasprintf(&message, "MAINPID=%lu", (unsigned long) upgrade->pid);
+        status = sd_notify(false, message);
+        if (status < 0)
+            warn("cannot notify systemd of new PID: %s", strerror(-status));
+        free(message);
+    } else {
+        warn("new lbcd failed, continuing to answer queries");
+        waitpid(upgrade->pid, NULL, 0);
+    }
+    free(upgrade);
+    return okay;
+}
+
+
+/*
+ * Abandon an upgrade in progress, stopping the new process, and free it.
+ * Used when the old process is exiting before the new one is ready.
+ */
+void
+lbcd_upgrade_abort(struct lbcd_upgrade *upgrade)
+{
+    close(upgrade->fd);
+    if (kill(upgrade->pid, SIGTERM) < 0)
+        syswarn("cannot stop new lbcd (PID %lu)",
+                (unsigned long) upgrade->pid);
+    else
+        waitpid(upgrade->pid, NULL, 0);
+    free(upgrade);
+}
+
+
+/*
+ * Restore the state sent by the old process.
+ */
+static void
+restore_state(const char *data)
+{
+    struct vector *lines, *fields;
+    unsigned long expires, weight, incr;
+    size_t i;
+
+    lines = vector_split(data, '\n', NULL);
+    fields = vector_new();
+    for (i = 0; i < lines->count; i++) {
+        vector_split_space(lines->strings[i], fields);
+        if (fields->count == 5 && strcmp(fields->strings[0], "cache") == 0) {
+            expires = strtoul(fields->strings[2], NULL, 10);
+            weight = strtoul(fields->strings[3], NULL, 10);
+            incr = strtoul(fields->strings[4], NULL, 10);
+            lbcd_service_restore(fields->strings[1], (time_t) expires,
+                                 weight, incr);
+        }
+    }
+    vector_free(fields);
+    vector_free(lines);
+}
+
+
+/*
+ * In a new process started by lbcd_upgrade_start, receive the sockets and
+ * state from the old process.  Returns false if this process wasn't started
+ * for an upgrade, and otherwise stores the sockets in fds and their number in
+ * count, restores the state, and returns true.  Dies on any failure, which
+ * the old process notices.
+ */
+bool
+lbcd_upgrade_receive(int **fds, unsigned int *count)
+{
+    const char *value;
+    struct upgrade_header header;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    } control;
+    char *data;
+    ssize_t status;
+
+    /* Find the socketpair, if any. */
+    value = getenv(UPGRADE_ENV);
+    if (value == NULL)
+        return false;
+    inherited_fd = atoi(value);
+    unsetenv(UPGRADE_ENV);
+    if (!fdflag_close_exec(inherited_fd, true))
+        sysdie("cannot set file descriptor close on exec");
+
+    /* Receive the header and the sockets. */
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    do {
+        status = recvmsg(inherited_fd, &msg, 0);
+    } while (status < 0 && errno == EINTR);
+    if (status != (ssize_t) sizeof(header))
+        sysdie("cannot receive sockets from old process");
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if ((msg.msg_flags & MSG_CTRUNC) || cmsg == NULL
+        || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || header.count == 0 || header.count > UPGRADE_MAX_FDS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * header.count))
+        die("invalid sockets received from old process");
+    *count = header.count;
+    *fds = xcalloc(*count, sizeof(int));
+    memcpy(*fds, CMSG_DATA(cmsg), sizeof(int) * *count);
+
+    /* Receive and restore the state. */
+    data = xmalloc(header.length + 1);
+    if (header.length > 0)
+        if (!network_read(inherited_fd, data, header.length, UPGRADE_TIMEOUT))
+            sysdie("cannot receive state from old process");
+    data[header.length] = '\0';
+    restore_state(data);
+    free(data);
+    notice("received %u sockets from old process", *count);
+    return true;
+}
+
+
+/*
+ * In a new process started by lbcd_upgrade_start, tell the old process that
+ * we're ready to answer queries so that it can exit.  Returns true if this
+ * process was started for an upgrade and false, doing nothing, otherwise.
+ */
+bool
+lbcd_upgrade_ready(void)
+{
+    if (inherited_fd < 0)
+        return false;
+    if (xwrite(inherited_fd, "R", 1) != 1)
+        syswarn("cannot notify old process of startup");
+    close(inherited_fd);
+    inherited_fd = -1;
+    return true;
+}
@@ -0,0 +1,616 @@
+/*
+ * CPU time used by each user.
+ *
+ * The number of unique users says nothing about how much of the system each
+ * is using: one running an editor counts the same as one running a build on
+ * every CPU.  When enabled, this walks /proc at its own interval, reads the
+ * CPU time of every process from /proc/<pid>/stat, and adds up the CPU time
+ * each user used since the last walk.  From that we report how many users
+ * used more than a threshold and the share of all CPU time used by the user
+ * who used the most, so that weight formulas can steer new users away from
+ * systems where someone is already using most of the CPU.
+ *
+ * Walks are taken from the main loop, never while answering a query, since
+ * with tens of thousands of processes one takes tens of milliseconds.  /proc
+ * is kept open and each stat file is opened relative to it, so that the
+ * kernel doesn't have to look up /proc for each process, and the buffers and
+ * tables are reused from one walk to the next.  The CPU time of each process
+ * is remembered by process ID and start time, so that only the time used
+ * since the last walk is counted and a reused process ID isn't mistaken for
+ * the process that had it before.
+ *
+ * The owner of a process is taken from the owner of its stat file, which is
+ * its effective UID except for processes that aren't dumpable, such as those
+ * that changed UID, which appear to be owned by root.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <server/sample.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* The default directory to walk. */
+#define USERCPU_PROC "/proc"
+
+/* The default threshold for a heavy user, in percent of one CPU. */
+#define USERCPU_THRESHOLD 100
+
+/* The largest interval we accept, in seconds. */
+#define USERCPU_INTERVAL_MAX 3600
+
+/* The smallest size of the process and user tables. */
+#define USERCPU_TABLE_MIN 1024
+
+/*
+ * The longest stat file we read.  They are normally a few hundred bytes, and
+ * the fields we need come well before the end.
+ */
+#define USERCPU_STAT_MAX 1024
+
+/* The CPU time of a process as of the last walk.  pid is 0 if unused. */
+struct proc_entry {
+    pid_t pid;
+    unsigned long long start;   /* Start time in clock ticks after boot */
+    unsigned long long ticks;   /* User and system time in clock ticks */
+};
+
+/* A hash table of processes, using linear probing. */
+struct proc_table {
+    struct proc_entry *entries;
+    size_t size;
+    size_t count;
+};
+
+/* The CPU time used by a user during one walk. */
+struct uid_entry {
+    bool used;
+    uid_t uid;
+    unsigned long long ticks;
+};
+
+/* The interval between walks in microseconds, or 0 if disabled. */
+static unsigned long long interval = 0;
+
+/* The threshold for a heavy user, in percent of one CPU. */
+static unsigned long threshold = USERCPU_THRESHOLD;
+
+/* The directory to walk and the open handle for it. */
+static char *proc_path = NULL;
+static DIR *proc_dir = NULL;
+
+/* Whether the directory couldn't be opened, so that we only warn once. */
+static bool proc_failed = false;
+
+/* Clock ticks per second, used to turn CPU time into utilization. */
+static long clock_ticks = 0;
+
+/*
+ * The processes seen by the last walk and the table being filled by the
+ * current one, which swap after each walk, and the users of the current
+ * walk.
+ */
+static struct proc_table tables[2];
+static unsigned int current = 0;
+static struct uid_entry *uids = NULL;
+static size_t uids_size = 0;
+static size_t uids_count = 0;
+
+/* When the last walk was taken, or 0 if there hasn't been one. */
+static unsigned long long last_time = 0;
+
+/* The results of the last walk. */
+static struct usercpu_info results;
+
+/* The buffer for stat files, reused for every process. */
+static char stat_buffer[USERCPU_STAT_MAX];
+
+/*
+ * The settings of a new configuration, with an interval of 0 to disable
+ * sampling, and whether there are any.
+ */
+static unsigned long long pending_interval = 0;
+static unsigned long pending_threshold = USERCPU_THRESHOLD;
+static char *pending_path = NULL;
+static bool have_pending = false;
+
+
+/*
+ * Return the slot for a process in a table, which is either its entry or the
+ * empty slot where it would go.
+ */
+static struct proc_entry *
+proc_find(const struct proc_table *table, pid_t pid)
+{
+    size_t mask = table->size - 1;
+    size_t i;
+
+    i = ((size_t) pid * 2654435761U) & mask;
+    while (table->entries[i].pid != 0 && table->entries[i].pid != pid)
+        i = (i + 1) & mask;
+    return &table->entries[i];
+}
+
+
+/*
+ * Empty a table, making it at least large enough for the given number of
+ * processes at no more than half full.
+ */
+static void
+proc_reset(struct proc_table *table, size_t count)
+{
+    size_t size;
+
+    size = (table->size == 0) ? USERCPU_TABLE_MIN : table->size;
+    while (size < count * 2)
+        size *= 2;
+    if (size != table->size) {
+        free(table->entries);
+        table->entries = xcalloc(size, sizeof(struct proc_entry));
+        table->size = size;
+    } else {
+        memset(table->entries, 0, size * sizeof(struct proc_entry));
+    }
+    table->count = 0;
+}
+
+
+/*
+ * Add a process to a table, doubling its size first if it's half full.
+ */
+static void
+proc_add(struct proc_table *table, pid_t pid, unsigned long long start,
+         unsigned long long ticks)
+{
+    struct proc_entry *old, *entry;
+    size_t old_size, i;
+
+    if ((table->count + 1) * 2 > table->size) {
+        old = table->entries;
+        old_size = table->size;
+        table->size *= 2;
+        table->entries = xcalloc(table->size, sizeof(struct proc_entry));
+        for (i = 0; i < old_size; i++)
+            if (old[i].pid != 0)
+                *proc_find(table, old[i].pid) = old[i];
+        free(old);
+    }
+    entry = proc_find(table, pid);
+    entry->pid = pid;
+    entry->start = start;
+    entry->ticks = ticks;
+    table->count++;
+}
+
+
+/*
+ * Return the slot for a user in the user table, either its entry or the empty
+ * slot where it would go.
+ */
+static struct uid_entry *
+uid_find(uid_t uid)
+{
+    size_t mask = uids_size - 1;
+    size_t i;
+
+    i = ((size_t) uid * 2654435761U) & mask;
+    while (uids[i].used && uids[i].uid != uid)
+        i = (i + 1) & mask;
+    return &uids[i];
+}
+
+
+/*
+ * Add CPU time used by a user, doubling the size of the user table first if
+ * it's half full.
+ */
+static void
+uid_add(uid_t uid, unsigned long long ticks)
+{
+    struct uid_entry *old, *entry;
+    size_t old_size, i;
+
+    if ((uids_count + 1) * 2 > uids_size) {
+        old = uids;
+        old_size = uids_size;
+        uids_size = (old_size == 0) ? USERCPU_TABLE_MIN : old_size * 2;
+        uids = xcalloc(uids_size, sizeof(struct uid_entry));
+        for (i = 0; i < old_size; i++)
+            if (old[i].used)
+                *uid_find(old[i].uid) = old[i];
+        free(old);
+    }
+    entry = uid_find(uid);
+    if (!entry->used) {
+        entry->used = true;
+        entry->uid = uid;
+        entry->ticks = 0;
+        uids_count++;
+    }
+    entry->ticks += ticks;
+}
+
+
+/*
+ * Parse a /proc/<pid>/stat file for the user and system time and the start
+ * time of the process.  The command name, in parentheses, may contain spaces
+ * and parentheses, so the fields are counted from the last parenthesis.
+ * Returns false if the fields aren't found.
+ */
+static bool
+stat_parse(const char *data, size_t length, unsigned long long *ticks,
+           unsigned long long *start)
+{
+    const char *p, *end;
+    unsigned long long value;
+    unsigned long long utime = 0;
+    unsigned int field;
+
+    *ticks = 0;
+    end = data + length;
+    for (p = end; p > data && p[-1] != ')'; p--)
+        ;
+    if (p == data)
+        return false;
+
+    /* The field after the command name is field 3. */
+    for (field = 3; p < end; field++) {
+        while (p < end && *p == ' ')
+            p++;
+        if (field == 14 || field == 15 || field == 22) {
+            if (p == end || !isdigit((unsigned char) *p))
+                return false;
+            for (value = 0; p < end && isdigit((unsigned char) *p); p++)
+                value = value * 10 + (unsigned long long) (*p - '0');
+            if (field == 14)
+                utime = value;
+            else if (field == 15)
+                *ticks = utime + value;
+            else {
+                *start = value;
+                return true;
+            }
+        }
+        while (p < end && *p != ' ')
+            p++;
+    }
+    return false;
+}
+
+
+/*
+ * Read the owner, CPU time, and start time of a process, given its directory
+ * name.  Returns false if the process has exited or its stat file can't be
+ * parsed.
+ */
+static bool
+proc_read(const char *name, uid_t *uid, unsigned long long *ticks,
+          unsigned long long *start)
+{
+    char path[64];
+    struct stat st;
+    size_t size;
+    ssize_t length;
+    int fd;
+
+    size = strlen(name);
+    if (size > sizeof(path) - sizeof("/stat"))
+        return false;
+    memcpy(path, name, size);
+    memcpy(path + size, "/stat", sizeof("/stat"));
+    fd = openat(dirfd(proc_dir), path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+    length = read(fd, stat_buffer, sizeof(stat_buffer));
+    close(fd);
+    if (length <= 0)
+        return false;
+    *uid = st.st_uid;
+    return stat_parse(stat_buffer, (size_t) length, ticks, start);
+}
+
+
+/*
+ * Compute the results from the CPU time each user used over the given
+ * number of microseconds.
+ */
+static void
+results_update(unsigned long long elapsed)
+{
+    double capacity, util;
+    unsigned long long total = 0;
+    unsigned long long top = 0;
+    size_t i;
+
+    memset(&results, 0, sizeof(results));
+    capacity = (double) elapsed / 1000000 * (double) clock_ticks;
+    if (capacity <= 0)
+        return;
+    for (i = 0; i < uids_size; i++) {
+        if (!uids[i].used || uids[i].ticks == 0)
+            continue;
+        results.users++;
+        total += uids[i].ticks;
+        if (uids[i].ticks > top)
+            top = uids[i].ticks;
+        util = (double) uids[i].ticks / capacity * 100;
+        if (util >= threshold)
+            results.heavy++;
+    }
+    if (total == 0)
+        return;
+    results.top_share = (unsigned long) (top * 10000 / total);
+    results.top_util = (unsigned long) ((double) top / capacity * 10000 + 0.5);
+}
+
+
+/*
+ * Walk the process directory now, taking the time as given in microseconds
+ * on the monotonic clock.  The first walk only records the CPU time of each
+ * process.  After that, a process seen before is charged the time it used
+ * since, and a new process all of its time, since it started after the last
+ * walk.
+ */
+void
+lbcd_usercpu_scan(unsigned long long now)
+{
+    struct proc_table *prev, *next;
+    struct proc_entry *entry;
+    struct dirent *dirent;
+    unsigned long long ticks, start, used;
+    unsigned long pid;
+    char *end;
+    uid_t uid;
+    size_t i;
+
+    if (proc_dir == NULL && !proc_failed) {
+        proc_dir = opendir(proc_path != NULL ? proc_path : USERCPU_PROC);
+        if (proc_dir == NULL) {
+            syswarn("cannot open %s",
+                    proc_path != NULL ? proc_path : USERCPU_PROC);
+            proc_failed = true;
+        }
+    }
+    if (proc_dir == NULL)
+        return;
+    prev = &tables[current];
+    next = &tables[!current];
+    proc_reset(next, prev->count);
+    for (i = 0; i < uids_size; i++)
+        uids[i].used = false;
+    uids_count = 0;
+
+    /* Record each process and charge its owner for the time it used. */
+    rewinddir(proc_dir);
+    while ((dirent = readdir(proc_dir)) != NULL) {
+        if (!isdigit((unsigned char) dirent->d_name[0]))
+            continue;
+        errno = 0;
+        pid = strtoul(dirent->d_name, &end, 10);
+        if (*end != '\0' || errno != 0 || pid == 0 || pid > INT_MAX)
+            continue;
+        if (!proc_read(dirent->d_name, &uid, &ticks, &start))
+            continue;
+        proc_add(next, (pid_t) pid, start, ticks);
+        if (last_time == 0)
+            continue;
+        used = ticks;
+        if (prev->size > 0) {
+            entry = proc_find(prev, (pid_t) pid);
+            if (entry->pid != 0 && entry->start == start)
+                used = (ticks > entry->ticks) ? ticks - entry->ticks : 0;
+        }
+        if (used > 0)
+            uid_add(uid, used);
+    }
+    current = !current;
+    if (last_time != 0 && now > last_time)
+        results_update(now - last_time);
+    last_time = now;
+}
+
+
+/*
+ * Return the number of milliseconds until the next walk is due, or -1 if
+ * there will be no more walks.
+ */
+int
+lbcd_usercpu_timeout(void)
+{
+    unsigned long long now;
+
+    if (interval == 0 || proc_failed)
+        return -1;
+    if (last_time == 0)
+        return 0;
+    now = sample_now();
+    if (now - last_time >= interval)
+        return 0;
+    return (int) ((interval - (now - last_time) + 999) / 1000);
+}
+
+
+/*
+ * Walk the process directory if a walk is due.
+ */
+void
+lbcd_usercpu_sample(void)
+{
+    if (lbcd_usercpu_timeout() != 0)
+        return;
+    lbcd_usercpu_scan(sample_now());
+}
+
+
+/*
+ * Store the results of the last walk in info.  They are zero until two walks
+ * have been taken.
+ */
+void
+lbcd_usercpu_read(struct usercpu_info *info)
+{
+    *info = results;
+}
+
+
+/*
+ * Parse a number from a specification, returning a pointer to the character
+ * after it or NULL if there is no number or it is larger than max.
+ */
+static const char *
+spec_number(const char *p, unsigned long max, unsigned long *value)
+{
+    char *end;
+
+    if (!isdigit((unsigned char) *p))
+        return NULL;
+    errno = 0;
+    *value = strtoul(p, &end, 10);
+    if (errno != 0 || *value > max)
+        return NULL;
+    return end;
+}
+
+
+/*
+ * Parse a specification of the interval in seconds and, optionally after a
+ * comma, the threshold for a heavy user in percent of one CPU, or NULL to
+ * disable sampling, and keep it to be used once lbcd_usercpu_commit is
+ * called.  dir is the directory to walk, or NULL for /proc.  Returns false
+ * after reporting the problem with warn if the specification is invalid.
+ */
+bool
+lbcd_usercpu_prepare(const char *spec, const char *dir)
+{
+    unsigned long seconds = 0;
+    unsigned long percent = USERCPU_THRESHOLD;
+    const char *p;
+
+    lbcd_usercpu_abort();
+    if (spec != NULL) {
+        p = spec_number(spec, USERCPU_INTERVAL_MAX, &seconds);
+        if (p != NULL && *p == ',')
+            p = spec_number(p + 1, ULONG_MAX / 100, &percent);
+        if (p == NULL || *p != '\0' || seconds == 0 || percent == 0) {
+            warn("invalid user CPU sampling %s (expected interval in"
+                 " seconds and optional threshold in percent)", spec);
+            return false;
+        }
+    }
+    pending_interval = (unsigned long long) seconds * 1000000;
+    pending_threshold = percent;
+    pending_path = (dir != NULL) ? xstrdup(dir) : NULL;
+    have_pending = true;
+    return true;
+}
+
+
+/*
+ * Switch to the settings from lbcd_usercpu_prepare.  If sampling is
+ * disabled, all walks are forgotten.  Otherwise, the CPU time seen so far is
+ * kept unless the directory changes.
+ */
+void
+lbcd_usercpu_commit(void)
+{
+    char *path = pending_path;
+
+    if (!have_pending)
+        return;
+    pending_path = NULL;
+    have_pending = false;
+    if (pending_interval == 0 || (path == NULL) != (proc_path == NULL)
+        || (path != NULL && strcmp(path, proc_path) != 0)) {
+        lbcd_usercpu_close();
+        if (pending_interval == 0) {
+            free(path);
+            return;
+        }
+        proc_path = path;
+    } else
+        free(path);
+    interval = pending_interval;
+    threshold = pending_threshold;
+    if (clock_ticks <= 0)
+        clock_ticks = sysconf(_SC_CLK_TCK);
+    if (clock_ticks <= 0)
+        clock_ticks = 100;
+}
+
+
+/*
+ * Discard the settings from lbcd_usercpu_prepare.
+ */
+void
+lbcd_usercpu_abort(void)
+{
+    free(pending_path);
+    pending_path = NULL;
+    have_pending = false;
+}
+
+
+/*
+ * Enable or disable sampling immediately, as with lbcd_usercpu_prepare.
+ * Returns false after reporting the problem with warn if the specification
+ * is invalid, in which case nothing is changed.
+ */
+bool
+lbcd_usercpu_init(const char *spec, const char *dir)
+{
+    if (!lbcd_usercpu_prepare(spec, dir))
+        return false;
+    lbcd_usercpu_commit();
+    return true;
+}
+
+
+/*
+ * Close the process directory and forget all walks.
+ */
+void
+lbcd_usercpu_close(void)
+{
+    size_t i;
+
+    lbcd_usercpu_abort();
+    if (proc_dir != NULL)
+        closedir(proc_dir);
+    proc_dir = NULL;
+    proc_failed = false;
+    free(proc_path);
+    proc_path = NULL;
+    for (i = 0; i < 2; i++) {
+        free(tables[i].entries);
+        tables[i].entries = NULL;
+        tables[i].size = 0;
+        tables[i].count = 0;
+    }
+    free(uids);
+    uids = NULL;
+    uids_size = 0;
+    uids_count = 0;
+    last_time = 0;
+    interval = 0;
+    memset(&results, 0, sizeof(results));
+}
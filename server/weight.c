@@ -15,10 +15,13 @@
 #include <errno.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <time.h>
 
 #include <server/internal.h>
 #include <util/macros.h>
 #include <util/messages.h>
+#include <util/vector.h>
+#include <util/xmalloc.h>
 
 /* Supported services list and a mapping from service to weight function. */
 struct service_mapping {
@@ -30,6 +33,7 @@ struct service_mapping {
 
     /* Internal built-ins. */
     { "cmd",     &lbcd_cmd_weight     },
+    { "listen",  &lbcd_listen_weight  },
     { "rr",      &lbcd_rr_weight      },
     { "unknown", &lbcd_unknown_weight },
 
@@ -50,12 +54,68 @@ struct service_mapping {
     { "",      NULL                   }
 };
 
+/*
+ * Services registered at runtime, such as probe scripts loaded from a
+ * directory or plugins.  These are checked before the built-in table.  If ttl
+ * is non-zero, results may be reused for that many seconds.  The registry
+ * owns the data and frees it with the free function, if any.
+ */
+struct service_registration {
+    char *service;
+    service_func_type *function;
+    void *data;
+    unsigned int ttl;
+    service_free_type *free;
+};
+struct service_registry {
+    struct service_registration *entries;
+    size_t count;
+};
+
+/*
+ * The registry used to answer queries, and the one being built to replace it
+ * when the configuration is reloaded, if any.  Registrations go to the
+ * pending registry while one exists.
+ */
+static struct service_registry *active = NULL;
+static struct service_registry *pending = NULL;
+
+/*
+ * Cached results for registered services with a ttl, keyed by the full
+ * service name including any argument after the colon.
+ */
+struct service_cache {
+    char *service;
+    time_t expires;
+    uint32_t weight;
+    uint32_t incr;
+};
+static struct service_cache *cache = NULL;
+static size_t cache_count = 0;
+
+/*
+ * Results computed while building the current reply, keyed by the full
+ * service name, so that each service is run at most once per reply even if
+ * it's requested more than once or is part of a composite service.  Entries
+ * from previous replies are recognized by their generation and reused.  busy
+ * is set while the service is being computed to catch loops.
+ */
+struct service_result {
+    char *service;
+    unsigned long generation;
+    bool busy;
+    uint32_t weight;
+    uint32_t incr;
+};
+static struct service_result *results = NULL;
+static size_t result_count = 0;
+static unsigned long generation = 0;
+
 /* Module globals. */
 static const char *lbcd_command;
-static const char *lbcd_service;
+static const char *lbcd_default_service;
 static uint32_t default_weight;
 static uint32_t default_increment;
-static const struct service_mapping *lbcd_default_functab;
 static int lbcd_timeout;
 
 
@@ -100,6 +160,75 @@ is_weights(const char *service)
 }
 
 
+/*
+ * Copy the service name portion (without any :port suffix) of a service into
+ * the provided buffer.
+ */
+static void
+service_name(lbcd_name_type name, const char *service)
+{
+    char *cp;
+
+    strlcpy(name, service, sizeof(lbcd_name_type));
+    cp = strchr(name, ':');
+    if (cp != NULL)
+        *cp = '\0';
+}
+
+
+/*
+ * Given a registry and the name of a service, return the registered service
+ * for it or NULL if that service was not registered at runtime.
+ */
+static struct service_registration *
+registry_find(struct service_registry *registry, const char *service)
+{
+    lbcd_name_type name;
+    size_t i;
+
+    if (registry == NULL)
+        return NULL;
+    service_name(name, service);
+    for (i = 0; i < registry->count; i++)
+        if (strcmp(name, registry->entries[i].service) == 0)
+            return &registry->entries[i];
+    return NULL;
+}
+
+
+/*
+ * Free a registry and all of the data registered in it.
+ */
+static void
+registry_free(struct service_registry *registry)
+{
+    struct service_registration *entry;
+    size_t i;
+
+    if (registry == NULL)
+        return;
+    for (i = 0; i < registry->count; i++) {
+        entry = &registry->entries[i];
+        if (entry->free != NULL)
+            entry->free(entry->data);
+        free(entry->service);
+    }
+    free(registry->entries);
+    free(registry);
+}
+
+
+/*
+ * Given the name of a service, return the registered service for it or NULL
+ * if that service was not registered at runtime.
+ */
+static const struct service_registration *
+service_to_registration(const char *service)
+{
+    return registry_find(active, service);
+}
+
+
 /*
  * Given the name of a service, return the function table entry for it or
  * NULL on failure.
@@ -109,17 +238,9 @@ service_to_func(const char *service)
 {
     const struct service_mapping *stp;
     lbcd_name_type name;
-    char *cp;
-
-    /* Return default if service is NULL or "default". */
-    if (service == NULL || strcmp("default", service) == 0)
-        return lbcd_default_functab;
 
     /* Obtain service name portion (service:port). */
-    strlcpy(name, service, sizeof(name));
-    cp = strchr(name, ':');
-    if (cp != NULL)
-        *cp ='\0';
+    service_name(name, service);
 
     /* Check table for exact match on service */
     for (stp = service_table; stp->service[0] != '\0'; stp++)
@@ -134,6 +255,276 @@ service_to_func(const char *service)
 }
 
 
+/*
+ * Register a service at runtime.  Takes the name of the service, the function
+ * to call to compute its weight, opaque data passed to that function, the
+ * number of seconds its results may be cached (0 to never cache), and a
+ * function to free the data when the service is removed, which may be NULL.
+ * A later registration of the same name replaces and frees the earlier one.
+ */
+void
+lbcd_service_register(const char *service, service_func_type *function,
+                      void *data, unsigned int ttl,
+                      service_free_type *free_func)
+{
+    struct service_registry *registry;
+    struct service_registration *entry;
+
+    if (pending != NULL)
+        registry = pending;
+    else {
+        if (active == NULL)
+            active = xcalloc(1, sizeof(struct service_registry));
+        registry = active;
+    }
+    entry = registry_find(registry, service);
+    if (entry == NULL) {
+        registry->entries = xreallocarray(registry->entries,
+                                          registry->count + 1,
+                                          sizeof(struct service_registration));
+        entry = &registry->entries[registry->count++];
+        entry->service = xstrdup(service);
+    } else if (entry->free != NULL)
+        entry->free(entry->data);
+    entry->function = function;
+    entry->data = data;
+    entry->ttl = ttl;
+    entry->free = free_func;
+}
+
+
+/*
+ * Return the data for a service in the registry being built, or the active
+ * registry if none is being built, provided that it was registered with the
+ * given function.  Otherwise, return NULL.  Any argument after a colon in
+ * the service name is ignored.
+ */
+void *
+lbcd_service_data(const char *service, service_func_type *function)
+{
+    const struct service_registration *entry;
+
+    entry = registry_find(pending != NULL ? pending : active, service);
+    if (entry == NULL || entry->function != function)
+        return NULL;
+    return entry->data;
+}
+
+
+/*
+ * Return a newly allocated array of the data for every service registered
+ * with the given function, in the registry being built or the active
+ * registry if none is being built.  Stores the number of elements in count.
+ */
+void **
+lbcd_service_list(service_func_type *function, size_t *count)
+{
+    const struct service_registry *registry;
+    void **list;
+    size_t i;
+
+    *count = 0;
+    registry = (pending != NULL) ? pending : active;
+    if (registry == NULL)
+        return NULL;
+    list = xcalloc(registry->count, sizeof(void *));
+    for (i = 0; i < registry->count; i++)
+        if (registry->entries[i].function == function)
+            list[(*count)++] = registry->entries[i].data;
+    return list;
+}
+
+
+/*
+ * Start building a new set of registered services.  Until it is committed,
+ * new registrations go to it and queries are still answered from the current
+ * set.
+ */
+void
+lbcd_service_prepare(void)
+{
+    registry_free(pending);
+    pending = xcalloc(1, sizeof(struct service_registry));
+}
+
+
+/*
+ * Replace the current set of registered services with the one being built
+ * and free the old one.  Cached results are kept for services that are still
+ * registered and cacheable, but not for longer than their new ttl.
+ */
+void
+lbcd_service_commit(void)
+{
+    const struct service_registration *entry;
+    time_t now;
+    size_t i, kept;
+
+    if (pending == NULL)
+        return;
+    registry_free(active);
+    active = pending;
+    pending = NULL;
+    now = time(NULL);
+    for (i = 0, kept = 0; i < cache_count; i++) {
+        entry = registry_find(active, cache[i].service);
+        if (entry == NULL || entry->ttl == 0) {
+            free(cache[i].service);
+            continue;
+        }
+        if (cache[i].expires > now + (time_t) entry->ttl)
+            cache[i].expires = now + entry->ttl;
+        cache[kept++] = cache[i];
+    }
+    cache_count = kept;
+    generation++;
+}
+
+
+/*
+ * Discard the set of registered services being built, keeping the current
+ * one.
+ */
+void
+lbcd_service_abort(void)
+{
+    registry_free(pending);
+    pending = NULL;
+}
+
+
+/*
+ * Remove all services registered at runtime and all cached results.
+ */
+void
+lbcd_service_clear(void)
+{
+    size_t i;
+
+    registry_free(active);
+    active = NULL;
+    registry_free(pending);
+    pending = NULL;
+    for (i = 0; i < cache_count; i++)
+        free(cache[i].service);
+    free(cache);
+    cache = NULL;
+    cache_count = 0;
+    for (i = 0; i < result_count; i++)
+        free(results[i].service);
+    free(results);
+    results = NULL;
+    result_count = 0;
+}
+
+
+/*
+ * Add the cached results that haven't expired to a list of state lines,
+ * passed to a new lbcd process on upgrade.  Each line is the word cache
+ * followed by the service, the expiration time, the weight, and the
+ * increment.
+ */
+void
+lbcd_service_save(struct vector *state)
+{
+    time_t now;
+    size_t i;
+    char *line;
+
+    now = time(NULL);
+    for (i = 0; i < cache_count; i++) {
+        if (cache[i].expires <= now)
+            continue;
+        xasprintf(&line, "cache %s %ld %lu %lu", cache[i].service,
+                  (long) cache[i].expires, (unsigned long) cache[i].weight,
+                  (unsigned long) cache[i].incr);
+        vector_add(state, line);
+        free(line);
+    }
+}
+
+
+/*
+ * Restore a cached result saved by another lbcd process.  The result is only
+ * used if the service is registered and cacheable here, and not for longer
+ * than its ttl.
+ */
+void
+lbcd_service_restore(const char *service, time_t expires, uint32_t weight,
+                     uint32_t incr)
+{
+    const struct service_registration *entry;
+    struct service_cache *cached;
+    time_t now;
+    size_t i;
+
+    entry = registry_find(active, service);
+    now = time(NULL);
+    if (entry == NULL || entry->ttl == 0 || expires <= now)
+        return;
+    for (i = 0; i < cache_count; i++)
+        if (strcmp(cache[i].service, service) == 0)
+            break;
+    if (i == cache_count) {
+        cache = xreallocarray(cache, cache_count + 1,
+                              sizeof(struct service_cache));
+        cache[cache_count].service = xstrdup(service);
+        cache_count++;
+    }
+    cached = &cache[i];
+    cached->expires = expires;
+    if (cached->expires > now + (time_t) entry->ttl)
+        cached->expires = now + entry->ttl;
+    cached->weight = weight;
+    cached->incr = incr;
+}
+
+
+/*
+ * Run a registered service, using and updating the cache if the service
+ * allows its results to be cached.  Failures are never cached.  Takes the
+ * same arguments as a weight function plus the registration and the full
+ * service name.
+ */
+static void
+service_run(const struct service_registration *entry, const char *service,
+            uint32_t *weight, uint32_t *incr, const char *portarg,
+            struct lbcd_reply *lb)
+{
+    struct service_cache *cached = NULL;
+    time_t now;
+    size_t i;
+
+    if (entry->ttl == 0) {
+        entry->function(entry->data, weight, incr, lbcd_timeout, portarg, lb);
+        return;
+    }
+    now = time(NULL);
+    for (i = 0; i < cache_count; i++)
+        if (strcmp(cache[i].service, service) == 0) {
+            cached = &cache[i];
+            break;
+        }
+    if (cached != NULL && now < cached->expires) {
+        *weight = cached->weight;
+        *incr = cached->incr;
+        return;
+    }
+    if (entry->function(entry->data, weight, incr, lbcd_timeout, portarg,
+                        lb) < 0)
+        return;
+    if (cached == NULL) {
+        cache = xreallocarray(cache, cache_count + 1,
+                              sizeof(struct service_cache));
+        cached = &cache[cache_count++];
+        cached->service = xstrdup(service);
+    }
+    cached->expires = now + entry->ttl;
+    cached->weight = *weight;
+    cached->incr = *incr;
+}
+
+
 /*
  * Initialize our globals from the command-line options.
  */
@@ -141,22 +532,17 @@ int
 lbcd_weight_init(const char *cmd, const char *service, int timeout)
 {
     lbcd_command = cmd;
-    lbcd_service = service;
     lbcd_timeout = timeout;
 
     /* Round robin with default specified. */
     if (service != NULL && is_weights(service) == 0) {
-        char *cp;
-
-        cp = strchr(service,':');
-        *cp++ = '\0';
         default_weight = atoi(service);
-        default_increment = atoi(cp);
-        lbcd_default_functab = service_to_func("rr");
+        default_increment = atoi(strchr(service, ':') + 1);
+        lbcd_default_service = "rr";
     }
     /* External command */
     else if (cmd) {
-        lbcd_default_functab = service_to_func("cmd");
+        lbcd_default_service = "cmd";
     }
     /* Specified module */
     else {
@@ -165,12 +551,85 @@ lbcd_weight_init(const char *cmd, const char *service, int timeout)
         default_increment = 1;
 
         /* Specify default load module */
-        lbcd_default_functab = service_to_func(service ? service : "load");
+        lbcd_default_service = service ? service : "load";
     }
     return 0;
 }
 
 
+/*
+ * Start building a new reply.  Results of services computed for previous
+ * replies will no longer be reused.
+ */
+void
+lbcd_service_begin(void)
+{
+    generation++;
+}
+
+
+/*
+ * Given the name of a service, get the weight and increment for that
+ * service, reusing the result if it was already computed for this reply.
+ * Used both to fill in the reply and by composite services.
+ */
+void
+lbcd_service_weight(const char *service, uint32_t *weight, uint32_t *incr,
+                    struct lbcd_reply *lb)
+{
+    const struct service_registration *entry;
+    const struct service_mapping *functab;
+    const char *cp;
+    size_t i;
+
+    if (strcmp(service, "default") == 0)
+        service = lbcd_default_service;
+
+    /* Reuse a result from this reply, or detect a loop. */
+    for (i = 0; i < result_count; i++)
+        if (strcmp(results[i].service, service) == 0)
+            break;
+    if (i < result_count && results[i].generation == generation) {
+        if (results[i].busy) {
+            warn("service %s depends on itself", service);
+            *weight = (uint32_t) -1;
+            *incr = 0;
+        } else {
+            *weight = results[i].weight;
+            *incr = results[i].incr;
+        }
+        return;
+    }
+    if (i == result_count) {
+        results = xreallocarray(results, result_count + 1,
+                                sizeof(struct service_result));
+        results[i].service = xstrdup(service);
+        result_count++;
+    }
+    results[i].generation = generation;
+    results[i].busy = true;
+
+    /*
+     * Compute the result.  This may recursively compute other services and
+     * therefore move the results array, so only refer to it by index.
+     */
+    *incr = default_increment;
+    cp = strchr(service, ':');
+    if (cp != NULL)
+        cp++;
+    entry = service_to_registration(service);
+    if (entry != NULL)
+        service_run(entry, service, weight, incr, cp, lb);
+    else {
+        functab = service_to_func(service);
+        functab->function(weight, incr, lbcd_timeout, cp, lb);
+    }
+    results[i].busy = false;
+    results[i].weight = *weight;
+    results[i].incr = *incr;
+}
+
+
 /*
  * Given a response, the number of the service, and the name of the service,
  * get the weight and increment for that service and fill it into the
@@ -179,20 +638,18 @@ lbcd_weight_init(const char *cmd, const char *service, int timeout)
 void
 lbcd_setweight(struct lbcd_reply *lb, int offset, const char *service)
 {
-    uint32_t *weight_ptr, *incr_ptr;
-    const struct service_mapping *functab;
-    const char *cp = NULL;
+    lbcd_service_weight(service, &lb->weights[offset].host_weight,
+                        &lb->weights[offset].host_incr, lb);
+}
 
-    weight_ptr = &lb->weights[offset].host_weight;
-    incr_ptr = &lb->weights[offset].host_incr;
-    *incr_ptr = default_increment;
 
-    functab = service_to_func(service);
-    cp = strcmp(service, "default") == 0 ? functab->service : service;
-    cp = strchr(cp, ':');
-    if (cp != NULL)
-        cp++;
-    functab->function(weight_ptr, incr_ptr, lbcd_timeout, cp, lb);
+/*
+ * Return the name of the service used for the default weight.
+ */
+const char *
+lbcd_default_service_name(void)
+{
+    return lbcd_default_service;
 }
 
 
@@ -0,0 +1,115 @@
+/*
+ * An example lbcd weight plugin, used by the test suite.
+ *
+ * Returns a weight of 100 plus the number of times the weight function has
+ * been called, so that tests can tell whether results were cached.  If the
+ * argument "async" is given, it instead returns 200 plus the call count, but
+ * only after first asking lbcd to wait for a pipe to become readable.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <server/plugin.h>
+
+/* Private state of the plugin. */
+struct example {
+    unsigned int calls;         /* Number of completed weight calls */
+    int pipe[2];                /* Pipe used for the pending check */
+    int pending;                /* Whether a check is pending */
+};
+
+
+/*
+ * Allocate the private state.
+ */
+static int
+example_init(void **data)
+{
+    struct example *example;
+
+    example = calloc(1, sizeof(struct example));
+    if (example == NULL)
+        return -1;
+    example->pipe[0] = -1;
+    example->pipe[1] = -1;
+    *data = example;
+    return 0;
+}
+
+
+/*
+ * Compute the weight, going through a pending state first if requested.
+ */
+static int
+example_weight(void *data, uint32_t *weight, uint32_t *incr, int *fd,
+               const char *portarg, int timeout)
+{
+    struct example *example = data;
+    char c;
+
+    (void) timeout;
+    if (portarg != NULL && strcmp(portarg, "async") == 0) {
+        if (!example->pending) {
+            if (pipe(example->pipe) < 0)
+                return LBCD_PLUGIN_ERROR;
+            if (write(example->pipe[1], "x", 1) != 1)
+                return LBCD_PLUGIN_ERROR;
+            example->pending = 1;
+            *fd = example->pipe[0];
+            return LBCD_PLUGIN_PENDING;
+        }
+        if (read(example->pipe[0], &c, 1) != 1)
+            return LBCD_PLUGIN_ERROR;
+        close(example->pipe[0]);
+        close(example->pipe[1]);
+        example->pending = 0;
+        *weight = 200 + ++example->calls;
+    } else if (portarg != NULL && strcmp(portarg, "down") == 0) {
+        return LBCD_PLUGIN_ERROR;
+    } else {
+        *weight = 100 + ++example->calls;
+    }
+    *incr = 3;
+    return LBCD_PLUGIN_OK;
+}
+
+
+/*
+ * Free the private state.
+ */
+static void
+example_teardown(void *data)
+{
+    free(data);
+}
+
+
+/*
+ * Results can be cached for a minute.
+ */
+static unsigned int
+example_cacheable(void *data)
+{
+    (void) data;
+    return 60;
+}
+
+
+/* The descriptor that lbcd looks for. */
+const struct lbcd_plugin lbcd_plugin = {
+    LBCD_PLUGIN_VERSION,
+    "example",
+    example_init,
+    example_weight,
+    NULL,
+    example_teardown,
+    example_cacheable
+};
@@ -0,0 +1,117 @@
+/*
+ * Tests for load reported by applications.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <sys/un.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <util/macros.h>
+
+/* The service registered by lbcd_app_init, recorded by the stub below. */
+static service_func_type *registered_function = NULL;
+
+
+/*
+ * Stub for the registration function in weight.c.  Records the service so
+ * that the test can call it.
+ */
+void
+lbcd_service_register(const char *service UNUSED,
+                      service_func_type *function, void *data UNUSED,
+                      unsigned int ttl UNUSED,
+                      service_free_type *free_func UNUSED)
+{
+    registered_function = function;
+}
+
+
+/*
+ * Apply a report given as a string at a time in seconds.
+ */
+static bool
+report(const char *message, unsigned long seconds)
+{
+    return lbcd_app_report(message, strlen(message),
+                           (unsigned long long) seconds * 1000000);
+}
+
+
+int
+main(void)
+{
+    const char *invalid[] = {
+        "", "web", "web 10", "web 10 20", "web -1 20 30", "web 1 2 86401",
+        "web 4294967296 1 10", "web 1 2 3 4", "w/b 1 2 3",
+        "abcdefghijklmnopqrstuvwxyz01 1 2 3"
+    };
+    struct sockaddr_un addr;
+    uint32_t weight, incr;
+    char *tmpdir, *path;
+    int fd;
+    size_t i;
+
+    plan(25);
+
+    /* Invalid reports. */
+    for (i = 0; i < ARRAY_SIZE(invalid); i++)
+        ok(!report(invalid[i], 100), "Invalid report \"%s\"", invalid[i]);
+
+    /* A report lasts for its ttl. */
+    ok(report("web 500 20 10\n", 100), "Report for web");
+    ok(lbcd_app_lookup("web", 109000000, &weight, &incr), "...found");
+    is_int(500, weight, "...with its weight");
+    is_int(20, incr, "...and increment");
+    ok(!lbcd_app_lookup("web", 110000000, &weight, &incr),
+       "...and expires after its ttl");
+    ok(!lbcd_app_lookup("mail", 100000000, &weight, &incr),
+       "Application without a report");
+
+    /* A new report replaces it, and a ttl of 0 removes it. */
+    ok(report("  web 1 2 5", 200), "Renewed report");
+    ok(lbcd_app_lookup("web", 204000000, &weight, &incr) && weight == 1,
+       "...replaces the old one");
+    ok(report("web 0 0 0", 201), "Removing report");
+    ok(!lbcd_app_lookup("web", 201000000, &weight, &incr), "...removes it");
+
+    /* Reports through the socket, answered by the registered service. */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/app.sock", tmpdir);
+    ok(lbcd_app_init(path, NULL), "Configure the application socket");
+    ok(lbcd_app_open() >= 0, "...and open it");
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0)
+        sysbail("cannot create socket");
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+    if (sendto(fd, "db 300 30 60\n", 13, 0, (struct sockaddr *) &addr,
+               sizeof(addr)) < 0)
+        sysbail("cannot send report");
+    close(fd);
+    lbcd_app_event();
+    if (registered_function == NULL)
+        bail("app service not registered");
+    registered_function(NULL, &weight, &incr, 0, "db", NULL);
+    is_int(300, weight, "Weight of a reported application");
+    registered_function(NULL, &weight, &incr, 0, "web", NULL);
+    is_int(-1, (int) weight, "Maximum weight without a report");
+
+    /* Closing removes the socket. */
+    lbcd_app_close();
+    ok(access(path, F_OK) < 0, "Closing removes the socket");
+    free(path);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
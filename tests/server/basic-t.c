@@ -2,7 +2,7 @@
  * Test for basic lbcd server functionality.
  *
  * Written by Russ Allbery <eagle@eyrie.org>
- * Copyright 2013, 2014
+ * Copyright 2013, 2014, 2026
  *     The Board of Trustees of the Leland Stanford Junior University
  *
  * See LICENSE for licensing terms.
@@ -92,9 +92,11 @@ main(void)
     ssize_t result;
     struct lbcd_reply reply;
     struct lbcd_request request;
+    struct lbcd_ext ext;
+    char packet[sizeof(struct lbcd_reply) + sizeof(struct lbcd_ext)];
 
     /* Declare a plan. */
-    plan(65);
+    plan(73);
 
     /* Start the lbcd daemon, allowing load and rr services. */
     lbcd_start("-a", "load", "-a", "rr", NULL);
@@ -173,6 +175,35 @@ main(void)
     is_int(1, ntohl(reply.weights[3].host_incr),
            "...rr service increment is 1");
 
+    /*
+     * Send a simple query for extended information.  The reply has only the
+     * default service, so the extended fields start after that.
+     */
+    request.h.op = htons(LBCD_OP_LBINFO_EXT);
+    request.h.status = htons(0);
+    result = send(fd, &request, sizeof(struct lbcd_header), 0);
+    if (result != (ssize_t) sizeof(struct lbcd_header))
+        sysbail("cannot send extended query");
+    memset(packet, 0, sizeof(packet));
+    result = recv(fd, packet, sizeof(packet), 0);
+    size = sizeof(reply) - LBCD_MAX_SERVICES * sizeof(reply.weights[0]);
+    is_int(size + 4 + 9 * sizeof(struct lbcd_ext_field), result,
+           "Reply to extended query is correct size");
+    memcpy(&reply, packet, size);
+    is_int(LBCD_OP_LBINFO_EXT, ntohs(reply.h.op),
+           "...and has correct operation");
+    memcpy(&ext, packet + size, sizeof(ext));
+    is_int(9, ntohs(ext.count), "...and has nine extended fields");
+    is_int(LBCD_EXT_CPUS, ntohs(ext.fields[0].type), "...first is CPUs");
+    ok(ntohl(ext.fields[0].value) >= 1, "...at least some CPU");
+    is_int(LBCD_EXT_NL1, ntohs(ext.fields[1].type),
+           "...second is normalized load");
+    ok(ntohl(ext.fields[1].value) <= (unsigned long) ntohs(reply.l1)
+           * 100 / ntohl(ext.fields[0].value) + 1,
+       "...which is no more than the load");
+    is_int(LBCD_EXT_NUMA_FREE_MAX, ntohs(ext.fields[8].type),
+           "...last is the free memory of the emptiest NUMA node");
+
     /* All done.  Clean up and return. */
     close(fd);
     return 0;
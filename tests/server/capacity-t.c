@@ -0,0 +1,128 @@
+/*
+ * Tests for capacity calibration.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <poll.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/lbcd.h>
+#include <tests/tap/string.h>
+#include <util/messages.h>
+
+
+/*
+ * Read the score from a state file, returning 0 if it can't be read.
+ */
+static unsigned long
+read_state(const char *path)
+{
+    FILE *file;
+    unsigned long score;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+    if (fscanf(file, "lbcd-capacity 1 %lu", &score) != 1)
+        score = 0;
+    fclose(file);
+    return score;
+}
+
+
+int
+main(void)
+{
+    char *tmpdir, *path;
+    uint32_t weight, incr;
+    struct pollfd pfd;
+
+    plan(22);
+
+    /* Without a state file, weights aren't scaled. */
+    is_int(0, lbcd_capacity_get(), "No capacity by default");
+    weight = 1000;
+    incr = 200;
+    lbcd_capacity_scale(&weight, &incr);
+    is_int(1000, weight, "...and weight isn't scaled");
+    is_int(200, incr, "...nor increment");
+    is_int(-1, lbcd_capacity_start(), "...and there is nothing to calibrate");
+
+    /* A cached score is used without running the benchmark. */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/capacity", tmpdir);
+    lbcd_write_file(NULL, path, "lbcd-capacity 1 250\n");
+    lbcd_capacity_init(path);
+    is_int(250, lbcd_capacity_get(), "Score from the state file");
+    lbcd_capacity_scale(&weight, &incr);
+    is_int(400, weight, "...scales the weight");
+    is_int(80, incr, "...and the increment");
+    weight = UINT32_MAX;
+    incr = 1;
+    lbcd_capacity_scale(&weight, &incr);
+    ok(weight == UINT32_MAX, "...but not the maximum weight");
+    is_int(1, incr, "...and increments stay positive");
+
+    /* Initializing with the same file keeps the score. */
+    lbcd_write_file(NULL, path, "lbcd-capacity 1 300\n");
+    lbcd_capacity_init(path);
+    is_int(250, lbcd_capacity_get(), "Same state file keeps the score");
+
+    /* A slow system never scales a busy weight up to the maximum. */
+    lbcd_capacity_init(NULL);
+    lbcd_write_file(NULL, path, "lbcd-capacity 1 50\n");
+    lbcd_capacity_init(path);
+    is_int(50, lbcd_capacity_get(), "Score of a slow system");
+    weight = UINT32_MAX - 2;
+    incr = 200;
+    lbcd_capacity_scale(&weight, &incr);
+    ok(weight == UINT32_MAX - 1, "...saturates below the maximum weight");
+    weight = UINT32_MAX;
+    lbcd_capacity_scale(&weight, &incr);
+    ok(weight == UINT32_MAX, "...and leaves the maximum alone");
+
+    /* A score from another version of the benchmark is measured again. */
+    message_handlers_notice(0);
+    lbcd_write_file(NULL, path, "lbcd-capacity 0 250\n");
+    lbcd_capacity_init(NULL);
+    is_int(0, lbcd_capacity_get(), "No capacity after clearing");
+    lbcd_capacity_init(path);
+    ok(lbcd_capacity_get() > 0, "Benchmark run for an old score");
+    is_int(lbcd_capacity_get(), read_state(path), "...and score saved");
+
+    /* Calibrating again replaces the saved score. */
+    lbcd_write_file(NULL, path, "invalid\n");
+    lbcd_capacity_calibrate();
+    ok(lbcd_capacity_get() > 0, "Calibrate again");
+    is_int(lbcd_capacity_get(), read_state(path), "...and score saved");
+
+    /* Calibrating in a child process does the same. */
+    lbcd_write_file(NULL, path, "invalid\n");
+    pfd.fd = lbcd_capacity_start();
+    pfd.events = POLLIN;
+    ok(pfd.fd >= 0, "Calibrate in a child process");
+    if (pfd.fd >= 0 && poll(&pfd, 1, 60 * 1000) < 0)
+        sysbail("cannot wait for calibration");
+    lbcd_capacity_event();
+    ok(lbcd_capacity_get() > 0, "...and get a score");
+    is_int(lbcd_capacity_get(), read_state(path), "...and score saved");
+
+    /* Stop scaling weights. */
+    lbcd_capacity_init(NULL);
+    is_int(0, lbcd_capacity_get(), "No capacity at the end");
+
+    /* Clean up. */
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * Tests for reporting the resource usage of a cgroup.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+
+#include <server/internal.h>
+#include <server/metrics.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/lbcd.h>
+#include <tests/tap/string.h>
+#include <util/macros.h>
+#include <util/messages.h>
+
+/* Contents of the test cpu.pressure file. */
+#define PRESSURE \
+    "some avg10=12.50 avg60=3.00 avg300=1.00 total=100\n" \
+    "full avg10=1.25 avg60=0.50 avg300=0.00 total=10\n"
+
+/* How many times the cached number of CPUs was invalidated. */
+static unsigned long invalidated = 0;
+
+
+/*
+ * Stubs for the functions used by the psi service, which this test doesn't
+ * need but which are in the same file as the pressure parser, and for
+ * lbcd_cpus_invalidate, which counts the calls.
+ */
+void
+lbcd_service_register(const char *service UNUSED,
+                      service_func_type *function UNUSED, void *data,
+                      unsigned int ttl UNUSED, service_free_type *free_func)
+{
+    free_func(data);
+}
+
+const struct lbcd_metrics *
+lbcd_metrics_get(void)
+{
+    return NULL;
+}
+
+void
+lbcd_cpus_invalidate(void)
+{
+    invalidated++;
+}
+
+
+/*
+ * Remove a file in the test cgroup.
+ */
+static void
+remove_file(const char *dir, const char *name)
+{
+    char *path;
+
+    basprintf(&path, "%s/%s", dir, name);
+    unlink(path);
+    free(path);
+}
+
+
+int
+main(void)
+{
+    struct cgroup_info info;
+    char *tmpdir, *dir;
+    long cpus;
+
+    plan(29);
+
+    /* No cgroup configured. */
+    ok(lbcd_cgroup_init(NULL), "No cgroup");
+    is_int(-1, lbcd_cgroup_read(&info), "...and nothing to read");
+
+    /* Set up a test cgroup. */
+    tmpdir = test_tmpdir();
+    basprintf(&dir, "%s/cgroup", tmpdir);
+    if (mkdir(dir, 0755) < 0)
+        sysbail("cannot create %s", dir);
+    message_handlers_warn(0);
+    ok(!lbcd_cgroup_init(dir), "Directory without cpu.stat");
+    message_handlers_warn(1, message_log_stderr);
+    lbcd_write_file(dir, "cpu.stat",
+                    "usage_usec 1000000\nuser_usec 600000\n"
+                    "system_usec 400000\nnr_periods 10\nnr_throttled 0\n"
+                    "throttled_usec 0\n");
+    lbcd_write_file(dir, "cpu.max", "200000 100000\n");
+    lbcd_write_file(dir, "memory.current", "536870912\n");
+    lbcd_write_file(dir, "memory.max", "2147483648\n");
+    lbcd_write_file(dir, "cpu.pressure", PRESSURE);
+    ok(lbcd_cgroup_init(dir), "Test cgroup");
+
+    /* The first sample has no CPU usage. */
+    is_int(0, lbcd_cgroup_read(&info), "Read cgroup");
+    is_int(200, info.cpu_limit, "...CPU limit");
+    is_int(0, info.cpu_util, "...no CPU usage yet");
+    is_int(512, info.mem_current, "...memory used");
+    is_int(2048, info.mem_max, "...memory limit");
+    is_int(2500, info.mem_used, "...percent of memory used");
+    is_int(1250, info.pressure.some10, "...CPU pressure");
+    is_int(50, info.pressure.full60, "...full CPU pressure");
+    is_int(200, (int) (lbcd_cgroup_cpus() * 100), "...CPUs from quota");
+
+    /*
+     * Use one CPU second and get throttled for a quarter second over a
+     * second.  Since some time will have passed before and after sleeping,
+     * the percentages will be a little less than half of the two CPUs and a
+     * quarter of the time.
+     */
+    lbcd_write_file(dir, "cpu.stat",
+                    "usage_usec 2000000\nnr_throttled 2\n"
+                    "throttled_usec 250000\n");
+    sleep(1);
+    is_int(0, lbcd_cgroup_read(&info), "Read cgroup again");
+    ok(info.cpu_util > 4000 && info.cpu_util <= 5000, "...CPU usage");
+    ok(info.cpu_throttled > 2000 && info.cpu_throttled <= 2500,
+       "...throttled time");
+
+    /* Reading again right away reuses the same usage. */
+    lbcd_write_file(dir, "cpu.stat", "usage_usec 9000000\nthrottled_usec 0\n");
+    lbcd_cgroup_read(&info);
+    ok(info.cpu_util > 4000 && info.cpu_util <= 5000,
+       "...and the same soon after");
+
+    /* No limits, and no memory controller. */
+    lbcd_write_file(dir, "cpu.max", "max 100000\n");
+    lbcd_write_file(dir, "cpuset.cpus.effective", "0-2,5\n");
+    remove_file(dir, "memory.current");
+    remove_file(dir, "memory.max");
+    lbcd_cgroup_init(NULL);
+    ok(lbcd_cgroup_init(dir), "Reinitialize cgroup");
+    lbcd_cgroup_read(&info);
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    is_int(cpus * 100, info.cpu_limit, "...CPU limit is all CPUs");
+    is_int(0, info.mem_current, "...no memory used");
+    is_int(0, info.mem_max, "...no memory limit");
+    is_int(400, (int) (lbcd_cgroup_cpus() * 100), "...CPUs from cpuset");
+
+    /* Resizing the cpuset invalidates the cached number of CPUs. */
+    lbcd_cgroup_read(&info);
+    invalidated = 0;
+    lbcd_write_file(dir, "cpuset.cpus.effective", "0-1\n");
+    lbcd_cgroup_read(&info);
+    is_int(1, invalidated, "Cpuset change invalidates the CPU count");
+    is_int(200, (int) (lbcd_cgroup_cpus() * 100), "...CPUs from new cpuset");
+    lbcd_cgroup_read(&info);
+    is_int(1, invalidated, "...but only once");
+
+    /* A staged change takes effect only when committed. */
+    ok(lbcd_cgroup_prepare(NULL), "Prepare to clear cgroup");
+    lbcd_cgroup_abort();
+    is_int(0, lbcd_cgroup_read(&info), "...still reported after abort");
+    lbcd_cgroup_prepare(NULL);
+    lbcd_cgroup_commit();
+    is_int(-1, lbcd_cgroup_read(&info), "...and cleared after commit");
+
+    /* Stop reporting on the cgroup. */
+    ok(lbcd_cgroup_init(NULL), "Clear cgroup");
+
+    /* Clean up. */
+    remove_file(dir, "cpu.stat");
+    remove_file(dir, "cpu.max");
+    remove_file(dir, "cpu.pressure");
+    remove_file(dir, "cpuset.cpus.effective");
+    rmdir(dir);
+    free(dir);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Tests for composite services.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <server/internal.h>
+#include <server/metrics.h>
+#include <tests/tap/basic.h>
+#include <util/macros.h>
+#include <util/messages.h>
+
+/* A fake service with a fixed result that counts how often it's run. */
+struct fake {
+    uint32_t weight;
+    uint32_t incr;
+    unsigned long calls;
+};
+
+
+/* The snapshot returned by the lbcd_metrics_get stub. */
+static struct lbcd_metrics snapshot;
+
+
+/*
+ * Stub for the metrics snapshot, used by the load service.
+ */
+const struct lbcd_metrics *
+lbcd_metrics_get(void)
+{
+    return &snapshot;
+}
+
+
+/*
+ * The weight function for the fake services.
+ */
+static int
+fake_weight(void *data, uint32_t *weight, uint32_t *incr, int timeout UNUSED,
+            const char *portarg UNUSED, struct lbcd_reply *lb UNUSED)
+{
+    struct fake *fake = data;
+
+    fake->calls++;
+    *weight = fake->weight;
+    *incr = fake->incr;
+    return 0;
+}
+
+
+/*
+ * Compute the weight and increment of a service for a new reply.
+ */
+static void
+compute(const char *service, uint32_t *weight, uint32_t *incr)
+{
+    struct lbcd_reply lb;
+
+    memset(&lb, 0, sizeof(lb));
+    lbcd_service_begin();
+    lbcd_service_weight(service, weight, incr, &lb);
+}
+
+
+int
+main(void)
+{
+    struct fake up   = { 100, 10, 0 };
+    struct fake busy = { 300, 30, 0 };
+    struct fake down = { (uint32_t) -1, 0, 0 };
+    struct lbcd_reply lb;
+    uint32_t weight, incr;
+
+    plan(25);
+
+    /* Set up the fake services. */
+    if (lbcd_weight_init(NULL, "load", 5) != 0)
+        bail("cannot initialize weights");
+    lbcd_service_register("up", fake_weight, &up, 0, NULL);
+    lbcd_service_register("busy", fake_weight, &busy, 0, NULL);
+    lbcd_service_register("down", fake_weight, &down, 0, NULL);
+
+    /* The operations. */
+    ok(lbcd_composite_define("hi=max(up, busy, up)"), "Define max");
+    compute("hi", &weight, &incr);
+    is_int(300, weight, "max weight");
+    is_int(30, incr, "...and increment of the same service");
+    ok(lbcd_composite_define("total=sum(up, busy)"), "Define sum");
+    compute("total", &weight, &incr);
+    is_int(400, weight, "sum weight");
+    is_int(40, incr, "...and increment");
+    ok(lbcd_composite_define("web=gate(down, up)"), "Define gate");
+    compute("web", &weight, &incr);
+    ok(weight == (uint32_t) -1, "gate on a failed service");
+    compute("web:8080", &weight, &incr);
+    ok(weight == (uint32_t) -1, "...with an argument");
+    ok(lbcd_composite_define("half=scale(gate(up, busy), 0.5)"),
+       "Define nested scale");
+    compute("half", &weight, &incr);
+    is_int(150, weight, "scale weight");
+    is_int(15, incr, "...and increment");
+    ok(lbcd_composite_define("sat=sum(down, up)"), "Define saturating sum");
+    compute("sat", &weight, &incr);
+    ok(weight == (uint32_t) -1, "...saturates");
+
+    /* Each service is only run once per reply. */
+    up.calls = 0;
+    busy.calls = 0;
+    memset(&lb, 0, sizeof(lb));
+    lbcd_service_begin();
+    lbcd_service_weight("hi", &weight, &incr, &lb);
+    lbcd_service_weight("total", &weight, &incr, &lb);
+    lbcd_service_weight("up", &weight, &incr, &lb);
+    is_int(1, up.calls, "Shared service run once per reply");
+    is_int(1, busy.calls, "...as is another");
+    compute("hi", &weight, &incr);
+    is_int(2, up.calls, "...but run again for the next reply");
+
+    /* Syntax errors. */
+    message_handlers_warn(0);
+    ok(!lbcd_composite_define("bad=frob(up)"), "Unknown operation");
+    ok(!lbcd_composite_define("bad=gate(up)"), "Too few arguments");
+    ok(!lbcd_composite_define("bad=scale(up, 1, 2)"), "Too many arguments");
+    ok(!lbcd_composite_define("bad=max(up"), "Missing parenthesis");
+    ok(!lbcd_composite_define("bad:80=up"), "Invalid name");
+    message_handlers_warn(1, message_log_stderr);
+
+    /* Loops. */
+    ok(lbcd_composite_check(), "No loops");
+    ok(lbcd_composite_define("a=max(up, b:80)")
+       && lbcd_composite_define("b=sum(a, busy)"),
+       "Define composites that refer to each other");
+    message_handlers_warn(0);
+    ok(!lbcd_composite_check(), "...and the loop is detected");
+    message_handlers_warn(1, message_log_stderr);
+
+    /* Clean up. */
+    lbcd_service_clear();
+    return 0;
+}
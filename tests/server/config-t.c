@@ -0,0 +1,174 @@
+/*
+ * Tests for the lbcd configuration file and reloading it.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <signal.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/lbcd.h>
+#include <tests/tap/string.h>
+#include <util/messages.h>
+#include <util/network.h>
+#include <util/vector.h>
+
+
+/*
+ * Write a configuration file with the given contents, bailing on failure.
+ */
+static void
+write_config(const char *path, const char *contents)
+{
+    FILE *file;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    if (fputs(contents, file) == EOF)
+        sysbail("cannot write to %s", path);
+    if (fclose(file) == EOF)
+        sysbail("cannot flush %s", path);
+}
+
+
+/*
+ * Query lbcd for a single service and return the status of the reply.
+ */
+static int
+query(socket_type fd, const char *service)
+{
+    struct lbcd_request request;
+    struct lbcd_reply reply;
+    size_t size;
+    ssize_t result;
+
+    memset(&request, 0, sizeof(request));
+    request.h.version = htons(3);
+    request.h.id = htons(10);
+    request.h.op = htons(LBCD_OP_LBINFO);
+    request.h.status = htons(1);
+    strlcpy(request.names[0], service, sizeof(request.names[0]));
+    size = sizeof(struct lbcd_header) + sizeof(lbcd_name_type);
+    result = send(fd, &request, size, 0);
+    if (result != (ssize_t) size)
+        sysbail("cannot send query");
+    memset(&reply, 0, sizeof(reply));
+    result = recv(fd, &reply, sizeof(reply), 0);
+    if (result < (ssize_t) sizeof(struct lbcd_header))
+        sysbail("cannot read reply");
+    return ntohs(reply.h.status);
+}
+
+
+int
+main(void)
+{
+    struct lbcd_config *config;
+    char *tmpdir, *path, *pidpath;
+    FILE *pidfile;
+    socket_type fd;
+    struct sockaddr_in sin;
+    struct timespec delay;
+    long pid;
+    int i, status;
+
+    plan(23);
+
+    /* Path to a configuration file in the temporary directory. */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/lbcd.conf", tmpdir);
+
+    /* Defaults and individual settings. */
+    config = lbcd_config_new();
+    is_int(LBCD_PORTNUM, config->port, "Default port");
+    is_int(LBCD_TIMEOUT, config->timeout, "Default timeout");
+    ok(lbcd_config_set(config, "port", "14331"), "Set port");
+    is_int(14331, config->port, "...and the port is set");
+    ok(lbcd_config_set(config, "simple", NULL), "Set flag without a value");
+    ok(config->simple, "...and it is on");
+    ok(lbcd_config_set(config, "simple", "off"), "Turn flag off");
+    ok(!config->simple, "...and it is off");
+    ok(lbcd_config_set(config, "weight", "load"), "Set weight");
+    is_string("load", config->weight, "...and the weight is set");
+    is_int(1, config->services->count, "...and the service is allowed");
+    is_string("allow", lbcd_config_key('a'), "Key for an option");
+    ok(lbcd_config_key('d') == NULL, "...and none for command-line only");
+
+    /* Invalid settings. */
+    message_handlers_warn(0);
+    ok(!lbcd_config_set(config, "frob", "1"), "Unknown setting");
+    ok(!lbcd_config_set(config, "port", "65536"), "Port too large");
+    ok(!lbcd_config_set(config, "timeout", "0"), "Timeout too small");
+    ok(!lbcd_config_set(config, "log", "maybe"), "Invalid boolean");
+    ok(!lbcd_config_set(config, "bind", NULL), "Missing value");
+    message_handlers_warn(1, message_log_stderr);
+    lbcd_config_free(config);
+
+    /* Reading a file. */
+    write_config(path, "# Comment\n\nallow rr\n  timeout   10  \nlog\n"
+                 "allow load\n");
+    config = lbcd_config_new();
+    ok(lbcd_config_read(config, path), "Read configuration file");
+    ok(config->services->count == 2 && config->timeout == 10 && config->log,
+       "...with the right settings");
+    write_config(path, "allow rr\ntimeout 500\n");
+    message_handlers_warn(0);
+    ok(!lbcd_config_read(config, path), "Invalid setting in file");
+    message_handlers_warn(1, message_log_stderr);
+    lbcd_config_free(config);
+
+    /* Start lbcd with a configuration file that doesn't allow rr. */
+    write_config(path, "allow load\n");
+    lbcd_start("-C", path, NULL);
+    fd = network_client_create(PF_INET, SOCK_DGRAM, "127.0.0.1");
+    if (fd == INVALID_SOCKET)
+        sysbail("cannot create client socket");
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(14330);
+    sin.sin_addr.s_addr = htonl(0x7f000001UL);
+    if (connect(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+        sysbail("cannot connect client socket");
+    is_int(LBCD_STATUS_ERROR, query(fd, "rr"), "rr not allowed");
+
+    /* Allow rr and send lbcd a SIGHUP. */
+    write_config(path, "allow load\nallow rr\n");
+    basprintf(&pidpath, "%s/lbcd.pid", tmpdir);
+    pidfile = fopen(pidpath, "r");
+    if (pidfile == NULL)
+        sysbail("cannot open %s", pidpath);
+    if (fscanf(pidfile, "%ld", &pid) != 1)
+        bail("cannot read PID from %s", pidpath);
+    fclose(pidfile);
+    if (kill((pid_t) pid, SIGHUP) < 0)
+        sysbail("cannot send SIGHUP to lbcd");
+
+    /* The reload happens asynchronously, so retry for up to ten seconds. */
+    delay.tv_sec = 0;
+    delay.tv_nsec = 100000000;
+    status = query(fd, "rr");
+    for (i = 0; i < 100 && status != LBCD_STATUS_OK; i++) {
+        nanosleep(&delay, NULL);
+        status = query(fd, "rr");
+    }
+    is_int(LBCD_STATUS_OK, status, "rr allowed after reload");
+
+    /* Clean up. */
+    close(fd);
+    unlink(path);
+    free(path);
+    free(pidpath);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
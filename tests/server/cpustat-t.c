@@ -0,0 +1,155 @@
+/*
+ * Tests for CPU utilization from /proc/stat.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <time.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <util/macros.h>
+#include <util/messages.h>
+
+
+/*
+ * Stubs for NUMA node utilization.  This test is for a host with one node,
+ * which doesn't need the times of each CPU.
+ */
+size_t
+lbcd_numa_cpus(void)
+{
+    return 0;
+}
+
+void
+lbcd_numa_update(const struct cpustat_times *total UNUSED,
+                 const struct cpustat_times *cpus UNUSED, size_t count UNUSED,
+                 unsigned long long now UNUSED, double half_life UNUSED)
+{
+}
+
+
+/*
+ * Parse the totals from the given /proc/stat contents, returning true on
+ * success.
+ */
+static bool
+parse(const char *contents, struct cpustat_times *times)
+{
+    return lbcd_stat_parse(contents, strlen(contents), times, NULL, 0) >= 0;
+}
+
+
+int
+main(void)
+{
+    struct cpustat_times times;
+    struct cpustat_info info;
+    struct timespec delay;
+    int timeout;
+
+    plan(35);
+
+    /* Parsing. */
+    ok(parse("cpu  10 20 30 40 50 60 70 80 90 100\n"
+             "cpu0 5 10 15 20 25 30 35 40 45 50\n", &times),
+       "Parse /proc/stat");
+    is_int(10, times.user, "...user");
+    is_int(20, times.nice, "...nice");
+    is_int(30, times.system, "...system");
+    is_int(40, times.idle, "...idle");
+    is_int(50, times.iowait, "...iowait");
+    is_int(60, times.irq, "...irq");
+    is_int(70, times.softirq, "...softirq");
+    is_int(80, times.steal, "...steal");
+    ok(parse("cpu  1 2 3 4\n", &times), "Parse old format");
+    is_int(4, times.idle, "...idle");
+    is_int(0, times.steal, "...and no steal");
+    ok(!parse("intr 1 2 3 4\n", &times), "Not a cpu line");
+    ok(!parse("cpu  1 2\n", &times), "Too few times");
+
+    /* Half-lives. */
+    ok(lbcd_cpustat_init("1,5.5,30"), "Half-lives");
+    message_handlers_warn(0);
+    ok(!lbcd_cpustat_init("2,10"), "Too few half-lives");
+    ok(!lbcd_cpustat_init("2,10,60,120"), "Too many half-lives");
+    ok(!lbcd_cpustat_init("0,10,60"), "Zero half-life");
+    ok(!lbcd_cpustat_init("a,b,c"), "Invalid half-life");
+    message_handlers_warn(1, message_log_stderr);
+    ok(lbcd_cpustat_init(NULL), "Default half-lives");
+
+    /*
+     * The averages start at the values over the first interval: half busy
+     * and a tenth waiting for I/O.
+     */
+    memset(&times, 0, sizeof(times));
+    lbcd_cpustat_update(&times, 1000000);
+    lbcd_cpustat_read(&info);
+    is_int(0, info.util[0], "No utilization after one sample");
+    times.user = 50;
+    times.idle = 40;
+    times.iowait = 10;
+    lbcd_cpustat_update(&times, 2000000);
+    lbcd_cpustat_read(&info);
+    ok(info.util[0] == 5000 && info.util[1] == 5000 && info.util[2] == 5000,
+       "First averages are the utilization");
+    ok(info.iowait[0] == 1000 && info.iowait[2] == 1000, "...and iowait");
+
+    /*
+     * Two idle seconds.  That's a half-life of the fast average, so it
+     * drops by half, and the others drop by less.
+     */
+    times.idle += 100;
+    lbcd_cpustat_update(&times, 4000000);
+    lbcd_cpustat_read(&info);
+    is_int(2500, info.util[0], "Fast average after two idle seconds");
+    is_int(4353, info.util[1], "...medium average");
+    is_int(4886, info.util[2], "...slow average");
+    is_int(500, info.iowait[0], "...fast iowait");
+
+    /* Two seconds with all time stolen, which counts as busy. */
+    times.steal += 100;
+    lbcd_cpustat_update(&times, 6000000);
+    lbcd_cpustat_read(&info);
+    is_int(6250, info.util[0], "Fast average after steal");
+    is_int(5000, info.steal[0], "...fast steal");
+    is_int(0, info.softirq[0], "...no softirq");
+
+    /* Counters going backwards start over from the new values. */
+    times.idle = 0;
+    lbcd_cpustat_update(&times, 8000000);
+    lbcd_cpustat_read(&info);
+    is_int(6250, info.util[0], "Averages unchanged after reset");
+    times.idle += 100;
+    lbcd_cpustat_update(&times, 10000000);
+    lbcd_cpustat_read(&info);
+    is_int(3125, info.util[0], "...and decay from the new values");
+
+    /* Sampling the real file, if there is one. */
+    lbcd_cpustat_close();
+    if (access("/proc/stat", R_OK) == 0) {
+        lbcd_cpustat_sample();
+        timeout = lbcd_cpustat_timeout();
+        ok(timeout > 0 && timeout <= 250, "Timeout after a sample");
+        delay.tv_sec = 0;
+        delay.tv_nsec = 300 * 1000 * 1000;
+        nanosleep(&delay, NULL);
+        is_int(0, lbcd_cpustat_timeout(), "...and none when a sample is due");
+        lbcd_cpustat_sample();
+        lbcd_cpustat_read(&info);
+        ok(info.util[0] <= 10000, "...utilization is a valid percentage");
+    } else
+        skip_block(3, "/proc/stat not available");
+
+    /* Clean up. */
+    lbcd_cpustat_close();
+    return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * Tests for disk I/O utilization.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/vector.h>
+
+/*
+ * The counters of a test device.  Requests and their times are split between
+ * reads and writes in the file.
+ */
+struct counters {
+    unsigned long ios;
+    unsigned long ticks;
+    unsigned long busy;
+    unsigned long queue;
+};
+
+
+/*
+ * Write /proc/diskstats under the test root with a loop device, sda with
+ * the counters of a newer kernel, and sdb if its counters aren't NULL.
+ */
+static void
+write_stats(const char *path, const struct counters *sda,
+            const struct counters *sdb)
+{
+    FILE *file;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    fprintf(file, "   7       0 loop0 5 0 10 1 0 0 0 0 0 4 1\n");
+    fprintf(file, "   8       0 sda %lu 0 800 %lu %lu 0 400 %lu 0 %lu %lu"
+            " 0 0 0 0 0 0\n", sda->ios / 2, sda->ticks / 2,
+            sda->ios - sda->ios / 2, sda->ticks - sda->ticks / 2, sda->busy,
+            sda->queue);
+    if (sdb != NULL)
+        fprintf(file, "   8      16 sdb %lu 0 8 %lu 0 0 0 0 0 %lu %lu\n",
+                sdb->ios, sdb->ticks, sdb->busy, sdb->queue);
+    fclose(file);
+}
+
+
+int
+main(void)
+{
+    const char *invalid[] = { "", "a/b", "sd a" };
+    struct counters sda = { 1000, 5000, 10000, 20000 };
+    struct counters sdb = { 0, 0, 0, 0 };
+    struct disk_info info;
+    struct vector *names;
+    char *tmpdir, *root, *dir, *path;
+    size_t i;
+
+    plan(18);
+
+    /* Invalid device names. */
+    names = vector_new();
+    message_handlers_warn(0);
+    for (i = 0; i < ARRAY_SIZE(invalid); i++) {
+        vector_clear(names);
+        vector_add(names, invalid[i]);
+        ok(!lbcd_disk_init(names, NULL), "Invalid device \"%s\"",
+           invalid[i]);
+    }
+    message_handlers_warn(1, message_log_stderr);
+
+    /* A fake root with only one of the two devices to monitor. */
+    tmpdir = test_tmpdir();
+    basprintf(&root, "%s/disk", tmpdir);
+    basprintf(&dir, "%s/proc", root);
+    basprintf(&path, "%s/proc/diskstats", root);
+    if (mkdir(root, 0755) < 0 || mkdir(dir, 0755) < 0)
+        sysbail("cannot create %s", dir);
+    write_stats(path, &sda, NULL);
+    vector_clear(names);
+    vector_add(names, "sda");
+    vector_add(names, "sdb");
+    ok(lbcd_disk_init(names, root), "Monitor two devices");
+
+    /* The first sample only establishes a baseline. */
+    lbcd_disk_scan(1000000);
+    lbcd_disk_read(&info);
+    is_int(0, info.util, "No utilization after one sample");
+
+    /*
+     * Over one second, sda completes 100 requests taking 5ms each and is
+     * busy for 800ms with an average of two requests in flight.  sdb is
+     * added.
+     */
+    sda.ios += 100;
+    sda.ticks += 500;
+    sda.busy += 800;
+    sda.queue += 2000;
+    write_stats(path, &sda, &sdb);
+    lbcd_disk_scan(2000000);
+    lbcd_disk_read(&info);
+    is_int(8000, info.util, "Utilization");
+    is_int(200, info.queue, "Queue depth");
+    is_int(500, info.await, "Await");
+
+    /*
+     * Over the next second, sda is idle and keeps its await, and the new sdb
+     * is busy the whole time, completing ten requests taking 50ms each.
+     */
+    sdb.ios += 10;
+    sdb.ticks += 500;
+    sdb.busy += 1000;
+    sdb.queue += 500;
+    write_stats(path, &sda, &sdb);
+    lbcd_disk_scan(3000000);
+    lbcd_disk_read(&info);
+    is_int(10000, info.util, "Utilization of an added device");
+    is_int(5000, info.await, "...and its await");
+
+    /*
+     * sdb is removed and added again with new counters, which only start
+     * over without changing its averages.  A second later, it's idle.
+     */
+    write_stats(path, &sda, NULL);
+    lbcd_disk_scan(4000000);
+    sdb.ios = 1;
+    sdb.ticks = 1;
+    sdb.busy = 1;
+    sdb.queue = 1;
+    write_stats(path, &sda, &sdb);
+    lbcd_disk_scan(5000000);
+    lbcd_disk_read(&info);
+    is_int(10000, info.util, "Removed and added device keeps its averages");
+    lbcd_disk_scan(6000000);
+    lbcd_disk_read(&info);
+    is_int(9330, info.util, "...and its counters start over");
+
+    /* Reloading keeps the averages. */
+    ok(lbcd_disk_init(names, root), "Monitor the same devices");
+    lbcd_disk_read(&info);
+    is_int(9330, info.util, "...keeping their averages");
+
+    /* A root without /proc/diskstats is not sampled. */
+    free(dir);
+    basprintf(&dir, "%s/missing", tmpdir);
+    ok(lbcd_disk_init(names, dir), "Monitor a missing root");
+    lbcd_disk_sample();
+    is_int(-1, lbcd_disk_timeout(), "...which is then not sampled");
+
+    /* Disabling monitoring. */
+    ok(lbcd_disk_init(NULL, NULL), "Disable monitoring");
+    is_int(-1, lbcd_disk_timeout(), "...and there are no more samples");
+
+    /* Clean up. */
+    lbcd_disk_close();
+    vector_free(names);
+    unlink(path);
+    free(path);
+    free(dir);
+    basprintf(&dir, "%s/proc", root);
+    rmdir(dir);
+    free(dir);
+    rmdir(root);
+    free(root);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
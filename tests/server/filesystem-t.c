@@ -0,0 +1,121 @@
+/*
+ * Tests for monitoring how full filesystems are.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <util/messages.h>
+#include <util/vector.h>
+
+
+/*
+ * Initialize the monitored filesystems from a single specification, and
+ * return whether that succeeded.
+ */
+static bool
+init_one(const char *spec)
+{
+    struct vector *specs;
+    bool okay;
+
+    specs = vector_new();
+    vector_add(specs, spec);
+    okay = lbcd_fs_init(specs);
+    vector_free(specs);
+    return okay;
+}
+
+
+int
+main(void)
+{
+    struct fs_usage usage;
+    struct fs_info info;
+    char *tmpdir, *dir, *spec, *list;
+    unsigned long fullest;
+    size_t i;
+
+    plan(23);
+
+    /* /tmp is always monitored. */
+    ok(lbcd_fs_init(NULL), "Default filesystems");
+    ok(lbcd_fs_usage("/tmp", &usage), "/tmp is monitored");
+    ok(usage.available, "...and available");
+    ok(usage.full <= 100 && usage.inodes <= 100, "...with valid usage");
+    ok(!lbcd_fs_usage("/nonexistent", &usage), "Other paths are not");
+    is_int(1, usage.penalty, "...and have no penalty");
+
+    /* Invalid specifications leave the filesystems alone. */
+    message_handlers_warn(0);
+    ok(!init_one("scratch=90"), "Relative path");
+    ok(!init_one("/scratch=101"), "Threshold too large");
+    ok(!init_one("/scratch=90:2,0"), "Zero multiplier");
+    ok(!init_one("/scratch=90:2,"), "Trailing comma");
+    ok(!init_one("/scratch=90x"), "Trailing garbage");
+    message_handlers_warn(1, message_log_stderr);
+    ok(lbcd_fs_usage("/tmp", &usage), "...and /tmp is still monitored");
+
+    /*
+     * Monitor the test directory with a penalty of one more than the percent
+     * full, so the penalty shows the percent the monitor computed.
+     */
+    tmpdir = test_tmpdir();
+    list = bstrdup("1");
+    for (i = 2; i <= 101; i++) {
+        basprintf(&spec, "%s,%lu", list, (unsigned long) i);
+        free(list);
+        list = spec;
+    }
+    basprintf(&spec, "%s=0:%s", tmpdir, list);
+    ok(init_one(spec), "Monitor the test directory");
+    free(spec);
+    free(list);
+    ok(lbcd_fs_usage(tmpdir, &usage), "...which is monitored");
+    fullest = (usage.full > usage.inodes) ? usage.full : usage.inodes;
+    is_int(fullest + 1, usage.penalty, "...with a penalty from its usage");
+    lbcd_fs_read(&info);
+    ok(info.penalty >= usage.penalty, "...included in the largest penalty");
+    ok(info.full >= usage.full, "...and the fullest filesystem");
+    ok(info.inodes >= usage.inodes, "...and the most inodes used");
+
+    /* A threshold of 100 with one multiplier only applies when full. */
+    basprintf(&spec, "%s=100:7", tmpdir);
+    ok(init_one(spec), "Monitor with a threshold of 100");
+    free(spec);
+    lbcd_fs_usage(tmpdir, &usage);
+    fullest = (usage.full > usage.inodes) ? usage.full : usage.inodes;
+    is_int(fullest >= 100 ? 7 : 1, usage.penalty, "...penalty is correct");
+
+    /*
+     * A directory that doesn't exist yet is picked up once it's created, at
+     * the next check.  Initializing again forces a check.
+     */
+    basprintf(&dir, "%s/scratch", tmpdir);
+    ok(init_one(dir), "Monitor a missing directory");
+    lbcd_fs_usage(dir, &usage);
+    ok(!usage.available, "...which is not available");
+    if (mkdir(dir, 0755) < 0)
+        sysbail("cannot create %s", dir);
+    init_one(dir);
+    lbcd_fs_usage(dir, &usage);
+    ok(usage.available, "...until it is created");
+
+    /* Clean up. */
+    lbcd_fs_close();
+    rmdir(dir);
+    free(dir);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
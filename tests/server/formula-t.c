@@ -0,0 +1,437 @@
+/*
+ * Tests for weight formulas.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <server/internal.h>
+#include <server/metrics.h>
+#include <tests/tap/basic.h>
+#include <util/macros.h>
+
+/* The last service registered by lbcd_formula_define. */
+static char registered[sizeof(lbcd_name_type)];
+static service_func_type *registered_function = NULL;
+static void *registered_data = NULL;
+static service_free_type *registered_free = NULL;
+
+
+/*
+ * Stubs for the registry functions in weight.c so that this test doesn't
+ * have to pull in all of the weight modules.  Only one registration is
+ * remembered.
+ */
+void
+lbcd_service_register(const char *service, service_func_type *function,
+                      void *data, unsigned int ttl UNUSED,
+                      service_free_type *free_func)
+{
+    if (registered_free != NULL)
+        registered_free(registered_data);
+    strlcpy(registered, service, sizeof(registered));
+    registered_function = function;
+    registered_data = data;
+    registered_free = free_func;
+}
+
+void **
+lbcd_service_list(service_func_type *function UNUSED, size_t *count)
+{
+    *count = 0;
+    return NULL;
+}
+
+
+/*
+ * Stub for the monitored filesystems.  /tmp is nearly full, which makes the
+ * penalty easy to recognize, and a scratch filesystem is out of inodes.
+ */
+void
+lbcd_fs_read(struct fs_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->tmp.full = 95;
+    info->tmp.inodes = 10;
+    info->tmp.penalty = 32;
+    info->tmpdir = info->tmp;
+    info->full = 95;
+    info->inodes = 100;
+    info->penalty = 32;
+}
+
+
+/*
+ * Stub for the kernel information, with fixed values.
+ */
+int
+kernel_getinfo(struct kernel_info *info)
+{
+    info->procs = 250;
+    info->mem_total = 4096;
+    info->mem_free = 1024;
+    info->swap_total = 0;
+    info->swap_free = 0;
+    return 0;
+}
+
+
+/*
+ * Stub for pressure stall information.  Memory is under pressure and
+ * nothing else is, and there has been a recent stall.
+ */
+int
+lbcd_psi_read(enum psi_resource resource, struct psi_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    if (resource == PSI_MEMORY) {
+        info->some10 = 1250;
+        info->full10 = 500;
+    }
+    return 0;
+}
+
+bool
+lbcd_psi_stalled(void)
+{
+    return true;
+}
+
+
+/*
+ * Stub for the cgroup information.  The cgroup is using three quarters of
+ * its two CPUs.
+ */
+int
+lbcd_cgroup_read(struct cgroup_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->cpu_util = 7500;
+    info->cpu_limit = 200;
+    return 0;
+}
+
+
+/*
+ * Stub for the number of available CPUs.
+ */
+double
+lbcd_cpus_get(void)
+{
+    return 2;
+}
+
+
+/*
+ * Stub for the capacity score.  The system is half again as fast as the
+ * reference system.
+ */
+unsigned long
+lbcd_capacity_get(void)
+{
+    return 150;
+}
+
+
+/*
+ * Stubs for CPU utilization.  The system has been a quarter busy.
+ */
+void
+lbcd_cpustat_sample(void)
+{
+}
+
+void
+lbcd_cpustat_read(struct cpustat_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->util[0] = 2500;
+    info->util[1] = 2500;
+    info->util[2] = 2500;
+}
+
+
+/*
+ * Stub for NUMA information.  One of two nodes is nearly saturated and has
+ * little free memory.
+ */
+int
+lbcd_numa_read(struct numa_info *info)
+{
+    info->nodes = 2;
+    info->util_max = 9500;
+    info->util_min = 1000;
+    info->free_min = 512;
+    info->free_max = 8192;
+    return 0;
+}
+
+
+/*
+ * Stub for the CPU time of each user.  One of three users is using four
+ * CPUs, 80% of all CPU time.
+ */
+void
+lbcd_usercpu_read(struct usercpu_info *info)
+{
+    info->users = 3;
+    info->heavy = 1;
+    info->top_share = 8000;
+    info->top_util = 40000;
+}
+
+
+/*
+ * Stub for sampling memory pressure, which does nothing.
+ */
+void
+lbcd_memory_sample(void)
+{
+}
+
+
+/*
+ * Stub for memory pressure.  Most memory is in use and the system is
+ * swapping, but there's still more available than the floor.
+ */
+void
+lbcd_memory_read(struct memory_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->available = 1024;
+    info->used = 88;
+    info->swap_used = 40;
+    info->majfaults = 50;
+    info->pressure = 93;
+    info->penalty = 8;
+    info->low = false;
+}
+
+
+/*
+ * Stubs for network throughput.  The busiest interface is 60% used and a
+ * tenth of a percent of TCP segments are retransmitted.
+ */
+void
+lbcd_netdev_sample(void)
+{
+}
+
+void
+lbcd_netdev_read(struct netdev_info *info)
+{
+    info->rx = 51200;
+    info->tx = 12800;
+    info->util = 6000;
+    info->errors = 2;
+    info->retrans = 10;
+}
+
+
+/*
+ * Stubs for disk I/O.  The busiest disk is 90% busy with four requests in
+ * flight taking 12.5ms each.
+ */
+void
+lbcd_disk_sample(void)
+{
+}
+
+void
+lbcd_disk_read(struct disk_info *info)
+{
+    info->util = 9000;
+    info->queue = 400;
+    info->await = 1250;
+}
+
+
+/*
+ * Stub for the idle users.  Two of the five sessions are idle, one of them
+ * the only session of its user.
+ */
+void
+lbcd_users_idle(int *sessions, int *uniq)
+{
+    *sessions = 2;
+    *uniq = 1;
+}
+
+
+/*
+ * Compile and evaluate a formula against the current snapshot, returning the
+ * result truncated to an integer or -1 if the formula doesn't compile.  Also
+ * stores the number of instructions in size if it's not NULL.
+ */
+static int
+eval(const char *source, size_t *size)
+{
+    struct formula *formula;
+    char *error;
+    double result;
+
+    formula = lbcd_formula_compile(source, &error);
+    if (formula == NULL) {
+        diag("%s: %s", source, error);
+        free(error);
+        return -1;
+    }
+    result = lbcd_formula_eval(formula, lbcd_metrics_get());
+    if (size != NULL)
+        *size = lbcd_formula_size(formula);
+    lbcd_formula_free(formula);
+    return (int) result;
+}
+
+
+/*
+ * Compile a formula that should be rejected and return the error message,
+ * which the caller must free, or NULL if it compiled.
+ */
+static char *
+reject(const char *source)
+{
+    struct formula *formula;
+    char *error;
+
+    formula = lbcd_formula_compile(source, &error);
+    if (formula != NULL) {
+        lbcd_formula_free(formula);
+        return NULL;
+    }
+    return error;
+}
+
+
+/*
+ * Check that a formula is rejected, ignoring the error message.
+ */
+static void
+is_rejected(const char *source)
+{
+    char *error;
+
+    error = reject(source);
+    ok(error != NULL, "Rejected: %s", source);
+    free(error);
+}
+
+
+int
+main(void)
+{
+    struct lbcd_reply lb;
+    uint32_t weight, incr;
+    size_t size;
+    char *error;
+
+    plan(47);
+
+    /* Set up a snapshot of metrics. */
+    memset(&lb, 0, sizeof(lb));
+    lb.l1 = htons(150);
+    lb.l5 = htons(100);
+    lb.tot_users = htons(5);
+    lb.uniq_users = htons(3);
+    lb.on_console = 1;
+    lb.tmp_full = 95;
+    lbcd_metrics_update(&lb);
+
+    /* The built-in load weight expressed as a formula. */
+    is_int(3*100 + 3*150 + 2*20,
+           eval("uniq*100 + 3*l1 + (tot - uniq)*20", NULL),
+           "Default load formula");
+    is_int(2*100 + 1*25 + 3*150 + 1*20 + 1*5,
+           eval("(uniq - uniq_idle)*100 + uniq_idle*25 + 3*l1"
+                " + (tot - idle - uniq + uniq_idle)*20"
+                " + (idle - uniq_idle)*5", NULL),
+           "Default load formula with idle users");
+    is_int(32, eval("tmp_penalty", NULL), "Tmp penalty metric");
+    is_int(1, eval("fs_inodes >= 100 && tmp_inodes < 50 ? 1 : 0", NULL),
+           "Filesystem inode metrics");
+    is_int(26, eval("mem_free * 100 / mem_total + procs / 250", NULL),
+           "Kernel metrics");
+    is_int(75, eval("nl1", NULL), "Load per CPU");
+    is_int(1, eval("user_cpu_heavy > 0 && user_cpu_top_share > 5000"
+                   " && user_cpu_top_util / 100 == 400 ? 1 : 0", NULL),
+           "Per-user CPU metrics");
+    is_int(8 * 9, eval("mem_low ? 0 : mem_penalty * (mem_pressure - mem_used"
+                       " + swap_used / 10)", NULL),
+           "Memory pressure metrics");
+    is_int(6000 + 2*100 + 10*10,
+           eval("net_util + net_errors*100 + tcp_retrans*10", NULL),
+           "Network metrics");
+    is_int(1, eval("disk_util > 8000 && disk_queue / 100 == 4"
+                   " && disk_await == 1250 ? 1 : 0", NULL), "Disk metrics");
+    is_int(1, eval("cpu_util_fast > 2000 && cpu_steal_slow < 100 ? 1 : 0",
+                   NULL), "CPU utilization");
+    is_int(100, eval("l1 * 100 / capacity", NULL), "Capacity");
+    is_int(1, eval("numa_nodes > 1 && numa_util_max - numa_util_min > 5000"
+                   " && numa_free_min < 1024 ? 1 : 0", NULL),
+           "NUMA metrics");
+    is_int(3000, eval("psi_memory_full10 * 4 + (psi_stall ? 1000 : 0)",
+                      NULL),
+           "Pressure metrics");
+    is_int(150, eval("cg_cpu_util * cg_cpu_limit / 10000", NULL),
+           "cgroup metrics");
+
+    /* Operators and precedence. */
+    is_int(7, eval("1 + 2 * 3", NULL), "Precedence");
+    is_int(3, eval("-(2 - 5)", NULL), "Unary minus");
+    is_int(2, eval("8 / 2 / 2", NULL), "Left associativity");
+    is_int(0, eval("l1 / (tot - 5)", NULL), "Division by zero");
+    is_int(150, eval("max(l1, 5, uniq)", NULL), "max");
+    is_int(3, eval("min(l1, 5, uniq)", NULL), "min");
+    is_int(100, eval("console ? 100 : 0", NULL), "Boolean metric");
+    is_int(2, eval("tot == uniq ? 1 : 2", NULL), "Equality");
+    is_int(1, eval("!console || tmp_full >= 95 ? 1 : 2", NULL),
+           "Logical operators");
+    is_int(2, eval("l5 < l1 && false ? 1 : 2", NULL),
+           "Boolean constants");
+    is_int(1, eval("0.5 + .5", NULL), "Fractional numbers");
+
+    /* Constant folding. */
+    is_int(300, eval("uniq * 2 * 50", &size), "Unfolded formula");
+    is_int(5, size, "...compiles to five instructions");
+    is_int(103, eval("uniq + 2 * 50", &size), "Folded subexpression");
+    is_int(3, size, "...compiles to three instructions");
+    is_int(150, eval("1 < 2 ? l1 : tot * 2", &size),
+           "Folded conditional");
+    is_int(1, size, "...compiles to one instruction");
+
+    /* Errors. */
+    error = reject("uniq * bogus");
+    is_string("unknown metric at position 8", error, "Unknown metric");
+    free(error);
+    error = reject("console + 1");
+    is_string("expected a number at position 1", error, "Type error");
+    free(error);
+    is_rejected("uniq +");
+    is_rejected("l1 ? 1 : 2");
+    is_rejected("console ? 1 : false");
+    is_rejected("1 < 2 < 3");
+    is_rejected("min()");
+    is_rejected("(l1");
+    is_rejected("l1 l5");
+    is_rejected("l1 > 100");
+
+    /* Defining formula services. */
+    ok(lbcd_formula_define("batch=-uniq;maxweight * 2"),
+       "Defining a formula service");
+    is_string("batch", registered, "...registers the service");
+    registered_function(registered_data, &weight, &incr, 5, NULL, &lb);
+    is_int(0, weight, "...and the weight is clamped");
+    ok(incr == (uint32_t) -1, "...as is the increment");
+    ok(!lbcd_formula_define("bad:name=1") && !lbcd_formula_define("=1")
+       && !lbcd_formula_define("x=1;") && !lbcd_formula_define("default=1"),
+       "Invalid definitions are rejected");
+    registered_free(registered_data);
+    return 0;
+}
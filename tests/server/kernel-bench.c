@@ -0,0 +1,112 @@
+/*
+ * Benchmark reading the load average and uptime from /proc.
+ *
+ * Compares opening and parsing /proc/loadavg and /proc/uptime with stdio on
+ * each call, as lbcd used to, with the persistent procfile readers.  Run with
+ * make bench, optionally passing the number of iterations as an argument.
+ * This is not part of the test suite.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/time.h>
+
+#include <server/procfile.h>
+#include <util/messages.h>
+
+/* Default number of iterations. */
+#define BENCH_ITERATIONS 100000
+
+
+/*
+ * Read the load and uptime with stdio, the way lbcd used to.
+ */
+static void
+read_stdio(void)
+{
+    FILE *fp;
+    double l1, l5, l15, uptime;
+
+    fp = fopen("/proc/loadavg", "r");
+    if (fp == NULL)
+        sysdie("cannot open /proc/loadavg");
+    if (fscanf(fp, "%lf %lf %lf", &l1, &l5, &l15) < 3)
+        die("cannot parse /proc/loadavg");
+    fclose(fp);
+    fp = fopen("/proc/uptime", "r");
+    if (fp == NULL)
+        sysdie("cannot open /proc/uptime");
+    if (fscanf(fp, "%lf", &uptime) < 1)
+        die("cannot parse /proc/uptime");
+    fclose(fp);
+}
+
+
+/*
+ * Read the load and uptime with persistent procfile readers.
+ */
+static void
+read_procfile(void)
+{
+    static struct procfile loadavg = PROCFILE_INIT("/proc/loadavg");
+    static struct procfile uptime = PROCFILE_INIT("/proc/uptime");
+    char buffer[128];
+    const char *p;
+    unsigned long value;
+    int i;
+
+    if (procfile_read(&loadavg, buffer, sizeof(buffer)) < 0)
+        exit(1);
+    for (i = 0, p = buffer; i < 3 && p != NULL; i++)
+        p = procfile_fixed(p, 2, &value);
+    if (p == NULL)
+        die("cannot parse /proc/loadavg");
+    if (procfile_read(&uptime, buffer, sizeof(buffer)) < 0)
+        exit(1);
+    if (procfile_fixed(buffer, 0, &value) == NULL)
+        die("cannot parse /proc/uptime");
+}
+
+
+/*
+ * Run a reader the given number of times and report the time per call.
+ */
+static void
+bench(const char *name, void (*reader)(void), unsigned long iterations)
+{
+    struct timeval start, end;
+    unsigned long i;
+    double elapsed;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iterations; i++)
+        reader();
+    gettimeofday(&end, NULL);
+    elapsed = (end.tv_sec - start.tv_sec) * 1e9
+        + (end.tv_usec - start.tv_usec) * 1e3;
+    printf("%-10s %10lu calls %10.0f ns/call\n", name, iterations,
+           elapsed / iterations);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    unsigned long iterations = BENCH_ITERATIONS;
+
+    message_program_name = "kernel-bench";
+    if (argc > 1)
+        iterations = strtoul(argv[1], NULL, 10);
+    if (iterations == 0)
+        die("invalid number of iterations");
+    bench("stdio", read_stdio, iterations);
+    bench("procfile", read_procfile, iterations);
+    return 0;
+}
@@ -0,0 +1,224 @@
+/*
+ * Tests for the listen service.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#if defined(HAVE_LINUX_NETLINK_H) && defined(HAVE_LINUX_INET_DIAG_H) \
+    && defined(HAVE_LINUX_SOCK_DIAG_H)
+# include <linux/netlink.h>
+# include <linux/inet_diag.h>
+# include <linux/sock_diag.h>
+# define HAVE_SOCK_DIAG 1
+#endif
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <util/macros.h>
+
+#ifdef HAVE_SOCK_DIAG
+
+/* A netlink message about one socket, as in a sock_diag dump. */
+struct diag_message {
+    struct nlmsghdr header;
+    struct inet_diag_msg msg;
+};
+
+
+/*
+ * Fill in a message about a socket with the given state, local port, and
+ * queue lengths.
+ */
+static void
+fill_socket(struct diag_message *message, int state, unsigned short port,
+            unsigned int rqueue, unsigned int wqueue)
+{
+    memset(message, 0, sizeof(*message));
+    message->header.nlmsg_len = NLMSG_LENGTH(sizeof(message->msg));
+    message->header.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    message->msg.idiag_family = AF_INET;
+    message->msg.idiag_state = state;
+    message->msg.id.idiag_sport = htons(port);
+    message->msg.id.idiag_dport = htons(40000);
+    message->msg.idiag_rqueue = rqueue;
+    message->msg.idiag_wqueue = wqueue;
+}
+
+
+/*
+ * Fill in a message ending a dump.
+ */
+static void
+fill_done(struct diag_message *message)
+{
+    memset(message, 0, sizeof(*message));
+    message->header.nlmsg_len = NLMSG_LENGTH(sizeof(int));
+    message->header.nlmsg_type = NLMSG_DONE;
+}
+
+
+/*
+ * Test the listen service against a socket listening on the loopback
+ * interface with one connection waiting to be accepted.  Skips the tests if
+ * the kernel doesn't support sock_diag.
+ */
+static void
+test_live(void)
+{
+    struct sockaddr_in addr;
+    socklen_t size = sizeof(addr);
+    socket_type server, client;
+    uint32_t weight, incr;
+    char port[16];
+
+    server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server == INVALID_SOCKET)
+        sysbail("cannot create socket");
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(server, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        sysbail("cannot bind socket");
+    if (listen(server, 4) < 0)
+        sysbail("cannot listen on socket");
+    if (getsockname(server, (struct sockaddr *) &addr, &size) < 0)
+        sysbail("cannot get socket address");
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    if (client == INVALID_SOCKET)
+        sysbail("cannot create socket");
+    if (connect(client, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        sysbail("cannot connect to socket");
+    snprintf(port, sizeof(port), "%u", ntohs(addr.sin_port));
+    if (lbcd_listen_weight(&weight, &incr, 0, port, NULL) < 0)
+        skip_block(2, "sock_diag not available");
+    else {
+        is_int(10 + 10000 / 4, weight, "Weight of a listening port");
+        is_int(10, incr, "...and its increment");
+    }
+    socket_close(client);
+    socket_close(server);
+}
+
+
+/*
+ * Parse a dump of listeners on many ports followed by a dump of one
+ * connection to each, which grows the table several times, and check that
+ * every port is found.
+ */
+static void
+test_many(void)
+{
+    struct listen_table table = { NULL, 0, 0 };
+    struct diag_message message;
+    const struct listen_port *port;
+    unsigned short i;
+    bool okay = true;
+
+    for (i = 1; i <= 1000; i++) {
+        fill_socket(&message, 10, i * 64, 0, 128);
+        lbcd_listen_parse(&table, &message, sizeof(message));
+    }
+    for (i = 1; i <= 1000; i++) {
+        fill_socket(&message, 1, i * 64, 0, 0);
+        lbcd_listen_parse(&table, &message, sizeof(message));
+    }
+    is_int(1000, table.count, "Listeners on 1000 ports");
+    for (i = 1; i <= 1000; i++) {
+        port = lbcd_listen_find(&table, i * 64);
+        if (port == NULL || port->established != 1)
+            okay = false;
+    }
+    ok(okay, "...each with one connection");
+    ok(lbcd_listen_find(&table, 65) == NULL, "...and no others");
+    free(table.ports);
+}
+
+
+int
+main(void)
+{
+    struct diag_message messages[6];
+    struct listen_table table = { NULL, 0, 0 };
+    const struct listen_port *port;
+    struct nlmsgerr *error;
+    uint32_t weight, incr;
+
+    plan(20);
+
+    /*
+     * A dump of listeners on port 80 for IPv4 and IPv6, followed by a dump
+     * of two connections to it and one to port 22, split into two batches.
+     */
+    fill_socket(&messages[0], 10, 80, 3, 128);
+    fill_socket(&messages[1], 10, 80, 1, 128);
+    fill_done(&messages[2]);
+    is_int(1, lbcd_listen_parse(&table, messages, 3 * sizeof(messages[0])),
+           "Dump of listeners");
+    fill_socket(&messages[0], 1, 80, 0, 0);
+    fill_socket(&messages[1], 1, 22, 0, 0);
+    fill_socket(&messages[2], 1, 80, 0, 0);
+    is_int(0, lbcd_listen_parse(&table, messages, 3 * sizeof(messages[0])),
+           "First batch of connections");
+    fill_done(&messages[0]);
+    is_int(1, lbcd_listen_parse(&table, messages, sizeof(messages[0])),
+           "...and the end of the dump");
+    port = lbcd_listen_find(&table, 80);
+    ok(port != NULL && port->listening, "Port 80 is listening");
+    if (port == NULL)
+        skip_block(3, "port 80 not found");
+    else {
+        is_int(4, port->queue, "...with the queues added together");
+        is_int(256, port->backlog, "...as are the backlogs");
+        is_int(2, port->established, "...and two connections");
+    }
+    ok(lbcd_listen_find(&table, 22) == NULL,
+       "Connections to port 22 without a listener are ignored");
+    ok(lbcd_listen_find(&table, 25) == NULL, "Port 25 has no sockets");
+    free(table.ports);
+    test_many();
+
+    /* An error from the kernel. */
+    memset(messages, 0, sizeof(messages));
+    messages[0].header.nlmsg_len = NLMSG_LENGTH(sizeof(struct nlmsgerr));
+    messages[0].header.nlmsg_type = NLMSG_ERROR;
+    error = NLMSG_DATA(&messages[0].header);
+    error->error = -EPERM;
+    memset(&table, 0, sizeof(table));
+    is_int(-1, lbcd_listen_parse(&table, messages, sizeof(messages[0])),
+           "Error from the kernel");
+    is_int(EPERM, errno, "...with the error set");
+    free(table.ports);
+
+    /* Invalid ports. */
+    is_int(-1, lbcd_listen_weight(&weight, &incr, 0, NULL, NULL),
+           "No port");
+    is_int(-1, lbcd_listen_weight(&weight, &incr, 0, "65536", NULL),
+           "Port out of range");
+    is_int(-1, lbcd_listen_weight(&weight, &incr, 0, "nonexistent", NULL),
+           "Unknown service");
+    is_int(-1, (int) weight, "...with the maximum weight");
+
+    /* The service with a real listening socket. */
+    test_live();
+    lbcd_listen_close();
+    return 0;
+}
+
+#else /* !HAVE_SOCK_DIAG */
+
+int
+main(void)
+{
+    skip_all("sock_diag not available");
+}
+
+#endif /* !HAVE_SOCK_DIAG */
@@ -0,0 +1,72 @@
+/*
+ * Tests for the default load service.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <server/internal.h>
+#include <server/metrics.h>
+#include <tests/tap/basic.h>
+
+/* The snapshot returned by the lbcd_metrics_get stub. */
+static struct lbcd_metrics snapshot;
+
+
+/*
+ * Stub for the metrics snapshot.
+ */
+const struct lbcd_metrics *
+lbcd_metrics_get(void)
+{
+    return &snapshot;
+}
+
+
+/*
+ * Return the weight of the load service for a system with no load and the
+ * given number of users, each with one session, and the given filesystem
+ * and memory penalties.
+ */
+static uint32_t
+load(unsigned short users, double fs_penalty, double mem_penalty)
+{
+    struct lbcd_reply lb;
+    uint32_t weight, incr;
+
+    memset(&lb, 0, sizeof(lb));
+    lb.tot_users = htons(users);
+    lb.uniq_users = htons(users);
+    snapshot.value[METRIC_TMP_PENALTY] = fs_penalty;
+    snapshot.value[METRIC_MEM_PENALTY] = mem_penalty;
+    lbcd_load_weight(&weight, &incr, 0, NULL, &lb);
+    return weight;
+}
+
+
+int
+main(void)
+{
+    if (access("/etc/nologin", F_OK) == 0)
+        skip_all("/etc/nologin exists");
+    plan(5);
+
+    /* Penalties larger than an int can hold saturate below the maximum. */
+    is_int(3000, load(30, 1, 1), "Weight without penalties");
+    ok(load(30, 1000000, 1) == 3000000000U,
+       "Filesystem penalty beyond the range of an int");
+    ok(load(3000, 1000000, 1) == UINT32_MAX - 1,
+       "...saturates below the maximum weight");
+    ok(load(30, 1, 1000000) == 3000000000U,
+       "Memory penalty beyond the range of an int");
+    ok(load(30, 1000000, 1000000) == UINT32_MAX - 1,
+       "...saturates on top of the filesystem penalty");
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Tests for the memory and swap pressure.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <util/messages.h>
+
+/* Sample /proc/meminfo from a 16 GiB system with 4 GiB of swap. */
+static const char meminfo[] = "\
+MemTotal:       16384000 kB\n\
+MemFree:         1024000 kB\n\
+MemAvailable:    4096000 kB\n\
+Buffers:          512000 kB\n\
+Cached:          2048000 kB\n\
+SwapCached:        10240 kB\n\
+SwapTotal:       4096000 kB\n\
+SwapFree:        3072000 kB\n";
+
+/* The same from a kernel without MemAvailable. */
+static const char meminfo_old[] = "\
+MemTotal:       16384000 kB\n\
+MemFree:         1024000 kB\n\
+Buffers:          512000 kB\n\
+Cached:          2048000 kB\n\
+SwapTotal:             0 kB\n\
+SwapFree:              0 kB\n";
+
+/* Part of /proc/vmstat. */
+static const char vmstat[] = "\
+nr_free_pages 256000\n\
+pgfault 987654321\n\
+pgmajfault 12345\n\
+pgrefill 0\n";
+
+
+/*
+ * Update with a sample of the given available memory in MiB and count of
+ * major faults at the given time in seconds, and return the results.
+ */
+static void
+update(unsigned long available, unsigned long faults, unsigned long when,
+       struct memory_info *info)
+{
+    struct memory_sample sample;
+
+    memset(&sample, 0, sizeof(sample));
+    sample.total = 16000 * 1024;
+    sample.available = available * 1024;
+    sample.majfaults = faults;
+    lbcd_memory_update(&sample, (unsigned long long) when * 1000000);
+    lbcd_memory_read(info);
+}
+
+
+int
+main(void)
+{
+    struct memory_sample sample;
+    struct memory_info info;
+
+    plan(31);
+
+    /* Parsing. */
+    ok(lbcd_memory_parse(meminfo, vmstat, &sample), "Parse meminfo");
+    is_int(16384000, sample.total, "...total");
+    is_int(4096000, sample.available, "...available");
+    is_int(4096000, sample.swap_total, "...swap total");
+    is_int(3072000, sample.swap_free, "...swap free");
+    is_int(12345, sample.majfaults, "...major faults");
+    ok(lbcd_memory_parse(meminfo_old, NULL, &sample),
+       "Parse meminfo without MemAvailable");
+    is_int(3584000, sample.available, "...available from free and cache");
+    is_int(0, sample.majfaults, "...and no major faults without vmstat");
+    ok(!lbcd_memory_parse("MemFree: 1024 kB\n", vmstat, &sample),
+       "Missing total");
+
+    /* Invalid penalties. */
+    message_handlers_warn(0);
+    ok(!lbcd_memory_init("101", 0), "Threshold too high");
+    ok(!lbcd_memory_init("80:2,0", 0), "Zero multiplier");
+    ok(!lbcd_memory_init("80:", 0), "Missing multipliers");
+    ok(!lbcd_memory_init("80:2x", 0), "Trailing garbage");
+    message_handlers_warn(1, message_log_stderr);
+
+    /* Without a penalty, the penalty is always 1. */
+    ok(lbcd_memory_init(NULL, 0), "No penalty");
+    update(400, 100, 10, &info);
+    is_int(400, info.available, "...available");
+    is_int(97, info.used, "...used");
+    is_int(0, info.majfaults, "...no fault rate from one sample");
+    is_int(97, info.pressure, "...pressure");
+    is_int(1, info.penalty, "...penalty");
+    ok(!info.low, "...and no floor");
+
+    /*
+     * With the default multipliers starting at 61, swapping at 200 faults a
+     * second raises the pressure of 50% memory use to 70, and at 500 faults
+     * a second it's 100.
+     */
+    ok(lbcd_memory_init("61", 0), "Default multipliers");
+    update(8000, 500, 12, &info);
+    is_int(200, info.majfaults, "...fault rate over two seconds");
+    is_int(70, info.pressure, "...pressure includes faults");
+    is_int(16, info.penalty, "...penalty");
+    update(8000, 1000, 13, &info);
+    is_int(100, info.pressure, "...pressure is capped");
+    is_int(32, info.penalty, "...as is the penalty");
+
+    /* Explicit multipliers and the floor. */
+    ok(lbcd_memory_init("90:3,5", 500), "Explicit multipliers and floor");
+    update(1000, 1000, 14, &info);
+    is_int(5, info.penalty, "...penalty past the end of the list");
+    ok(!info.low, "...and above the floor");
+    update(400, 1000, 15, &info);
+    ok(info.low, "...and then below the floor");
+
+    /* Clean up. */
+    lbcd_memory_close();
+    return 0;
+}
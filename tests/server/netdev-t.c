@@ -0,0 +1,233 @@
+/*
+ * Tests for network throughput and errors.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+
+#include <server/internal.h>
+#include <server/metrics.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/lbcd.h>
+#include <tests/tap/string.h>
+#include <util/macros.h>
+#include <util/messages.h>
+#include <util/vector.h>
+
+/* The header of /proc/net/dev. */
+#define DEV_HEADER                                                         \
+    "Inter-|   Receive                                                |"  \
+    "  Transmit\n"                                                        \
+    " face |bytes    packets errs drop fifo frame compressed multicast|"  \
+    "bytes    packets errs drop fifo colls carrier compressed\n"           \
+    "    lo: 100 1 0 0 0 0 0 0 100 1 0 0 0 0 0 0\n"
+
+/* Files and directories under the test root, in the order to remove them. */
+static const char *const files[] = {
+    "sys/class/net/eth0/speed", "sys/class/net/eth0", "sys/class/net",
+    "sys/class", "sys", "proc/net/dev", "proc/net/snmp", "proc/net", "proc"
+};
+
+/* The service registered by lbcd_netdev_init, recorded by the stub below. */
+static service_func_type *registered_function = NULL;
+
+/* The snapshot returned by the lbcd_metrics_get stub. */
+static struct lbcd_metrics snapshot;
+
+
+/*
+ * Stub for the registration function in weight.c.  Records the service so
+ * that the test can call it.
+ */
+void
+lbcd_service_register(const char *service UNUSED,
+                      service_func_type *function, void *data UNUSED,
+                      unsigned int ttl UNUSED,
+                      service_free_type *free_func UNUSED)
+{
+    registered_function = function;
+}
+
+
+/*
+ * Stub for the metrics snapshot.
+ */
+const struct lbcd_metrics *
+lbcd_metrics_get(void)
+{
+    return &snapshot;
+}
+
+
+/*
+ * Create a directory, bailing on failure.
+ */
+static void
+make_dir(const char *root, const char *name)
+{
+    char *path;
+
+    basprintf(&path, "%s/%s", root, name);
+    if (mkdir(path, 0755) < 0)
+        sysbail("cannot create %s", path);
+    free(path);
+}
+
+
+/*
+ * Write the counters of both test interfaces and the TCP counters.  The
+ * second interface has no space after its colon, as with long names on old
+ * kernels.
+ */
+static void
+write_counters(const char *root, unsigned long eth0_rx, unsigned long eth0_tx,
+               unsigned long errors, unsigned long eth1_tx,
+               unsigned long out, unsigned long retrans)
+{
+    char *contents;
+
+    basprintf(&contents, DEV_HEADER
+              "  eth0: %lu 10 %lu %lu 0 0 0 0 %lu 10 0 0 0 0 0 0\n"
+              "  eth1:0 0 0 0 0 0 0 0 %lu 10 0 0 0 0 0 0\n",
+              eth0_rx, errors / 3, errors - errors / 3, eth0_tx, eth1_tx);
+    lbcd_write_file(root, "proc/net/dev", contents);
+    free(contents);
+    basprintf(&contents, "Ip: Forwarding DefaultTTL\nIp: 1 64\n"
+              "Tcp: RtoAlgorithm RtoMin RtoMax MaxConn ActiveOpens OutSegs"
+              " RetransSegs InErrs\n"
+              "Tcp: 1 200 120000 -1 5 %lu %lu 0\n"
+              "Udp: InDatagrams\nUdp: 5\n", out, retrans);
+    lbcd_write_file(root, "proc/net/snmp", contents);
+    free(contents);
+}
+
+
+/*
+ * Read the averages and copy them into the metrics snapshot.
+ */
+static void
+read_info(struct netdev_info *info)
+{
+    lbcd_netdev_read(info);
+    snapshot.value[METRIC_NET_UTIL] = info->util;
+    snapshot.value[METRIC_NET_ERRORS] = info->errors;
+    snapshot.value[METRIC_TCP_RETRANS] = info->retrans;
+}
+
+
+int
+main(void)
+{
+    const char *invalid[] = { "", "eth0=", "eth0=0", "a/b", "eth0=10x" };
+    struct netdev_info info;
+    struct vector *specs;
+    char *tmpdir, *root, *path;
+    uint32_t weight, incr;
+    size_t i;
+
+    plan(24);
+
+    /* Invalid interfaces. */
+    specs = vector_new();
+    message_handlers_warn(0);
+    for (i = 0; i < ARRAY_SIZE(invalid); i++) {
+        vector_clear(specs);
+        vector_add(specs, invalid[i]);
+        ok(!lbcd_netdev_init(specs, NULL), "Invalid interface \"%s\"",
+           invalid[i]);
+    }
+    message_handlers_warn(1, message_log_stderr);
+
+    /*
+     * A fake root with two interfaces, one reporting a speed of 1Gb/s and
+     * one whose speed is configured as 100Mb/s.
+     */
+    tmpdir = test_tmpdir();
+    basprintf(&root, "%s/net", tmpdir);
+    if (mkdir(root, 0755) < 0)
+        sysbail("cannot create %s", root);
+    make_dir(root, "proc");
+    make_dir(root, "proc/net");
+    make_dir(root, "sys");
+    make_dir(root, "sys/class");
+    make_dir(root, "sys/class/net");
+    make_dir(root, "sys/class/net/eth0");
+    lbcd_write_file(root, "sys/class/net/eth0/speed", "1000\n");
+    write_counters(root, 1000, 2000, 0, 0, 1000, 10);
+    vector_clear(specs);
+    vector_add(specs, "eth0");
+    vector_add(specs, "eth1=100");
+    ok(lbcd_netdev_init(specs, root), "Monitor two interfaces");
+    ok(registered_function != NULL, "...and register the net service");
+
+    /* The first sample only establishes a baseline. */
+    lbcd_netdev_scan(1000000);
+    read_info(&info);
+    is_int(0, info.rx, "No throughput after one sample");
+    is_int(0, info.util, "...and no utilization");
+
+    /*
+     * Over one second, eth0 receives 500Mb and transmits 100Mb with three
+     * errors and drops, eth1 transmits 75Mb, and half a percent of TCP
+     * segments are retransmitted.
+     */
+    write_counters(root, 1000 + 62500000, 2000 + 12500000, 3, 9375000, 2000,
+                   15);
+    lbcd_netdev_scan(2000000);
+    read_info(&info);
+    is_int(61035, info.rx, "Receive KiB/s");
+    is_int(21362, info.tx, "Transmit KiB/s");
+    is_int(7500, info.util, "Utilization of the busiest interface");
+    is_int(3, info.errors, "Errors and drops per second");
+    is_int(50, info.retrans, "Retransmissions");
+    registered_function(NULL, &weight, &incr, 0, NULL, NULL);
+    is_int(7500 + 3 * 100 + 50 * 10, weight, "Weight of the net service");
+
+    /* After one half-life with no traffic, the averages halve. */
+    lbcd_netdev_scan(12000000);
+    read_info(&info);
+    is_int(3750, info.util, "Utilization after a half-life");
+    is_int(2, info.errors, "...errors");
+    is_int(25, info.retrans, "...and retransmissions");
+
+    /* Reloading keeps the averages of interfaces still monitored. */
+    vector_clear(specs);
+    vector_add(specs, "eth0");
+    ok(lbcd_netdev_init(specs, root), "Monitor one interface");
+    read_info(&info);
+    is_int(2500, info.util, "...keeping its averages");
+
+    /* A root without /proc/net/dev is not sampled. */
+    basprintf(&path, "%s/missing", tmpdir);
+    ok(lbcd_netdev_init(specs, path), "Monitor a missing root");
+    free(path);
+    lbcd_netdev_sample();
+    is_int(-1, lbcd_netdev_timeout(), "...which is then not sampled");
+
+    /* Disabling monitoring. */
+    vector_clear(specs);
+    ok(lbcd_netdev_init(specs, NULL), "Disable monitoring");
+    is_int(-1, lbcd_netdev_timeout(), "...and there are no more samples");
+
+    /* Clean up. */
+    lbcd_netdev_close();
+    vector_free(specs);
+    for (i = 0; i < ARRAY_SIZE(files); i++) {
+        basprintf(&path, "%s/%s", root, files[i]);
+        if (unlink(path) < 0)
+            rmdir(path);
+        free(path);
+    }
+    rmdir(root);
+    free(root);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * Tests for the load and free memory of NUMA nodes.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/lbcd.h>
+#include <tests/tap/string.h>
+#include <util/macros.h>
+#include <util/messages.h>
+
+/* The test nodes: a directory name, its cpulist, and its meminfo. */
+static const struct {
+    const char *name;
+    const char *cpulist;
+    const char *meminfo;
+} test_nodes[] = {
+    { "node0", "0-1\n",
+      "Node 0 MemTotal:        8388608 kB\n"
+      "Node 0 MemFree:         1048576 kB\n"
+      "Node 0 MemUsed:         7340032 kB\n" },
+    { "node1", "2,3\n",
+      "Node 1 MemTotal:        8388608 kB\n"
+      "Node 1 MemFree:         4194304 kB\n"
+      "Node 1 MemUsed:         4194304 kB\n" },
+    { "node2", "\n",
+      "Node 2 MemTotal:        2097152 kB\n"
+      "Node 2 MemFree:         2097152 kB\n"
+      "Node 2 MemUsed:               0 kB\n" },
+};
+
+
+/*
+ * Create a node directory with cpulist and meminfo files.  Returns the path
+ * to the directory, which the caller must free.
+ */
+static char *
+make_node(const char *root, const char *name, const char *cpulist,
+          const char *meminfo)
+{
+    char *dir;
+
+    basprintf(&dir, "%s/%s", root, name);
+    if (mkdir(dir, 0755) < 0)
+        sysbail("cannot create %s", dir);
+    lbcd_write_file(dir, "cpulist", cpulist);
+    lbcd_write_file(dir, "meminfo", meminfo);
+    return dir;
+}
+
+
+/*
+ * Remove a node directory created by make_node and free its path.
+ */
+static void
+remove_node(char *dir)
+{
+    char *path;
+
+    basprintf(&path, "%s/cpulist", dir);
+    unlink(path);
+    free(path);
+    basprintf(&path, "%s/meminfo", dir);
+    unlink(path);
+    free(path);
+    rmdir(dir);
+    free(dir);
+}
+
+
+/*
+ * Set the times of a CPU to the given busy and idle times.
+ */
+static void
+set_cpu(struct cpustat_times *cpu, unsigned long busy, unsigned long idle)
+{
+    memset(cpu, 0, sizeof(*cpu));
+    cpu->user = busy;
+    cpu->idle = idle;
+}
+
+
+int
+main(void)
+{
+    struct numa_info info;
+    struct cpustat_times total, cpus[4];
+    char *tmpdir, *root, *single, *bad;
+    char *dirs[3];
+    char *dir;
+    size_t i;
+
+    plan(26);
+
+    /* No NUMA information. */
+    tmpdir = test_tmpdir();
+    basprintf(&root, "%s/nonexistent", tmpdir);
+    lbcd_numa_init(root);
+    is_int(0, lbcd_numa_cpus(), "No nodes needs no per-CPU times");
+    is_int(-1, lbcd_numa_read(&info), "...and there is nothing to read");
+    is_int(0, info.nodes, "...and no nodes");
+    free(root);
+
+    /*
+     * Two nodes with CPUs and one with only memory, plus other files in the
+     * same directory that aren't nodes.
+     */
+    basprintf(&root, "%s/node", tmpdir);
+    if (mkdir(root, 0755) < 0)
+        sysbail("cannot create %s", root);
+    for (i = 0; i < ARRAY_SIZE(test_nodes); i++)
+        dirs[i] = make_node(root, test_nodes[i].name, test_nodes[i].cpulist,
+                            test_nodes[i].meminfo);
+    lbcd_write_file(root, "possible", "0-2\n");
+    basprintf(&dir, "%s/power", root);
+    if (mkdir(dir, 0755) < 0)
+        sysbail("cannot create %s", dir);
+    free(dir);
+    lbcd_numa_init(root);
+    is_int(4, lbcd_numa_cpus(), "Times of four CPUs needed");
+    is_int(0, lbcd_numa_read(&info), "Read NUMA information");
+    is_int(3, info.nodes, "...three nodes");
+    is_int(0, info.util_max, "...no utilization yet");
+    is_int(1024, info.free_min, "...least free memory");
+    is_int(4096, info.free_max, "...most free memory");
+
+    /*
+     * One node is three quarters busy and the other is a tenth busy over the
+     * first interval, which sets the averages.
+     */
+    memset(&total, 0, sizeof(total));
+    memset(cpus, 0, sizeof(cpus));
+    lbcd_numa_update(&total, cpus, 4, 1000000, 10);
+    set_cpu(&cpus[0], 75, 25);
+    set_cpu(&cpus[1], 75, 25);
+    set_cpu(&cpus[2], 10, 90);
+    set_cpu(&cpus[3], 10, 90);
+    lbcd_numa_update(&total, cpus, 4, 2000000, 10);
+    lbcd_numa_read(&info);
+    is_int(7500, info.util_max, "Utilization of the busiest node");
+    is_int(1000, info.util_min, "...and of the least busy node");
+
+    /*
+     * After one half-life at a quarter busy, the busy node's average is
+     * halfway between.
+     */
+    set_cpu(&cpus[0], 100, 100);
+    set_cpu(&cpus[1], 100, 100);
+    set_cpu(&cpus[2], 20, 180);
+    set_cpu(&cpus[3], 20, 180);
+    lbcd_numa_update(&total, cpus, 4, 12000000, 10);
+    lbcd_numa_read(&info);
+    is_int(5000, info.util_max, "Average after one half-life");
+    is_int(1000, info.util_min, "...and the other is unchanged");
+
+    /* A CPU going offline starts that node over from a new baseline. */
+    memset(&cpus[1], 0, sizeof(cpus[1]));
+    lbcd_numa_update(&total, cpus, 4, 13000000, 10);
+    lbcd_numa_read(&info);
+    is_int(5000, info.util_max, "Offline CPU leaves average unchanged");
+    set_cpu(&cpus[0], 200, 100);
+    lbcd_numa_update(&total, cpus, 4, 13000000 + 10000000, 10);
+    lbcd_numa_read(&info);
+    is_int(7500, info.util_max, "...and later samples use the new baseline");
+
+    /* Free memory is read again each time. */
+    lbcd_write_file(dirs[0], "meminfo",
+                    "Node 0 MemTotal:        8388608 kB\n"
+                    "Node 0 MemFree:          524288 kB\n");
+    lbcd_numa_read(&info);
+    is_int(512, info.free_min, "Free memory reread");
+    is_int(4096, info.free_max, "...and most free is unchanged");
+
+    /* Invalidating starts over with no averages. */
+    lbcd_numa_invalidate();
+    is_int(4, lbcd_numa_cpus(), "Nodes found again after invalidating");
+    lbcd_numa_read(&info);
+    is_int(0, info.util_max, "...with no utilization");
+
+    /* With a single node, its utilization is that of all CPUs. */
+    basprintf(&single, "%s/single", tmpdir);
+    if (mkdir(single, 0755) < 0)
+        sysbail("cannot create %s", single);
+    dir = make_node(single, "node0", "0-3\n", test_nodes[0].meminfo);
+    lbcd_numa_init(single);
+    is_int(0, lbcd_numa_cpus(), "Single node needs no per-CPU times");
+    set_cpu(&total, 100, 100);
+    lbcd_numa_update(&total, NULL, 0, 1000000, 10);
+    set_cpu(&total, 140, 160);
+    lbcd_numa_update(&total, NULL, 0, 2000000, 10);
+    is_int(0, lbcd_numa_read(&info), "Read single node");
+    is_int(1, info.nodes, "...one node");
+    is_int(4000, info.util_max, "...utilization from the totals");
+    is_int(4000, info.util_min, "...which is also the least busy");
+    remove_node(dir);
+    rmdir(single);
+    free(single);
+
+    /* An invalid cpulist is reported but the node is still used. */
+    basprintf(&bad, "%s/bad", tmpdir);
+    if (mkdir(bad, 0755) < 0)
+        sysbail("cannot create %s", bad);
+    dir = make_node(bad, "node0", "0-3x\n", test_nodes[0].meminfo);
+    lbcd_numa_init(bad);
+    message_handlers_warn(0);
+    is_int(0, lbcd_numa_read(&info), "Invalid cpulist");
+    message_handlers_warn(1, message_log_stderr);
+    is_int(1024, info.free_min, "...still reports free memory");
+    remove_node(dir);
+    rmdir(bad);
+    free(bad);
+
+    /* Clean up. */
+    lbcd_numa_close();
+    for (i = 0; i < ARRAY_SIZE(test_nodes); i++)
+        remove_node(dirs[i]);
+    basprintf(&dir, "%s/power", root);
+    rmdir(dir);
+    free(dir);
+    basprintf(&dir, "%s/possible", root);
+    unlink(dir);
+    free(dir);
+    rmdir(root);
+    free(root);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Tests for penalty multipliers.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <server/penalty.h>
+#include <tests/tap/basic.h>
+
+
+/*
+ * Check that a specification is rejected.
+ */
+static void
+invalid(const char *spec)
+{
+    struct penalty penalty;
+
+    ok(!penalty_parse(spec, &penalty), "Invalid penalty %s", spec);
+}
+
+
+int
+main(void)
+{
+    struct penalty penalty;
+
+    plan(18);
+
+    /* A threshold alone uses the default multipliers. */
+    ok(penalty_parse("90", &penalty), "Threshold");
+    is_int(1, penalty_get(&penalty, 89), "...no penalty below it");
+    is_int(2, penalty_get(&penalty, 90), "...2 at the threshold");
+    is_int(4, penalty_get(&penalty, 94), "...4 four above it");
+    is_int(32, penalty_get(&penalty, 100), "...32 ten above it");
+    penalty_free(&penalty);
+    is_int(1, penalty_get(&penalty, 100), "No penalty after free");
+
+    /* An explicit list, with the last multiplier used beyond its end. */
+    ok(penalty_parse("50:3,1000000", &penalty), "Threshold and list");
+    is_int(3, penalty_get(&penalty, 50), "...first multiplier");
+    is_int(1000000, penalty_get(&penalty, 51), "...second multiplier");
+    is_int(1000000, penalty_get(&penalty, 100), "...and beyond the list");
+    penalty_free(&penalty);
+
+    /* Invalid specifications. */
+    invalid("");
+    invalid("101");
+    invalid("90:");
+    invalid("90:2,");
+    invalid("90:0");
+    invalid("90:1000001");
+    invalid("90:2x");
+    invalid("-1");
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * Test for lbcd weight plugins.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <server/protocol.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/lbcd.h>
+#include <util/network.h>
+
+
+/*
+ * Send a version three query for the given services and store the reply.
+ * Returns the size of the reply.
+ */
+static ssize_t
+query(socket_type fd, struct lbcd_reply *reply, const char *services[],
+      size_t count)
+{
+    struct lbcd_request request;
+    size_t i, size;
+
+    memset(&request, 0, sizeof(request));
+    request.h.version = htons(3);
+    request.h.id = htons(10);
+    request.h.op = htons(LBCD_OP_LBINFO);
+    request.h.status = htons(count);
+    for (i = 0; i < count; i++)
+        strlcpy(request.names[i], services[i], sizeof(request.names[i]));
+    size = sizeof(struct lbcd_header) + count * sizeof(lbcd_name_type);
+    if (send(fd, &request, size, 0) != (ssize_t) size)
+        sysbail("cannot send query");
+    memset(reply, 0, sizeof(*reply));
+    return recv(fd, reply, sizeof(*reply), 0);
+}
+
+
+int
+main(void)
+{
+    socket_type fd;
+    struct sockaddr_in sin;
+    struct lbcd_reply reply;
+    char *plugins;
+    const char *first[] = { "example", "example", "example:async" };
+    const char *second[] = { "example", "example:down" };
+
+    /* Skip if the example plugin wasn't built. */
+    plugins = test_file_path("data/plugins/example.so");
+    if (plugins == NULL)
+        skip_all("example plugin not built");
+    test_file_path_free(plugins);
+    plugins = test_file_path("data/plugins");
+    if (plugins == NULL)
+        bail("cannot find plugin directory");
+    plan(8);
+
+    /* Start the lbcd daemon, allowing the plugin services. */
+    lbcd_start("-M", plugins, "-a", "example", "-a", "example:async", "-a",
+               "example:down", NULL);
+    test_file_path_free(plugins);
+
+    /* Set up our client socket. */
+    fd = network_client_create(PF_INET, SOCK_DGRAM, "127.0.0.1");
+    if (fd == INVALID_SOCKET)
+        sysbail("cannot create client socket");
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(14330);
+    sin.sin_addr.s_addr = htonl(0x7f000001UL);
+    if (connect(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+        sysbail("cannot connect client socket");
+
+    /* The second query should be cached and the async one should work. */
+    query(fd, &reply, first, 3);
+    is_int(3, reply.services, "Reply has three services");
+    is_int(101, ntohl(reply.weights[1].host_weight), "First plugin weight");
+    is_int(3, ntohl(reply.weights[1].host_incr), "...and increment");
+    is_int(101, ntohl(reply.weights[2].host_weight), "Second is cached");
+    is_int(202, ntohl(reply.weights[3].host_weight),
+           "Pending weight completes");
+
+    /* The cache should persist across queries, and failures should work. */
+    query(fd, &reply, second, 2);
+    is_int(2, reply.services, "Reply has two services");
+    is_int(101, ntohl(reply.weights[1].host_weight), "Still cached");
+    is_hex(0xffffffffUL, ntohl(reply.weights[2].host_weight),
+           "Failing plugin returns the maximum weight");
+
+    /* All done.  Clean up and return. */
+    close(fd);
+    return 0;
+}
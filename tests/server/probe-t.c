@@ -0,0 +1,238 @@
+/*
+ * Tests for the declarative send/expect probe engine.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <util/macros.h>
+#include <util/network.h>
+
+/* Names registered by lbcd_probe_init, recorded by the stub below. */
+static char registered[8][sizeof(lbcd_name_type)];
+static size_t registered_count = 0;
+
+
+/*
+ * Stub for the registration function in weight.c so that this test doesn't
+ * have to pull in all of the weight modules.  Records the name and frees the
+ * script immediately.
+ */
+void
+lbcd_service_register(const char *service,
+                      service_func_type *function UNUSED, void *data,
+                      unsigned int ttl UNUSED, service_free_type *free_func)
+{
+    if (registered_count < ARRAY_SIZE(registered))
+        strlcpy(registered[registered_count++], service,
+                sizeof(lbcd_name_type));
+    free_func(data);
+}
+
+
+/*
+ * A trivial service.  Sends a banner in two pieces to exercise partial reads,
+ * reads a line, and replies with a queue depth.  Runs until killed.
+ */
+static void
+serve(socket_type listener)
+{
+    socket_type fd;
+    char buffer[BUFSIZ];
+    ssize_t status;
+
+    while ((fd = accept(listener, NULL, NULL)) != INVALID_SOCKET) {
+        if (socket_write(fd, "200 re", 6) < 0)
+            _exit(1);
+        usleep(100000);
+        if (socket_write(fd, "ady\r\n", 5) < 0)
+            _exit(1);
+        status = socket_read(fd, buffer, sizeof(buffer));
+        if (status > 0 && strncmp(buffer, "STATUS\r\n", 8) == 0)
+            if (socket_write(fd, "ok depth=42\r\n", 13) < 0)
+                _exit(1);
+        socket_close(fd);
+    }
+    _exit(0);
+}
+
+
+/*
+ * Write a probe script to the given path.  The %d in the contents, if any,
+ * is replaced with the port number of the test service.
+ */
+static void
+write_script(const char *path, const char *contents, unsigned short port)
+{
+    FILE *file;
+    const char *p;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    p = strstr(contents, "%d");
+    if (p == NULL)
+        fputs(contents, file);
+    else
+        fprintf(file, "%.*s%hu%s", (int) (p - contents), contents, port,
+                p + 2);
+    if (fclose(file) == EOF)
+        sysbail("cannot write %s", path);
+}
+
+
+/*
+ * Compile a script with the given contents and run it, returning the status
+ * and storing the weight.  Returns -2 if the script failed to compile.
+ */
+static int
+run_script(const char *dir, const char *contents, unsigned short port,
+           uint32_t *weight)
+{
+    struct probe_script *script;
+    char *path;
+    int status;
+
+    basprintf(&path, "%s/script", dir);
+    write_script(path, contents, port);
+    script = lbcd_probe_compile("script", path);
+    unlink(path);
+    free(path);
+    if (script == NULL)
+        return -2;
+    *weight = 0;
+    status = lbcd_probe_run(script, 5, weight);
+    lbcd_probe_script_free(script);
+    return status;
+}
+
+
+int
+main(void)
+{
+    socket_type listener;
+    struct sockaddr_in sin;
+    socklen_t length;
+    unsigned short port;
+    pid_t child;
+    char *tmpdir, *probedir, *path;
+    uint32_t weight;
+    time_t start;
+
+    plan(17);
+
+    /* Start the test service on an arbitrary port. */
+    listener = network_bind_ipv4(SOCK_STREAM, "127.0.0.1", 0);
+    if (listener == INVALID_SOCKET)
+        sysbail("cannot bind listening socket");
+    if (listen(listener, 5) < 0)
+        sysbail("cannot listen");
+    length = sizeof(sin);
+    if (getsockname(listener, (struct sockaddr *) &sin, &length) < 0)
+        sysbail("cannot get listening port");
+    port = ntohs(sin.sin_port);
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0)
+        serve(listener);
+    socket_close(listener);
+
+    /* Set up a directory for the scripts. */
+    tmpdir = test_tmpdir();
+    basprintf(&probedir, "%s/probes", tmpdir);
+    if (mkdir(probedir, 0755) < 0)
+        sysbail("cannot create %s", probedir);
+
+    /* A complete exchange that extracts the weight. */
+    is_int(0, run_script(probedir,
+                         "# Full exchange.\n"
+                         "host 127.0.0.1\n"
+                         "port %d\n"
+                         "expect \"200 ready\\r\\n\"\n"
+                         "send \"STATUS\\r\\n\"\n"
+                         "weight \"depth=([0-9]+)\"\n",
+                         port, &weight),
+           "Full exchange succeeds");
+    is_int(42, weight, "...and extracts the weight");
+
+    /* Regex matching across a banner split into two reads. */
+    is_int(0, run_script(probedir,
+                         "host 127.0.0.1\nport %d\nmatch \"^200 re+ady\"\n",
+                         port, &weight),
+           "Regex match across partial reads succeeds");
+    is_int(0, weight, "...with a weight of zero");
+
+    /* Mismatched prefixes should fail without waiting for the timeout. */
+    start = time(NULL);
+    is_int(-1, run_script(probedir,
+                          "host 127.0.0.1\nport %d\nexpect \"500\"\n",
+                          port, &weight),
+           "Mismatched prefix fails");
+    ok(time(NULL) - start < 3, "...without waiting for the timeout");
+
+    /* Waiting for data that never arrives should time out. */
+    is_int(-1, run_script(probedir,
+                          "host 127.0.0.1\nport %d\ntimeout 1\n"
+                          "expect \"200 ready\\r\\nmore\"\n",
+                          port, &weight),
+           "Missing data times out");
+
+    /* Syntax errors are caught when compiling. */
+    is_int(-2, run_script(probedir, "port %d\nbogus \"foo\"\n", port,
+                          &weight),
+           "Unknown directive rejected");
+    is_int(-2, run_script(probedir, "port %d\nmatch \"([0-9\"\n", port,
+                          &weight),
+           "Invalid regex rejected");
+    is_int(-2, run_script(probedir, "port %d\nweight \"[0-9]+\"\n", port,
+                          &weight),
+           "Weight regex without subexpression rejected");
+    is_int(-2, run_script(probedir, "send \"foo\"\n", port, &weight),
+           "Script without port rejected");
+    is_int(-2, run_script(probedir, "port %d\nsend foo\n", port, &weight),
+           "Unquoted string rejected");
+    is_int(-2, run_script(probedir, "port %d\nsend \"\\q\"\n", port,
+                          &weight),
+           "Invalid escape rejected");
+
+    /* Loading a directory registers each script as a service. */
+    basprintf(&path, "%s/queue", probedir);
+    write_script(path, "port %d\nexpect \"200\"\n", port);
+    free(path);
+    basprintf(&path, "%s/queue~", probedir);
+    write_script(path, "port %d\nexpect \"200\"\n", port);
+    ok(lbcd_probe_init(probedir), "Loading probe directory succeeds");
+    is_int(1, registered_count, "...and registers one service");
+    is_string("queue", registered[0], "...with the right name");
+    unlink(path);
+    free(path);
+    registered_count = 0;
+    basprintf(&path, "%s/queue", probedir);
+    write_script(path, "port %d\nexpect 200\n", port);
+    ok(!lbcd_probe_init(probedir), "Loading invalid script fails");
+    unlink(path);
+    free(path);
+
+    /* Clean up. */
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+    rmdir(probedir);
+    free(probedir);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
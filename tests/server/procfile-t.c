@@ -0,0 +1,93 @@
+/*
+ * Tests for reading and parsing files under /proc.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <server/procfile.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/lbcd.h>
+#include <tests/tap/string.h>
+#include <util/messages.h>
+
+
+/*
+ * Parse a number with procfile_fixed and return the value, or -1 if it can't
+ * be parsed.
+ */
+static long
+fixed(const char *string, unsigned int places)
+{
+    unsigned long value;
+
+    if (procfile_fixed(string, places, &value) == NULL)
+        return -1;
+    return (long) value;
+}
+
+
+int
+main(void)
+{
+    struct procfile file;
+    char buffer[16];
+    char *tmpdir, *path;
+    const char *p;
+    unsigned long value;
+    unsigned long long counter;
+
+    plan(21);
+
+    /* Parsing. */
+    is_int(52, fixed("0.52", 2), "Load average");
+    is_int(1234, fixed("  12.34 5", 2), "...with leading spaces");
+    is_int(1230, fixed("12.3", 2), "...with fewer places");
+    is_int(1234, fixed("12.3456", 2), "...with more places");
+    is_int(1200, fixed("12", 2), "...with no decimal point");
+    is_int(350735, fixed("350735.47 1390056.23", 0), "Uptime in seconds");
+    is_int(-1, fixed("", 2), "Empty string");
+    is_int(-1, fixed("-1.00", 2), "Negative number");
+    p = procfile_fixed("0.52 0.58 0.59 1/389", 2, &value);
+    p = procfile_fixed(p, 2, &value);
+    is_int(58, value, "Second number");
+    is_string(" 0.59 1/389", p, "...and the rest of the string");
+    p = procfile_counter("\t18446744073709551615 7", &counter);
+    ok(counter == 18446744073709551615ULL, "Counter");
+    is_string(" 7", p, "...and the rest of the string");
+    ok(procfile_counter(" .5", &counter) == NULL, "...but not a fraction");
+
+    /* Reading a file, which sees changes without reopening. */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/procfile", tmpdir);
+    lbcd_write_file(NULL, path, "0.52 0.58 0.59\n");
+    file.path = path;
+    file.fd = -1;
+    is_int(15, procfile_read(&file, buffer, sizeof(buffer)), "Read file");
+    is_string("0.52 0.58 0.59\n", buffer, "...with the right contents");
+    ok(file.fd >= 0, "...and it stays open");
+    lbcd_write_file(NULL, path, "1.00 2.00 3.00 4.00\n");
+    is_int(15, procfile_read(&file, buffer, sizeof(buffer)),
+           "Read longer file");
+    is_string("1.00 2.00 3.00 ", buffer, "...truncated to the buffer");
+    procfile_close(&file);
+    ok(file.fd < 0, "Closed");
+
+    /* A missing file. */
+    unlink(path);
+    message_handlers_warn(0);
+    is_int(-1, procfile_read(&file, buffer, sizeof(buffer)), "Missing file");
+    message_handlers_warn(1, message_log_stderr);
+    ok(file.fd < 0, "...and it's not open");
+
+    /* Clean up. */
+    free(path);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Tests for pressure stall information.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <server/internal.h>
+#include <server/metrics.h>
+#include <tests/tap/basic.h>
+#include <util/macros.h>
+#include <util/messages.h>
+
+/* The service registered by lbcd_psi_init, recorded by the stub below. */
+static service_func_type *registered_function = NULL;
+static void *registered_data = NULL;
+
+/* The snapshot returned by the lbcd_metrics_get stub. */
+static struct lbcd_metrics snapshot;
+
+
+/*
+ * Stub for the registration function in weight.c.  Records the service so
+ * that the test can call it, freeing any previous registration.
+ */
+void
+lbcd_service_register(const char *service UNUSED,
+                      service_func_type *function, void *data,
+                      unsigned int ttl UNUSED, service_free_type *free_func)
+{
+    if (registered_data != NULL)
+        free_func(registered_data);
+    registered_function = function;
+    registered_data = data;
+}
+
+
+/*
+ * Stub for the metrics snapshot.
+ */
+const struct lbcd_metrics *
+lbcd_metrics_get(void)
+{
+    return &snapshot;
+}
+
+
+/*
+ * Call the registered psi service and return the weight.
+ */
+static unsigned long
+psi_weight(void)
+{
+    uint32_t weight, incr;
+
+    registered_function(registered_data, &weight, &incr, 5, NULL, NULL);
+    return weight;
+}
+
+
+int
+main(void)
+{
+    struct psi_info info;
+    int fds[PSI_RESOURCE_COUNT];
+    size_t count;
+
+    plan(23);
+
+    /* Parsing. */
+    ok(lbcd_psi_parse("some avg10=1.50 avg60=0.25 avg300=0.10 total=1234\n"
+                      "full avg10=0.75 avg60=12.00 avg300=0.00 total=99\n",
+                      &info), "Parse pressure");
+    is_int(150, info.some10, "...some avg10");
+    is_int(25, info.some60, "...some avg60");
+    is_int(75, info.full10, "...full avg10");
+    is_int(1200, info.full60, "...full avg60");
+    ok(lbcd_psi_parse("some avg10=100.00 avg60=3.89 avg300=11.78 total=25\n",
+                      &info), "Parse pressure without full");
+    is_int(10000, info.some10, "...some avg10");
+    is_int(0, info.full10, "...and full is zero");
+    ok(!lbcd_psi_parse("some avg10=x avg60=0.00\n", &info), "Invalid number");
+    ok(!lbcd_psi_parse("most avg10=0.00 avg60=0.00\n", &info),
+       "Invalid line");
+    ok(!lbcd_psi_parse("some avg60=0.00 avg300=0.00\n", &info),
+       "Missing avg10");
+
+    /* Reading the real files, if the kernel supports them. */
+    if (access("/proc/pressure/cpu", R_OK) == 0)
+        is_int(0, lbcd_psi_read(PSI_CPU, &info), "Read CPU pressure");
+    else
+        is_int(-1, lbcd_psi_read(PSI_CPU, &info), "No CPU pressure");
+
+    /* The default coefficients. */
+    ok(lbcd_psi_init(NULL), "Default coefficients");
+    snapshot.value[METRIC_PSI_CPU_SOME10] = 1000;
+    snapshot.value[METRIC_PSI_CPU_SOME60] = 5000;
+    snapshot.value[METRIC_PSI_MEMORY_FULL10] = 200;
+    snapshot.value[METRIC_PSI_IO_FULL10] = 50;
+    is_int(1000 + 4 * 200 + 2 * 50, psi_weight(), "...weight");
+    snapshot.value[METRIC_PSI_STALL] = 1;
+    is_int(1900 + 5000, psi_weight(), "...with a stall");
+
+    /* Configured coefficients. */
+    ok(lbcd_psi_init("cpu_some60=0.5,stall=-100"), "Coefficients");
+    is_int(2500 - 100, psi_weight(), "...weight");
+    ok(lbcd_psi_init("stall=-10000"), "Negative weight");
+    is_int(0, psi_weight(), "...is zero");
+    message_handlers_warn(0);
+    ok(!lbcd_psi_init("cpu=1"), "Unknown metric");
+    ok(!lbcd_psi_init("cpu_some10=x"), "Invalid coefficient");
+    message_handlers_warn(1, message_log_stderr);
+
+    /* Triggers.  We can't cause a stall, so just fake an event. */
+    count = lbcd_psi_triggers(fds, ARRAY_SIZE(fds));
+    if (count > 0) {
+        ok(!lbcd_psi_stalled(), "No stall before a trigger");
+        lbcd_psi_event(fds[0], false);
+        ok(lbcd_psi_stalled(), "...and stall after a trigger");
+    } else
+        skip_block(2, "PSI triggers not available");
+
+    /* Clean up. */
+    lbcd_psi_close();
+    free(registered_data);
+    return 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * Tests for application reports in shared memory.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* Let slots become stale quickly enough to test taking them over. */
+#define LBCD_SHM_STALE 1
+
+#include <server/internal.h>
+#include <server/shm.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/lbcd.h>
+#include <tests/tap/string.h>
+#include <util/macros.h>
+#include <util/messages.h>
+
+/* How many times to read a slot while another process writes it. */
+#define READS 200000
+
+/* The service registered by lbcd_app_init, recorded by the stub below. */
+static service_func_type *registered_function = NULL;
+
+
+/*
+ * Stub for the registration function in weight.c.  Records the service so
+ * that the test can call it.
+ */
+void
+lbcd_service_register(const char *service UNUSED,
+                      service_func_type *function, void *data UNUSED,
+                      unsigned int ttl UNUSED,
+                      service_free_type *free_func UNUSED)
+{
+    registered_function = function;
+}
+
+
+/*
+ * Read a slot many times while a child process publishes to it as fast as
+ * it can, always with the increment one more than the weight.  Returns the
+ * number of reads that saw a weight and increment from different updates.
+ */
+static unsigned long
+count_torn(struct lbcd_shm_slot *slot)
+{
+    unsigned long i, torn = 0;
+    uint32_t weight, incr, ttl, n;
+    uint64_t heartbeat;
+    pid_t child;
+
+    lbcd_shm_publish(slot, 0, 1, 60);
+    child = fork();
+    if (child < 0)
+        sysbail("cannot fork");
+    else if (child == 0) {
+        for (n = 0;; n++)
+            lbcd_shm_publish(slot, n, n + 1, 60);
+    }
+    for (i = 0; i < READS; i++)
+        if (lbcd_shm_read(slot, &weight, &incr, &heartbeat, &ttl) == 0
+            && incr != weight + 1)
+            torn++;
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    return torn;
+}
+
+
+int
+main(void)
+{
+    struct lbcd_shm_header *header;
+    struct lbcd_shm_slot *slot, *other;
+    uint32_t weight, incr, ttl;
+    uint64_t heartbeat, now;
+    char *tmpdir, *path, *alias, *name;
+    struct stat st;
+    unsigned int i;
+
+    plan(35);
+
+    /* lbcd creates the file, and applications can then map it. */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/app.shm", tmpdir);
+    ok(lbcd_shm_map(path) == NULL, "Cannot map a missing file");
+    ok(lbcd_app_init(NULL, path), "Create the shared-memory file");
+    ok(registered_function != NULL, "...and register the app service");
+    header = lbcd_shm_map(path);
+    ok(header != NULL, "Map the file");
+    if (header == NULL)
+        bail("cannot map %s", path);
+    is_int(LBCD_SHM_SLOTS, header->slots, "...with all its slots");
+    is_int(64, sizeof(struct lbcd_shm_slot), "Slots are one cache line");
+
+    /* Claiming slots. */
+    ok(lbcd_shm_claim(header, "") == NULL, "Cannot claim an empty name");
+    ok(lbcd_shm_claim(header, "w/b") == NULL, "...or an invalid name");
+    ok(lbcd_shm_claim(header, "abcdefghijklmnopqrstuvwxyz01") == NULL,
+       "...or a name that is too long");
+    slot = lbcd_shm_claim(header, "web");
+    ok(slot != NULL, "Claim a slot");
+    ok(lbcd_shm_claim(header, "web") == slot, "...and claim it again");
+    other = lbcd_shm_claim(header, "db");
+    ok(other != NULL && other != slot, "Another application gets another");
+    if (slot == NULL || other == NULL)
+        bail("cannot claim slots");
+
+    /* A slot without a report and one with a current report. */
+    ok(!lbcd_app_lookup("web", lbcd_shm_now(), &weight, &incr),
+       "No report before publishing");
+    lbcd_shm_publish(slot, 400, 40, 10);
+    now = lbcd_shm_now();
+    ok(lbcd_app_lookup("web", now, &weight, &incr), "Report after publishing");
+    is_int(400, weight, "...with the weight");
+    is_int(40, incr, "...and increment");
+    registered_function(NULL, &weight, &incr, 0, "web", NULL);
+    is_int(400, weight, "...returned by the app service");
+
+    /* A stale heartbeat means the application is down. */
+    if (lbcd_shm_read(slot, &weight, &incr, &heartbeat, &ttl) < 0)
+        bail("cannot read slot");
+    ok(!lbcd_app_lookup("web", heartbeat + 10 * 1000000, &weight, &incr),
+       "Report expires after its ttl");
+    ok(lbcd_app_lookup("web", heartbeat + 10 * 1000000 - 1, &weight, &incr),
+       "...but not before");
+
+    /* Reads are never torn by a concurrent writer. */
+    is_int(0, count_torn(other), "No torn reads");
+
+    /* Releasing a slot. */
+    lbcd_shm_release(slot);
+    ok(!lbcd_app_lookup("web", lbcd_shm_now(), &weight, &incr),
+       "Released slot has no report");
+    ok(lbcd_shm_claim(header, "mail") == slot, "...and can be claimed again");
+
+    /* A writer that died while writing doesn't wedge the slot. */
+    lbcd_shm_publish(slot, 100, 10, 10);
+    __atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELEASE);
+    ok(!lbcd_app_lookup("mail", lbcd_shm_now(), &weight, &incr),
+       "Slot left mid-write has no report");
+    ok(lbcd_shm_claim(header, "mail") == slot, "...is claimed again");
+    lbcd_shm_publish(slot, 300, 30, 10);
+    ok(lbcd_app_lookup("mail", lbcd_shm_now(), &weight, &incr)
+       && weight == 300, "...and reported after the next publication");
+
+    /* lbcd ignores the number of slots in the header. */
+    header->slots = UINT32_MAX;
+    ok(!lbcd_app_lookup("nonexistent", lbcd_shm_now(), &weight, &incr),
+       "Lookup ignores a corrupt slot count");
+    ok(lbcd_app_lookup("mail", lbcd_shm_now(), &weight, &incr),
+       "...and still finds claimed slots");
+    header->slots = LBCD_SHM_SLOTS;
+
+    /* When all slots are in use, a new name takes over a stale one. */
+    for (i = 0; i < LBCD_SHM_SLOTS; i++) {
+        basprintf(&name, "fill%u", i);
+        lbcd_shm_claim(header, name);
+        free(name);
+    }
+    ok(lbcd_shm_claim(header, "new") == NULL, "No slot when all are in use");
+    lbcd_shm_publish(slot, 300, 30, 0);
+    heartbeat = __atomic_load_n(&slot->heartbeat, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->heartbeat, heartbeat - 2 * 1000000,
+                     __ATOMIC_RELAXED);
+    ok(lbcd_shm_claim(header, "new") == slot, "...until one is stale");
+    ok(!lbcd_app_lookup("mail", lbcd_shm_now(), &weight, &incr),
+       "...which its old application loses");
+
+    lbcd_shm_unmap(header);
+    lbcd_app_close();
+
+    /* Only a new or empty file is initialized, and symlinks aren't used. */
+    unlink(path);
+    lbcd_write_file(NULL, path, "important\n");
+    message_handlers_warn(0);
+    ok(!lbcd_app_init(NULL, path), "Refuse to overwrite another file");
+    ok(stat(path, &st) == 0 && st.st_size == 10, "...and leave it alone");
+    basprintf(&alias, "%s/app.link", tmpdir);
+    lbcd_write_file(NULL, path, "");
+    if (symlink(path, alias) < 0)
+        sysbail("cannot create %s", alias);
+    ok(!lbcd_app_init(NULL, alias), "Refuse to follow a symlink");
+    message_handlers_warn(1, message_log_stderr);
+    ok(lbcd_app_init(NULL, path), "Initialize an empty file");
+    header = lbcd_shm_map(path);
+    ok(header != NULL, "...which can then be mapped");
+    if (header != NULL)
+        lbcd_shm_unmap(header);
+
+    /* Clean up. */
+    lbcd_app_close();
+    unlink(alias);
+    unlink(path);
+    free(alias);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
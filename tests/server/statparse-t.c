@@ -0,0 +1,333 @@
+/*
+ * Tests for the /proc/stat parser.
+ *
+ * The parser is checked against a simple reference parser on generated
+ * /proc/stat contents for hosts with 8 to 512 CPUs, with and without SIMD
+ * instructions.  If AUTHOR_TESTING is set, also report how long each takes.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <limits.h>
+#include <time.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <util/macros.h>
+
+/* The largest number of CPUs in a generated /proc/stat. */
+#define MAX_CPUS 512
+
+/* The sizes of the generated /proc/stat contents. */
+static const size_t sizes[] = { 8, 64, 256, 512 };
+
+/* State of the random number generator, so that the results repeat. */
+static unsigned long long state = 88172645463325252ULL;
+
+
+/*
+ * Return a random number.
+ */
+static unsigned long long
+random_number(void)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+
+/*
+ * Return a random time with a random number of digits, as large as will fit
+ * in an unsigned long.
+ */
+static unsigned long
+random_time(void)
+{
+    unsigned long long value, limit;
+    unsigned int digits, max_digits, i;
+
+    max_digits = (ULONG_MAX > 0xffffffffUL) ? 19 : 9;
+    digits = (unsigned int) (random_number() % max_digits) + 1;
+    limit = 1;
+    for (i = 0; i < digits; i++)
+        limit *= 10;
+    value = random_number() % limit;
+    return (unsigned long) value;
+}
+
+
+/*
+ * Append a cpu line with the given label and random times to a buffer,
+ * sometimes without the newer fields, and return the new length.
+ */
+static size_t
+append_line(char *buffer, size_t length, size_t size, const char *label)
+{
+    unsigned int fields, i;
+    int status;
+
+    fields = (random_number() % 8 == 0) ? 4 : 10;
+    status = snprintf(buffer + length, size - length, "%s", label);
+    length += (size_t) status;
+    for (i = 0; i < fields; i++) {
+        status = snprintf(buffer + length, size - length, " %lu",
+                          random_time());
+        length += (size_t) status;
+    }
+    buffer[length++] = '\n';
+    buffer[length] = '\0';
+    return length;
+}
+
+
+/*
+ * Generate /proc/stat contents for a host with the given number of CPUs, a
+ * few of which are offline, followed by some of the other lines.  Returns
+ * the buffer, which the caller must free, and stores its length in length.
+ */
+static char *
+generate(size_t cpus, size_t *length)
+{
+    char *buffer;
+    char label[32];
+    size_t size, cpu;
+
+    size = (cpus + 1) * 256 + 1024;
+    buffer = bmalloc(size);
+    *length = append_line(buffer, 0, size, "cpu ");
+    for (cpu = 0; cpu < cpus; cpu++) {
+        if (cpu > 0 && random_number() % 16 == 0)
+            continue;
+        snprintf(label, sizeof(label), "cpu%lu", (unsigned long) cpu);
+        *length = append_line(buffer, *length, size, label);
+    }
+    *length = append_line(buffer, *length, size, "intr");
+    *length += (size_t) snprintf(buffer + *length, size - *length,
+                                 "ctxt 123456789\nbtime 1700000000\n");
+    return buffer;
+}
+
+
+/*
+ * The reference parser.  Parses one line of times with strtoul, storing
+ * them in times, and returns false if the line is incomplete.
+ */
+static bool
+reference_line(const char *p, struct cpustat_times *times)
+{
+    unsigned long value[8];
+    char *end;
+    size_t i;
+
+    if (strchr(p, '\n') == NULL)
+        return false;
+    memset(value, 0, sizeof(value));
+    for (i = 0; i < ARRAY_SIZE(value); i++) {
+        while (*p == ' ')
+            p++;
+        if (*p < '0' || *p > '9')
+            break;
+        value[i] = strtoul(p, &end, 10);
+        p = end;
+    }
+    if (i < 4)
+        return false;
+    times->user = value[0];
+    times->nice = value[1];
+    times->system = value[2];
+    times->idle = value[3];
+    times->iowait = value[4];
+    times->irq = value[5];
+    times->softirq = value[6];
+    times->steal = value[7];
+    return true;
+}
+
+
+/*
+ * The reference parser for the whole file, with the same interface as
+ * lbcd_stat_parse except that the buffer must be nul-terminated.
+ */
+static ssize_t
+reference(const char *buffer, struct cpustat_times *total,
+          struct cpustat_times *cpus, size_t ncpus)
+{
+    const char *p;
+    unsigned long cpu;
+    char *end;
+    size_t count = 0;
+
+    if (strncmp(buffer, "cpu ", 4) != 0 || !reference_line(buffer + 4, total))
+        return -1;
+    p = strchr(buffer, '\n') + 1;
+    while (strncmp(p, "cpu", 3) == 0 && p[3] >= '0' && p[3] <= '9') {
+        cpu = strtoul(p + 3, &end, 10);
+        if (cpu < ncpus) {
+            if (!reference_line(end, &cpus[cpu]))
+                break;
+            if (cpu + 1 > count)
+                count = cpu + 1;
+        }
+        p = strchr(p, '\n');
+        if (p == NULL)
+            break;
+        p++;
+    }
+    return (ssize_t) count;
+}
+
+
+/*
+ * Parse a buffer with both the parser and the reference parser and return
+ * true if the results are the same.
+ */
+static bool
+same_result(const char *buffer, size_t length)
+{
+    static struct cpustat_times cpus[MAX_CPUS], expected_cpus[MAX_CPUS];
+    struct cpustat_times total, expected_total;
+    ssize_t count, expected;
+    char *copy;
+
+    memset(cpus, 0, sizeof(cpus));
+    memset(expected_cpus, 0, sizeof(expected_cpus));
+    memset(&total, 0, sizeof(total));
+    memset(&expected_total, 0, sizeof(expected_total));
+    copy = bstrndup(buffer, length);
+    count = lbcd_stat_parse(buffer, length, &total, cpus, MAX_CPUS);
+    expected = reference(copy, &expected_total, expected_cpus, MAX_CPUS);
+    free(copy);
+    if (count != expected) {
+        diag("parsed %ld CPUs, expected %ld", (long) count, (long) expected);
+        return false;
+    }
+    if (count < 0)
+        return true;
+    return (memcmp(&total, &expected_total, sizeof(total)) == 0
+            && memcmp(cpus, expected_cpus, sizeof(cpus)) == 0);
+}
+
+
+/*
+ * Return the current monotonic time in seconds.
+ */
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Report how long it takes to parse a buffer, both with and without the
+ * per-CPU lines.
+ */
+static void
+benchmark(const char *buffer, size_t length, size_t ncpus, bool simd)
+{
+    static struct cpustat_times cpus[MAX_CPUS];
+    struct cpustat_times total;
+    double start, all, totals;
+    unsigned long i, rounds = 2000;
+
+    start = now();
+    for (i = 0; i < rounds; i++)
+        lbcd_stat_parse(buffer, length, &total, cpus, MAX_CPUS);
+    all = (now() - start) / rounds * 1e6;
+    start = now();
+    for (i = 0; i < rounds; i++)
+        lbcd_stat_parse(buffer, length, &total, NULL, 0);
+    totals = (now() - start) / rounds * 1e6;
+    diag("%3lu CPUs, %s: %8.2f us all, %5.2f us totals only",
+         (unsigned long) ncpus, simd ? "SIMD  " : "scalar", all, totals);
+}
+
+
+int
+main(void)
+{
+    struct cpustat_times total;
+    struct cpustat_times cpus[4];
+    char *buffer;
+    size_t length, cut, i;
+    int simd;
+    bool available;
+
+    plan(12 + ARRAY_SIZE(sizes) * 2 * 3);
+
+    /* Numbers of every length the conversion handles differently. */
+    buffer = bstrdup("cpu  0 9 10 99999999 100000000 1234567890123456"
+                     " 12345678901234567 1\n                ");
+    ok(lbcd_stat_parse(buffer, strlen(buffer), &total, NULL, 0) == 0,
+       "Parse numbers of different lengths");
+    ok(total.user == 0 && total.nice == 9 && total.system == 10,
+       "...short numbers");
+    is_int(99999999, total.idle, "...eight digits");
+    is_int(100000000, total.iowait, "...nine digits");
+#if ULONG_MAX > 0xffffffffUL
+    ok(total.irq == 1234567890123456UL, "...sixteen digits");
+    ok(total.softirq == 12345678901234567UL, "...seventeen digits");
+#else
+    skip_block(2, "unsigned long is too small");
+#endif
+    free(buffer);
+
+    /* Invalid and partial contents. */
+    buffer = bstrdup("intr 1 2 3 4\n");
+    is_int(-1, lbcd_stat_parse(buffer, strlen(buffer), &total, NULL, 0),
+           "No cpu line");
+    free(buffer);
+    buffer = bstrdup("cpu  1 2 3\n");
+    is_int(-1, lbcd_stat_parse(buffer, strlen(buffer), &total, NULL, 0),
+           "Too few times");
+    free(buffer);
+    buffer = bstrdup("cpu  1 2 3 4");
+    is_int(-1, lbcd_stat_parse(buffer, strlen(buffer), &total, NULL, 0),
+           "Truncated cpu line");
+    free(buffer);
+    buffer = bstrdup("cpu  1 2 3 4\ncpu0 1 2 3 4\ncpu1 1 2");
+    is_int(1, lbcd_stat_parse(buffer, strlen(buffer), &total, cpus, 4),
+           "Truncated cpu1 line");
+    free(buffer);
+    buffer = bstrdup("cpu  1 2 3 4\ncpu0 1 2 3 4\ncpu9 1 2 3 4\n"
+                     "cpu1 5 6 7 8\nintr 1 2 3 4 5\n");
+    is_int(2, lbcd_stat_parse(buffer, strlen(buffer), &total, cpus, 4),
+           "CPUs past the end are ignored");
+    is_int(8, cpus[1].idle, "...and later CPUs are still parsed");
+    free(buffer);
+
+    /* Compare against the reference parser, with and without SIMD. */
+    for (simd = 1; simd >= 0; simd--) {
+        available = lbcd_stat_simd(simd);
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+            if (simd && !available) {
+                skip_block(3, "SIMD not available");
+                continue;
+            }
+            buffer = generate(sizes[i], &length);
+            ok(same_result(buffer, length), "%s parse of %lu CPUs",
+               simd ? "SIMD" : "Scalar", (unsigned long) sizes[i]);
+            cut = (size_t) (random_number() % length);
+            ok(same_result(buffer, cut), "...truncated at %lu",
+               (unsigned long) cut);
+            ok(lbcd_stat_parse(buffer, length, &total, NULL, 0) == 0,
+               "...totals only");
+            if (getenv("AUTHOR_TESTING") != NULL)
+                benchmark(buffer, length, sizes[i], simd);
+            free(buffer);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * Test for handing the lbcd sockets over to a new binary on SIGUSR2.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/socket.h>
+#include <portable/system.h>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <server/protocol.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/lbcd.h>
+#include <tests/tap/string.h>
+#include <util/network.h>
+
+
+/*
+ * Query lbcd for the default service and return the status of the reply.
+ */
+static int
+query(socket_type fd)
+{
+    struct lbcd_request request;
+    struct lbcd_reply reply;
+    size_t size;
+    ssize_t result;
+
+    memset(&request, 0, sizeof(request));
+    request.h.version = htons(3);
+    request.h.id = htons(10);
+    request.h.op = htons(LBCD_OP_LBINFO);
+    request.h.status = htons(1);
+    strlcpy(request.names[0], "default", sizeof(request.names[0]));
+    size = sizeof(struct lbcd_header) + sizeof(lbcd_name_type);
+    result = send(fd, &request, size, 0);
+    if (result != (ssize_t) size)
+        sysbail("cannot send query");
+    memset(&reply, 0, sizeof(reply));
+    result = recv(fd, &reply, sizeof(reply), 0);
+    if (result < (ssize_t) sizeof(struct lbcd_header))
+        sysbail("cannot read reply");
+    return ntohs(reply.h.status);
+}
+
+
+/*
+ * Read the PID from the lbcd PID file, returning 0 if it can't be read.
+ */
+static long
+read_pid(const char *path)
+{
+    FILE *file;
+    long pid;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+    if (fscanf(file, "%ld", &pid) != 1)
+        pid = 0;
+    fclose(file);
+    return pid;
+}
+
+
+int
+main(void)
+{
+    char *tmpdir, *pidpath;
+    socket_type fd;
+    struct sockaddr_in sin;
+    struct timespec delay;
+    siginfo_t info;
+    long old_pid, new_pid;
+    int i;
+
+    plan(6);
+
+    /* Start lbcd and check that it answers. */
+    lbcd_start(NULL);
+    fd = network_client_create(PF_INET, SOCK_DGRAM, "127.0.0.1");
+    if (fd == INVALID_SOCKET)
+        sysbail("cannot create client socket");
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(14330);
+    sin.sin_addr.s_addr = htonl(0x7f000001UL);
+    if (connect(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+        sysbail("cannot connect client socket");
+    is_int(LBCD_STATUS_OK, query(fd), "lbcd answers before upgrade");
+
+    /* Ask lbcd to upgrade and wait for the new PID to show up. */
+    tmpdir = test_tmpdir();
+    basprintf(&pidpath, "%s/lbcd.pid", tmpdir);
+    old_pid = read_pid(pidpath);
+    if (old_pid == 0)
+        bail("cannot read PID from %s", pidpath);
+    if (kill((pid_t) old_pid, SIGUSR2) < 0)
+        sysbail("cannot send SIGUSR2 to lbcd");
+    delay.tv_sec = 0;
+    delay.tv_nsec = 100000000;
+    new_pid = read_pid(pidpath);
+    for (i = 0; i < 100 && (new_pid == 0 || new_pid == old_pid); i++) {
+        nanosleep(&delay, NULL);
+        new_pid = read_pid(pidpath);
+    }
+    ok(new_pid != 0 && new_pid != old_pid, "New lbcd wrote its PID");
+    is_int(LBCD_STATUS_OK, query(fd), "...and answers on the same socket");
+
+    /* The old process should exit cleanly.  Leave it for cleanup to reap. */
+    memset(&info, 0, sizeof(info));
+    for (i = 0; i < 100; i++) {
+        if (waitid(P_PID, (id_t) old_pid, &info,
+                   WEXITED | WNOHANG | WNOWAIT) < 0)
+            sysbail("cannot wait for old lbcd");
+        if (info.si_pid != 0)
+            break;
+        nanosleep(&delay, NULL);
+    }
+    is_int(old_pid, info.si_pid, "Old lbcd exited");
+    is_int(0, info.si_status, "...successfully");
+
+    /* Stop the new process, which isn't our child. */
+    if (kill((pid_t) new_pid, SIGTERM) < 0)
+        sysbail("cannot stop new lbcd");
+    for (i = 0; i < 100 && access(pidpath, F_OK) == 0; i++)
+        nanosleep(&delay, NULL);
+    ok(access(pidpath, F_OK) < 0, "New lbcd removes its PID file on exit");
+
+    /* Clean up. */
+    close(fd);
+    free(pidpath);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * Benchmark walking /proc for the CPU time used by each user.
+ *
+ * Builds a synthetic /proc with many processes and measures one walk of it,
+ * compared with opening each stat file by its full path with stdio and
+ * calling stat for its owner, the simple way to do it.  Run with make bench,
+ * optionally passing the number of processes and the number of iterations
+ * as arguments.  Pass 0 processes to walk the real /proc instead.  This is
+ * not part of the test suite.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <server/internal.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Default number of processes and iterations. */
+#define BENCH_PROCESSES  20000
+#define BENCH_ITERATIONS 20
+
+/* The directory being walked. */
+static char *proc;
+
+
+/*
+ * Create a synthetic /proc in a temporary directory with the given number of
+ * processes.
+ */
+static char *
+make_proc(unsigned long count)
+{
+    char template[] = "/tmp/usercpu-bench.XXXXXX";
+    char *dir, *path;
+    unsigned long i;
+    FILE *file;
+
+    if (mkdtemp(template) == NULL)
+        sysdie("cannot create temporary directory");
+    dir = xstrdup(template);
+    for (i = 1; i <= count; i++) {
+        xasprintf(&path, "%s/%lu", dir, i);
+        if (mkdir(path, 0755) < 0)
+            sysdie("cannot create %s", path);
+        free(path);
+        xasprintf(&path, "%s/%lu/stat", dir, i);
+        file = fopen(path, "w");
+        if (file == NULL)
+            sysdie("cannot create %s", path);
+        fprintf(file, "%lu (worker) S 1 %lu %lu 0 -1 4194560 1234 0 0 0"
+                " %lu %lu 0 0 20 0 1 0 %lu 104857600 2560 18446744073709551615"
+                " 1 1 0 0 0 0 0 0 0 0 0 0 17 3 0 0 0 0 0\n", i, i, i,
+                i * 7, i * 3, i * 11);
+        fclose(file);
+        free(path);
+    }
+    return dir;
+}
+
+
+/*
+ * Remove the synthetic /proc.
+ */
+static void
+remove_proc(const char *dir, unsigned long count)
+{
+    char *path;
+    unsigned long i;
+
+    for (i = 1; i <= count; i++) {
+        xasprintf(&path, "%s/%lu/stat", dir, i);
+        unlink(path);
+        free(path);
+        xasprintf(&path, "%s/%lu", dir, i);
+        rmdir(path);
+        free(path);
+    }
+    rmdir(dir);
+}
+
+
+/*
+ * Walk with lbcd_usercpu_scan.
+ */
+static void
+walk_usercpu(void)
+{
+    static unsigned long long now = 0;
+
+    now += 1000000;
+    lbcd_usercpu_scan(now);
+}
+
+
+/*
+ * Walk by opening each stat file by its full path with stdio and calling stat
+ * for its owner.
+ */
+static void
+walk_stdio(void)
+{
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    char path[512];
+    char buffer[1024];
+    unsigned long long total = 0;
+    FILE *file;
+
+    dir = opendir(proc);
+    if (dir == NULL)
+        sysdie("cannot open %s", proc);
+    while ((entry = readdir(dir)) != NULL) {
+        if (!isdigit((unsigned char) entry->d_name[0]))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/stat", proc, entry->d_name);
+        if (stat(path, &st) < 0)
+            continue;
+        file = fopen(path, "r");
+        if (file == NULL)
+            continue;
+        if (fgets(buffer, sizeof(buffer), file) != NULL)
+            total += st.st_uid + strlen(buffer);
+        fclose(file);
+    }
+    closedir(dir);
+    if (total == 0)
+        warn("no processes found in %s", proc);
+}
+
+
+/*
+ * Run a walker the given number of times and report the time per walk.
+ */
+static void
+bench(const char *name, void (*walker)(void), unsigned long iterations)
+{
+    struct timeval start, end;
+    unsigned long i;
+    double elapsed;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iterations; i++)
+        walker();
+    gettimeofday(&end, NULL);
+    elapsed = (end.tv_sec - start.tv_sec) * 1e6
+        + (end.tv_usec - start.tv_usec);
+    printf("%-10s %10lu walks %12.0f us/walk\n", name, iterations,
+           elapsed / iterations);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    unsigned long count = BENCH_PROCESSES;
+    unsigned long iterations = BENCH_ITERATIONS;
+
+    message_program_name = "usercpu-bench";
+    if (argc > 1)
+        count = strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        iterations = strtoul(argv[2], NULL, 10);
+    if (iterations == 0)
+        die("invalid number of iterations");
+    if (count > 0)
+        proc = make_proc(count);
+    else
+        proc = xstrdup("/proc");
+    if (!lbcd_usercpu_init("1", proc))
+        die("cannot initialize sampling of %s", proc);
+    printf("walking %s\n", proc);
+    walk_usercpu();
+    bench("usercpu", walk_usercpu, iterations);
+    bench("stdio", walk_stdio, iterations);
+    lbcd_usercpu_close();
+    if (count > 0)
+        remove_proc(proc, count);
+    free(proc);
+    return 0;
+}
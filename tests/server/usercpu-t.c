@@ -0,0 +1,170 @@
+/*
+ * Tests for sampling the CPU time used by each user.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <util/messages.h>
+
+
+/*
+ * Write the stat file of a process in a fake /proc, creating its directory
+ * if needed.  The command name contains spaces and parentheses to check that
+ * the fields are counted from the end of it.
+ */
+static void
+write_stat(const char *dir, const char *name, unsigned long utime,
+           unsigned long stime, unsigned long start)
+{
+    char *path;
+    FILE *file;
+
+    basprintf(&path, "%s/%s", dir, name);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        sysbail("cannot create %s", path);
+    free(path);
+    basprintf(&path, "%s/%s/stat", dir, name);
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    fprintf(file, "%s (a (b) c) S 1 1 1 0 -1 4194560 0 0 0 0 %lu %lu 0 0"
+            " 20 0 1 0 %lu 1000 100\n", name, utime, stime, start);
+    fclose(file);
+    free(path);
+}
+
+
+/*
+ * Remove the directory of a process from a fake /proc.
+ */
+static void
+remove_proc(const char *dir, const char *name)
+{
+    char *path;
+
+    basprintf(&path, "%s/%s/stat", dir, name);
+    unlink(path);
+    free(path);
+    basprintf(&path, "%s/%s", dir, name);
+    rmdir(path);
+    free(path);
+}
+
+
+int
+main(void)
+{
+    struct usercpu_info info;
+    char *tmpdir, *dir, *path;
+    unsigned long tick;
+    int timeout;
+
+    plan(23);
+
+    /* Invalid specifications. */
+    message_handlers_warn(0);
+    ok(!lbcd_usercpu_init("0", NULL), "Zero interval");
+    ok(!lbcd_usercpu_init("5,0", NULL), "Zero threshold");
+    ok(!lbcd_usercpu_init("5,", NULL), "Missing threshold");
+    ok(!lbcd_usercpu_init("3601", NULL), "Interval too long");
+    ok(!lbcd_usercpu_init("5x", NULL), "Trailing garbage");
+    message_handlers_warn(1, message_log_stderr);
+
+    /* A fake /proc with two processes and some things that aren't. */
+    tmpdir = test_tmpdir();
+    basprintf(&dir, "%s/proc", tmpdir);
+    if (mkdir(dir, 0755) < 0)
+        sysbail("cannot create %s", dir);
+    tick = (unsigned long) sysconf(_SC_CLK_TCK);
+    write_stat(dir, "100", 100, 0, 10);
+    write_stat(dir, "200", 0, 0, 20);
+    write_stat(dir, "self", 0, 0, 30);
+    basprintf(&path, "%s/300", dir);
+    if (mkdir(path, 0755) < 0)
+        sysbail("cannot create %s", path);
+    free(path);
+    ok(lbcd_usercpu_init("1,50", dir), "Sample a fake /proc");
+
+    /* The first walk only records the CPU time so far. */
+    lbcd_usercpu_scan(1000000);
+    lbcd_usercpu_read(&info);
+    is_int(0, info.users, "No users after one walk");
+    is_int(0, info.heavy, "...and no heavy users");
+
+    /*
+     * Over two seconds, one process uses a CPU in user and system time, and
+     * the other a quarter of a CPU.  Both are owned by the same user.
+     */
+    write_stat(dir, "100", 100 + tick, tick, 10);
+    write_stat(dir, "200", tick / 2, 0, 20);
+    write_stat(dir, "self", 100 * tick, 0, 30);
+    lbcd_usercpu_scan(3000000);
+    lbcd_usercpu_read(&info);
+    is_int(1, info.users, "One user");
+    is_int(1, info.heavy, "...who is heavy");
+    is_int(10000, info.top_share, "...and used all the CPU time");
+    is_int(12500, info.top_util, "...which is 125%% of a CPU");
+
+    /*
+     * One process exits and its process ID is reused by a new process, all
+     * of whose CPU time is counted.  Nothing else used any CPU time.
+     */
+    remove_proc(dir, "200");
+    write_stat(dir, "100", tick / 4, 0, 40);
+    lbcd_usercpu_scan(4000000);
+    lbcd_usercpu_read(&info);
+    is_int(1, info.users, "Reused process ID");
+    is_int(0, info.heavy, "...and the user isn't heavy");
+    is_int(2500, info.top_util, "...using a quarter of a CPU");
+
+    /* No CPU time used at all. */
+    lbcd_usercpu_scan(5000000);
+    lbcd_usercpu_read(&info);
+    is_int(0, info.users, "No CPU time used");
+    is_int(0, info.top_share, "...and no top user");
+
+    /* Sampling from the main loop waits for the interval. */
+    lbcd_usercpu_sample();
+    timeout = lbcd_usercpu_timeout();
+    ok(timeout > 0 && timeout <= 1000, "Next sample after the interval");
+
+    /* A missing directory is reported once and then not sampled. */
+    basprintf(&path, "%s/missing", tmpdir);
+    ok(lbcd_usercpu_init("1", path), "Sample a missing directory");
+    free(path);
+    message_handlers_warn(0);
+    lbcd_usercpu_sample();
+    message_handlers_warn(1, message_log_stderr);
+    is_int(-1, lbcd_usercpu_timeout(), "...which is then not sampled");
+    lbcd_usercpu_read(&info);
+    is_int(0, info.users, "...and has no users");
+
+    /* Disabling sampling. */
+    ok(lbcd_usercpu_init(NULL, NULL), "Disable sampling");
+    is_int(-1, lbcd_usercpu_timeout(), "...and there are no more samples");
+
+    /* Clean up. */
+    lbcd_usercpu_close();
+    remove_proc(dir, "100");
+    remove_proc(dir, "self");
+    basprintf(&path, "%s/300", dir);
+    rmdir(path);
+    free(path);
+    rmdir(dir);
+    free(dir);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
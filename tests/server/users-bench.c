@@ -0,0 +1,252 @@
+/*
+ * Benchmark counting logged-in users in a large utmp file.
+ *
+ * Writes a synthetic utmp file with many sessions of a smaller number of
+ * users and measures reading it for the first time, a query when it hasn't
+ * changed, and a query after one login or logout.  For comparison, it also
+ * measures reading the whole file with getutxent and counting unique users
+ * with hsearch, as lbcd used to on every change.  Run with make bench,
+ * optionally passing the number of records and the number of iterations as
+ * arguments.  This is not part of the test suite.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <fcntl.h>
+#ifdef HAVE_SEARCH_H
+# include <search.h>
+#endif
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef HAVE_UTMPX_H
+# include <utmpx.h>
+#endif
+
+#include <server/internal.h>
+#include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Default number of records and iterations. */
+#define BENCH_RECORDS    10000
+#define BENCH_ITERATIONS 10000
+
+#ifdef HAVE_UTMPX_H
+
+/* The path to the synthetic utmp file and its number of records. */
+static char path[] = "/tmp/users-bench.XXXXXX";
+static size_t records;
+
+/*
+ * Fill in a record.  Every fifth record is a logged-out session, and the
+ * rest are spread over one user for every four records.
+ */
+static void
+make_record(struct utmpx *ut, size_t index, bool user)
+{
+    memset(ut, 0, sizeof(*ut));
+    ut->ut_type = user ? USER_PROCESS : DEAD_PROCESS;
+    ut->ut_pid = (pid_t) (index + 1000);
+    snprintf(ut->ut_line, sizeof(ut->ut_line), "pts/%lu",
+             (unsigned long) index);
+    snprintf(ut->ut_user, sizeof(ut->ut_user), "user%lu",
+             (unsigned long) (index * 7919 % (records / 4 + 1)));
+}
+
+
+/*
+ * Create the synthetic utmp file.
+ */
+static void
+make_utmp(void)
+{
+    struct utmpx ut;
+    size_t i;
+    int fd;
+
+    fd = mkstemp(path);
+    if (fd < 0)
+        sysdie("cannot create %s", path);
+    for (i = 0; i < records; i++) {
+        make_record(&ut, i, i % 5 != 0);
+        if (write(fd, &ut, sizeof(ut)) != (ssize_t) sizeof(ut))
+            sysdie("cannot write to %s", path);
+    }
+    close(fd);
+}
+
+
+/*
+ * Forget everything read from the file so that the next query reads it for
+ * the first time.  This is not timed, since closing an inotify descriptor
+ * is slow and lbcd only does it on exit.
+ */
+static void
+reset(void)
+{
+    lbcd_users_init(path);
+}
+
+
+/*
+ * Query the counts without any change.
+ */
+static void
+read_unchanged(void)
+{
+    int total, uniq, console;
+    time_t mtime;
+
+    get_user_stats(&total, &uniq, &console, &mtime);
+}
+
+
+/*
+ * Log a session in or out and query the counts.
+ */
+static void
+read_changed(void)
+{
+    static size_t count = 0;
+    static int fd = -1;
+    struct utmpx ut;
+    size_t index;
+    int total, uniq, console;
+    time_t mtime;
+
+    if (fd < 0) {
+        fd = open(path, O_WRONLY);
+        if (fd < 0)
+            sysdie("cannot open %s", path);
+    }
+    index = (count++ * 7) % records;
+    make_record(&ut, index, count % 2 == 0);
+    if (pwrite(fd, &ut, sizeof(ut), (off_t) (index * sizeof(ut)))
+        != (ssize_t) sizeof(ut))
+        sysdie("cannot write to %s", path);
+    get_user_stats(&total, &uniq, &console, &mtime);
+}
+
+
+# if defined(HAVE_UTMPXNAME) && defined(HAVE_HSEARCH)
+
+/*
+ * Read the whole file with getutxent and count unique users with hsearch,
+ * the way lbcd used to.
+ */
+static void
+read_getutxent(void)
+{
+    struct utmpx *ut;
+    struct stat st;
+    ENTRY item;
+    char **names;
+    size_t count = 0;
+    size_t i;
+
+    if (stat(path, &st) < 0)
+        sysdie("cannot stat %s", path);
+    names = xcalloc(records, sizeof(char *));
+    hcreate(211);
+    utmpxname(path);
+    setutxent();
+    while ((ut = getutxent()) != NULL) {
+        if (ut->ut_type != USER_PROCESS)
+            continue;
+        item.key = xstrndup(ut->ut_user, sizeof(ut->ut_user));
+        item.data = NULL;
+        if (hsearch(item, FIND) == NULL && count < records) {
+            names[count++] = item.key;
+            hsearch(item, ENTER);
+        } else {
+            free(item.key);
+        }
+    }
+    endutxent();
+    hdestroy();
+    for (i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+}
+
+# endif /* HAVE_UTMPXNAME && HAVE_HSEARCH */
+
+
+/*
+ * Run a reader the given number of times and report the time per call.  If
+ * setup is not NULL, it is run untimed before each call.
+ */
+static void
+bench(const char *name, void (*setup)(void), void (*reader)(void),
+      unsigned long iterations)
+{
+    struct timeval start, end;
+    unsigned long i;
+    double elapsed = 0;
+
+    for (i = 0; i < iterations; i++) {
+        if (setup != NULL)
+            setup();
+        gettimeofday(&start, NULL);
+        reader();
+        if (setup == NULL)
+            while (++i < iterations)
+                reader();
+        gettimeofday(&end, NULL);
+        elapsed += (end.tv_sec - start.tv_sec) * 1e9
+            + (end.tv_usec - start.tv_usec) * 1e3;
+    }
+    printf("%-10s %10lu calls %12.0f ns/call\n", name, iterations,
+           elapsed / iterations);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    unsigned long iterations = BENCH_ITERATIONS;
+    int total, uniq, console;
+    time_t mtime;
+
+    message_program_name = "users-bench";
+    records = BENCH_RECORDS;
+    if (argc > 1)
+        records = strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        iterations = strtoul(argv[2], NULL, 10);
+    if (records == 0 || iterations == 0)
+        die("invalid number of records or iterations");
+    make_utmp();
+    if (!lbcd_users_init(path)) {
+        unlink(path);
+        die("utmp cannot be read directly on this system");
+    }
+    get_user_stats(&total, &uniq, &console, &mtime);
+    printf("%lu records, %d sessions, %d users\n", (unsigned long) records,
+           total, uniq);
+    bench("initial", reset, read_unchanged, iterations / 1000 + 1);
+    bench("unchanged", NULL, read_unchanged, iterations);
+    bench("changed", NULL, read_changed, iterations);
+# if defined(HAVE_UTMPXNAME) && defined(HAVE_HSEARCH)
+    bench("getutxent", NULL, read_getutxent, iterations / 100 + 1);
+# endif
+    lbcd_users_close();
+    unlink(path);
+    return 0;
+}
+
+#else /* !HAVE_UTMPX_H */
+
+int
+main(void)
+{
+    die("utmpx not available");
+}
+
+#endif /* !HAVE_UTMPX_H */
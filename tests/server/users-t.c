@@ -0,0 +1,313 @@
+/*
+ * Tests for counting logged-in users.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <utime.h>
+#ifdef HAVE_UTMPX_H
+# include <utmpx.h>
+#endif
+
+#include <server/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+#ifndef HAVE_UTMPX_H
+
+/*
+ * Create a terminal device in the given directory, last used the given
+ * number of seconds ago.
+ */
+static void
+make_tty(const char *devdir, const char *line, time_t age)
+{
+    struct utimbuf times;
+    char *path;
+    int fd;
+
+    basprintf(&path, "%s/%s", devdir, line);
+    fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+        sysbail("cannot create %s", path);
+    close(fd);
+    times.actime = time(NULL) - age;
+    times.modtime = times.actime;
+    if (utime(path, &times) < 0)
+        sysbail("cannot set times of %s", path);
+    free(path);
+}
+
+
+/*
+ * Check the idle sessions and users.  Initializing idle detection again
+ * forces every session to be checked.
+ */
+static void
+check_idle(const char *devdir, int sessions, int uniq, const char *message)
+{
+    int t, u, console, idle, uniq_idle;
+    time_t mtime;
+
+    lbcd_users_idle_init(300, devdir);
+    get_user_stats(&t, &u, &console, &mtime);
+    lbcd_users_idle(&idle, &uniq_idle);
+    is_int(sessions, idle, "%s", message);
+    is_int(uniq, uniq_idle, "...idle users");
+}
+
+
+int
+main(void)
+{
+    skip_all("utmpx not available");
+    return 0;
+}
+
+#else /* HAVE_UTMPX_H */
+
+/* The number of users for the test of many users. */
+#define MANY_USERS 1000
+
+
+/*
+ * Fill in a utmp record for a user, or a dead process if user is NULL.  The
+ * name is copied without a nul if it fills the field.
+ */
+static void
+make_record(struct utmpx *ut, const char *user, const char *line)
+{
+    size_t length;
+
+    memset(ut, 0, sizeof(*ut));
+    ut->ut_type = (user == NULL) ? DEAD_PROCESS : USER_PROCESS;
+    if (user != NULL) {
+        length = strlen(user);
+        if (length > sizeof(ut->ut_user))
+            length = sizeof(ut->ut_user);
+        memcpy(ut->ut_user, user, length);
+    }
+    length = strlen(line);
+    if (length > sizeof(ut->ut_line))
+        length = sizeof(ut->ut_line);
+    memcpy(ut->ut_line, line, length);
+}
+
+
+/*
+ * Write a record at the given index of a utmp file, in place.
+ */
+static void
+write_record(const char *path, size_t index, const char *user,
+             const char *line)
+{
+    struct utmpx ut;
+    int fd;
+
+    make_record(&ut, user, line);
+    fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+        sysbail("cannot open %s", path);
+    if (pwrite(fd, &ut, sizeof(ut), (off_t) (index * sizeof(ut)))
+        != (ssize_t) sizeof(ut))
+        sysbail("cannot write to %s", path);
+    close(fd);
+}
+
+
+/*
+ * Check the total and unique users.
+ */
+static void
+check_users(int total, int uniq, const char *message)
+{
+    int t, u, console;
+    time_t mtime;
+
+    is_int(0, get_user_stats(&t, &u, &console, &mtime), "%s", message);
+    is_int(total, t, "...total users");
+    is_int(uniq, u, "...unique users");
+}
+
+
+/*
+ * Create a terminal device in the given directory, last used the given
+ * number of seconds ago.
+ */
+static void
+make_tty(const char *devdir, const char *line, time_t age)
+{
+    struct utimbuf times;
+    char *path;
+    int fd;
+
+    basprintf(&path, "%s/%s", devdir, line);
+    fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+        sysbail("cannot create %s", path);
+    close(fd);
+    times.actime = time(NULL) - age;
+    times.modtime = times.actime;
+    if (utime(path, &times) < 0)
+        sysbail("cannot set times of %s", path);
+    free(path);
+}
+
+
+/*
+ * Check the idle sessions and users.  Initializing idle detection again
+ * forces every session to be checked.
+ */
+static void
+check_idle(const char *devdir, int sessions, int uniq, const char *message)
+{
+    int t, u, console, idle, uniq_idle;
+    time_t mtime;
+
+    lbcd_users_idle_init(300, devdir);
+    get_user_stats(&t, &u, &console, &mtime);
+    lbcd_users_idle(&idle, &uniq_idle);
+    is_int(sessions, idle, "%s", message);
+    is_int(uniq, uniq_idle, "...idle users");
+}
+
+
+int
+main(void)
+{
+    char *tmpdir, *path, *new_path, *devdir, *ptsdir;
+    int idle, uniq_idle;
+    char name[32];
+    char full[sizeof(((struct utmpx *) 0)->ut_user) + 8];
+    int total, uniq, console;
+    time_t mtime;
+    struct stat st;
+    size_t i;
+
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/utmp", tmpdir);
+    unlink(path);
+    if (!lbcd_users_init(path))
+        skip_all("utmp cannot be read directly");
+
+    plan(44);
+
+    /* A missing file has no users. */
+    check_users(0, 0, "Missing utmp");
+
+    /* Users with several sessions, and records that aren't users. */
+    write_record(path, 0, "alice", "pts/0");
+    write_record(path, 1, "bob", "pts/1");
+    write_record(path, 2, "alice", "pts/2");
+    write_record(path, 3, NULL, "pts/3");
+    check_users(3, 2, "utmp created");
+    get_user_stats(&total, &uniq, &console, &mtime);
+    if (stat(path, &st) < 0)
+        sysbail("cannot stat %s", path);
+    is_int(st.st_mtime, mtime, "...and modification time");
+
+    /* Logouts and logins in place. */
+    write_record(path, 1, NULL, "pts/1");
+    check_users(2, 1, "Logout");
+    write_record(path, 3, "carol", "pts/3");
+    check_users(3, 2, "Login into an unused record");
+    write_record(path, 0, NULL, "pts/0");
+    check_users(2, 2, "Logout of one of two sessions");
+
+    /* Usernames are compared in full, even if they fill the field. */
+    write_record(path, 4, "xxxxxxxxlong", "pts/4");
+    write_record(path, 5, "xxxxxxxxlonger", "pts/5");
+    memset(full, 'x', sizeof(full) - 1);
+    full[sizeof(full) - 1] = '\0';
+    write_record(path, 6, full, "pts/6");
+    full[sizeof(((struct utmpx *) 0)->ut_user) - 1] = 'y';
+    write_record(path, 7, full, "pts/7");
+    check_users(6, 6, "Long usernames");
+
+    /* Console logins. */
+    write_record(path, 8, "dave", "console");
+    get_user_stats(&total, &uniq, &console, &mtime);
+    is_int(1, console, "Console login");
+    write_record(path, 8, NULL, "console");
+
+    /* A shorter file drops the records past its end. */
+    if (truncate(path, (off_t) (3 * sizeof(struct utmpx))) < 0)
+        sysbail("cannot truncate %s", path);
+    check_users(1, 1, "Truncated utmp");
+
+    /* A replacement file is opened and read. */
+    basprintf(&new_path, "%s/utmp.new", tmpdir);
+    write_record(new_path, 0, "erin", "pts/0");
+    write_record(new_path, 1, "frank", "pts/1");
+    if (rename(new_path, path) < 0)
+        sysbail("cannot rename %s", new_path);
+    free(new_path);
+    check_users(2, 2, "Replaced utmp");
+
+    /*
+     * Idle detection from the access times of terminals.  A session whose
+     * terminal can't be found is never idle.
+     */
+    basprintf(&devdir, "%s/dev", tmpdir);
+    basprintf(&ptsdir, "%s/pts", devdir);
+    if (mkdir(devdir, 0755) < 0 || mkdir(ptsdir, 0755) < 0)
+        sysbail("cannot create %s", ptsdir);
+    make_tty(devdir, "pts/0", 1000);
+    make_tty(devdir, "pts/1", 0);
+    check_idle(devdir, 1, 1, "One idle session");
+    write_record(path, 2, "erin", "pts/1");
+    write_record(path, 3, "gina", "pts/9");
+    check_idle(devdir, 1, 0, "...and its user is active elsewhere");
+    make_tty(devdir, "pts/1", 600);
+    check_idle(devdir, 3, 2, "Both sessions of a user idle");
+    make_tty(devdir, "pts/0", 0);
+    check_idle(devdir, 2, 1, "Activity on an idle session");
+    lbcd_users_idle_init(0, NULL);
+    get_user_stats(&total, &uniq, &console, &mtime);
+    lbcd_users_idle(&idle, &uniq_idle);
+    ok(idle == 0 && uniq_idle == 0, "No idle sessions when disabled");
+    write_record(path, 2, NULL, "pts/1");
+    write_record(path, 3, NULL, "pts/9");
+
+    /* Many users, which grows the hash set, and then most of them leaving. */
+    for (i = 0; i < MANY_USERS; i++) {
+        snprintf(name, sizeof(name), "user%lu", (unsigned long) i);
+        write_record(path, i, name, "pts/0");
+    }
+    check_users(MANY_USERS, MANY_USERS, "Many users");
+    for (i = 1; i < MANY_USERS; i++)
+        write_record(path, i, "user0", "pts/0");
+    check_users(MANY_USERS, 1, "...then all the same user");
+    for (i = 1; i < MANY_USERS; i += 2)
+        write_record(path, i, NULL, "pts/0");
+    check_users(MANY_USERS / 2, 1, "...then half logged out");
+
+    /* Clean up. */
+    lbcd_users_close();
+    unlink(path);
+    free(path);
+    basprintf(&path, "%s/pts/0", devdir);
+    unlink(path);
+    free(path);
+    basprintf(&path, "%s/pts/1", devdir);
+    unlink(path);
+    free(path);
+    rmdir(ptsdir);
+    rmdir(devdir);
+    free(ptsdir);
+    free(devdir);
+    test_tmpdir_free(tmpdir);
+    return 0;
+}
+
+#endif /* HAVE_UTMPX_H */
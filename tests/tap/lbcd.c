@@ -2,10 +2,11 @@
  * Spawn a copy of lbcd in the background for tests.
  *
  * Provides functions to start and stop the newly-built lbcd daemon, using
- * port 14330 instead of the default of 4330.
+ * port 14330 instead of the default of 4330, and to write the files that
+ * tests point lbcd at in place of the ones under /proc, /sys, and /var.
  *
  * Written by Russ Allbery <eagle@eyrie.org>
- * Copyright 2013
+ * Copyright 2013, 2026
  *     The Board of Trustees of the Leland Stanford Junior University
  *
  * See LICENSE for licensing terms.
@@ -84,3 +85,27 @@ lbcd_start(const char *first, ...)
     free(argv);
     return process;
 }
+
+
+/*
+ * Write a test file, bailing on any failure.
+ */
+void
+lbcd_write_file(const char *dir, const char *name, const char *contents)
+{
+    FILE *file;
+    char *path;
+
+    if (dir == NULL)
+        path = bstrdup(name);
+    else
+        basprintf(&path, "%s/%s", dir, name);
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    if (fputs(contents, file) == EOF)
+        sysbail("cannot write to %s", path);
+    if (fclose(file) == EOF)
+        sysbail("cannot flush %s", path);
+    free(path);
+}
@@ -34,6 +34,14 @@ BEGIN_DECLS
  */
 struct process *lbcd_start(const char *arg, ...);
 
+/*
+ * Write contents to the file name in the directory dir, or to the path name
+ * if dir is NULL, replacing any existing contents.  The file is rewritten in
+ * place, so open file descriptors see the new contents.  Calls bail on any
+ * failure.
+ */
+void lbcd_write_file(const char *dir, const char *name, const char *contents);
+
 END_DECLS
 
 #endif /* !TAP_REMCTL_H */